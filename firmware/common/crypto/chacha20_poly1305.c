@@ -3,7 +3,10 @@
 // Оптимизировано для 32-битных процессоров (ESP32)
 
 #include "chacha20_poly1305.h"
-#include "../utils.h" // Для constant_time_compare и memzero
+#include "mesh_crypto_backend.h"
+#include <string.h>
+#include <stdint.h>
+#include "../utils.h" // Для memzero и write_be32
 
 // ==================== ВНУТРЕННИЕ ФУНКЦИИ CHACHA20 ====================
 
@@ -26,85 +29,131 @@ static inline void qr(uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
     *c += *d; *b ^= *c; *b = rotl32(*b, 7);
 }
 
-// Инициализация состояния ChaCha20 из ключа и nonce
-static void chacha20_init_state(uint32_t state[16],
-                               const uint8_t key[32],
-                               const uint8_t nonce[12],
-                               uint32_t counter) {
+// Чтение/запись 32-битного слова little-endian
+static inline uint32_t load32_le(const uint8_t *p) {
+    return ((uint32_t)p[0] << 0)  | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void store32_le(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 0);
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+void chacha20_key_schedule_init(chacha20_key_schedule_t *ks,
+                               const uint8_t key[CHACHA20_KEY_SIZE]) {
     // Константы
-    state[0] = CHACHA20_CONSTANT0;
-    state[1] = CHACHA20_CONSTANT1;
-    state[2] = CHACHA20_CONSTANT2;
-    state[3] = CHACHA20_CONSTANT3;
+    ks->words[0] = CHACHA20_CONSTANT0;
+    ks->words[1] = CHACHA20_CONSTANT1;
+    ks->words[2] = CHACHA20_CONSTANT2;
+    ks->words[3] = CHACHA20_CONSTANT3;
     
     // Ключ (256 бит = 8 слов по 32 бита)
     for (int i = 0; i < 8; i++) {
-        state[4 + i] = ((uint32_t)key[i*4] << 0)  | ((uint32_t)key[i*4+1] << 8) |
-                       ((uint32_t)key[i*4+2] << 16) | ((uint32_t)key[i*4+3] << 24);
+        ks->words[4 + i] = load32_le(key + i * 4);
     }
+}
+
+// Состояние ChaCha20 из готового расписания: копия 12 слов, счётчик и nonce
+static void chacha20_init_state(uint32_t state[16],
+                               const chacha20_key_schedule_t *ks,
+                               const uint8_t nonce[12],
+                               uint32_t counter) {
+    memcpy(state, ks->words, sizeof(ks->words));
     
     // Счётчик блока
     state[12] = counter;
     
     // Nonce (96 бит = 3 слова по 32 бита)
-    state[13] = ((uint32_t)nonce[0] << 0)  | ((uint32_t)nonce[1] << 8) |
-                ((uint32_t)nonce[2] << 16) | ((uint32_t)nonce[3] << 24);
-    state[14] = ((uint32_t)nonce[4] << 0)  | ((uint32_t)nonce[5] << 8) |
-                ((uint32_t)nonce[6] << 16) | ((uint32_t)nonce[7] << 24);
-    state[15] = ((uint32_t)nonce[8] << 0)  | ((uint32_t)nonce[9] << 8) |
-                ((uint32_t)nonce[10] << 16)| ((uint32_t)nonce[11] << 24);
+    state[13] = load32_le(nonce + 0);
+    state[14] = load32_le(nonce + 4);
+    state[15] = load32_le(nonce + 8);
 }
 
-// Генерация одного блока ключевого потока (64 байта)
-static void chacha20_block(uint32_t state[16], uint8_t keystream[64]) {
-    uint32_t workspace[16];
-    
-    // Копируем состояние в рабочую область
-    for (int i = 0; i < 16; i++) {
-        workspace[i] = state[i];
+// Слово ключевого потока в порядке байт памяти. На little-endian
+// (ESP32) сериализация блока — просто запись слов.
+static inline uint32_t chacha20_le_word(uint32_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap32(v);
+#else
+    return v;
+#endif
+}
+
+// Сколько блоков ядро считает за один проход (180-байтный
+// payload — три блока, полный кадр ESP-NOW — четыре)
+#define CHACHA20_MAX_LANES 4
+
+// Ядро: nblocks блоков со счётчиками state[12] .. state[12]+nblocks-1,
+// результат — слова ключевого потока подряд, счётчик сдвигается.
+// Полосы независимы и раунды идут по всем сразу: компилятор
+// перемежает их цепочки зависимостей. nblocks — только константа,
+// тогда циклы по полосам разворачиваются.
+static inline __attribute__((always_inline))
+void chacha20_blocks_n(uint32_t state[16], uint32_t *out, const int nblocks) {
+    uint32_t x[CHACHA20_MAX_LANES][16];
+    
+    // Копируем состояние в рабочую область каждой полосы
+    for (int b = 0; b < nblocks; b++) {
+        for (int i = 0; i < 16; i++) {
+            x[b][i] = state[i];
+        }
+        x[b][12] += (uint32_t)b;
     }
     
     // 20 раундов (10 двойных раундов)
-    for (int i = 0; i < 10; i++) {
+    for (int r = 0; r < 10; r++) {
         // Нечётный раунд
-        qr(&workspace[0], &workspace[4], &workspace[8], &workspace[12]);
-        qr(&workspace[1], &workspace[5], &workspace[9], &workspace[13]);
-        qr(&workspace[2], &workspace[6], &workspace[10], &workspace[14]);
-        qr(&workspace[3], &workspace[7], &workspace[11], &workspace[15]);
-        
+        for (int b = 0; b < nblocks; b++) {
+            qr(&x[b][0], &x[b][4], &x[b][8], &x[b][12]);
+            qr(&x[b][1], &x[b][5], &x[b][9], &x[b][13]);
+            qr(&x[b][2], &x[b][6], &x[b][10], &x[b][14]);
+            qr(&x[b][3], &x[b][7], &x[b][11], &x[b][15]);
+        }
+    
         // Чётный раунд
-        qr(&workspace[0], &workspace[5], &workspace[10], &workspace[15]);
-        qr(&workspace[1], &workspace[6], &workspace[11], &workspace[12]);
-        qr(&workspace[2], &workspace[7], &workspace[8], &workspace[13]);
-        qr(&workspace[3], &workspace[4], &workspace[9], &workspace[14]);
+        for (int b = 0; b < nblocks; b++) {
+            qr(&x[b][0], &x[b][5], &x[b][10], &x[b][15]);
+            qr(&x[b][1], &x[b][6], &x[b][11], &x[b][12]);
+            qr(&x[b][2], &x[b][7], &x[b][8], &x[b][13]);
+            qr(&x[b][3], &x[b][4], &x[b][9], &x[b][14]);
+        }
     }
     
     // Добавляем исходное состояние (mod 2^32)
-    for (int i = 0; i < 16; i++) {
-        workspace[i] += state[i];
+    for (int b = 0; b < nblocks; b++) {
+        for (int i = 0; i < 16; i++) {
+            out[b * 16 + i] = chacha20_le_word(x[b][i] + state[i]);
+        }
+        out[b * 16 + 12] = chacha20_le_word(x[b][12] + state[12] + (uint32_t)b);
     }
     
-    // Преобразуем в little-endian байты
-    for (int i = 0; i < 16; i++) {
-        keystream[i*4 + 0] = (uint8_t)(workspace[i] >> 0);
-        keystream[i*4 + 1] = (uint8_t)(workspace[i] >> 8);
-        keystream[i*4 + 2] = (uint8_t)(workspace[i] >> 16);
-        keystream[i*4 + 3] = (uint8_t)(workspace[i] >> 24);
+    state[12] += (uint32_t)nblocks;
+}
+
+// Выбор специализации ядра по числу блоков (1..4)
+static void chacha20_blocks(uint32_t state[16], uint32_t *out, size_t nblocks) {
+    switch (nblocks) {
+        case 1:  chacha20_blocks_n(state, out, 1); break;
+        case 2:  chacha20_blocks_n(state, out, 2); break;
+        case 3:  chacha20_blocks_n(state, out, 3); break;
+        default: chacha20_blocks_n(state, out, 4); break;
     }
 }
 
+// Генерация одного блока ключевого потока (64 байта), счётчик +1
+static void chacha20_block(uint32_t state[16], uint32_t keystream[16]) {
+    chacha20_blocks_n(state, keystream, 1);
+}
+
 // ==================== ВНУТРЕННИЕ ФУНКЦИИ POLY1305 ====================
 
 // Ключевые константы Poly1305
 #define POLY1305_KEY_SIZE 32
-#define POLY1305_TAG_SIZE 16
 #define POLY1305_BLOCK_SIZE 16
 
-// Маска для ключа r
-static const uint32_t poly1305_clamp_r[4] = {
-    0x0ffffffc, 0x0ffffffc, 0x0ffffffc, 0x0ffffffc
-};
-
 // Инициализация контекста Poly1305
 static void poly1305_init(poly1305_ctx_t *ctx, const uint8_t key[32]) {
     // Обнуляем аккумулятор
@@ -112,38 +161,27 @@ static void poly1305_init(poly1305_ctx_t *ctx, const uint8_t key[32]) {
         ctx->h[i] = 0;
     }
     
-    // Клонируем и зажимаем ключ r
-    uint32_t t0 = ((uint32_t)key[0] << 0) | ((uint32_t)key[1] << 8) |
-                  ((uint32_t)key[2] << 16) | ((uint32_t)key[3] << 24);
-    uint32_t t1 = ((uint32_t)key[4] << 0) | ((uint32_t)key[5] << 8) |
-                  ((uint32_t)key[6] << 16) | ((uint32_t)key[7] << 24);
-    uint32_t t2 = ((uint32_t)key[8] << 0) | ((uint32_t)key[9] << 8) |
-                  ((uint32_t)key[10] << 16) | ((uint32_t)key[11] << 24);
-    uint32_t t3 = ((uint32_t)key[12] << 0) | ((uint32_t)key[13] << 8) |
-                  ((uint32_t)key[14] << 16) | ((uint32_t)key[15] << 24);
-    
-    ctx->r[0] = t0 & poly1305_clamp_r[0];
-    ctx->r[1] = t1 & poly1305_clamp_r[1];
-    ctx->r[2] = t2 & poly1305_clamp_r[2];
-    ctx->r[3] = t3 & poly1305_clamp_r[3];
-    ctx->r[4] = 0;
+    // Зажимаем ключ r (RFC 8439, 2.5) и сразу режем на 26-битные лимбы
+    ctx->r[0] = (load32_le(key + 0) >> 0) & 0x3ffffff;
+    ctx->r[1] = (load32_le(key + 3) >> 2) & 0x3ffff03;
+    ctx->r[2] = (load32_le(key + 6) >> 4) & 0x3ffc0ff;
+    ctx->r[3] = (load32_le(key + 9) >> 6) & 0x3f03fff;
+    ctx->r[4] = (load32_le(key + 12) >> 8) & 0x00fffff;
     
     // Сохраняем ключ s
-    ctx->pad[0] = ((uint32_t)key[16] << 0) | ((uint32_t)key[17] << 8) |
-                  ((uint32_t)key[18] << 16) | ((uint32_t)key[19] << 24);
-    ctx->pad[1] = ((uint32_t)key[20] << 0) | ((uint32_t)key[21] << 8) |
-                  ((uint32_t)key[22] << 16) | ((uint32_t)key[23] << 24);
-    ctx->pad[2] = ((uint32_t)key[24] << 0) | ((uint32_t)key[25] << 8) |
-                  ((uint32_t)key[26] << 16) | ((uint32_t)key[27] << 24);
-    ctx->pad[3] = ((uint32_t)key[28] << 0) | ((uint32_t)key[29] << 8) |
-                  ((uint32_t)key[30] << 16) | ((uint32_t)key[31] << 24);
+    ctx->pad[0] = load32_le(key + 16);
+    ctx->pad[1] = load32_le(key + 20);
+    ctx->pad[2] = load32_le(key + 24);
+    ctx->pad[3] = load32_le(key + 28);
     
     ctx->leftover = 0;
     ctx->final = 0;
 }
 
-// Добавление блока данных в Poly1305
+// Добавление полных 16-байтовых блоков в Poly1305
 static void poly1305_blocks(poly1305_ctx_t *ctx, const uint8_t *data, size_t len) {
+    const uint32_t hibit = ctx->final ? 0 : (1UL << 24);  // 2^128 у полного блока
+    
     uint32_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2],
              h3 = ctx->h[3], h4 = ctx->h[4];
     uint32_t r0 = ctx->r[0], r1 = ctx->r[1], r2 = ctx->r[2],
@@ -154,25 +192,15 @@ static void poly1305_blocks(poly1305_ctx_t *ctx, const uint8_t *data, size_t len
     uint32_t s3 = r3 * 5;
     uint32_t s4 = r4 * 5;
     
-    while (len >= 16) {
-        // Читаем блок как little-endian
-        uint32_t d0 = ((uint32_t)data[0] << 0) | ((uint32_t)data[1] << 8) |
-                      ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
-        uint32_t d1 = ((uint32_t)data[4] << 0) | ((uint32_t)data[5] << 8) |
-                      ((uint32_t)data[6] << 16) | ((uint32_t)data[7] << 24);
-        uint32_t d2 = ((uint32_t)data[8] << 0) | ((uint32_t)data[9] << 8) |
-                      ((uint32_t)data[10] << 16) | ((uint32_t)data[11] << 24);
-        uint32_t d3 = ((uint32_t)data[12] << 0) | ((uint32_t)data[13] << 8) |
-                      ((uint32_t)data[14] << 16) | ((uint32_t)data[15] << 24);
-        
-        // Добавляем 1 к верхнему биту (для Padding)
-        h0 += d0 & 0x3ffffff;
-        h1 += ((d0 >> 26) | (d1 << 6)) & 0x3ffffff;
-        h2 += ((d1 >> 20) | (d2 << 12)) & 0x3ffffff;
-        h3 += ((d2 >> 14) | (d3 << 18)) & 0x3ffffff;
-        h4 += (d3 >> 8) | (1 << 24);
-        
-        // Умножение и редукция по модулю 2^130-5
+    while (len >= POLY1305_BLOCK_SIZE) {
+        // Читаем блок как little-endian, режем на 26-битные лимбы
+        h0 += (load32_le(data + 0) >> 0) & 0x3ffffff;
+        h1 += (load32_le(data + 3) >> 2) & 0x3ffffff;
+        h2 += (load32_le(data + 6) >> 4) & 0x3ffffff;
+        h3 += (load32_le(data + 9) >> 6) & 0x3ffffff;
+        h4 += (load32_le(data + 12) >> 8) | hibit;
+    
+        // Умножение h * r по модулю 2^130-5
         uint64_t t0 = ((uint64_t)h0 * r0) + ((uint64_t)h1 * s4) +
                       ((uint64_t)h2 * s3) + ((uint64_t)h3 * s2) +
                       ((uint64_t)h4 * s1);
@@ -188,137 +216,228 @@ static void poly1305_blocks(poly1305_ctx_t *ctx, const uint8_t *data, size_t len
         uint64_t t4 = ((uint64_t)h0 * r4) + ((uint64_t)h1 * r3) +
                       ((uint64_t)h2 * r2) + ((uint64_t)h3 * r1) +
                       ((uint64_t)h4 * r0);
-        
+    
         // Частичная редукция
-        h0 = (uint32_t)t0 & 0x3ffffff; t1 += t0 >> 26;
-        h1 = (uint32_t)t1 & 0x3ffffff; t2 += t1 >> 26;
-        h2 = (uint32_t)t2 & 0x3ffffff; t3 += t2 >> 26;
-        h3 = (uint32_t)t3 & 0x3ffffff; t4 += t3 >> 26;
-        h4 = (uint32_t)t4 & 0x3ffffff;
-        
-        // Полная редукция
-        h0 += (uint32_t)(t4 >> 26) * 5;
-        h1 += h0 >> 26; h0 &= 0x3ffffff;
-        h2 += h1 >> 26; h1 &= 0x3ffffff;
-        h3 += h2 >> 26; h2 &= 0x3ffffff;
-        h4 += h3 >> 26; h3 &= 0x3ffffff;
-        h0 += (h4 >> 26) * 5; h4 &= 0x3ffffff;
-        h1 += h0 >> 26; h0 &= 0x3ffffff;
-        
-        data += 16;
-        len -= 16;
+        uint32_t c;
+        c = (uint32_t)(t0 >> 26); h0 = (uint32_t)t0 & 0x3ffffff;
+        t1 += c; c = (uint32_t)(t1 >> 26); h1 = (uint32_t)t1 & 0x3ffffff;
+        t2 += c; c = (uint32_t)(t2 >> 26); h2 = (uint32_t)t2 & 0x3ffffff;
+        t3 += c; c = (uint32_t)(t3 >> 26); h3 = (uint32_t)t3 & 0x3ffffff;
+        t4 += c; c = (uint32_t)(t4 >> 26); h4 = (uint32_t)t4 & 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+    
+        data += POLY1305_BLOCK_SIZE;
+        len -= POLY1305_BLOCK_SIZE;
     }
     
     ctx->h[0] = h0; ctx->h[1] = h1; ctx->h[2] = h2;
     ctx->h[3] = h3; ctx->h[4] = h4;
 }
 
+// Данные с дополнением нулями до 16 байт (pad16 из RFC 8439, 2.8).
+// В AEAD каждый блок, включая дополненный, считается полным.
+static void poly1305_update_padded(poly1305_ctx_t *ctx, const uint8_t *data, size_t len) {
+    size_t full = len & ~(size_t)(POLY1305_BLOCK_SIZE - 1);
+    poly1305_blocks(ctx, data, full);
+    
+    size_t rest = len - full;
+    if (rest) {
+        memset(ctx->buffer, 0, POLY1305_BLOCK_SIZE);
+        memcpy(ctx->buffer, data + full, rest);
+        poly1305_blocks(ctx, ctx->buffer, POLY1305_BLOCK_SIZE);
+    }
+}
+
 // Финализация Poly1305 (вычисление тега)
 static void poly1305_final(poly1305_ctx_t *ctx, uint8_t tag[16]) {
-    // Обработка оставшихся байт
+    // Неполный последний блок: 0x01 после данных, без 2^128
     if (ctx->leftover) {
-        ctx->buffer[ctx->leftover] = 1;
-        for (size_t i = ctx->leftover + 1; i < 16; i++) {
+        size_t i = ctx->leftover;
+        ctx->buffer[i++] = 1;
+        for (; i < POLY1305_BLOCK_SIZE; i++) {
             ctx->buffer[i] = 0;
         }
-        poly1305_blocks(ctx, ctx->buffer, 16);
+        ctx->final = 1;
+        poly1305_blocks(ctx, ctx->buffer, POLY1305_BLOCK_SIZE);
     }
     
-    // Финальная редукция
+    // Полный перенос
     uint32_t h0 = ctx->h[0], h1 = ctx->h[1], h2 = ctx->h[2],
              h3 = ctx->h[3], h4 = ctx->h[4];
+    uint32_t c;
     
-    h1 += h0 >> 26; h0 &= 0x3ffffff;
-    h2 += h1 >> 26; h1 &= 0x3ffffff;
-    h3 += h2 >> 26; h2 &= 0x3ffffff;
-    h4 += h3 >> 26; h3 &= 0x3ffffff;
-    h0 += (h4 >> 26) * 5; h4 &= 0x3ffffff;
-    h1 += h0 >> 26; h0 &= 0x3ffffff;
+    c = h1 >> 26; h1 &= 0x3ffffff;
+    h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+    h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+    h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
     
     // Вычисление h + (-p)
-    uint32_t g0 = h0 + 5;
-    uint32_t g1 = h1 + (g0 >> 26); g0 &= 0x3ffffff;
-    uint32_t g2 = h2 + (g1 >> 26); g1 &= 0x3ffffff;
-    uint32_t g3 = h3 + (g2 >> 26); g2 &= 0x3ffffff;
-    uint32_t g4 = h4 + (g3 >> 26) - (1 << 26); g3 &= 0x3ffffff;
+    uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    uint32_t g4 = h4 + c - (1UL << 26);
     
-    // Выбор h или h-p
+    // Выбор h или h-p (без ветвлений)
     uint32_t mask = (g4 >> 31) - 1;
-    h0 = (h0 & mask) | (g0 & ~mask);
-    h1 = (h1 & mask) | (g1 & ~mask);
-    h2 = (h2 & mask) | (g2 & ~mask);
-    h3 = (h3 & mask) | (g3 & ~mask);
-    h4 = (h4 & mask) | (g4 & ~mask);
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+    h3 = (h3 & ~mask) | (g3 & mask);
+    h4 = (h4 & ~mask) | (g4 & mask);
+    
+    // h % 2^128 — в 4 слова по 32 бита
+    uint32_t w0 = (h0 >> 0)  | (h1 << 26);
+    uint32_t w1 = (h1 >> 6)  | (h2 << 20);
+    uint32_t w2 = (h2 >> 12) | (h3 << 14);
+    uint32_t w3 = (h3 >> 18) | (h4 << 8);
+    
+    // Добавляем ключ s (mod 2^128)
+    uint64_t f;
+    f = (uint64_t)w0 + ctx->pad[0];             store32_le(tag + 0, (uint32_t)f);
+    f = (uint64_t)w1 + ctx->pad[1] + (f >> 32); store32_le(tag + 4, (uint32_t)f);
+    f = (uint64_t)w2 + ctx->pad[2] + (f >> 32); store32_le(tag + 8, (uint32_t)f);
+    f = (uint64_t)w3 + ctx->pad[3] + (f >> 32); store32_le(tag + 12, (uint32_t)f);
+}
+
+// Хвост AEAD: длины AAD и шифртекста, затем тег
+static void poly1305_aead_finish(chacha20_poly1305_ctx_t *ctx, uint8_t tag[16]) {
+    uint8_t length_block[16];
+    store32_le(length_block + 0, (uint32_t)ctx->aad_len);
+    store32_le(length_block + 4, (uint32_t)(ctx->aad_len >> 32));
+    store32_le(length_block + 8, (uint32_t)ctx->ciphertext_len);
+    store32_le(length_block + 12, (uint32_t)(ctx->ciphertext_len >> 32));
+    
+    poly1305_blocks(&ctx->auth_ctx, length_block, 16);
+    poly1305_final(&ctx->auth_ctx, tag);
+}
+
+// XOR с ключевым потоком словами. Вход и выход с одинаковым
+// смещением (в том числе на месте: payload пакета начинается с
+// 31-го байта) добираются байтами до границы слова, дальше слова
+// ключевого потока сдвигаются на то же смещение. Иначе — побайтно.
+static void xor_keystream(uint8_t *out, const uint8_t *in, const uint32_t *keystream, size_t len) {
+    const uint8_t *ks = (const uint8_t *)keystream;
+    size_t i = 0;
+    
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if ((((uintptr_t)in ^ (uintptr_t)out) & 3) == 0) {
+        size_t head = (4 - ((uintptr_t)in & 3)) & 3;
+        if (head > len) {
+            head = len;
+        }
+        for (; i < head; i++) {
+            out[i] = in[i] ^ ks[i];
+        }
+    
+        const uint32_t *src = (const uint32_t *)(in + head);
+        uint32_t *dst = (uint32_t *)(out + head);
+        size_t words = (len - head) / 4;
+        if (head == 0) {
+            for (size_t j = 0; j < words; j++) {
+                dst[j] = src[j] ^ keystream[j];
+            }
+        } else {
+            // Слово данных j — байты head+4j.. ключевого потока
+            // (len <= 64, так что keystream[j + 1] всегда в блоке)
+            unsigned shift = 8 * (unsigned)head;
+            for (size_t j = 0; j < words; j++) {
+                dst[j] = src[j] ^ ((keystream[j] >> shift) | (keystream[j + 1] << (32 - shift)));
+            }
+        }
+        i = head + words * 4;
+    }
+#endif
+    
+    for (; i < len; i++) {
+        out[i] = in[i] ^ ks[i];
+    }
+}
+
+// Шифрование/расшифровка за один проход по данным: каждый кусок
+// до четырёх блоков ключевого потока XOR-ится и тут же, блоками по
+// 64 байта, поглощается Poly1305 — буфер не читается второй раз.
+// MAC всегда считается по шифртексту: при шифровании — после XOR,
+// при расшифровке — до. Работает и на месте (in == out).
+static void chacha20_poly1305_crypt(chacha20_poly1305_ctx_t *ctx, const uint8_t *in,
+                                    uint8_t *out, size_t length, bool encrypt) {
+    poly1305_ctx_t *auth = &ctx->auth_ctx;
+    uint32_t wide[CHACHA20_MAX_LANES * 16];
+    size_t pos = 0;
     
-    // h % 2^128
-    uint64_t f = (uint64_t)h0 + ((uint64_t)h1 << 26) +
-                 ((uint64_t)h2 << 52) + ((uint64_t)h3 << 78);
+    while (pos < length) {
+        size_t remaining = length - pos;
+        size_t nblocks = (remaining + CHACHA20_BLOCK_SIZE - 1) / CHACHA20_BLOCK_SIZE;
+        if (nblocks > CHACHA20_MAX_LANES) {
+            nblocks = CHACHA20_MAX_LANES;
+        }
     
-    // Добавляем ключ s
-    f += ((uint64_t)ctx->pad[0] + ((uint64_t)ctx->pad[1] << 32));
+        chacha20_blocks(ctx->cipher_ctx.state, wide, nblocks);
     
-    // Записываем little-endian
-    tag[0] = (uint8_t)(f >> 0);  tag[1] = (uint8_t)(f >> 8);
-    tag[2] = (uint8_t)(f >> 16); tag[3] = (uint8_t)(f >> 24);
-    tag[4] = (uint8_t)(f >> 32); tag[5] = (uint8_t)(f >> 40);
-    tag[6] = (uint8_t)(f >> 48); tag[7] = (uint8_t)(f >> 56);
+        for (size_t b = 0; b < nblocks; b++) {
+            size_t n = remaining < CHACHA20_BLOCK_SIZE ? remaining : CHACHA20_BLOCK_SIZE;
     
-    f = ((uint64_t)h4 << 104) | ((uint64_t)(h3 >> 4) << 80) |
-        ((uint64_t)(h2 >> 30) << 56) | ((uint64_t)(h1 >> 24) << 32) |
-        ((uint64_t)(h0 >> 20) << 8);
+            // Хвост короче 16 байт бывает только в самом конце данных
+            if (!encrypt) {
+                poly1305_update_padded(auth, in + pos, n);
+            }
+            xor_keystream(out + pos, in + pos, wide + b * 16, n);
+            if (encrypt) {
+                poly1305_update_padded(auth, out + pos, n);
+            }
     
-    f += ((uint64_t)ctx->pad[2] + ((uint64_t)ctx->pad[3] << 32));
+            pos += n;
+            remaining -= n;
+        }
+    }
     
-    tag[8] = (uint8_t)(f >> 0);  tag[9] = (uint8_t)(f >> 8);
-    tag[10] = (uint8_t)(f >> 16); tag[11] = (uint8_t)(f >> 24);
-    tag[12] = (uint8_t)(f >> 32); tag[13] = (uint8_t)(f >> 40);
-    tag[14] = (uint8_t)(f >> 48); tag[15] = (uint8_t)(f >> 56);
+    ctx->ciphertext_len += length;
 }
 
 // ==================== ОСНОВНЫЕ ФУНКЦИИ AEAD ====================
 
-bool chacha20_poly1305_init(chacha20_poly1305_ctx_t *ctx,
-                           const uint8_t key[CHACHA20_KEY_SIZE],
-                           const uint8_t nonce[CHACHA20_NONCE_SIZE]) {
-    if (!ctx || !key || !nonce) return false;
+bool chacha20_poly1305_init_with_schedule(chacha20_poly1305_ctx_t *ctx,
+                                         const chacha20_key_schedule_t *ks,
+                                         const uint8_t nonce[CHACHA20_NONCE_SIZE]) {
+    if (!ctx || !ks || !nonce) return false;
     
-    // Инициализируем контекст ChaCha20 нулевым счётчиком
-    chacha20_init_state(ctx->cipher_ctx.state, key, nonce, 1);
-    ctx->cipher_ctx.position = CHACHA20_BLOCK_SIZE; // Принудительно генерируем первый блок
+    // Ключ Poly1305 — первые 32 байта блока с нулевым счётчиком
+    chacha20_init_state(ctx->cipher_ctx.state, ks, nonce, 0);
     
-    // Генерируем ключ для Poly1305
-    uint8_t poly_key[32];
+    uint32_t poly_key[16];
     chacha20_block(ctx->cipher_ctx.state, poly_key);
-    poly1305_init(&ctx->auth_ctx, poly_key);
+    poly1305_init(&ctx->auth_ctx, (const uint8_t *)poly_key);
     memzero(poly_key, sizeof(poly_key));
     
-    // Обновляем счётчик для шифрования данных
-    chacha20_init_state(ctx->cipher_ctx.state, key, nonce, 1);
-    ctx->cipher_ctx.position = 0;
-    
-    // Сохраняем ключ и nonce
-    memcpy(ctx->key, key, CHACHA20_KEY_SIZE);
-    memcpy(ctx->nonce, nonce, CHACHA20_NONCE_SIZE);
+    // Данные шифруются с счётчика 1 (chacha20_block его уже увеличил)
     ctx->aad_len = 0;
     ctx->ciphertext_len = 0;
     
     return true;
 }
 
+bool chacha20_poly1305_init(chacha20_poly1305_ctx_t *ctx,
+                           const uint8_t key[CHACHA20_KEY_SIZE],
+                           const uint8_t nonce[CHACHA20_NONCE_SIZE]) {
+    if (!key) return false;
+    
+    chacha20_key_schedule_t ks;
+    chacha20_key_schedule_init(&ks, key);
+    bool ok = chacha20_poly1305_init_with_schedule(ctx, &ks, nonce);
+    secure_wipe(&ks, sizeof(ks));
+    return ok;
+}
+
 void chacha20_poly1305_aad(chacha20_poly1305_ctx_t *ctx,
                           const uint8_t *aad,
                           size_t aad_len) {
     if (!ctx || !aad || aad_len == 0) return;
     
-    // Добавляем AAD в Poly1305
-    poly1305_blocks(&ctx->auth_ctx, aad, aad_len);
-    if (ctx->auth_ctx.leftover) {
-        size_t i = ctx->auth_ctx.leftover;
-        ctx->auth_ctx.buffer[i++] = 1;
-        for (; i < 16; i++) ctx->auth_ctx.buffer[i] = 0;
-        poly1305_blocks(&ctx->auth_ctx, ctx->auth_ctx.buffer, 16);
-    }
-    
+    // Добавляем AAD в Poly1305 с дополнением до 16 байт
+    poly1305_update_padded(&ctx->auth_ctx, aad, aad_len);
     ctx->aad_len += aad_len;
 }
 
@@ -329,51 +448,9 @@ void chacha20_poly1305_encrypt(chacha20_poly1305_ctx_t *ctx,
                               uint8_t tag[POLY1305_TAG_SIZE]) {
     if (!ctx || !plaintext || !ciphertext) return;
     
-    // Шифрование ChaCha20
-    size_t pos = 0;
-    while (pos < length) {
-        if (ctx->cipher_ctx.position >= CHACHA20_BLOCK_SIZE) {
-            chacha20_block(ctx->cipher_ctx.state, ctx->cipher_ctx.keystream);
-            ctx->cipher_ctx.position = 0;
-        }
-        
-        size_t to_process = CHACHA20_BLOCK_SIZE - ctx->cipher_ctx.position;
-        if (to_process > length - pos) {
-            to_process = length - pos;
-        }
-        
-        for (size_t i = 0; i < to_process; i++) {
-            ciphertext[pos + i] = plaintext[pos + i] ^ 
-                                 ctx->cipher_ctx.keystream[ctx->cipher_ctx.position + i];
-        }
-        
-        ctx->cipher_ctx.position += to_process;
-        pos += to_process;
-    }
-    
-    // Добавляем шифртекст в Poly1305
-    poly1305_blocks(&ctx->auth_ctx, ciphertext, length);
-    if (ctx->auth_ctx.leftover) {
-        size_t i = ctx->auth_ctx.leftover;
-        ctx->auth_ctx.buffer[i++] = 1;
-        for (; i < 16; i++) ctx->auth_ctx.buffer[i] = 0;
-        poly1305_blocks(&ctx->auth_ctx, ctx->auth_ctx.buffer, 16);
-    }
-    
-    // Финализируем с длинами AAD и шифртекста
-    uint8_t length_block[16] = {0};
-    uint64_t aad_len_bits = ctx->aad_len * 8;
-    uint64_t cipher_len_bits = (ctx->ciphertext_len + length) * 8;
-    
-    for (int i = 0; i < 8; i++) {
-        length_block[i] = (uint8_t)(aad_len_bits >> (i * 8));
-        length_block[i + 8] = (uint8_t)(cipher_len_bits >> (i * 8));
-    }
-    
-    poly1305_blocks(&ctx->auth_ctx, length_block, 16);
-    poly1305_final(&ctx->auth_ctx, tag);
-    
-    ctx->ciphertext_len += length;
+    // Шифрование ChaCha20 и MAC по шифртексту одним проходом
+    chacha20_poly1305_crypt(ctx, plaintext, ciphertext, length, true);
+    poly1305_aead_finish(ctx, tag);
 }
 
 bool chacha20_poly1305_decrypt(chacha20_poly1305_ctx_t *ctx,
@@ -383,66 +460,68 @@ bool chacha20_poly1305_decrypt(chacha20_poly1305_ctx_t *ctx,
                               const uint8_t tag[POLY1305_TAG_SIZE]) {
     if (!ctx || !ciphertext || !plaintext || !tag) return false;
     
-    // Вычисляем тег аутентификации
+    // Расшифровка и MAC по шифртексту одним проходом
     uint8_t computed_tag[POLY1305_TAG_SIZE];
-    chacha20_poly1305_ctx_t verify_ctx = *ctx;
-    
-    poly1305_blocks(&verify_ctx.auth_ctx, ciphertext, length);
-    if (verify_ctx.auth_ctx.leftover) {
-        size_t i = verify_ctx.auth_ctx.leftover;
-        verify_ctx.auth_ctx.buffer[i++] = 1;
-        for (; i < 16; i++) verify_ctx.auth_ctx.buffer[i] = 0;
-        poly1305_blocks(&verify_ctx.auth_ctx, verify_ctx.auth_ctx.buffer, 16);
-    }
-    
-    uint8_t length_block[16] = {0};
-    uint64_t aad_len_bits = verify_ctx.aad_len * 8;
-    uint64_t cipher_len_bits = (verify_ctx.ciphertext_len + length) * 8;
+    chacha20_poly1305_crypt(ctx, ciphertext, plaintext, length, false);
+    poly1305_aead_finish(ctx, computed_tag);
     
-    for (int i = 0; i < 8; i++) {
-        length_block[i] = (uint8_t)(aad_len_bits >> (i * 8));
-        length_block[i + 8] = (uint8_t)(cipher_len_bits >> (i * 8));
+    // Проверяем тег (константное время). Подделка — расшифрованное
+    // затирается, наружу не уходит ни байта
+    bool valid = constant_time_compare(computed_tag, tag, POLY1305_TAG_SIZE);
+    memzero(computed_tag, sizeof(computed_tag));
+    if (!valid) {
+        secure_wipe(plaintext, length);
+        return false;
     }
     
-    poly1305_blocks(&verify_ctx.auth_ctx, length_block, 16);
-    poly1305_final(&verify_ctx.auth_ctx, computed_tag);
+    return true;
+}
+
+// ==================== УПРОЩЁННЫЙ API ДЛЯ MESH ====================
+// Реализация выбирается флагом MESH_CRYPTO_BACKEND (mesh_crypto_backend.h)
+
+#if MESH_CRYPTO_BACKEND == MESH_CRYPTO_SOFTWARE
+
+void mesh_encrypt_packet_ks(const chacha20_key_schedule_t *ks,
+                           const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                           const uint8_t *plaintext,
+                           size_t plaintext_len,
+                           const uint8_t *aad,
+                           size_t aad_len,
+                           uint8_t *ciphertext,
+                           uint8_t tag[POLY1305_TAG_SIZE]) {
+    chacha20_poly1305_ctx_t ctx;
+    if (!chacha20_poly1305_init_with_schedule(&ctx, ks, nonce)) return;
     
-    // Проверяем тег (константное время)
-    if (!constant_time_compare(computed_tag, tag, POLY1305_TAG_SIZE)) {
-        memzero(computed_tag, sizeof(computed_tag));
-        return false;
+    if (aad_len > 0) {
+        chacha20_poly1305_aad(&ctx, aad, aad_len);
     }
     
-    memzero(computed_tag, sizeof(computed_tag));
+    chacha20_poly1305_encrypt(&ctx, plaintext, ciphertext, plaintext_len, tag);
+    secure_wipe(&ctx, sizeof(ctx));
+}
+
+bool mesh_decrypt_packet_ks(const chacha20_key_schedule_t *ks,
+                           const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                           const uint8_t *ciphertext,
+                           size_t ciphertext_len,
+                           const uint8_t *aad,
+                           size_t aad_len,
+                           const uint8_t tag[POLY1305_TAG_SIZE],
+                           uint8_t *plaintext) {
+    chacha20_poly1305_ctx_t ctx;
+    if (!chacha20_poly1305_init_with_schedule(&ctx, ks, nonce)) return false;
     
-    // Расшифровываем ChaCha20
-    size_t pos = 0;
-    while (pos < length) {
-        if (ctx->cipher_ctx.position >= CHACHA20_BLOCK_SIZE) {
-            chacha20_block(ctx->cipher_ctx.state, ctx->cipher_ctx.keystream);
-            ctx->cipher_ctx.position = 0;
-        }
-        
-        size_t to_process = CHACHA20_BLOCK_SIZE - ctx->cipher_ctx.position;
-        if (to_process > length - pos) {
-            to_process = length - pos;
-        }
-        
-        for (size_t i = 0; i < to_process; i++) {
-            plaintext[pos + i] = ciphertext[pos + i] ^ 
-                                ctx->cipher_ctx.keystream[ctx->cipher_ctx.position + i];
-        }
-        
-        ctx->cipher_ctx.position += to_process;
-        pos += to_process;
+    if (aad_len > 0) {
+        chacha20_poly1305_aad(&ctx, aad, aad_len);
     }
     
-    ctx->ciphertext_len += length;
-    return true;
+    bool result = chacha20_poly1305_decrypt(&ctx, ciphertext, plaintext,
+                                           ciphertext_len, tag);
+    secure_wipe(&ctx, sizeof(ctx));
+    return result;
 }
 
-// ==================== УПРОЩЁННЫЙ API ДЛЯ MESH ====================
-
 void mesh_encrypt_packet(const uint8_t key[CHACHA20_KEY_SIZE],
                         const uint8_t nonce[CHACHA20_NONCE_SIZE],
                         const uint8_t *plaintext,
@@ -451,15 +530,11 @@ void mesh_encrypt_packet(const uint8_t key[CHACHA20_KEY_SIZE],
                         size_t aad_len,
                         uint8_t *ciphertext,
                         uint8_t tag[POLY1305_TAG_SIZE]) {
-    chacha20_poly1305_ctx_t ctx;
-    if (!chacha20_poly1305_init(&ctx, key, nonce)) return;
-    
-    if (aad_len > 0) {
-        chacha20_poly1305_aad(&ctx, aad, aad_len);
-    }
-    
-    chacha20_poly1305_encrypt(&ctx, plaintext, ciphertext, plaintext_len, tag);
-    secure_wipe(&ctx, sizeof(ctx));
+    chacha20_key_schedule_t ks;
+    chacha20_key_schedule_init(&ks, key);
+    mesh_encrypt_packet_ks(&ks, nonce, plaintext, plaintext_len,
+                           aad, aad_len, ciphertext, tag);
+    secure_wipe(&ks, sizeof(ks));
 }
 
 bool mesh_decrypt_packet(const uint8_t key[CHACHA20_KEY_SIZE],
@@ -470,19 +545,81 @@ bool mesh_decrypt_packet(const uint8_t key[CHACHA20_KEY_SIZE],
                         size_t aad_len,
                         const uint8_t tag[POLY1305_TAG_SIZE],
                         uint8_t *plaintext) {
-    chacha20_poly1305_ctx_t ctx;
-    if (!chacha20_poly1305_init(&ctx, key, nonce)) return false;
-    
-    if (aad_len > 0) {
-        chacha20_poly1305_aad(&ctx, aad, aad_len);
+    chacha20_key_schedule_t ks;
+    chacha20_key_schedule_init(&ks, key);
+    bool result = mesh_decrypt_packet_ks(&ks, nonce, ciphertext, ciphertext_len,
+                                         aad, aad_len, tag, plaintext);
+    secure_wipe(&ks, sizeof(ks));
+    return result;
+}
+
+#else
+
+// Сырой ключ из расписания: слова 4..11 — ключ в little-endian
+static void chacha20_key_schedule_key(const chacha20_key_schedule_t *ks,
+                                     uint8_t key[CHACHA20_KEY_SIZE]) {
+    for (int i = 0; i < 8; i++) {
+        store32_le(key + i * 4, ks->words[4 + i]);
     }
-    
-    bool result = chacha20_poly1305_decrypt(&ctx, ciphertext, plaintext, 
-                                           ciphertext_len, tag);
-    secure_wipe(&ctx, sizeof(ctx));
+}
+
+void mesh_encrypt_packet(const uint8_t key[CHACHA20_KEY_SIZE],
+                        const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                        const uint8_t *plaintext,
+                        size_t plaintext_len,
+                        const uint8_t *aad,
+                        size_t aad_len,
+                        uint8_t *ciphertext,
+                        uint8_t tag[POLY1305_TAG_SIZE]) {
+    mesh_backend_encrypt(key, nonce, plaintext, plaintext_len,
+                         aad, aad_len, ciphertext, tag);
+}
+
+bool mesh_decrypt_packet(const uint8_t key[CHACHA20_KEY_SIZE],
+                        const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                        const uint8_t *ciphertext,
+                        size_t ciphertext_len,
+                        const uint8_t *aad,
+                        size_t aad_len,
+                        const uint8_t tag[POLY1305_TAG_SIZE],
+                        uint8_t *plaintext) {
+    return mesh_backend_decrypt(key, nonce, ciphertext, ciphertext_len,
+                                aad, aad_len, tag, plaintext);
+}
+
+void mesh_encrypt_packet_ks(const chacha20_key_schedule_t *ks,
+                           const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                           const uint8_t *plaintext,
+                           size_t plaintext_len,
+                           const uint8_t *aad,
+                           size_t aad_len,
+                           uint8_t *ciphertext,
+                           uint8_t tag[POLY1305_TAG_SIZE]) {
+    uint8_t key[CHACHA20_KEY_SIZE];
+    chacha20_key_schedule_key(ks, key);
+    mesh_backend_encrypt(key, nonce, plaintext, plaintext_len,
+                         aad, aad_len, ciphertext, tag);
+    secure_wipe(key, sizeof(key));
+}
+
+bool mesh_decrypt_packet_ks(const chacha20_key_schedule_t *ks,
+                           const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                           const uint8_t *ciphertext,
+                           size_t ciphertext_len,
+                           const uint8_t *aad,
+                           size_t aad_len,
+                           const uint8_t tag[POLY1305_TAG_SIZE],
+                           uint8_t *plaintext) {
+    uint8_t key[CHACHA20_KEY_SIZE];
+    chacha20_key_schedule_key(ks, key);
+    bool result = mesh_backend_decrypt(key, nonce, ciphertext, ciphertext_len,
+                                       aad, aad_len, tag, plaintext);
+    secure_wipe(key, sizeof(key));
     return result;
 }
 
+#endif
+
 // ==================== ФУНКЦИИ KDF ====================
 
 void derive_session_key(const uint8_t master_key[CHACHA20_KEY_SIZE],
@@ -506,14 +643,142 @@ void derive_session_key(const uint8_t master_key[CHACHA20_KEY_SIZE],
     memzero(tag, sizeof(tag));
 }
 
+void derive_device_key(const uint8_t session_key[CHACHA20_KEY_SIZE],
+                      const uint8_t mac[6],
+                      uint8_t device_key[CHACHA20_KEY_SIZE]) {
+    // Первые 32 байта блока ChaCha20 с nonce = MAC + "DK"
+    uint8_t nonce[12] = {0};
+    memcpy(nonce, mac, 6);
+    nonce[6] = 'D';
+    nonce[7] = 'K';
+    
+    chacha20_key_schedule_t ks;
+    chacha20_key_schedule_init(&ks, session_key);
+    
+    uint32_t state[16];
+    uint32_t block[16];
+    chacha20_init_state(state, &ks, nonce, 0);
+    chacha20_block(state, block);
+    memcpy(device_key, block, CHACHA20_KEY_SIZE);
+    
+    secure_wipe(&ks, sizeof(ks));
+    secure_wipe(state, sizeof(state));
+    secure_wipe(block, sizeof(block));
+}
+
 void derive_packet_nonce(const uint8_t session_key[CHACHA20_KEY_SIZE],
                         uint32_t packet_id,
                         const uint8_t src_mac[6],
+                        uint16_t boot_epoch,
                         uint8_t output_nonce[CHACHA20_NONCE_SIZE]) {
-    // Формируем уникальный nonce: packet_id + src_mac
+    (void)session_key;
+    
+    // Формируем уникальный nonce: packet_id + src_mac + номер загрузки
+    // источника (packet_id после перезагрузки начинается заново)
     write_be32(output_nonce, packet_id);
     memcpy(output_nonce + 4, src_mac, 6);
-    memset(output_nonce + 10, 0, 2); // Резервные байты
+    output_nonce[10] = (uint8_t)(boot_epoch >> 8);
+    output_nonce[11] = (uint8_t)boot_epoch;
+}
+
+// ==================== САМОПРОВЕРКА ====================
+
+// RFC 8439, 2.8.2: AEAD ChaCha20-Poly1305
+static const uint8_t rfc8439_key[32] = {
+    0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f,
+    0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97,
+    0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f
+};
+
+static const uint8_t rfc8439_nonce[12] = {
+    0x07, 0x00, 0x00, 0x00, 0x40, 0x41, 0x42, 0x43,
+    0x44, 0x45, 0x46, 0x47
+};
+
+static const uint8_t rfc8439_aad[12] = {
+    0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7
+};
+
+static const char rfc8439_plaintext[] =
+    "Ladies and Gentlemen of the class of '99: If I could offer you "
+    "only one tip for the future, sunscreen would be it.";
+
+static const uint8_t rfc8439_ciphertext[114] = {
+    0xd3, 0x1a, 0x8d, 0x34, 0x64, 0x8e, 0x60, 0xdb,
+    0x7b, 0x86, 0xaf, 0xbc, 0x53, 0xef, 0x7e, 0xc2,
+    0xa4, 0xad, 0xed, 0x51, 0x29, 0x6e, 0x08, 0xfe,
+    0xa9, 0xe2, 0xb5, 0xa7, 0x36, 0xee, 0x62, 0xd6,
+    0x3d, 0xbe, 0xa4, 0x5e, 0x8c, 0xa9, 0x67, 0x12,
+    0x82, 0xfa, 0xfb, 0x69, 0xda, 0x92, 0x72, 0x8b,
+    0x1a, 0x71, 0xde, 0x0a, 0x9e, 0x06, 0x0b, 0x29,
+    0x05, 0xd6, 0xa5, 0xb6, 0x7e, 0xcd, 0x3b, 0x36,
+    0x92, 0xdd, 0xbd, 0x7f, 0x2d, 0x77, 0x8b, 0x8c,
+    0x98, 0x03, 0xae, 0xe3, 0x28, 0x09, 0x1b, 0x58,
+    0xfa, 0xb3, 0x24, 0xe4, 0xfa, 0xd6, 0x75, 0x94,
+    0x55, 0x85, 0x80, 0x8b, 0x48, 0x31, 0xd7, 0xbc,
+    0x3f, 0xf4, 0xde, 0xf0, 0x8e, 0x4b, 0x7a, 0x9d,
+    0xe5, 0x76, 0xd2, 0x65, 0x86, 0xce, 0xc6, 0x4b,
+    0x61, 0x16
+};
+
+static const uint8_t rfc8439_tag[16] = {
+    0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a,
+    0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06, 0x91
+};
+
+bool chacha20_poly1305_self_test(void) {
+    const size_t len = sizeof(rfc8439_ciphertext);
+    uint8_t buffer[sizeof(rfc8439_ciphertext)];
+    uint8_t tag[POLY1305_TAG_SIZE];
+    chacha20_poly1305_ctx_t ctx;
+    bool ok = true;
+    
+    // Шифрование: шифртекст и тег бит в бит
+    chacha20_poly1305_init(&ctx, rfc8439_key, rfc8439_nonce);
+    chacha20_poly1305_aad(&ctx, rfc8439_aad, sizeof(rfc8439_aad));
+    chacha20_poly1305_encrypt(&ctx, (const uint8_t *)rfc8439_plaintext, buffer, len, tag);
+    ok &= memcmp(buffer, rfc8439_ciphertext, len) == 0;
+    ok &= memcmp(tag, rfc8439_tag, sizeof(tag)) == 0;
+    
+    // Расшифровка на месте
+    chacha20_poly1305_init(&ctx, rfc8439_key, rfc8439_nonce);
+    chacha20_poly1305_aad(&ctx, rfc8439_aad, sizeof(rfc8439_aad));
+    ok &= chacha20_poly1305_decrypt(&ctx, buffer, buffer, len, rfc8439_tag);
+    ok &= memcmp(buffer, rfc8439_plaintext, len) == 0;
+    
+    // Испорченный шифртекст отвергается
+    memcpy(buffer, rfc8439_ciphertext, len);
+    buffer[len / 2] ^= 0x01;
+    chacha20_poly1305_init(&ctx, rfc8439_key, rfc8439_nonce);
+    chacha20_poly1305_aad(&ctx, rfc8439_aad, sizeof(rfc8439_aad));
+    ok &= !chacha20_poly1305_decrypt(&ctx, buffer, buffer, len, rfc8439_tag);
+    
+    // То же через точку входа пакетов — реализацию, выбранную
+    // MESH_CRYPTO_BACKEND. AES-CCM с векторами RFC 8439 не сравнить:
+    // для него только туда-обратно и отказ на подделке
+    chacha20_key_schedule_t ks;
+    chacha20_key_schedule_init(&ks, rfc8439_key);
+    mesh_encrypt_packet_ks(&ks, rfc8439_nonce, (const uint8_t *)rfc8439_plaintext, len,
+                           rfc8439_aad, sizeof(rfc8439_aad), buffer, tag);
+#if MESH_CRYPTO_BACKEND != MESH_CRYPTO_AES_CCM
+    ok &= memcmp(buffer, rfc8439_ciphertext, len) == 0;
+    ok &= memcmp(tag, rfc8439_tag, sizeof(tag)) == 0;
+#endif
+    ok &= mesh_decrypt_packet_ks(&ks, rfc8439_nonce, buffer, len,
+                                 rfc8439_aad, sizeof(rfc8439_aad), tag, buffer);
+    ok &= memcmp(buffer, rfc8439_plaintext, len) == 0;
+    
+    mesh_encrypt_packet_ks(&ks, rfc8439_nonce, (const uint8_t *)rfc8439_plaintext, len,
+                           rfc8439_aad, sizeof(rfc8439_aad), buffer, tag);
+    buffer[len / 2] ^= 0x01;
+    ok &= !mesh_decrypt_packet_ks(&ks, rfc8439_nonce, buffer, len,
+                                  rfc8439_aad, sizeof(rfc8439_aad), tag, buffer);
+    
+    secure_wipe(&ks, sizeof(ks));
+    secure_wipe(&ctx, sizeof(ctx));
+    return ok;
 }
 
 // ==================== СЛУЖЕБНЫЕ ФУНКЦИИ ====================
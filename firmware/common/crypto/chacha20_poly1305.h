@@ -5,44 +5,141 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define CHACHA20_KEY_SIZE     32  // 256-bit key
 #define CHACHA20_NONCE_SIZE   12  // 96-bit nonce
+#define CHACHA20_BLOCK_SIZE   64  // Блок ключевого потока
 #define POLY1305_TAG_SIZE     16  // 128-bit authentication tag
 
+// Развёрнутый ключ: константы и 8 слов ключа (слова 0..11 состояния).
+// Готовится один раз на ключ, на пакет остаются только счётчик и nonce.
+typedef struct {
+    uint32_t words[12];
+} chacha20_key_schedule_t;
+
+typedef struct {
+    uint32_t state[16];           // Счётчик в state[12] — следующий блок
+} chacha20_ctx_t;
+
+typedef struct {
+    uint32_t r[5];                // Ключ r, 26-битные лимбы
+    uint32_t h[5];                // Аккумулятор
+    uint32_t pad[4];              // Ключ s
+    size_t   leftover;
+    uint8_t  buffer[16];
+    uint8_t  final;
+} poly1305_ctx_t;
+
+typedef struct {
+    chacha20_ctx_t cipher_ctx;
+    poly1305_ctx_t auth_ctx;
+    uint64_t aad_len;
+    uint64_t ciphertext_len;
+} chacha20_poly1305_ctx_t;
+
+// Развёртывание ключа (один раз на ключ)
+void chacha20_key_schedule_init(chacha20_key_schedule_t *ks,
+                               const uint8_t key[CHACHA20_KEY_SIZE]);
+
+// Инициализация контекста по готовому расписанию: nonce, один блок
+// для ключа Poly1305 — и всё
+bool chacha20_poly1305_init_with_schedule(chacha20_poly1305_ctx_t *ctx,
+                                         const chacha20_key_schedule_t *ks,
+                                         const uint8_t nonce[CHACHA20_NONCE_SIZE]);
+
 // Инициализация контекста шифрования с ключом и одноразовым номером
-bool chacha20_poly1305_init(const uint8_t key[CHACHA20_KEY_SIZE],
+bool chacha20_poly1305_init(chacha20_poly1305_ctx_t *ctx,
+                           const uint8_t key[CHACHA20_KEY_SIZE],
                            const uint8_t nonce[CHACHA20_NONCE_SIZE]);
 
-// Добавление дополнительных аутентифицированных данных (AAD)
-void chacha20_poly1305_aad(const uint8_t *aad, size_t aad_len);
+// Добавление дополнительных аутентифицированных данных (AAD).
+// Вызывается один раз, до encrypt/decrypt.
+void chacha20_poly1305_aad(chacha20_poly1305_ctx_t *ctx,
+                          const uint8_t *aad,
+                          size_t aad_len);
 
-// Шифрование и аутентификация данных
-void chacha20_poly1305_encrypt(const uint8_t *plaintext,
+// Шифрование и аутентификация данных (один вызов на контекст)
+void chacha20_poly1305_encrypt(chacha20_poly1305_ctx_t *ctx,
+                              const uint8_t *plaintext,
                               uint8_t *ciphertext,
                               size_t length,
                               uint8_t tag[POLY1305_TAG_SIZE]);
 
-// Расшифровка и проверка аутентификации
-bool chacha20_poly1305_decrypt(const uint8_t *ciphertext,
+// Расшифровка и проверка аутентификации (один вызов на контекст).
+// Один проход по данным; при неверном теге plaintext обнуляется.
+bool chacha20_poly1305_decrypt(chacha20_poly1305_ctx_t *ctx,
+                              const uint8_t *ciphertext,
                               uint8_t *plaintext,
                               size_t length,
                               const uint8_t tag[POLY1305_TAG_SIZE]);
 
 // Упрощенный API для Mesh-пакетов
-void mesh_encrypt_payload(const uint8_t key[32],
-                         const uint8_t nonce[12],
-                         const uint8_t *plaintext,
-                         size_t plaintext_len,
-                         const uint8_t *aad,
-                         size_t aad_len,
-                         uint8_t *ciphertext,
-                         uint8_t tag[16]);
-
-bool mesh_decrypt_payload(const uint8_t key[32],
-                         const uint8_t nonce[12],
-                         const uint8_t *ciphertext,
-                         size_t ciphertext_len,
-                         const uint8_t *aad,
-                         size_t aad_len,
-                         const uint8_t tag[16],
-                         uint8_t *plaintext);
\ No newline at end of file
+void mesh_encrypt_packet(const uint8_t key[CHACHA20_KEY_SIZE],
+                        const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                        const uint8_t *plaintext,
+                        size_t plaintext_len,
+                        const uint8_t *aad,
+                        size_t aad_len,
+                        uint8_t *ciphertext,
+                        uint8_t tag[POLY1305_TAG_SIZE]);
+
+bool mesh_decrypt_packet(const uint8_t key[CHACHA20_KEY_SIZE],
+                        const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                        const uint8_t *ciphertext,
+                        size_t ciphertext_len,
+                        const uint8_t *aad,
+                        size_t aad_len,
+                        const uint8_t tag[POLY1305_TAG_SIZE],
+                        uint8_t *plaintext);
+
+// То же по готовому расписанию ключа (без развёртывания на каждый пакет)
+void mesh_encrypt_packet_ks(const chacha20_key_schedule_t *ks,
+                           const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                           const uint8_t *plaintext,
+                           size_t plaintext_len,
+                           const uint8_t *aad,
+                           size_t aad_len,
+                           uint8_t *ciphertext,
+                           uint8_t tag[POLY1305_TAG_SIZE]);
+
+bool mesh_decrypt_packet_ks(const chacha20_key_schedule_t *ks,
+                           const uint8_t nonce[CHACHA20_NONCE_SIZE],
+                           const uint8_t *ciphertext,
+                           size_t ciphertext_len,
+                           const uint8_t *aad,
+                           size_t aad_len,
+                           const uint8_t tag[POLY1305_TAG_SIZE],
+                           uint8_t *plaintext);
+
+// Ключи
+void derive_session_key(const uint8_t master_key[CHACHA20_KEY_SIZE],
+                       uint32_t session_id,
+                       uint8_t session_key[CHACHA20_KEY_SIZE]);
+
+// Ключ конкретного устройства из сессионного ключа и его MAC
+void derive_device_key(const uint8_t session_key[CHACHA20_KEY_SIZE],
+                      const uint8_t mac[6],
+                      uint8_t device_key[CHACHA20_KEY_SIZE]);
+
+// Nonce пакета: packet_id (big-endian) + MAC источника + номер его
+// загрузки (big-endian). Не секретен, session_key не участвует (можно NULL).
+void derive_packet_nonce(const uint8_t session_key[CHACHA20_KEY_SIZE],
+                        uint32_t packet_id,
+                        const uint8_t src_mac[6],
+                        uint16_t boot_epoch,
+                        uint8_t output_nonce[CHACHA20_NONCE_SIZE]);
+
+// Проверка по векторам RFC 8439: своя реализация и выбранная
+// MESH_CRYPTO_BACKEND (true — всё сошлось)
+bool chacha20_poly1305_self_test(void);
+
+// Служебные
+bool constant_time_compare(const uint8_t *a, const uint8_t *b, size_t len);
+void secure_wipe(void *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
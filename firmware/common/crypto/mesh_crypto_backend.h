@@ -0,0 +1,68 @@
+// mesh_crypto_backend.h - Выбор реализации шифрования при сборке
+//
+// mesh_encrypt_packet / mesh_decrypt_packet (и *_ks) — единая точка
+// входа, реализация задаётся флагом MESH_CRYPTO_BACKEND в [env:*]
+// platformio.ini:
+//
+//   MESH_CRYPTO_SOFTWARE           — свой ChaCha20-Poly1305 на C
+//   MESH_CRYPTO_MBEDTLS_CHACHAPOLY — ChaCha20-Poly1305 из mbedTLS ESP-IDF,
+//                                    в эфире совместим с программным
+//   MESH_CRYPTO_AES_CCM            — AES-256-CCM (тег 16 байт) через
+//                                    mbedTLS на аппаратном AES
+//
+// AES-CCM меняет формат в эфире: его включают на координаторе и
+// всех датчиках разом. Репитерам всё равно — они не расшифровывают.
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define MESH_CRYPTO_SOFTWARE            0
+#define MESH_CRYPTO_MBEDTLS_CHACHAPOLY  1
+#define MESH_CRYPTO_AES_CCM             2
+
+#ifndef MESH_CRYPTO_BACKEND
+#define MESH_CRYPTO_BACKEND MESH_CRYPTO_SOFTWARE
+#endif
+
+#if MESH_CRYPTO_BACKEND == MESH_CRYPTO_SOFTWARE
+#define MESH_CRYPTO_BACKEND_NAME "software-chachapoly"
+#elif MESH_CRYPTO_BACKEND == MESH_CRYPTO_MBEDTLS_CHACHAPOLY
+#define MESH_CRYPTO_BACKEND_NAME "mbedtls-chachapoly"
+#elif MESH_CRYPTO_BACKEND == MESH_CRYPTO_AES_CCM
+#define MESH_CRYPTO_BACKEND_NAME "aes-ccm"
+#else
+#error "Unknown MESH_CRYPTO_BACKEND"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if MESH_CRYPTO_BACKEND != MESH_CRYPTO_SOFTWARE
+
+// Реализации на mbedTLS (mesh_crypto_mbedtls.c). Ключ 32 байта,
+// nonce 12 байт, тег 16 байт — как у программной версии.
+bool mesh_backend_encrypt(const uint8_t key[32],
+                          const uint8_t nonce[12],
+                          const uint8_t *plaintext,
+                          size_t plaintext_len,
+                          const uint8_t *aad,
+                          size_t aad_len,
+                          uint8_t *ciphertext,
+                          uint8_t tag[16]);
+
+bool mesh_backend_decrypt(const uint8_t key[32],
+                          const uint8_t nonce[12],
+                          const uint8_t *ciphertext,
+                          size_t ciphertext_len,
+                          const uint8_t *aad,
+                          size_t aad_len,
+                          const uint8_t tag[16],
+                          uint8_t *plaintext);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,125 @@
+// mesh_crypto_mbedtls.c
+// Шифрование пакетов через mbedTLS из ESP-IDF (см. mesh_crypto_backend.h)
+// При MESH_CRYPTO_SOFTWARE файл пустой.
+
+#include "mesh_crypto_backend.h"
+
+#if MESH_CRYPTO_BACKEND == MESH_CRYPTO_MBEDTLS_CHACHAPOLY
+
+#include <mbedtls/chachapoly.h>
+
+#ifndef MBEDTLS_CHACHAPOLY_C
+#error "MESH_CRYPTO_MBEDTLS_CHACHAPOLY needs CONFIG_MBEDTLS_CHACHAPOLY_C in sdkconfig"
+#endif
+
+bool mesh_backend_encrypt(const uint8_t key[32],
+                          const uint8_t nonce[12],
+                          const uint8_t *plaintext,
+                          size_t plaintext_len,
+                          const uint8_t *aad,
+                          size_t aad_len,
+                          uint8_t *ciphertext,
+                          uint8_t tag[16]) {
+    mbedtls_chachapoly_context ctx;
+    mbedtls_chachapoly_init(&ctx);
+    
+    int ret = mbedtls_chachapoly_setkey(&ctx, key);
+    if (ret == 0) {
+        ret = mbedtls_chachapoly_encrypt_and_tag(&ctx, plaintext_len, nonce,
+                                                 aad, aad_len,
+                                                 plaintext, ciphertext, tag);
+    }
+    
+    mbedtls_chachapoly_free(&ctx);
+    return ret == 0;
+}
+
+bool mesh_backend_decrypt(const uint8_t key[32],
+                          const uint8_t nonce[12],
+                          const uint8_t *ciphertext,
+                          size_t ciphertext_len,
+                          const uint8_t *aad,
+                          size_t aad_len,
+                          const uint8_t tag[16],
+                          uint8_t *plaintext) {
+    mbedtls_chachapoly_context ctx;
+    mbedtls_chachapoly_init(&ctx);
+    
+    // При неверном теге mbedTLS обнуляет выход
+    int ret = mbedtls_chachapoly_setkey(&ctx, key);
+    if (ret == 0) {
+        ret = mbedtls_chachapoly_auth_decrypt(&ctx, ciphertext_len, nonce,
+                                              aad, aad_len, tag,
+                                              ciphertext, plaintext);
+    }
+    
+    mbedtls_chachapoly_free(&ctx);
+    return ret == 0;
+}
+
+#elif MESH_CRYPTO_BACKEND == MESH_CRYPTO_AES_CCM
+
+#include <mbedtls/ccm.h>
+
+#ifndef MBEDTLS_CCM_C
+#error "MESH_CRYPTO_AES_CCM needs CONFIG_MBEDTLS_CCM_C in sdkconfig"
+#endif
+
+// AES-256: ключ сети тот же, что у ChaCha20. На ESP32/S3/C3 блоки
+// AES считает аппаратный движок (CONFIG_MBEDTLS_HARDWARE_AES).
+#define AES_CCM_KEY_BITS 256
+#define AES_CCM_NONCE_SIZE 12
+#define AES_CCM_TAG_SIZE 16
+
+bool mesh_backend_encrypt(const uint8_t key[32],
+                          const uint8_t nonce[12],
+                          const uint8_t *plaintext,
+                          size_t plaintext_len,
+                          const uint8_t *aad,
+                          size_t aad_len,
+                          uint8_t *ciphertext,
+                          uint8_t tag[16]) {
+    mbedtls_ccm_context ctx;
+    mbedtls_ccm_init(&ctx);
+    
+    int ret = mbedtls_ccm_setkey(&ctx, MBEDTLS_CIPHER_ID_AES, key, AES_CCM_KEY_BITS);
+    if (ret == 0) {
+        ret = mbedtls_ccm_encrypt_and_tag(&ctx, plaintext_len,
+                                          nonce, AES_CCM_NONCE_SIZE,
+                                          aad, aad_len,
+                                          plaintext, ciphertext,
+                                          tag, AES_CCM_TAG_SIZE);
+    }
+    
+    mbedtls_ccm_free(&ctx);
+    return ret == 0;
+}
+
+bool mesh_backend_decrypt(const uint8_t key[32],
+                          const uint8_t nonce[12],
+                          const uint8_t *ciphertext,
+                          size_t ciphertext_len,
+                          const uint8_t *aad,
+                          size_t aad_len,
+                          const uint8_t tag[16],
+                          uint8_t *plaintext) {
+    mbedtls_ccm_context ctx;
+    mbedtls_ccm_init(&ctx);
+    
+    // При неверном теге mbedTLS обнуляет выход
+    int ret = mbedtls_ccm_setkey(&ctx, MBEDTLS_CIPHER_ID_AES, key, AES_CCM_KEY_BITS);
+    if (ret == 0) {
+        ret = mbedtls_ccm_auth_decrypt(&ctx, ciphertext_len,
+                                       nonce, AES_CCM_NONCE_SIZE,
+                                       aad, aad_len,
+                                       ciphertext, plaintext,
+                                       tag, AES_CCM_TAG_SIZE);
+    }
+    
+    mbedtls_ccm_free(&ctx);
+    return ret == 0;
+}
+
+#endif
+
+// Конец файла mesh_crypto_mbedtls.c
@@ -0,0 +1,96 @@
+// mesh_packet_crypto.h - Шифрование payload пакета на месте
+//
+// Payload шифруется прямо в MeshPacketHeader: впереди открытый номер
+// загрузки источника (2 байта, little-endian), тег (16 байт) ложится
+// в хвост payload, payload_len включает оба, флаг FLAG_ENCRYPTED
+// выставлен. Заголовок передаётся открытым и аутентифицируется как
+// AAD — кроме полей, которые меняют ретрансляторы: ttl, last_hop_mac
+// и FLAG_RETRY. Поэтому репитер пересылает такой пакет как есть,
+// не зная ключа и не тратя на него ни такта.
+//
+// Ключ — ключ устройства-участника (не координатора), nonce —
+// derive_packet_nonce(packet_id, src_mac, boot_epoch): у каждого
+// источника свой счётчик пакетов, повтор (тот же packet_id) уходит
+// тем же кадром. packet_id после перезагрузки начинается заново, ключ
+// тот же — nonce различает номер загрузки, хранимый источником в NVS.
+// Кадр v1 не годится: его payload_len другой, тег не найти.
+// Служебные пакеты (маршруты, ACK, heartbeat) остаются открытыми —
+// их читают ретрансляторы.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "../mesh_protocol.h"
+#include "chacha20_poly1305.h"
+
+#define MESH_AEAD_TAG_SIZE          POLY1305_TAG_SIZE
+#define MESH_BOOT_EPOCH_SIZE        2
+#define MESH_ENCRYPTED_PAYLOAD_MAX  (MESH_PAYLOAD_MAX - MESH_BOOT_EPOCH_SIZE - MESH_AEAD_TAG_SIZE)
+
+static inline bool is_encrypted_packet(const MeshPacketHeader* pkt) {
+    return (pkt->flags & FLAG_ENCRYPTED) != 0;
+}
+
+// AAD: заголовок как есть, изменяемые в пути поля обнулены
+static inline void mesh_packet_aad(const MeshPacketHeader* pkt, uint8_t aad[MESH_HEADER_SIZE]) {
+    memcpy(aad, pkt, MESH_HEADER_SIZE);
+    aad[MESH_FIELD(ttl)] = 0;
+    memset(aad + MESH_FIELD(last_hop_mac), 0, 6);
+    aad[MESH_FIELD(flags)] &= (uint8_t)~FLAG_RETRY;
+}
+
+// Зашифровать payload на месте (перед первой отправкой).
+// boot_epoch — номер текущей загрузки источника, уже сохранённый в NVS.
+// false — payload не оставляет места под тег или уже зашифрован.
+static inline bool mesh_packet_encrypt(MeshPacketHeader* pkt, const chacha20_key_schedule_t* ks,
+                                       uint16_t boot_epoch) {
+    if (is_encrypted_packet(pkt) || pkt->payload_len > MESH_ENCRYPTED_PAYLOAD_MAX) {
+        return false;
+    }
+
+    // Флаг и итоговая длина — до расчёта AAD: они тоже под защитой
+    uint8_t plain_len = pkt->payload_len;
+    pkt->flags |= FLAG_ENCRYPTED;
+    pkt->payload_len = MESH_BOOT_EPOCH_SIZE + plain_len + MESH_AEAD_TAG_SIZE;
+
+    uint8_t* body = pkt->payload + MESH_BOOT_EPOCH_SIZE;
+    memmove(body, pkt->payload, plain_len);
+    pkt->payload[0] = (uint8_t)boot_epoch;
+    pkt->payload[1] = (uint8_t)(boot_epoch >> 8);
+
+    uint8_t aad[MESH_HEADER_SIZE];
+    uint8_t nonce[CHACHA20_NONCE_SIZE];
+    mesh_packet_aad(pkt, aad);
+    derive_packet_nonce(NULL, pkt->packet_id, pkt->src_mac, boot_epoch, nonce);
+
+    mesh_encrypt_packet_ks(ks, nonce, body, plain_len, aad, sizeof(aad),
+                           body, body + plain_len);
+    return true;
+}
+
+// Проверить и расшифровать payload на месте. После успеха пакет
+// выглядит как открытый: флаг снят, payload_len без тега.
+// false — подделка или повреждение (payload затёрт, пакет отбросить).
+static inline bool mesh_packet_decrypt(MeshPacketHeader* pkt, const chacha20_key_schedule_t* ks) {
+    if (!is_encrypted_packet(pkt) || pkt->payload_len < MESH_BOOT_EPOCH_SIZE + MESH_AEAD_TAG_SIZE) {
+        return false;
+    }
+
+    uint8_t plain_len = pkt->payload_len - MESH_BOOT_EPOCH_SIZE - MESH_AEAD_TAG_SIZE;
+    uint16_t boot_epoch = (uint16_t)(pkt->payload[0] | (pkt->payload[1] << 8));
+    uint8_t* body = pkt->payload + MESH_BOOT_EPOCH_SIZE;
+    uint8_t aad[MESH_HEADER_SIZE];
+    uint8_t nonce[CHACHA20_NONCE_SIZE];
+    mesh_packet_aad(pkt, aad);
+    derive_packet_nonce(NULL, pkt->packet_id, pkt->src_mac, boot_epoch, nonce);
+
+    if (!mesh_decrypt_packet_ks(ks, nonce, body, plain_len, aad, sizeof(aad),
+                                body + plain_len, body)) {
+        return false;
+    }
+    memmove(pkt->payload, body, plain_len);
+
+    pkt->flags &= (uint8_t)~FLAG_ENCRYPTED;
+    pkt->payload_len = plain_len;
+    return true;
+}
@@ -0,0 +1,95 @@
+// peer_key_cache.h - Кэш развёрнутых ключей устройств
+//
+// Ключ устройства выводится из сессионного ключа и MAC
+// (derive_device_key) и разворачивается в расписание ChaCha20.
+// Делать это на каждый пакет — лишний блок ChaCha20 плюс
+// развёртывание; кэш держит готовые расписания для последних
+// активных устройств, при промахе вытесняется самое давнее.
+//
+// Смена сессионного ключа сбрасывает кэш целиком. Синхронизацию
+// (если кэш трогают из разных задач) обеспечивает вызывающий.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "chacha20_poly1305.h"
+
+typedef struct {
+    uint8_t  mac[6];
+    uint8_t  in_use;
+    uint32_t last_used;                 // Для вытеснения (LRU)
+    chacha20_key_schedule_t schedule;
+} PeerKeyEntry;
+
+typedef struct {
+    PeerKeyEntry* entries;
+    uint8_t       capacity;
+    uint32_t      tick;                 // Логическое время обращений
+    uint8_t       session_key[CHACHA20_KEY_SIZE];
+
+    // Статистика
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+} PeerKeyCache;
+
+// Новый сессионный ключ: старые расписания стираются
+static inline void peer_key_cache_set_session(PeerKeyCache* cache, const uint8_t* session_key) {
+    secure_wipe(cache->entries, cache->capacity * sizeof(PeerKeyEntry));
+    memcpy(cache->session_key, session_key, CHACHA20_KEY_SIZE);
+    cache->tick = 0;
+}
+
+static inline void peer_key_cache_init(PeerKeyCache* cache, PeerKeyEntry* storage, uint8_t capacity,
+                                       const uint8_t* session_key) {
+    memset(cache, 0, sizeof(*cache));
+    cache->entries = storage;
+    cache->capacity = capacity;
+    peer_key_cache_set_session(cache, session_key);
+}
+
+// Расписание ключа устройства (выводится при промахе).
+// Указатель живёт до следующего вызова get или смены сессии.
+static inline const chacha20_key_schedule_t* peer_key_cache_get(PeerKeyCache* cache,
+                                                                const uint8_t* mac) {
+    PeerKeyEntry* victim = &cache->entries[0];
+    for (uint8_t i = 0; i < cache->capacity; i++) {
+        PeerKeyEntry* entry = &cache->entries[i];
+        if (entry->in_use && memcmp(entry->mac, mac, 6) == 0) {
+            entry->last_used = ++cache->tick;
+            cache->hits++;
+            return &entry->schedule;
+        }
+
+        // Свободный слот лучше любого занятого, из занятых — самый давний
+        if (victim->in_use && (!entry->in_use || entry->last_used < victim->last_used)) {
+            victim = entry;
+        }
+    }
+
+    cache->misses++;
+    if (victim->in_use) {
+        cache->evictions++;
+    }
+
+    uint8_t device_key[CHACHA20_KEY_SIZE];
+    derive_device_key(cache->session_key, mac, device_key);
+    chacha20_key_schedule_init(&victim->schedule, device_key);
+    secure_wipe(device_key, sizeof(device_key));
+
+    memcpy(victim->mac, mac, 6);
+    victim->in_use = 1;
+    victim->last_used = ++cache->tick;
+    return &victim->schedule;
+}
+
+// Устройство ушло из сети — его ключ больше не нужен
+static inline void peer_key_cache_forget(PeerKeyCache* cache, const uint8_t* mac) {
+    for (uint8_t i = 0; i < cache->capacity; i++) {
+        PeerKeyEntry* entry = &cache->entries[i];
+        if (entry->in_use && memcmp(entry->mac, mac, 6) == 0) {
+            secure_wipe(entry, sizeof(*entry));
+            return;
+        }
+    }
+}
@@ -0,0 +1,100 @@
+// dedup_cache.h - Кэш уже виденных пакетов для подавления дублей
+//
+// Ключ — (src_mac, packet_id). Запись живёт window_ms, после чего
+// тот же ключ снова считается новым. Память фиксированная:
+// множественно-ассоциативная таблица (DEDUP_WAYS записей на набор),
+// при переполнении набора вытесняется самая старая запись.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "mac_index.h"
+
+#define DEDUP_WAYS 4
+
+typedef struct {
+    uint32_t packet_id;
+    uint32_t seen_ms;
+    uint8_t  src_mac[6];
+    uint8_t  valid;
+    uint8_t  reserved;
+} DedupEntry;
+
+typedef struct {
+    DedupEntry* entries;    // set_count * DEDUP_WAYS записей
+    uint32_t set_mask;      // Число наборов - 1
+    uint32_t window_ms;     // Окно, в котором повтор считается дублем
+    uint32_t hits;          // Подавлено дублей
+    uint32_t misses;        // Новых пакетов
+    uint32_t evictions;     // Вытеснено ещё живых записей (окно велико для ёмкости)
+} DedupCache;
+
+// entry_count обязан быть степенью двойки и кратен DEDUP_WAYS
+static inline void dedup_init(DedupCache* cache, DedupEntry* storage,
+                              uint32_t entry_count, uint32_t window_ms) {
+    memset(storage, 0, entry_count * sizeof(DedupEntry));
+    cache->entries = storage;
+    cache->set_mask = entry_count / DEDUP_WAYS - 1;
+    cache->window_ms = window_ms;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->evictions = 0;
+}
+
+// true — пакет уже видели в пределах окна; иначе запоминаем его
+static inline bool dedup_check_and_insert(DedupCache* cache, const uint8_t* src_mac,
+                                          uint32_t packet_id, uint32_t now_ms) {
+    uint32_t set = (mac_index_hash(src_mac) ^ (packet_id * 0x9E3779B1u)) & cache->set_mask;
+    DedupEntry* ways = &cache->entries[set * DEDUP_WAYS];
+    DedupEntry* victim = NULL;
+    bool victim_alive = true;
+
+    for (int i = 0; i < DEDUP_WAYS; i++) {
+        DedupEntry* entry = &ways[i];
+        bool alive = entry->valid && (now_ms - entry->seen_ms) < cache->window_ms;
+
+        if (alive && entry->packet_id == packet_id &&
+            memcmp(entry->src_mac, src_mac, 6) == 0) {
+            cache->hits++;
+            return true;
+        }
+
+        // Свободные и протухшие записи — лучшие кандидаты на замену,
+        // иначе вытесняем самую старую
+        if (!alive) {
+            if (victim_alive) {
+                victim = entry;
+                victim_alive = false;
+            }
+        } else if (victim_alive && (!victim || (int32_t)(entry->seen_ms - victim->seen_ms) < 0)) {
+            victim = entry;
+        }
+    }
+
+    if (victim_alive) {
+        cache->evictions++;
+    }
+
+    victim->packet_id = packet_id;
+    victim->seen_ms = now_ms;
+    memcpy(victim->src_mac, src_mac, 6);
+    victim->valid = 1;
+    cache->misses++;
+    return false;
+}
+
+// Забыть пакет: его не удалось принять (например, очередь полна), и
+// повтор отправителя должен пройти как новый, а не как дубль
+static inline void dedup_forget(DedupCache* cache, const uint8_t* src_mac, uint32_t packet_id) {
+    uint32_t set = (mac_index_hash(src_mac) ^ (packet_id * 0x9E3779B1u)) & cache->set_mask;
+    DedupEntry* ways = &cache->entries[set * DEDUP_WAYS];
+
+    for (int i = 0; i < DEDUP_WAYS; i++) {
+        DedupEntry* entry = &ways[i];
+        if (entry->valid && entry->packet_id == packet_id &&
+            memcmp(entry->src_mac, src_mac, 6) == 0) {
+            entry->valid = 0;
+            return;
+        }
+    }
+}
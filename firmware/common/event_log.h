@@ -0,0 +1,207 @@
+// event_log.h - Компактный двоичный журнал событий
+//
+// Событие — запись 16 байт: время, код, MAC участника и два небольших
+// аргумента. На горячем пути — только копирование в кольцо в RAM,
+// без форматирования и кучи; текстом запись становится, когда журнал
+// читают (event_log_format).
+//
+// Записи нумеруются сквозным номером seq. В кольце лежат последние
+// capacity записей, persisted — граница того, что уже сохранено
+// (во flash). Не успевшие сохраниться и перезаписанные считаются
+// в lost. Синхронизацию обеспечивает вызывающий.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef enum {
+    EV_BOOT = 0,
+    EV_SYSTEM_STARTED,
+    EV_FILESYSTEM_MOUNTED,
+    EV_CONFIG_LOADED,           // arg0 — записей маршрутизации
+    EV_CRYPTO_SELFTEST_FAILED,
+    EV_WIFI_CONNECTED,
+    EV_WIFI_AP_STARTED,
+    EV_ESPNOW_INITIALIZED,
+    EV_ESPNOW_INIT_FAILED,
+    EV_WEB_SERVER_STARTED,
+    EV_SENSOR_DATA,             // arg0 — температура x10, arg1 — батарея, мВ
+    EV_HIGH_TEMPERATURE,        // arg0 — температура x10
+    EV_LOW_BATTERY,             // arg0 — батарея, мВ
+    EV_EMERGENCY,               // arg0 — тип, arg1 — серьёзность
+    EV_COMMAND_RECEIVED,
+    EV_GROUP_COMMAND,           // arg0 — группа, arg1 — код команды
+    EV_DEVICE_DISCOVERED,
+    EV_DISCOVERY_SENT,
+    EV_ROUTE_NOT_FOUND,
+    EV_PACKET_SEND_FAILED,
+    EV_ESPNOW_SEND_ERROR,       // arg0 — esp_err_t
+    EV_DELIVERY_FAILED,         // arg0 — причина NACK (0 — таймаут), arg1 — младшие биты packet_id
+    EV_DECRYPT_FAILED,
+    EV_COUNT
+} EventId;
+
+typedef struct {
+    const char* name;
+    const char* arg0;           // Подпись аргумента (NULL — не используется)
+    const char* arg1;
+} EventInfo;
+
+static const EventInfo EVENT_INFO[EV_COUNT] = {
+    { "boot",                   NULL,       NULL },
+    { "system_started",         NULL,       NULL },
+    { "filesystem_mounted",     NULL,       NULL },
+    { "config_loaded",          "routes",   NULL },
+    { "crypto_selftest_failed", NULL,       NULL },
+    { "wifi_connected",         NULL,       NULL },
+    { "wifi_ap_started",        NULL,       NULL },
+    { "espnow_initialized",     NULL,       NULL },
+    { "espnow_init_failed",     NULL,       NULL },
+    { "web_server_started",     NULL,       NULL },
+    { "sensor_data",            "temp_x10", "battery_mv" },
+    { "high_temperature",       "temp_x10", NULL },
+    { "low_battery",            "battery_mv", NULL },
+    { "emergency",              "type",     "severity" },
+    { "command_received",       NULL,       NULL },
+    { "group_command",          "group",    "cmd" },
+    { "device_discovered",      NULL,       NULL },
+    { "discovery_sent",         NULL,       NULL },
+    { "route_not_found",        NULL,       NULL },
+    { "packet_send_failed",     NULL,       NULL },
+    { "espnow_send_error",      "err",      NULL },
+    { "delivery_failed",        "nack",     "id16" },
+    { "decrypt_failed",         NULL,       NULL },
+};
+
+typedef struct {
+    uint32_t time_ms;           // millis() на момент события
+    uint8_t  event;             // EventId
+    uint8_t  reserved;
+    uint8_t  mac[6];            // Участник (нули — нет)
+    int16_t  arg0;
+    int16_t  arg1;
+} EventRecord;
+
+typedef struct {
+    EventRecord* records;       // capacity записей, степень двойки
+    uint32_t     mask;
+    uint32_t     head;          // seq следующей записи
+    uint32_t     persisted;     // Записи до этого seq уже сохранены
+    uint32_t     lost;          // Перезаписаны в кольце, не дойдя до сохранения
+} EventLog;
+
+// first_seq — с какого номера продолжить (после сохранённых ранее)
+static inline void event_log_init(EventLog* log, EventRecord* storage, uint32_t capacity,
+                                  uint32_t first_seq) {
+    memset(storage, 0, capacity * sizeof(EventRecord));
+    log->records = storage;
+    log->mask = capacity - 1;
+    log->head = first_seq;
+    log->persisted = first_seq;
+    log->lost = 0;
+}
+
+static inline void event_log_append(EventLog* log, uint8_t event, uint32_t time_ms,
+                                    const uint8_t* mac, int16_t arg0, int16_t arg1) {
+    if (!log->records) {
+        return;
+    }
+
+    EventRecord* rec = &log->records[log->head & log->mask];
+    rec->time_ms = time_ms;
+    rec->event = event;
+    rec->reserved = 0;
+    if (mac) {
+        memcpy(rec->mac, mac, 6);
+    } else {
+        memset(rec->mac, 0, 6);
+    }
+    rec->arg0 = arg0;
+    rec->arg1 = arg1;
+    log->head++;
+}
+
+// Первая запись, ещё лежащая в кольце
+static inline uint32_t event_log_oldest(const EventLog* log) {
+    uint32_t capacity = log->mask + 1;
+    return log->head > capacity ? log->head - capacity : 0;
+}
+
+// Запись по номеру, если она ещё в кольце
+static inline bool event_log_get(const EventLog* log, uint32_t seq, EventRecord* out) {
+    if (!log->records || seq >= log->head || seq < event_log_oldest(log)) {
+        return false;
+    }
+    *out = log->records[seq & log->mask];
+    return true;
+}
+
+// Скопировать до max несохранённых записей, *first — номер первой.
+// Сохранив, вызывающий отмечает их event_log_mark_persisted.
+static inline uint32_t event_log_take(EventLog* log, EventRecord* out, uint32_t max, uint32_t* first) {
+    uint32_t start = log->persisted;
+    uint32_t oldest = event_log_oldest(log);
+    if (start < oldest) {
+        log->lost += oldest - start;
+        start = log->persisted = oldest;
+    }
+
+    uint32_t count = log->head - start;
+    if (count > max) {
+        count = max;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        out[i] = log->records[(start + i) & log->mask];
+    }
+    *first = start;
+    return count;
+}
+
+static inline void event_log_mark_persisted(EventLog* log, uint32_t seq) {
+    if (seq > log->persisted) {
+        log->persisted = seq;
+    }
+}
+
+// Текстом: "12.345 sensor_data AA:BB:CC:DD:EE:FF temp_x10=215 battery_mv=3300"
+static inline int event_log_format(const EventRecord* rec, char* buf, size_t size) {
+    static const uint8_t no_mac[6] = {0};
+    const char* name = rec->event < EV_COUNT ? EVENT_INFO[rec->event].name : "unknown";
+
+    int len = snprintf(buf, size, "%lu.%03lu %s",
+                       (unsigned long)(rec->time_ms / 1000), (unsigned long)(rec->time_ms % 1000), name);
+
+    if (memcmp(rec->mac, no_mac, 6) != 0 && len < (int)size) {
+        len += snprintf(buf + len, size - len, " %02X:%02X:%02X:%02X:%02X:%02X",
+                        rec->mac[0], rec->mac[1], rec->mac[2], rec->mac[3], rec->mac[4], rec->mac[5]);
+    }
+    if (rec->event < EV_COUNT) {
+        const EventInfo* info = &EVENT_INFO[rec->event];
+        if (info->arg0 && len < (int)size) {
+            len += snprintf(buf + len, size - len, " %s=%d", info->arg0, rec->arg0);
+        }
+        if (info->arg1 && len < (int)size) {
+            len += snprintf(buf + len, size - len, " %s=%d", info->arg1, rec->arg1);
+        }
+    }
+    return len;
+}
+
+// Файл журнала во flash: заголовок и file_records записей по кругу,
+// запись seq лежит в слоте seq % file_records
+#define EVENT_LOG_MAGIC 0x4C45534Du     // "MSEL"
+
+typedef struct {
+    uint32_t magic;
+    uint16_t record_size;       // sizeof(EventRecord) — другая сборка не прочтёт чужой формат
+    uint16_t file_records;
+    uint32_t first_seq;         // Номер, с которого файл начали писать
+    uint32_t next_seq;          // Следующий после последнего сохранённого
+} EventLogFileHeader;
+
+// Первая запись, ещё лежащая в файле (старшие слоты уже перезаписаны)
+static inline uint32_t event_log_file_oldest(const EventLogFileHeader* header) {
+    uint32_t wrapped = header->next_seq > header->file_records ? header->next_seq - header->file_records : 0;
+    return wrapped > header->first_seq ? wrapped : header->first_seq;
+}
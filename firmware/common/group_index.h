@@ -0,0 +1,135 @@
+// group_index.h - Состав групп: битовая карта по позициям таблицы маршрутизации
+//
+// На каждую известную группу — бит на позицию в плотном массиве
+// записей. Члены группы перебираются по словам карты, без прохода по
+// всей таблице и сравнения MAC. Таблица удаляет записи swap-remove,
+// поэтому вместе с записью переезжают и её биты (group_index_move).
+// Хранилище внешнее: slot_count строк по words 32-битных слов.
+// Синхронизацию обеспечивает вызывающий.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define GROUP_INDEX_NONE   0xFF     // Группа не найдена
+#define GROUP_INDEX_END    0xFFFF   // Членов больше нет
+
+typedef struct {
+    uint16_t group_id;
+    uint16_t members;       // Выставленных бит (0 — слот свободен)
+} GroupSlot;
+
+typedef struct {
+    GroupSlot* slots;
+    uint32_t*  bits;        // slot_count * words
+    uint8_t    slot_count;
+    uint8_t    words;
+    uint32_t   overflow;    // Группе не хватило слота
+} GroupIndex;
+
+static inline void group_index_init(GroupIndex* index, GroupSlot* slots, uint32_t* bits,
+                                    uint8_t slot_count, uint8_t words) {
+    index->slots = slots;
+    index->bits = bits;
+    index->slot_count = slot_count;
+    index->words = words;
+    index->overflow = 0;
+    memset(slots, 0, slot_count * sizeof(GroupSlot));
+    memset(bits, 0, slot_count * words * sizeof(uint32_t));
+}
+
+static inline uint32_t* group_index_row(const GroupIndex* index, uint8_t slot) {
+    return &index->bits[slot * index->words];
+}
+
+static inline bool group_bitmap_test(const uint32_t* bits, uint16_t pos) {
+    return (bits[pos >> 5] >> (pos & 31)) & 1u;
+}
+
+static inline void group_bitmap_set(uint32_t* bits, uint16_t pos) {
+    bits[pos >> 5] |= 1u << (pos & 31);
+}
+
+static inline void group_bitmap_reset(uint32_t* bits, uint16_t pos) {
+    bits[pos >> 5] &= ~(1u << (pos & 31));
+}
+
+// Следующий выставленный бит начиная с pos (GROUP_INDEX_END — больше нет)
+static inline uint16_t group_bitmap_next(const uint32_t* bits, uint8_t words, uint16_t pos) {
+    uint32_t word = pos >> 5;
+    if (word >= words) {
+        return GROUP_INDEX_END;
+    }
+
+    uint32_t rest = bits[word] & (~0u << (pos & 31));
+    while (rest == 0) {
+        if (++word >= words) {
+            return GROUP_INDEX_END;
+        }
+        rest = bits[word];
+    }
+    return (uint16_t)(word * 32 + __builtin_ctz(rest));
+}
+
+// Групп единицы-десятки — линейного поиска по слотам хватает
+static inline uint8_t group_index_find(const GroupIndex* index, uint16_t group_id) {
+    for (uint8_t i = 0; i < index->slot_count; i++) {
+        if (index->slots[i].members && index->slots[i].group_id == group_id) {
+            return i;
+        }
+    }
+    return GROUP_INDEX_NONE;
+}
+
+// Отметить позицию pos членом группы. true — раньше не была.
+static inline bool group_index_add(GroupIndex* index, uint16_t group_id, uint16_t pos) {
+    uint8_t slot = group_index_find(index, group_id);
+    if (slot == GROUP_INDEX_NONE) {
+        for (uint8_t i = 0; i < index->slot_count; i++) {
+            if (index->slots[i].members == 0) {
+                slot = i;
+                break;
+            }
+        }
+        if (slot == GROUP_INDEX_NONE) {
+            index->overflow++;
+            return false;
+        }
+        index->slots[slot].group_id = group_id;
+    }
+
+    uint32_t* row = group_index_row(index, slot);
+    if (group_bitmap_test(row, pos)) {
+        return false;
+    }
+    group_bitmap_set(row, pos);
+    index->slots[slot].members++;
+    return true;
+}
+
+// Запись в позиции pos удалена: снять её со всех групп
+static inline void group_index_clear(GroupIndex* index, uint16_t pos) {
+    for (uint8_t i = 0; i < index->slot_count; i++) {
+        uint32_t* row = group_index_row(index, i);
+        if (index->slots[i].members && group_bitmap_test(row, pos)) {
+            group_bitmap_reset(row, pos);
+            index->slots[i].members--;
+        }
+    }
+}
+
+// Запись переехала из from в to (позиция to уже очищена)
+static inline void group_index_move(GroupIndex* index, uint16_t from, uint16_t to) {
+    for (uint8_t i = 0; i < index->slot_count; i++) {
+        uint32_t* row = group_index_row(index, i);
+        if (index->slots[i].members && group_bitmap_test(row, from)) {
+            group_bitmap_reset(row, from);
+            group_bitmap_set(row, to);
+        }
+    }
+}
+
+// Следующий член группы начиная с pos
+static inline uint16_t group_index_next(const GroupIndex* index, uint8_t slot, uint16_t pos) {
+    return group_bitmap_next(group_index_row(index, slot), index->words, pos);
+}
@@ -0,0 +1,59 @@
+// latency_histogram.h - Гистограмма задержек фиксированного размера
+//
+// Логарифмические корзины с 4 подкорзинами на октаву: ошибка оценки
+// не больше 25%, память постоянная (~0.5 КБ), запись — несколько тактов.
+// Единицы измерения выбирает вызывающий (мкс, такты CPU и т.д.).
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+#define LATENCY_HIST_SUB_BITS  2
+#define LATENCY_HIST_BUCKETS   124   // Покрывает весь диапазон uint32_t
+
+typedef struct {
+    uint32_t buckets[LATENCY_HIST_BUCKETS];
+    uint32_t count;
+    uint32_t max;
+} LatencyHistogram;
+
+static inline void latency_histogram_reset(LatencyHistogram* hist) {
+    memset(hist, 0, sizeof(*hist));
+}
+
+static inline uint32_t latency_histogram_bucket(uint32_t value) {
+    if (value < 4) return value;
+    uint32_t msb = 31 - __builtin_clz(value);
+    uint32_t sub = (value >> (msb - LATENCY_HIST_SUB_BITS)) & 3;
+    return ((msb - 1) << LATENCY_HIST_SUB_BITS) | sub;
+}
+
+// Верхняя граница корзины (включительно)
+static inline uint32_t latency_histogram_bucket_max(uint32_t index) {
+    if (index < 4) return index;
+    uint32_t msb = (index >> LATENCY_HIST_SUB_BITS) + 1;
+    uint32_t sub = index & 3;
+    uint64_t low = (uint64_t)(4 | sub) << (msb - LATENCY_HIST_SUB_BITS);
+    return (uint32_t)(low + ((uint64_t)1 << (msb - LATENCY_HIST_SUB_BITS)) - 1);
+}
+
+static inline void latency_histogram_record(LatencyHistogram* hist, uint32_t value) {
+    hist->buckets[latency_histogram_bucket(value)]++;
+    hist->count++;
+    if (value > hist->max) hist->max = value;
+}
+
+// Оценка перцентиля (percent: 1..100), 0 если данных нет
+static inline uint32_t latency_histogram_percentile(const LatencyHistogram* hist, uint32_t percent) {
+    if (hist->count == 0) return 0;
+
+    uint64_t target = ((uint64_t)hist->count * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target) {
+            uint32_t bound = latency_histogram_bucket_max(i);
+            return bound < hist->max ? bound : hist->max;
+        }
+    }
+    return hist->max;
+}
@@ -0,0 +1,167 @@
+// link_quality.h - Качество связи с соседями: сглаженный RSSI и ETX
+//
+// RSSI — с каждого принятого кадра ESP-NOW (promiscuous-callback WiFi:
+// callback приёма ESP-NOW уровень сигнала не сообщает). Успех
+// доставки — из callback'а отправки ESP-NOW: ACK MAC-уровня уже после
+// повторов самого WiFi. Доля доставленных даёт ETX — ожидаемое число
+// передач на кадр: 1.0 на чистом канале, 4.0 если доходит каждый
+// четвёртый. Пока unicast соседу почти не слали, ETX оценивается по RSSI.
+//
+// Фиксированная точка: RSSI и ETX — x16, доля доставки — x256.
+// Соседей немного (ESP-NOW держит до 20 peer'ов): поиск линейный, при
+// переполнении вытесняется давно не слышанный.
+// Синхронизацию обеспечивает вызывающий.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define LINK_EWMA_SHIFT      3                      // Вес нового отсчёта 1/8
+#define LINK_ETX_ONE         16                     // ETX 1.0
+#define LINK_ETX_UNKNOWN     (LINK_ETX_ONE * 2)     // Сосед, которого не слышали
+#define LINK_ETX_MAX         (LINK_ETX_ONE * 10)    // Хуже — канала фактически нет
+#define LINK_PRR_ONE         256                    // Доставлено всё
+#define LINK_MIN_TX_SAMPLES  4                      // Меньше — верим RSSI
+#define LINK_RSSI_GOOD       (-70)                  // Сильнее — потерь почти нет
+#define LINK_RSSI_BAD        (-92)                  // Слабее — связь на грани
+#define LINK_SWITCH_HYSTERESIS (LINK_ETX_ONE / 2)   // Выигрыш, ради которого меняем путь
+
+typedef struct {
+    uint8_t  mac[6];
+    uint8_t  valid;
+    uint8_t  tx_samples;        // Насыщается на 255
+    int16_t  rssi_q4;           // Сглаженный RSSI x16
+    uint16_t prr_q8;            // Сглаженная доля доставки x256
+    uint32_t last_rx_ms;
+    uint32_t tx_ok;
+    uint32_t tx_fail;
+} LinkStats;
+
+typedef struct {
+    LinkStats* links;
+    uint8_t    capacity;
+    uint32_t   evictions;
+} LinkTable;
+
+static inline void link_table_init(LinkTable* table, LinkStats* storage, uint8_t capacity) {
+    memset(storage, 0, capacity * sizeof(LinkStats));
+    table->links = storage;
+    table->capacity = capacity;
+    table->evictions = 0;
+}
+
+static inline LinkStats* link_find(const LinkTable* table, const uint8_t* mac) {
+    for (uint8_t i = 0; i < table->capacity; i++) {
+        LinkStats* link = &table->links[i];
+        if (link->valid && memcmp(link->mac, mac, 6) == 0) {
+            return link;
+        }
+    }
+    return NULL;
+}
+
+// Найти или завести запись (вытесняя давно не слышанного)
+static inline LinkStats* link_get(LinkTable* table, const uint8_t* mac, uint32_t now_ms) {
+    LinkStats* link = link_find(table, mac);
+    if (link) {
+        return link;
+    }
+
+    LinkStats* victim = &table->links[0];
+    for (uint8_t i = 0; i < table->capacity; i++) {
+        LinkStats* candidate = &table->links[i];
+        if (!candidate->valid) {
+            victim = candidate;
+            break;
+        }
+        if (now_ms - candidate->last_rx_ms > now_ms - victim->last_rx_ms) {
+            victim = candidate;
+        }
+    }
+    if (victim->valid) {
+        table->evictions++;
+    }
+
+    memset(victim, 0, sizeof(*victim));
+    memcpy(victim->mac, mac, 6);
+    victim->valid = 1;
+    victim->prr_q8 = LINK_PRR_ONE;
+    victim->last_rx_ms = now_ms;
+    return victim;
+}
+
+// Принят кадр от соседа
+static inline void link_on_rx(LinkTable* table, const uint8_t* mac, int8_t rssi, uint32_t now_ms) {
+    LinkStats* link = link_get(table, mac, now_ms);
+    int16_t sample = (int16_t)(rssi * 16);
+    if (link->rssi_q4 == 0) {
+        link->rssi_q4 = sample;
+    } else {
+        link->rssi_q4 += (sample - link->rssi_q4) >> LINK_EWMA_SHIFT;
+    }
+    link->last_rx_ms = now_ms;
+}
+
+// Итог unicast-отправки соседу (ACK MAC-уровня пришёл или нет)
+static inline void link_on_tx(LinkTable* table, const uint8_t* mac, bool delivered, uint32_t now_ms) {
+    LinkStats* link = link_get(table, mac, now_ms);
+    int32_t sample = delivered ? LINK_PRR_ONE : 0;
+    link->prr_q8 += (sample - (int32_t)link->prr_q8) >> LINK_EWMA_SHIFT;
+    if (link->tx_samples < 255) {
+        link->tx_samples++;
+    }
+    if (delivered) {
+        link->tx_ok++;
+    } else {
+        link->tx_fail++;
+    }
+}
+
+static inline int8_t link_rssi(const LinkStats* link) {
+    return link ? (int8_t)(link->rssi_q4 / 16) : 0;
+}
+
+// ETX по RSSI: 1.0 на сильном сигнале, до LINK_ETX_MAX на грани
+static inline uint16_t link_etx_from_rssi(int16_t rssi_q4) {
+    if (rssi_q4 == 0) {
+        return LINK_ETX_UNKNOWN;
+    }
+    if (rssi_q4 >= LINK_RSSI_GOOD * 16) {
+        return LINK_ETX_ONE;
+    }
+    if (rssi_q4 <= LINK_RSSI_BAD * 16) {
+        return LINK_ETX_MAX;
+    }
+    return LINK_ETX_ONE + (uint16_t)((LINK_RSSI_GOOD * 16 - rssi_q4) * (LINK_ETX_MAX - LINK_ETX_ONE) /
+                                     ((LINK_RSSI_GOOD - LINK_RSSI_BAD) * 16));
+}
+
+// Ожидаемых передач на кадр соседу (x16); NULL — сосед неизвестен
+static inline uint16_t link_etx(const LinkStats* link) {
+    if (!link) {
+        return LINK_ETX_UNKNOWN;
+    }
+    if (link->tx_samples < LINK_MIN_TX_SAMPLES) {
+        return link_etx_from_rssi(link->rssi_q4);
+    }
+
+    uint32_t etx = (uint32_t)LINK_ETX_ONE * LINK_PRR_ONE / (link->prr_q8 ? link->prr_q8 : 1);
+    return etx < LINK_ETX_MAX ? (uint16_t)etx : LINK_ETX_MAX;
+}
+
+// Стоимость пути: первый прыжок — по измерениям, остальные — по 1.0
+// (качества чужих каналов мы не знаем)
+static inline uint16_t link_path_metric(uint16_t first_hop_etx, uint8_t hops) {
+    return first_hop_etx + (hops > 1 ? (hops - 1) * LINK_ETX_ONE : 0);
+}
+
+// Источник кадра ESP-NOW в сыром 802.11 (promiscuous-callback):
+// action-кадр с vendor-specific категорией Espressif. NULL — не он.
+static inline const uint8_t* link_espnow_source(const uint8_t* frame, uint32_t len) {
+    static const uint8_t ESPRESSIF_OUI[3] = { 0x18, 0xFE, 0x34 };
+    if (len < 28 || frame[0] != 0xD0 || frame[24] != 127 ||
+        memcmp(&frame[25], ESPRESSIF_OUI, 3) != 0) {
+        return NULL;
+    }
+    return &frame[10];   // addr2 — отправитель
+}
@@ -0,0 +1,140 @@
+// live_delta.h - Накопитель изменений для живых обновлений веб-интерфейса
+//
+// Вместо опроса /api/* браузер получает только изменения: устройство
+// стало онлайн/офлайн, пришли новые показания, авария. Между тиками
+// рассылки изменения одного устройства сливаются в одну запись —
+// из десяти показаний за тик в браузер уйдёт последнее. Аварийные
+// события не сливаются: копятся очередью до ближайшего тика.
+//
+// Память фиксированная. Синхронизацию (пишет один поток, рассылает
+// другой) обеспечивает вызывающий.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+// Что изменилось у устройства с прошлого тика
+#define LIVE_CHANGE_ONLINE   0x01   // Онлайн/офлайн (поле online)
+#define LIVE_CHANGE_READING  0x02   // Новые показания датчика
+#define LIVE_CHANGE_REMOVED  0x04   // Запись удалена из таблицы маршрутов
+
+typedef struct {
+    uint8_t  mac[6];
+    uint8_t  changes;           // LIVE_CHANGE_*
+    uint8_t  online;
+    int8_t   rssi;
+    uint16_t battery_mv;
+    float    temperature;
+    float    humidity;
+} LiveDeviceDelta;
+
+typedef struct {
+    uint8_t sensor_mac[6];
+    uint8_t event_type;
+    uint8_t severity;
+} LiveEvent;
+
+typedef struct {
+    LiveDeviceDelta* devices;
+    uint16_t         capacity;
+    uint16_t         count;
+    LiveEvent*       events;
+    uint8_t          event_capacity;
+    uint8_t          event_count;
+
+    // Статистика
+    uint32_t coalesced;         // Изменений слито с уже накопленными
+    uint32_t dropped;           // Не хватило места до тика
+} LiveDeltaBuffer;
+
+static inline void live_delta_init(LiveDeltaBuffer* buf,
+                                   LiveDeviceDelta* devices, uint16_t capacity,
+                                   LiveEvent* events, uint8_t event_capacity) {
+    memset(buf, 0, sizeof(*buf));
+    buf->devices = devices;
+    buf->capacity = capacity;
+    buf->events = events;
+    buf->event_capacity = event_capacity;
+}
+
+// После рассылки: накопленное сбрасывается, статистика остаётся
+static inline void live_delta_clear(LiveDeltaBuffer* buf) {
+    buf->count = 0;
+    buf->event_count = 0;
+}
+
+static inline bool live_delta_empty(const LiveDeltaBuffer* buf) {
+    return buf->count == 0 && buf->event_count == 0;
+}
+
+// Запись устройства за этот тик (новая или уже накопленная).
+// NULL — буфер полон, изменение потеряно.
+static inline LiveDeviceDelta* live_delta_device(LiveDeltaBuffer* buf, const uint8_t* mac) {
+    for (uint16_t i = 0; i < buf->count; i++) {
+        if (memcmp(buf->devices[i].mac, mac, 6) == 0) {
+            buf->coalesced++;
+            return &buf->devices[i];
+        }
+    }
+
+    if (buf->count >= buf->capacity) {
+        buf->dropped++;
+        return NULL;
+    }
+
+    LiveDeviceDelta* delta = &buf->devices[buf->count++];
+    memset(delta, 0, sizeof(*delta));
+    memcpy(delta->mac, mac, 6);
+    return delta;
+}
+
+static inline void live_delta_reading(LiveDeltaBuffer* buf, const uint8_t* mac,
+                                      float temperature, float humidity,
+                                      uint16_t battery_mv, int8_t rssi) {
+    LiveDeviceDelta* delta = live_delta_device(buf, mac);
+    if (!delta) {
+        return;
+    }
+
+    delta->changes |= LIVE_CHANGE_READING;
+    delta->temperature = temperature;
+    delta->humidity = humidity;
+    delta->battery_mv = battery_mv;
+    delta->rssi = rssi;
+}
+
+static inline void live_delta_online(LiveDeltaBuffer* buf, const uint8_t* mac, bool online) {
+    LiveDeviceDelta* delta = live_delta_device(buf, mac);
+    if (!delta) {
+        return;
+    }
+
+    delta->changes |= LIVE_CHANGE_ONLINE;
+    delta->changes &= (uint8_t)~LIVE_CHANGE_REMOVED;
+    delta->online = online ? 1 : 0;
+}
+
+static inline void live_delta_removed(LiveDeltaBuffer* buf, const uint8_t* mac) {
+    LiveDeviceDelta* delta = live_delta_device(buf, mac);
+    if (!delta) {
+        return;
+    }
+
+    // Удалённому устройству прежние изменения уже не нужны
+    delta->changes = LIVE_CHANGE_REMOVED;
+    delta->online = 0;
+}
+
+static inline bool live_delta_event(LiveDeltaBuffer* buf, const uint8_t* sensor_mac,
+                                    uint8_t event_type, uint8_t severity) {
+    if (buf->event_count >= buf->event_capacity) {
+        buf->dropped++;
+        return false;
+    }
+
+    LiveEvent* event = &buf->events[buf->event_count++];
+    memcpy(event->sensor_mac, sensor_mac, 6);
+    event->event_type = event_type;
+    event->severity = severity;
+    return true;
+}
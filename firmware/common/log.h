@@ -0,0 +1,47 @@
+// log.h - Уровень логов при сборке и отложенный вывод в UART
+//
+// LOG_E / LOG_W / LOG_I / LOG_D(fmt, ...) — как printf, перевод
+// строки добавляется сам. Уровень задаётся флагом -D LOG_LEVEL=... в
+// [env:*] platformio.ini; вызовы ниже уровня не компилируются вовсе —
+// их аргументы (mac_to_string и т.п.) даже не вычисляются.
+//
+// Оставшиеся строки после log_init(writer, размер) форматируются в
+// кольцевой буфер и уходят в UART из фоновой задачи: отправитель не
+// ждёт 115200 бод. Не влезло в буфер — строка теряется (log_dropped).
+// Без буфера (или до log_init на хосте) вывод синхронный.
+#pragma once
+#include "utils.h"
+
+#define LOG_LEVEL_NONE  -1
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN  1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_E(...) log_message(LOG_ERROR, __VA_ARGS__)
+#else
+#define LOG_E(...) ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_W(...) log_message(LOG_WARN, __VA_ARGS__)
+#else
+#define LOG_W(...) ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_I(...) log_message(LOG_INFO, __VA_ARGS__)
+#else
+#define LOG_I(...) ((void)0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_D(...) log_message(LOG_DEBUG, __VA_ARGS__)
+#else
+#define LOG_D(...) ((void)0)
+#endif
@@ -0,0 +1,104 @@
+// mac_index.h - Хеш-индекс по 6-байтовому MAC (открытая адресация)
+//
+// Отображает MAC -> 16-битное значение (обычно индекс в плотном массиве).
+// Линейное пробирование, удаление через "надгробия" (tombstone).
+// Хранилище слотов внешнее, размер — степень двойки, не меньше
+// чем 2x от числа ключей, чтобы цепочки оставались короткими.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define MAC_INDEX_NONE       0xFFFF   // Значение "не найдено"
+#define MAC_INDEX_EMPTY      0xFFFF   // Слот никогда не занимался
+#define MAC_INDEX_TOMBSTONE  0xFFFE   // Слот освобождён, поиск идёт дальше
+
+typedef struct {
+    uint8_t  mac[6];
+    uint16_t value;
+} MacIndexSlot;
+
+typedef struct {
+    MacIndexSlot* slots;
+    uint16_t mask;         // Число слотов - 1
+    uint16_t used;         // Живых ключей
+    uint16_t tombstones;   // Надгробий (повод перестроить индекс)
+} MacIndex;
+
+// Младшие байты MAC почти случайны (старшие — OUI производителя),
+// поэтому достаточно одного умножения Фибоначчи
+static inline uint32_t mac_index_hash(const uint8_t* mac) {
+    uint32_t low = (uint32_t)mac[2] | ((uint32_t)mac[3] << 8) |
+                   ((uint32_t)mac[4] << 16) | ((uint32_t)mac[5] << 24);
+    uint32_t high = (uint32_t)mac[0] | ((uint32_t)mac[1] << 8);
+    return ((low ^ (high * 0x85EBCA6Bu)) * 0x9E3779B1u) >> 16;
+}
+
+static inline void mac_index_clear(MacIndex* index) {
+    for (uint32_t i = 0; i <= index->mask; i++) {
+        index->slots[i].value = MAC_INDEX_EMPTY;
+    }
+    index->used = 0;
+    index->tombstones = 0;
+}
+
+// slot_count обязан быть степенью двойки
+static inline void mac_index_init(MacIndex* index, MacIndexSlot* storage, uint16_t slot_count) {
+    index->slots = storage;
+    index->mask = slot_count - 1;
+    mac_index_clear(index);
+}
+
+// Поиск слота с ключом (NULL если нет)
+static inline MacIndexSlot* mac_index_find_slot(MacIndex* index, const uint8_t* mac) {
+    uint32_t pos = mac_index_hash(mac) & index->mask;
+    for (uint32_t probe = 0; probe <= index->mask; probe++) {
+        MacIndexSlot* slot = &index->slots[pos];
+        if (slot->value == MAC_INDEX_EMPTY) return NULL;
+        if (slot->value != MAC_INDEX_TOMBSTONE && memcmp(slot->mac, mac, 6) == 0) {
+            return slot;
+        }
+        pos = (pos + 1) & index->mask;
+    }
+    return NULL;
+}
+
+static inline uint16_t mac_index_find(MacIndex* index, const uint8_t* mac) {
+    MacIndexSlot* slot = mac_index_find_slot(index, mac);
+    return slot ? slot->value : MAC_INDEX_NONE;
+}
+
+// Вставка ключа, которого ещё нет в индексе
+static inline bool mac_index_insert(MacIndex* index, const uint8_t* mac, uint16_t value) {
+    if (index->used >= index->mask) return false;  // Хотя бы один пустой слот обязателен
+
+    uint32_t pos = mac_index_hash(mac) & index->mask;
+    for (;;) {
+        MacIndexSlot* slot = &index->slots[pos];
+        if (slot->value == MAC_INDEX_EMPTY || slot->value == MAC_INDEX_TOMBSTONE) {
+            if (slot->value == MAC_INDEX_TOMBSTONE) index->tombstones--;
+            memcpy(slot->mac, mac, 6);
+            slot->value = value;
+            index->used++;
+            return true;
+        }
+        pos = (pos + 1) & index->mask;
+    }
+}
+
+// Смена значения существующего ключа (например, после swap-remove)
+static inline bool mac_index_update(MacIndex* index, const uint8_t* mac, uint16_t value) {
+    MacIndexSlot* slot = mac_index_find_slot(index, mac);
+    if (!slot) return false;
+    slot->value = value;
+    return true;
+}
+
+static inline bool mac_index_remove(MacIndex* index, const uint8_t* mac) {
+    MacIndexSlot* slot = mac_index_find_slot(index, mac);
+    if (!slot) return false;
+    slot->value = MAC_INDEX_TOMBSTONE;
+    index->used--;
+    index->tombstones++;
+    return true;
+}
@@ -3,10 +3,15 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stddef.h>
 
 #define MESH_NETWORK_ID         0xFA23
-#define PROTOCOL_VERSION        0x01
+#ifndef PROTOCOL_VERSION
+#define PROTOCOL_VERSION        0x02   // v2: явная длина payload, кадр переменной длины
+#endif
+#define PROTOCOL_VERSION_MIN    0x01   // v1: всегда полный кадр (210 байт) — ещё принимаем
 #define MAX_PACKET_SIZE         250
+#define MESH_PAYLOAD_MAX        180
 #define DEFAULT_TTL             7
 static const uint8_t BROADCAST_MAC[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 
@@ -21,8 +26,12 @@ typedef enum {
     MSG_CMD_GROUP          = 0x08,
     MSG_EVENT_BROADCAST    = 0x09,
     MSG_DEVICE_STATE_UPDATE = 0x0A,
+    MSG_DATA_BATCH         = 0x0B,   // Несколько SensorData от детей репитера
+    MSG_PROBE              = 0x0C,   // Замер задержки по прыжкам (туда и обратно)
+    MSG_REFLEX_RULES       = 0x0D,   // Таблица рефлексов для репитера (reflex_rules.h)
     MSG_ACK                = 0x0E,
-    MSG_NACK               = 0x0F
+    MSG_NACK               = 0x0F,
+    MSG_ROUTE_DELTA        = 0x10    // Изменения маршрутов репитера (route_delta.h)
 } MessageType;
 
 typedef enum {
@@ -30,6 +39,7 @@ typedef enum {
     FLAG_LOCAL_PROCESS   = (1 << 1),
     FLAG_EMERGENCY       = (1 << 2),
     FLAG_ENCRYPTED       = (1 << 3),
+    FLAG_RETRY           = (1 << 4),   // Повтор по таймеру (тот же packet_id)
     FLAG_BROADCAST       = (1 << 6)
 } PacketFlags;
 
@@ -45,7 +55,8 @@ typedef struct {
     uint8_t  msg_type;
     uint8_t  flags;
     uint16_t group_id;
-    uint8_t  payload[180];
+    uint8_t  payload_len;           // Только v2: сколько байт payload реально передаётся
+    uint8_t  payload[MESH_PAYLOAD_MAX];
 } MeshPacketHeader;
 
 typedef struct {
@@ -56,6 +67,7 @@ typedef struct {
     uint16_t battery_mv;
     int8_t   rssi;
     uint8_t  accuracy;
+    uint16_t awake_ms;        // Сколько датчик бодрствовал в прошлом цикле (0 — не спит)
 } SensorData;
 
 typedef struct {
@@ -64,15 +76,256 @@ typedef struct {
     uint8_t  parameter_len;
     uint8_t  parameters[16];
 } GroupCommand;
+
+// Тело MSG_EVENT_BROADCAST
+typedef struct {
+    uint8_t event_type;       // Пожар, протечка, движение и т.д.
+    uint8_t severity;
+    uint8_t sensor_mac[6];    // Чей датчик сработал
+} EmergencyEvent;
+
+// Тело MSG_DATA_BATCH: показания, собранные репитером за окно агрегации.
+// С полным MAC запись занимает 26 байт — в payload помещается 6 записей.
+typedef struct {
+    uint8_t    src_mac[6];    // Датчик-источник
+    SensorData data;
+} SensorRecord;
+
+#define BATCH_MAX_RECORDS ((MESH_PAYLOAD_MAX - 1) / sizeof(SensorRecord))
+
+typedef struct {
+    uint8_t      count;
+    SensorRecord records[BATCH_MAX_RECORDS];
+} SensorBatch;
+
+// Тело MSG_ACK / MSG_NACK
+typedef enum {
+    ACK_STATUS_OK          = 0x00,
+    NACK_MALFORMED         = 0x01,   // Payload короче, чем требует тип
+    NACK_UNSUPPORTED       = 0x02,   // Тип сообщения не поддерживается
+    NACK_BUSY              = 0x03    // Получатель перегружен
+} AckStatus;
+
+typedef struct {
+    uint32_t acked_id;        // packet_id подтверждаемого пакета (первым — так его ждёт датчик)
+    uint8_t  status;          // AckStatus
+} AckPayload;
+
+// Тело MSG_PROBE: каждый пересылающий узел и адресат дописывают запись
+// о себе — хвост MAC и сколько пакет у них провёл. Часы узлов не
+// синхронизированы, поэтому время в эфире видно только суммарно:
+// RTT у отправителя минус сумма задержек на узлах.
+#define PROBE_DIR_REQUEST 0
+#define PROBE_DIR_REPLY   1
+
+typedef struct {
+    uint8_t  mac_tail[3];     // Последние три байта MAC узла
+    uint16_t residence_us;    // Приём → отправка на этом узле (насыщается на 65535)
+} ProbeHop;
+
+#define PROBE_HEADER_SIZE 6
+#define PROBE_MAX_HOPS ((MESH_PAYLOAD_MAX - PROBE_HEADER_SIZE) / sizeof(ProbeHop))
+
+typedef struct {
+    uint32_t probe_id;
+    uint8_t  direction;       // PROBE_DIR_*
+    uint8_t  hop_count;
+    ProbeHop hops[PROBE_MAX_HOPS];
+} ProbePayload;
+
+// Тело MSG_DISCOVERY от координатора (broadcast): окно, по которому узлы
+// разносят свои ответы (timer_wheel.h). Ответ — MSG_DISCOVERY
+// координатору без payload. Пустой запрос — окно по умолчанию.
+#define DISCOVERY_WINDOW_DEFAULT_MS 2000
+
+typedef struct {
+    uint16_t window_ms;
+} DiscoveryRequest;
+
+// Объявление маршрутов (MSG_ROUTING_UPDATE): "эти узлы достижимы через меня".
+// Полный список — так шлют прежние прошивки; новые шлют MSG_ROUTE_DELTA.
+#define ROUTE_ADVERT_MAX 25
+
+typedef struct {
+    uint8_t mac[6];
+    uint8_t hops;             // Прыжков от отправителя объявления
+} RouteAdvert;
+
+typedef struct {
+    uint8_t     count;
+    RouteAdvert routes[ROUTE_ADVERT_MAX];
+} RoutingUpdate;
+
+// Тело MSG_ROUTE_DELTA; операции в ops — см. route_delta.h
+#define ROUTE_DELTA_FULL    (1 << 0)   // Снимок: прежнее от отправителя забыть
+#define ROUTE_DELTA_RESYNC  (1 << 1)   // Просьба прислать снимок (операций нет)
+#define ROUTE_DELTA_HEADER_SIZE 4
+
+typedef struct {
+    uint16_t seq;
+    uint8_t  flags;
+    uint8_t  count;           // Операций в ops
+    uint8_t  ops[MESH_PAYLOAD_MAX - ROUTE_DELTA_HEADER_SIZE];
+} RouteDeltaPayload;
+
+// Запись таблицы маршрутизации в NVS (страницы "rn0", "rn1", ...).
+// Только то, что переживает перезагрузку: last_seen, rssi и статус
+// после неё всё равно устаревают. Родитель — номер узла (позиция в
+// той же таблице).
+#define NODE_SELF 0xFE            // Родитель — мы: узел слышит нас напрямую
+#define NODE_NONE 0xFF            // Маршрута нет
+
+typedef struct {
+    uint8_t device_mac[6];
+    uint8_t parent;           // Номер родителя, NODE_SELF или NODE_NONE
+    uint8_t proto_version;    // Версия из последнего пакета узла (0 — неизвестна)
+} RoutingRecord;
+
+// Прежний формат записи (страницы "rt<N>", ещё раньше — блоб
+// "routing_table"): читается только для переноса в RoutingRecord
+typedef struct {
+    uint8_t  device_mac[6];
+    uint8_t  parent_mac[6];   // Через кого устройство достижимо
+    int8_t   rssi;
+    uint8_t  status;          // 1 — онлайн, 0 — офлайн
+    uint16_t battery_mv;
+    uint32_t last_seen;       // Секунды с момента старта
+    uint8_t  proto_version;   // Версия из последнего пакета узла (0 — неизвестна)
+} RoutingEntry;
 #pragma pack(pop)
 
+// ==================== ФОРМАТ КАДРА ====================
+//
+// v2: заголовок (31 байт) + payload_len байт payload.
+// v1: заголовок без поля payload_len (30 байт) + всегда 180 байт payload.
+// Поля до payload_len у версий совпадают, поэтому TTL, MAC и тип
+// читаются одинаково. В памяти пакет всегда хранится в формате v2.
+
+#define MESH_HEADER_SIZE        offsetof(MeshPacketHeader, payload)
+#define MESH_HEADER_SIZE_V1     offsetof(MeshPacketHeader, payload_len)
+#define MESH_WIRE_SIZE_V1       (MESH_HEADER_SIZE_V1 + MESH_PAYLOAD_MAX)
+
+// Сколько байт реально уходит в эфир
+static inline size_t mesh_packet_wire_size(const MeshPacketHeader* pkt) {
+    return MESH_HEADER_SIZE + pkt->payload_len;
+}
+
+// Кодирование для узла, который понимает только v1 (полный кадр)
+static inline size_t mesh_encode_v1(const MeshPacketHeader* pkt, uint8_t* out) {
+    memcpy(out, pkt, MESH_HEADER_SIZE_V1);
+    out[offsetof(MeshPacketHeader, version)] = 0x01;
+    memcpy(out + MESH_HEADER_SIZE_V1, pkt->payload, pkt->payload_len);
+    memset(out + MESH_HEADER_SIZE_V1 + pkt->payload_len, 0, MESH_PAYLOAD_MAX - pkt->payload_len);
+    return MESH_WIRE_SIZE_V1;
+}
+
 static inline bool validate_packet(const MeshPacketHeader* pkt, size_t len) {
-    return (len >= sizeof(MeshPacketHeader)) &&
+    return (len >= MESH_HEADER_SIZE) &&
            (pkt->network_id == MESH_NETWORK_ID) &&
-           (pkt->version == PROTOCOL_VERSION) &&
+           (pkt->version >= PROTOCOL_VERSION_MIN && pkt->version <= PROTOCOL_VERSION) &&
+           (pkt->payload_len <= MESH_PAYLOAD_MAX) &&
+           (len >= mesh_packet_wire_size(pkt)) &&
            (pkt->ttl > 0);
 }
 
+// ==================== ПРОСМОТР ПАКЕТА БЕЗ КОПИРОВАНИЯ ====================
+//
+// Проверка и чтение полей прямо в приёмном буфере ESP-NOW.
+// Копировать пакет нужно только при постановке в очередь или пересылке.
+
+typedef struct {
+    const uint8_t* data;
+    const uint8_t* payload;
+    uint8_t version;
+    uint8_t payload_len;
+    uint8_t wire_len;         // Длина кадра без хвостового мусора
+} MeshPacketView;
+
+#define MESH_FIELD(field) offsetof(MeshPacketHeader, field)
+
+// Проверка заголовка: несколько загрузок байт, без копирования
+static inline bool mesh_view_init(MeshPacketView* view, const uint8_t* data, size_t len) {
+    if (len < MESH_HEADER_SIZE_V1 || len > MAX_PACKET_SIZE) return false;
+
+    uint16_t network_id = (uint16_t)data[MESH_FIELD(network_id)] |
+                          ((uint16_t)data[MESH_FIELD(network_id) + 1] << 8);
+    if (network_id != MESH_NETWORK_ID) return false;
+    if (data[MESH_FIELD(ttl)] == 0) return false;
+
+    uint8_t version = data[MESH_FIELD(version)];
+    if (version < PROTOCOL_VERSION_MIN || version > PROTOCOL_VERSION) return false;
+
+    if (version == 0x01) {
+        if (len < MESH_WIRE_SIZE_V1) return false;
+        view->payload = data + MESH_HEADER_SIZE_V1;
+        view->payload_len = MESH_PAYLOAD_MAX;
+        view->wire_len = MESH_WIRE_SIZE_V1;
+    } else {
+        if (len < MESH_HEADER_SIZE) return false;
+        uint8_t payload_len = data[MESH_FIELD(payload_len)];
+        if (payload_len > MESH_PAYLOAD_MAX || MESH_HEADER_SIZE + payload_len > len) return false;
+        view->payload = data + MESH_HEADER_SIZE;
+        view->payload_len = payload_len;
+        view->wire_len = MESH_HEADER_SIZE + payload_len;
+    }
+
+    view->data = data;
+    view->version = version;
+    return true;
+}
+
+static inline uint8_t mesh_view_ttl(const MeshPacketView* view) {
+    return view->data[MESH_FIELD(ttl)];
+}
+
+static inline uint8_t mesh_view_msg_type(const MeshPacketView* view) {
+    return view->data[MESH_FIELD(msg_type)];
+}
+
+static inline uint8_t mesh_view_flags(const MeshPacketView* view) {
+    return view->data[MESH_FIELD(flags)];
+}
+
+static inline uint16_t mesh_view_group_id(const MeshPacketView* view) {
+    return (uint16_t)view->data[MESH_FIELD(group_id)] |
+           ((uint16_t)view->data[MESH_FIELD(group_id) + 1] << 8);
+}
+
+static inline uint32_t mesh_view_packet_id(const MeshPacketView* view) {
+    uint32_t id;
+    memcpy(&id, view->data + MESH_FIELD(packet_id), sizeof(id));
+    return id;
+}
+
+static inline const uint8_t* mesh_view_src_mac(const MeshPacketView* view) {
+    return view->data + MESH_FIELD(src_mac);
+}
+
+static inline const uint8_t* mesh_view_dst_mac(const MeshPacketView* view) {
+    return view->data + MESH_FIELD(dst_mac);
+}
+
+static inline const uint8_t* mesh_view_payload(const MeshPacketView* view) {
+    return view->payload;
+}
+
+// Единственное копирование: в слот очереди.
+// Кадр v1 приводится к формату v2, поле version сохраняется.
+static inline size_t mesh_view_copy(const MeshPacketView* view, MeshPacketHeader* out) {
+    memcpy(out, view->data, MESH_HEADER_SIZE_V1);
+    out->payload_len = view->payload_len;
+    memcpy(out->payload, view->payload, view->payload_len);
+    return MESH_HEADER_SIZE + view->payload_len;
+}
+
+// Копия кадра как есть (для пересылки в исходной версии).
+// Поля TTL и last_hop_mac у v1 и v2 на одних местах,
+// их можно менять через (MeshPacketHeader*)out.
+static inline size_t mesh_view_copy_raw(const MeshPacketView* view, uint8_t* out) {
+    memcpy(out, view->data, view->wire_len);
+    return view->wire_len;
+}
+
 static inline void decrement_ttl(MeshPacketHeader* pkt) {
     if (pkt->ttl > 0) pkt->ttl--;
 }
@@ -85,6 +338,11 @@ static inline bool is_for_me(const MeshPacketHeader* pkt, const uint8_t* my_mac)
     return memcmp(pkt->dst_mac, my_mac, 6) == 0;
 }
 
+// Адресован нам лично или всем
+static inline bool is_packet_for_us(const MeshPacketHeader* pkt, const uint8_t* my_mac) {
+    return is_for_me(pkt, my_mac) || is_broadcast_packet(pkt);
+}
+
 static inline bool requires_local_processing(const MeshPacketHeader* pkt) {
     return (pkt->flags & FLAG_LOCAL_PROCESS) != 0;
 }
@@ -96,3 +354,19 @@ static inline bool requires_ack(const MeshPacketHeader* pkt) {
 static inline bool is_emergency(const MeshPacketHeader* pkt) {
     return (pkt->flags & FLAG_EMERGENCY) != 0;
 }
+
+// Дописать к MSG_PROBE запись об узле. false — места нет или payload
+// не сходится с hop_count (пакет уходит дальше без записи).
+static inline bool probe_append_hop(MeshPacketHeader* pkt, const uint8_t* mac, uint32_t residence_us) {
+    ProbePayload* probe = (ProbePayload*)pkt->payload;
+    if (pkt->payload_len < PROBE_HEADER_SIZE || probe->hop_count >= PROBE_MAX_HOPS ||
+        pkt->payload_len != PROBE_HEADER_SIZE + probe->hop_count * sizeof(ProbeHop)) {
+        return false;
+    }
+
+    ProbeHop* hop = &probe->hops[probe->hop_count++];
+    memcpy(hop->mac_tail, mac + 3, 3);
+    hop->residence_us = residence_us > 0xFFFF ? 0xFFFF : (uint16_t)residence_us;
+    pkt->payload_len += sizeof(ProbeHop);
+    return true;
+}
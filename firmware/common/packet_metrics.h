@@ -0,0 +1,160 @@
+// packet_metrics.h - Задержки горячего пути по типам сообщений
+//
+// На каждый MessageType — гистограмма (latency_histogram.h) на
+// каждую стадию пути пакета через узел:
+//   queue   — callback приёма → выборка из очереди обработки
+//   handler — выборка → конец обработки (ответы и пересылка включены)
+//   send    — esp_now_send → callback отправки (ответ MAC-уровня)
+// и счётчики отброшенных пакетов по причинам. Единицы — микросекунды.
+// Память фиксированная: 17 типов × 3 стадии × ~0.5 КБ ≈ 26 КБ.
+//
+// Синхронизацию обеспечивает вызывающий: каждую стадию пишет одна
+// задача, читатели (статистика) согласны на чуть рассогласованный срез.
+// Исключение — счётчики отбросов: их пишут и callback приёма, и задача
+// обработки, поэтому инкремент атомарный.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "latency_histogram.h"
+#include "mesh_protocol.h"
+
+#define METRICS_TYPE_SLOTS 17   // msg_type 0x00..0x10, остальные — в слот 0
+
+typedef enum {
+    METRIC_STAGE_QUEUE = 0,
+    METRIC_STAGE_HANDLER,
+    METRIC_STAGE_SEND,
+    METRIC_STAGE_COUNT
+} MetricStage;
+
+static const char* const METRIC_STAGE_NAMES[METRIC_STAGE_COUNT] = {
+    "queue", "handler", "send"
+};
+
+typedef enum {
+    DROP_INVALID = 0,           // Битый заголовок, длина, короткий payload
+    DROP_TTL_EXPIRED,           // Нужно переслать, а TTL кончился
+    DROP_NO_ROUTE,              // Нужно переслать, а маршрута нет
+    DROP_QUEUE_FULL,            // Очередь обработки переполнена
+    DROP_REASON_COUNT
+} DropReason;
+
+static const char* const DROP_REASON_NAMES[DROP_REASON_COUNT] = {
+    "invalid", "ttl_expired", "no_route", "queue_full"
+};
+
+typedef struct {
+    LatencyHistogram latency[METRICS_TYPE_SLOTS][METRIC_STAGE_COUNT];
+    uint32_t drops[DROP_REASON_COUNT];
+} PacketMetrics;
+
+static inline void packet_metrics_reset(PacketMetrics* metrics) {
+    memset(metrics, 0, sizeof(*metrics));
+}
+
+static inline uint8_t packet_metrics_slot(uint8_t msg_type) {
+    return msg_type < METRICS_TYPE_SLOTS ? msg_type : 0;
+}
+
+static inline void packet_metrics_record(PacketMetrics* metrics, uint8_t msg_type,
+                                         MetricStage stage, uint32_t micros) {
+    latency_histogram_record(&metrics->latency[packet_metrics_slot(msg_type)][stage], micros);
+}
+
+static inline void packet_metrics_drop(PacketMetrics* metrics, DropReason reason) {
+    __atomic_fetch_add(&metrics->drops[reason], 1, __ATOMIC_RELAXED);
+}
+
+// Имя для меток метрик (слот 0 — неизвестные типы)
+static inline const char* message_type_name(uint8_t msg_type) {
+    switch (msg_type) {
+        case MSG_DATA_SENSOR:         return "data_sensor";
+        case MSG_DATA_ACTUATOR:       return "data_actuator";
+        case MSG_CMD_SET:             return "cmd_set";
+        case MSG_CMD_GET:             return "cmd_get";
+        case MSG_ROUTING_UPDATE:      return "routing_update";
+        case MSG_HEARTBEAT:           return "heartbeat";
+        case MSG_DISCOVERY:           return "discovery";
+        case MSG_CMD_GROUP:           return "cmd_group";
+        case MSG_EVENT_BROADCAST:     return "event_broadcast";
+        case MSG_DEVICE_STATE_UPDATE: return "device_state_update";
+        case MSG_DATA_BATCH:          return "data_batch";
+        case MSG_PROBE:               return "probe";
+        case MSG_REFLEX_RULES:        return "reflex_rules";
+        case MSG_ACK:                 return "ack";
+        case MSG_NACK:                return "nack";
+        case MSG_ROUTE_DELTA:         return "route_delta";
+        default:                      return "other";
+    }
+}
+
+// ============================================================================
+// ОТПРАВКИ В ПОЛЁТЕ
+// ============================================================================
+
+// Callback отправки ESP-NOW сообщает только MAC получателя. Чтобы
+// отнести задержку к типу сообщения, при esp_now_send запоминаем время
+// и тип, а в callback'е забираем самую старую отправку на этот MAC.
+// Отправка без callback'а (не должно быть, но) через SEND_TRACK_EXPIRE_US
+// освобождает слот.
+#define SEND_TRACK_SLOTS 16
+#define SEND_TRACK_EXPIRE_US 1000000
+
+typedef struct {
+    uint32_t seq;               // 0 — слот свободен
+    uint32_t start_us;
+    uint8_t  mac[6];
+    uint8_t  msg_type;
+} SendTrackSlot;
+
+typedef struct {
+    SendTrackSlot slots[SEND_TRACK_SLOTS];
+    uint32_t next_seq;
+    uint32_t untracked;         // Не нашлось свободного слота
+} SendTracker;
+
+static inline void send_tracker_start(SendTracker* tracker, const uint8_t* mac,
+                                      uint8_t msg_type, uint32_t now_us) {
+    SendTrackSlot* free_slot = NULL;
+    for (uint32_t i = 0; i < SEND_TRACK_SLOTS; i++) {
+        SendTrackSlot* slot = &tracker->slots[i];
+        if (slot->seq == 0 || now_us - slot->start_us > SEND_TRACK_EXPIRE_US) {
+            free_slot = slot;
+            break;
+        }
+    }
+    if (!free_slot) {
+        tracker->untracked++;
+        return;
+    }
+
+    if (++tracker->next_seq == 0) {
+        tracker->next_seq = 1;
+    }
+    free_slot->seq = tracker->next_seq;
+    free_slot->start_us = now_us;
+    memcpy(free_slot->mac, mac, 6);
+    free_slot->msg_type = msg_type;
+}
+
+// Завершить самую старую отправку на mac. false — такой не было.
+static inline bool send_tracker_finish(SendTracker* tracker, const uint8_t* mac, uint32_t now_us,
+                                       uint8_t* msg_type, uint32_t* elapsed_us) {
+    SendTrackSlot* oldest = NULL;
+    for (uint32_t i = 0; i < SEND_TRACK_SLOTS; i++) {
+        SendTrackSlot* slot = &tracker->slots[i];
+        if (slot->seq != 0 && memcmp(slot->mac, mac, 6) == 0 &&
+            (!oldest || (int32_t)(slot->seq - oldest->seq) < 0)) {
+            oldest = slot;
+        }
+    }
+    if (!oldest) {
+        return false;
+    }
+
+    *msg_type = oldest->msg_type;
+    *elapsed_us = now_us - oldest->start_us;
+    oldest->seq = 0;
+    return true;
+}
@@ -0,0 +1,66 @@
+// packet_ring.h - Кольцевой буфер входящих пакетов (lock-free SPSC)
+//
+// Один писатель (callback ESP-NOW в задаче WiFi) и один читатель
+// (рабочая задача обработки). Слоты выделены заранее, никакого malloc.
+// Индексы свободно бегут по uint32_t, размер — степень двойки.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "mesh_protocol.h"
+
+// Слот кольца: сам пакет плюс метаданные приёма
+typedef struct {
+    uint32_t rx_time_us;        // Время приёма (micros)
+    uint8_t  last_hop_mac[6];   // Кто непосредственно передал пакет
+    uint8_t  len;               // Фактическая длина кадра
+    uint8_t  ack_only;          // Повтор уже обработанного пакета: только переподтвердить
+    MeshPacketHeader packet;
+} PacketSlot;
+
+typedef struct {
+    PacketSlot* slots;          // Внешнее хранилище на count слотов
+    uint32_t mask;              // count - 1
+    uint32_t head;              // Пишет только producer
+    uint32_t tail;              // Пишет только consumer
+} PacketRing;
+
+// count обязан быть степенью двойки
+static inline void packet_ring_init(PacketRing* ring, PacketSlot* storage, uint32_t count) {
+    ring->slots = storage;
+    ring->mask = count - 1;
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+static inline uint32_t packet_ring_count(const PacketRing* ring) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return head - tail;
+}
+
+// Producer: получить свободный слот для записи (NULL если кольцо полно)
+static inline PacketSlot* packet_ring_reserve(PacketRing* ring) {
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail > ring->mask) return NULL;
+    return &ring->slots[head & ring->mask];
+}
+
+// Producer: опубликовать заполненный слот
+static inline void packet_ring_commit(PacketRing* ring) {
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+// Consumer: самый старый пакет (NULL если пусто)
+static inline PacketSlot* packet_ring_peek(PacketRing* ring) {
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) return NULL;
+    return &ring->slots[tail & ring->mask];
+}
+
+// Consumer: освободить слот, полученный через peek
+static inline void packet_ring_release(PacketRing* ring) {
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,82 @@
+// packet_scheduler.h - Приоритетные очереди входящих пакетов
+//
+// Классы соответствуют SYSTEM_LOGIC.md ("Типы пакетов по приоритету").
+// Экстренный трафик имеет строгий приоритет, остальные классы
+// разбираются по ближайшему дедлайну (EDF), поэтому телеметрия
+// не голодает, но и не задерживает команды.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "mesh_protocol.h"
+#include "packet_ring.h"
+
+typedef enum {
+    PRIO_EMERGENCY = 0,   // FLAG_EMERGENCY, EVENT_BROADCAST — немедленно, вне очереди
+    PRIO_IMMEDIATE = 1,   // HEARTBEAT, локальный CMD_GROUP, ACK
+    PRIO_NORMAL    = 2,   // CMD_SET, ROUTING_UPDATE — очередь 100 мс
+    PRIO_BULK      = 3,   // DATA_SENSOR, DATA_BATCH, DISCOVERY — очередь 1 сек
+    PRIO_CLASS_COUNT
+} PriorityClass;
+
+// Дедлайн обработки для каждого класса, мкс
+static const uint32_t PRIO_DEADLINE_US[PRIO_CLASS_COUNT] = {
+    0,          // PRIO_EMERGENCY
+    10000,      // PRIO_IMMEDIATE
+    100000,     // PRIO_NORMAL
+    1000000     // PRIO_BULK
+};
+
+static const char* const PRIO_CLASS_NAMES[PRIO_CLASS_COUNT] = {
+    "emergency", "immediate", "normal", "bulk"
+};
+
+// Классификация по типу сообщения и флагам (достаточно двух байт заголовка)
+static inline PriorityClass packet_priority_class(uint8_t msg_type, uint8_t flags) {
+    if ((flags & FLAG_EMERGENCY) || msg_type == MSG_EVENT_BROADCAST) {
+        return PRIO_EMERGENCY;
+    }
+
+    switch (msg_type) {
+        case MSG_HEARTBEAT:
+        case MSG_ACK:
+        case MSG_NACK:
+            return PRIO_IMMEDIATE;
+        case MSG_CMD_GROUP:
+            return (flags & FLAG_LOCAL_PROCESS) ? PRIO_IMMEDIATE : PRIO_NORMAL;
+        case MSG_DATA_SENSOR:
+        case MSG_DATA_BATCH:
+        case MSG_DISCOVERY:
+            return PRIO_BULK;
+        default:
+            return PRIO_NORMAL;
+    }
+}
+
+typedef struct {
+    PacketRing rings[PRIO_CLASS_COUNT];
+} PacketScheduler;
+
+// Выбор очереди для следующего пакета (NULL если всё пусто)
+static inline PacketRing* packet_scheduler_select(PacketScheduler* sched, PriorityClass* out_class) {
+    // Экстренные — строго первыми
+    if (packet_ring_peek(&sched->rings[PRIO_EMERGENCY])) {
+        *out_class = PRIO_EMERGENCY;
+        return &sched->rings[PRIO_EMERGENCY];
+    }
+
+    // Остальные — по ближайшему дедлайну
+    PacketRing* best = NULL;
+    uint32_t best_deadline = 0;
+    for (int c = PRIO_IMMEDIATE; c < PRIO_CLASS_COUNT; c++) {
+        PacketSlot* head = packet_ring_peek(&sched->rings[c]);
+        if (!head) continue;
+
+        uint32_t deadline = head->rx_time_us + PRIO_DEADLINE_US[c];
+        if (!best || (int32_t)(deadline - best_deadline) < 0) {
+            best = &sched->rings[c];
+            best_deadline = deadline;
+            *out_class = (PriorityClass)c;
+        }
+    }
+    return best;
+}
@@ -0,0 +1,237 @@
+// reflex_rules.h - Рефлексы уровня 1: правила "условие → групповая команда"
+//
+// Координатор собирает таблицу правил и отправляет её репитеру одним
+// пакетом MSG_REFLEX_RULES; репитер хранит её в NVS и проверяет каждое
+// показание или аварийное событие своих детей. Сработавшее правило
+// рассылает MSG_CMD_GROUP (FLAG_LOCAL_PROCESS) на один прыжок — свет
+// по датчику движения включается без круга через координатор.
+//
+// Таблица фиксированного размера, пороги уже в целых единицах поля,
+// правила отсортированы по группе источника: на пакет — один поиск в
+// маленьком хеш-индексе и проверка правил этой группы. Кучи нет.
+// Синхронизацию обеспечивает вызывающий.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "mesh_protocol.h"
+
+// Что сравнивается с порогом
+typedef enum {
+    REFLEX_FIELD_TEMPERATURE = 0,   // SensorData.temperature, десятые градуса
+    REFLEX_FIELD_HUMIDITY,          // SensorData.humidity, десятые процента
+    REFLEX_FIELD_BATTERY,           // SensorData.battery_mv, мВ
+    REFLEX_FIELD_EVENT_TYPE,        // EmergencyEvent.event_type
+    REFLEX_FIELD_SEVERITY,          // EmergencyEvent.severity
+    REFLEX_FIELD_COUNT
+} ReflexField;
+
+typedef enum {
+    REFLEX_OP_GT = 0,
+    REFLEX_OP_LT,
+    REFLEX_OP_EQ,
+    REFLEX_OP_COUNT
+} ReflexOp;
+
+#pragma pack(push, 1)
+typedef struct {
+    uint16_t source_group;      // group_id пакета-источника
+    uint8_t  field;             // ReflexField (определяет и тип пакета)
+    uint8_t  op;                // ReflexOp
+    int16_t  threshold;
+    uint16_t target_group;      // Кому команда
+    uint8_t  command_code;
+    uint8_t  parameter;
+    uint8_t  cooldown_100ms;    // Не чаще раза в столько (x100 мс)
+    uint8_t  reserved;
+} ReflexRule;
+
+#define REFLEX_TABLE_HEADER_SIZE 4
+#define REFLEX_MAX_RULES ((MESH_PAYLOAD_MAX - REFLEX_TABLE_HEADER_SIZE) / sizeof(ReflexRule))
+
+// Тело MSG_REFLEX_RULES и запись в NVS — целиком заменяет прежнюю таблицу
+typedef struct {
+    uint16_t   version;
+    uint8_t    count;
+    uint8_t    reserved;
+    ReflexRule rules[REFLEX_MAX_RULES];
+} ReflexRuleTable;
+#pragma pack(pop)
+
+static inline size_t reflex_table_size(uint8_t count) {
+    return REFLEX_TABLE_HEADER_SIZE + count * sizeof(ReflexRule);
+}
+
+// Имена для API координатора (индекс — ReflexField / ReflexOp)
+static const char* const REFLEX_FIELD_NAMES[REFLEX_FIELD_COUNT] = {
+    "temperature", "humidity", "battery", "event_type", "severity"
+};
+static const char* const REFLEX_OP_NAMES[REFLEX_OP_COUNT] = { ">", "<", "=" };
+
+// Во сколько раз порог в таблице больше значения в единицах поля
+static inline int32_t reflex_field_scale(uint8_t field) {
+    return field <= REFLEX_FIELD_HUMIDITY ? 10 : 1;
+}
+
+// Поле берётся из пакета этого типа
+static inline uint8_t reflex_field_msg_type(uint8_t field) {
+    return field >= REFLEX_FIELD_EVENT_TYPE ? MSG_EVENT_BROADCAST : MSG_DATA_SENSOR;
+}
+
+static inline bool reflex_rule_valid(const ReflexRule* rule) {
+    return rule->field < REFLEX_FIELD_COUNT && rule->op < REFLEX_OP_COUNT;
+}
+
+// ============================================================================
+// ИСПОЛНИТЕЛЬ НА РЕПИТЕРЕ
+// ============================================================================
+
+#define REFLEX_INDEX_SLOTS 32   // Степень двойки, > 2 * REFLEX_MAX_RULES
+
+typedef struct {
+    uint16_t group;
+    uint8_t  first;             // Первое правило группы
+    uint8_t  count;             // 0 — слот пуст
+} ReflexIndexSlot;
+
+typedef struct {
+    ReflexRuleTable  table;
+    ReflexIndexSlot  index[REFLEX_INDEX_SLOTS];
+    uint32_t         last_fired_ms[REFLEX_MAX_RULES];
+
+    // Статистика
+    uint32_t fired;             // Команд разослано
+    uint32_t suppressed;        // Условие выполнено, но правило остывает
+} ReflexEngine;
+
+static inline uint32_t reflex_index_hash(uint16_t group) {
+    return ((uint32_t)group * 0x9E37u >> 5) & (REFLEX_INDEX_SLOTS - 1);
+}
+
+// Установить таблицу: проверка, сортировка по группе и индекс.
+// false — таблица битая, прежняя остаётся.
+static inline bool reflex_install(ReflexEngine* engine, const ReflexRuleTable* table, size_t len) {
+    if (len < REFLEX_TABLE_HEADER_SIZE || table->count > REFLEX_MAX_RULES ||
+        len < reflex_table_size(table->count)) {
+        return false;
+    }
+    for (uint8_t i = 0; i < table->count; i++) {
+        if (!reflex_rule_valid(&table->rules[i])) {
+            return false;
+        }
+    }
+
+    memcpy(&engine->table, table, reflex_table_size(table->count));
+
+    // Вставками: правил немного, порядок внутри группы сохраняется
+    ReflexRule* rules = engine->table.rules;
+    for (uint8_t i = 1; i < engine->table.count; i++) {
+        ReflexRule rule = rules[i];
+        int j = i - 1;
+        while (j >= 0 && rules[j].source_group > rule.source_group) {
+            rules[j + 1] = rules[j];
+            j--;
+        }
+        rules[j + 1] = rule;
+    }
+
+    memset(engine->index, 0, sizeof(engine->index));
+    for (uint8_t i = 0; i < engine->table.count; i++) {
+        uint16_t group = rules[i].source_group;
+        uint32_t slot = reflex_index_hash(group);
+        while (engine->index[slot].count && engine->index[slot].group != group) {
+            slot = (slot + 1) & (REFLEX_INDEX_SLOTS - 1);
+        }
+        if (engine->index[slot].count == 0) {
+            engine->index[slot].group = group;
+            engine->index[slot].first = i;
+        }
+        engine->index[slot].count++;
+    }
+
+    memset(engine->last_fired_ms, 0, sizeof(engine->last_fired_ms));
+    return true;
+}
+
+static inline void reflex_init(ReflexEngine* engine) {
+    memset(engine, 0, sizeof(*engine));
+}
+
+static inline const ReflexIndexSlot* reflex_lookup(const ReflexEngine* engine, uint16_t group) {
+    uint32_t slot = reflex_index_hash(group);
+    while (engine->index[slot].count) {
+        if (engine->index[slot].group == group) {
+            return &engine->index[slot];
+        }
+        slot = (slot + 1) & (REFLEX_INDEX_SLOTS - 1);
+    }
+    return NULL;
+}
+
+static inline bool reflex_compare(uint8_t op, int32_t value, int32_t threshold) {
+    switch (op) {
+        case REFLEX_OP_GT: return value > threshold;
+        case REFLEX_OP_LT: return value < threshold;
+        default:           return value == threshold;
+    }
+}
+
+// Значение поля из payload; false — пакет не того типа или короткий
+static inline bool reflex_field_value(uint8_t field, uint8_t msg_type,
+                                      const uint8_t* payload, uint8_t payload_len, int32_t* value) {
+    if (reflex_field_msg_type(field) != msg_type) {
+        return false;
+    }
+
+    if (msg_type == MSG_DATA_SENSOR) {
+        SensorData data;
+        if (payload_len < offsetof(SensorData, awake_ms)) {
+            return false;
+        }
+        memcpy(&data, payload, offsetof(SensorData, awake_ms));
+        switch (field) {
+            case REFLEX_FIELD_TEMPERATURE: *value = (int32_t)(data.temperature * 10); return true;
+            case REFLEX_FIELD_HUMIDITY:    *value = (int32_t)(data.humidity * 10); return true;
+            default:                       *value = data.battery_mv; return true;
+        }
+    }
+
+    EmergencyEvent event;
+    if (payload_len < sizeof(EmergencyEvent)) {
+        return false;
+    }
+    memcpy(&event, payload, sizeof(event));
+    *value = field == REFLEX_FIELD_EVENT_TYPE ? event.event_type : event.severity;
+    return true;
+}
+
+// Проверить пакет. Сработавшие правила (не больше max) — в fired.
+// Возвращает их число; остывающие считаются в suppressed.
+static inline uint8_t reflex_evaluate(ReflexEngine* engine, uint16_t group, uint8_t msg_type,
+                                      const uint8_t* payload, uint8_t payload_len, uint32_t now_ms,
+                                      const ReflexRule** fired, uint8_t max) {
+    const ReflexIndexSlot* slot = reflex_lookup(engine, group);
+    if (!slot) {
+        return 0;
+    }
+
+    uint8_t count = 0;
+    for (uint8_t i = slot->first; i < slot->first + slot->count && count < max; i++) {
+        const ReflexRule* rule = &engine->table.rules[i];
+        int32_t value;
+        if (!reflex_field_value(rule->field, msg_type, payload, payload_len, &value) ||
+            !reflex_compare(rule->op, value, rule->threshold)) {
+            continue;
+        }
+
+        uint32_t cooldown = rule->cooldown_100ms * 100u;
+        if (engine->last_fired_ms[i] != 0 && now_ms - engine->last_fired_ms[i] < cooldown) {
+            engine->suppressed++;
+            continue;
+        }
+        engine->last_fired_ms[i] = now_ms ? now_ms : 1;
+        engine->fired++;
+        fired[count++] = rule;
+    }
+    return count;
+}
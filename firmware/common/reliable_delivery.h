@@ -0,0 +1,231 @@
+// reliable_delivery.h - Доставка с подтверждением (MSG_ACK/MSG_NACK)
+//
+// Таблица пакетов "в полёте" фиксированного размера, ключ —
+// (dst_mac, packet_id). Каждый пакет перепосылается по своему таймеру
+// с экспоненциальной задержкой и случайным разбросом, после
+// max_attempts попыток (или по NACK) вызывается give_up.
+//
+// Ничего не блокирует: отправка — через callback, таймеры крутит
+// reliable_poll() из цикла владельца. Синхронизацию (если таблицу
+// трогают из разных задач) обеспечивает вызывающий.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "mesh_protocol.h"
+
+#ifndef RELIABLE_MAX_ATTEMPTS
+#define RELIABLE_MAX_ATTEMPTS   5       // Первая отправка + 4 повтора
+#endif
+#ifndef RELIABLE_BASE_TIMEOUT_MS
+#define RELIABLE_BASE_TIMEOUT_MS 200    // Ожидание ACK после первой отправки
+#endif
+#ifndef RELIABLE_MAX_BACKOFF_MS
+#define RELIABLE_MAX_BACKOFF_MS 5000    // Потолок задержки между повторами
+#endif
+
+// Почему пакет снят с доставки
+typedef enum {
+    RELIABLE_GAVE_UP_TIMEOUT = 0,       // Попытки кончились
+    RELIABLE_GAVE_UP_NACK    = 1        // Получатель отказал (AckStatus в nack_reason)
+} ReliableGiveUpReason;
+
+typedef struct {
+    uint8_t  frame[MAX_PACKET_SIZE];    // Кадр как он уходит в эфир
+    uint8_t  len;
+    uint8_t  attempts;                  // Сколько раз уже отправлен
+    uint8_t  in_use;
+    uint32_t next_retry_ms;
+    uint32_t backoff_ms;                // Текущая базовая задержка (без разброса)
+} ReliableSlot;
+
+// Отправить кадр (маршрут выбирает владелец: он мог смениться между повторами)
+typedef void (*reliable_send_fn)(const uint8_t* frame, uint8_t len, void* ctx);
+// Пакет не доставлен (вызывается до освобождения слота)
+typedef void (*reliable_give_up_fn)(const MeshPacketHeader* packet, uint8_t reason,
+                                    uint8_t nack_reason, void* ctx);
+
+typedef struct {
+    ReliableSlot*       slots;
+    uint8_t             capacity;
+    uint8_t             in_flight;
+    uint32_t            rng;            // xorshift32 для разброса задержек
+    reliable_send_fn    send;
+    reliable_give_up_fn give_up;
+    void*               ctx;
+
+    // Статистика
+    uint32_t sent;                      // Принято на доставку
+    uint32_t retransmits;
+    uint32_t acked;
+    uint32_t nacked;
+    uint32_t timeouts;
+    uint32_t table_full;                // Отказано: таблица заполнена
+} ReliableTable;
+
+static inline void reliable_init(ReliableTable* table, ReliableSlot* storage, uint8_t capacity,
+                                 reliable_send_fn send, reliable_give_up_fn give_up,
+                                 void* ctx, uint32_t seed) {
+    memset(table, 0, sizeof(*table));
+    memset(storage, 0, capacity * sizeof(ReliableSlot));
+    table->slots = storage;
+    table->capacity = capacity;
+    table->rng = seed ? seed : 0x2545F491u;
+    table->send = send;
+    table->give_up = give_up;
+    table->ctx = ctx;
+}
+
+static inline uint32_t reliable_random(ReliableTable* table) {
+    uint32_t x = table->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    table->rng = x;
+    return x;
+}
+
+// Задержка с разбросом +0..50%: соседи, потерявшие один и тот же
+// кадр, не повторяют его синхронно
+static inline uint32_t reliable_jittered(ReliableTable* table, uint32_t backoff_ms) {
+    return backoff_ms + reliable_random(table) % (backoff_ms / 2 + 1);
+}
+
+static inline ReliableSlot* reliable_find(ReliableTable* table, const uint8_t* dst_mac,
+                                          uint32_t packet_id) {
+    for (uint8_t i = 0; i < table->capacity; i++) {
+        ReliableSlot* slot = &table->slots[i];
+        if (!slot->in_use) continue;
+
+        const MeshPacketHeader* packet = (const MeshPacketHeader*)slot->frame;
+        if (packet->packet_id == packet_id && memcmp(packet->dst_mac, dst_mac, 6) == 0) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+static inline void reliable_release(ReliableTable* table, ReliableSlot* slot) {
+    slot->in_use = 0;
+    table->in_flight--;
+}
+
+// Взять на доставку кадр, который вызывающий уже отправил в now_ms
+// (первая отправка — не из владельца таблицы). Дальше — повторы по таймерам.
+// false — таблица заполнена или кадр уже в полёте.
+static inline bool reliable_track(ReliableTable* table, const uint8_t* frame, uint8_t len,
+                                  uint32_t now_ms) {
+    const MeshPacketHeader* packet = (const MeshPacketHeader*)frame;
+    if (reliable_find(table, packet->dst_mac, packet->packet_id)) {
+        return false;
+    }
+
+    ReliableSlot* slot = NULL;
+    for (uint8_t i = 0; i < table->capacity; i++) {
+        if (!table->slots[i].in_use) {
+            slot = &table->slots[i];
+            break;
+        }
+    }
+    if (!slot) {
+        table->table_full++;
+        return false;
+    }
+
+    memcpy(slot->frame, frame, len);
+    slot->len = len;
+    slot->attempts = 1;
+    slot->in_use = 1;
+    slot->backoff_ms = RELIABLE_BASE_TIMEOUT_MS;
+    slot->next_retry_ms = now_ms + reliable_jittered(table, slot->backoff_ms);
+    table->in_flight++;
+    table->sent++;
+    return true;
+}
+
+// Поставить кадр на доставку и сразу отправить.
+// false — таблица заполнена (кадр не отправлен) или он уже в полёте.
+static inline bool reliable_send(ReliableTable* table, const uint8_t* frame, uint8_t len,
+                                 uint32_t now_ms) {
+    if (!reliable_track(table, frame, len, now_ms)) return false;
+    table->send(frame, len, table->ctx);
+    return true;
+}
+
+// Пришёл MSG_ACK от from_mac на packet_id
+static inline bool reliable_on_ack(ReliableTable* table, const uint8_t* from_mac, uint32_t packet_id) {
+    ReliableSlot* slot = reliable_find(table, from_mac, packet_id);
+    if (!slot) return false;
+
+    table->acked++;
+    reliable_release(table, slot);
+    return true;
+}
+
+// Пришёл MSG_NACK: повторять бессмысленно, сразу сдаёмся
+static inline bool reliable_on_nack(ReliableTable* table, const uint8_t* from_mac,
+                                    uint32_t packet_id, uint8_t reason) {
+    ReliableSlot* slot = reliable_find(table, from_mac, packet_id);
+    if (!slot) return false;
+
+    table->nacked++;
+    if (table->give_up) {
+        table->give_up((const MeshPacketHeader*)slot->frame, RELIABLE_GAVE_UP_NACK,
+                       reason, table->ctx);
+    }
+    reliable_release(table, slot);
+    return true;
+}
+
+// Таймеры: повтор или отказ. Вызывать регулярно (раз в 10-50 мс).
+static inline void reliable_poll(ReliableTable* table, uint32_t now_ms) {
+    if (table->in_flight == 0) return;
+
+    for (uint8_t i = 0; i < table->capacity; i++) {
+        ReliableSlot* slot = &table->slots[i];
+        if (!slot->in_use || (int32_t)(now_ms - slot->next_retry_ms) < 0) continue;
+
+        if (slot->attempts >= RELIABLE_MAX_ATTEMPTS) {
+            table->timeouts++;
+            if (table->give_up) {
+                table->give_up((const MeshPacketHeader*)slot->frame, RELIABLE_GAVE_UP_TIMEOUT,
+                               0, table->ctx);
+            }
+            reliable_release(table, slot);
+            continue;
+        }
+
+        // Повтор помечается, чтобы репитеры не приняли его за петлю
+        ((MeshPacketHeader*)slot->frame)->flags |= FLAG_RETRY;
+
+        slot->attempts++;
+        slot->backoff_ms = slot->backoff_ms * 2 < RELIABLE_MAX_BACKOFF_MS ?
+                           slot->backoff_ms * 2 : RELIABLE_MAX_BACKOFF_MS;
+        slot->next_retry_ms = now_ms + reliable_jittered(table, slot->backoff_ms);
+        table->retransmits++;
+
+        table->send(slot->frame, slot->len, table->ctx);
+    }
+}
+
+// Кадр MSG_ACK/MSG_NACK источнику подтверждаемого пакета.
+// packet_id у каждого ответа свой: повторный ACK на повтор пакета
+// не должен погибнуть в кэше дублей репитеров.
+static inline void reliable_build_ack(MeshPacketHeader* out, const uint8_t* self_mac,
+                                      const uint8_t* dst_mac, uint32_t ack_packet_id,
+                                      uint32_t acked_id, uint8_t msg_type, uint8_t status) {
+    memset(out, 0, MESH_HEADER_SIZE + sizeof(AckPayload));
+    out->network_id = MESH_NETWORK_ID;
+    out->version = PROTOCOL_VERSION;
+    out->ttl = DEFAULT_TTL;
+    out->packet_id = ack_packet_id;
+    memcpy(out->src_mac, self_mac, 6);
+    memcpy(out->dst_mac, dst_mac, 6);
+    memcpy(out->last_hop_mac, self_mac, 6);
+    out->msg_type = msg_type;
+    out->payload_len = sizeof(AckPayload);
+
+    AckPayload* ack = (AckPayload*)out->payload;
+    ack->acked_id = acked_id;
+    ack->status = status;
+}
@@ -0,0 +1,408 @@
+// route_delta.h - Объявления маршрутов изменениями (MSG_ROUTE_DELTA)
+//
+// Репитер сообщает соседям не весь список своих детей раз в период, а
+// только что изменилось: ребёнок появился (ADD), пропал (REMOVE), у
+// канала до него заметно сменился ETX (METRIC). Объявленному MAC
+// отправитель выдаёт номер слота; MAC идёт в эфир один раз, в ADD,
+// дальше — только номер varint'ом (байт на операцию вместо семи).
+//
+// Кадр с изменениями несёт следующий номер последовательности. Пропуск
+// номера (или первую встречу с соседом) получатель замечает сам и
+// просит полный снимок (ROUTE_DELTA_RESYNC) — полная таблица уходит
+// только тогда. Без изменений раз в keepalive летит пустой кадр с
+// текущим номером: по нему видна и потеря последнего изменения.
+// Трафик управления растёт с числом изменений, а не узлов.
+//
+// Операции после RouteDeltaPayload: varint(slot << 2 | op), затем
+// для ADD — mac[6] и metric, для METRIC — metric. metric — ETX x16
+// канала отправитель → ребёнок (link_quality.h), насыщается на 255.
+// Синхронизацию обеспечивает вызывающий.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "mesh_protocol.h"
+
+#define ROUTE_DELTA_SLOTS        64     // Объявляемых детей у одного репитера
+#define ROUTE_DELTA_METRIC_STEP  8      // Меньшее изменение ETX не объявляем
+#define ROUTE_DELTA_RESYNC_MS    2000   // Не чаще просим снимок у одного соседа
+#define ROUTE_DELTA_OP_MAX_SIZE  12     // varint (до 5 байт) + mac + metric
+
+typedef enum {
+    ROUTE_DELTA_OP_ADD = 0,
+    ROUTE_DELTA_OP_REMOVE,
+    ROUTE_DELTA_OP_METRIC,
+    ROUTE_DELTA_OP_NONE = 0xFF          // Слоту нечего объявлять
+} RouteDeltaOp;
+
+// ============================================================================
+// VARINT (LEB128: 7 бит на байт, старший — "дальше ещё")
+// ============================================================================
+
+static inline uint8_t route_delta_put_varint(uint8_t* out, uint32_t value) {
+    uint8_t len = 0;
+    while (value >= 0x80) {
+        out[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (uint8_t)value;
+    return len;
+}
+
+static inline bool route_delta_get_varint(const uint8_t* in, size_t len, size_t* pos, uint32_t* value) {
+    uint32_t result = 0;
+    for (uint8_t shift = 0; shift < 35; shift += 7) {
+        if (*pos >= len) {
+            return false;
+        }
+        uint8_t byte = in[(*pos)++];
+        result |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+// ============================================================================
+// ОТПРАВИТЕЛЬ (репитер)
+// ============================================================================
+
+typedef struct {
+    uint8_t mac[6];
+    uint8_t metric;             // Последнее объявленное (или к объявлению)
+    uint8_t live;               // Слот занят, номер за MAC закреплён
+    uint8_t pending;            // RouteDeltaOp к отправке
+    uint8_t seen;               // Ребёнок есть в текущем обходе
+} RouteDeltaSlot;
+
+typedef struct {
+    RouteDeltaSlot slots[ROUTE_DELTA_SLOTS];
+    uint16_t seq;               // Номер последнего кадра с изменениями
+    bool     full_pending;      // Следующий кадр — снимок
+
+    // Статистика
+    uint32_t deltas;            // Кадров с изменениями
+    uint32_t snapshots;         // Из них снимков
+    uint32_t overflow;          // Ребёнку не хватило слота
+} RouteDeltaTx;
+
+static inline void route_delta_tx_init(RouteDeltaTx* tx, uint16_t seq) {
+    memset(tx, 0, sizeof(*tx));
+    for (uint8_t i = 0; i < ROUTE_DELTA_SLOTS; i++) {
+        tx->slots[i].pending = ROUTE_DELTA_OP_NONE;
+    }
+    tx->seq = seq;
+    tx->full_pending = true;   // Соседи нас ещё не знают
+}
+
+// Обход детей: begin, observe на каждого, end — кого не было, тех удаляем
+static inline void route_delta_tx_begin(RouteDeltaTx* tx) {
+    for (uint8_t i = 0; i < ROUTE_DELTA_SLOTS; i++) {
+        tx->slots[i].seen = 0;
+    }
+}
+
+static inline void route_delta_tx_observe(RouteDeltaTx* tx, const uint8_t* mac, uint8_t metric) {
+    RouteDeltaSlot* free_slot = NULL;
+    for (uint8_t i = 0; i < ROUTE_DELTA_SLOTS; i++) {
+        RouteDeltaSlot* slot = &tx->slots[i];
+        if (!slot->live) {
+            if (!free_slot) {
+                free_slot = slot;
+            }
+            continue;
+        }
+        if (memcmp(slot->mac, mac, 6) != 0) {
+            continue;
+        }
+
+        slot->seen = 1;
+        if (slot->pending == ROUTE_DELTA_OP_REMOVE) {
+            slot->pending = ROUTE_DELTA_OP_NONE;   // Вернулся до объявления ухода
+        }
+        int16_t change = (int16_t)metric - slot->metric;
+        if (change >= ROUTE_DELTA_METRIC_STEP || change <= -ROUTE_DELTA_METRIC_STEP) {
+            slot->metric = metric;
+            if (slot->pending == ROUTE_DELTA_OP_NONE) {
+                slot->pending = ROUTE_DELTA_OP_METRIC;
+            }
+        }
+        return;
+    }
+
+    if (!free_slot) {
+        tx->overflow++;
+        return;
+    }
+    memcpy(free_slot->mac, mac, 6);
+    free_slot->metric = metric;
+    free_slot->live = 1;
+    free_slot->seen = 1;
+    free_slot->pending = ROUTE_DELTA_OP_ADD;
+}
+
+static inline void route_delta_tx_end(RouteDeltaTx* tx) {
+    for (uint8_t i = 0; i < ROUTE_DELTA_SLOTS; i++) {
+        RouteDeltaSlot* slot = &tx->slots[i];
+        if (!slot->live || slot->seen) {
+            continue;
+        }
+        if (slot->pending == ROUTE_DELTA_OP_ADD) {
+            // Соседи о нём не слышали — объявлять нечего
+            slot->live = 0;
+            slot->pending = ROUTE_DELTA_OP_NONE;
+        } else {
+            slot->pending = ROUTE_DELTA_OP_REMOVE;
+        }
+    }
+}
+
+// Сосед просит снимок (или пропустил изменения)
+static inline void route_delta_tx_request_full(RouteDeltaTx* tx) {
+    tx->full_pending = true;
+}
+
+// Следующий кадр: изменения, сколько влезет (остальные — следующим).
+// Возвращает длину payload; 0 — объявлять нечего.
+static inline uint8_t route_delta_tx_build(RouteDeltaTx* tx, RouteDeltaPayload* out) {
+    memset(out, 0, ROUTE_DELTA_HEADER_SIZE);
+
+    if (tx->full_pending) {
+        // Снимок: получатель забывает прежнее, ушедших можно не объявлять
+        for (uint8_t i = 0; i < ROUTE_DELTA_SLOTS; i++) {
+            RouteDeltaSlot* slot = &tx->slots[i];
+            if (slot->live && slot->pending == ROUTE_DELTA_OP_REMOVE) {
+                slot->live = 0;
+            }
+            slot->pending = slot->live ? ROUTE_DELTA_OP_ADD : ROUTE_DELTA_OP_NONE;
+        }
+        out->flags = ROUTE_DELTA_FULL;
+        tx->full_pending = false;
+    }
+
+    size_t pos = 0;
+    for (uint8_t i = 0; i < ROUTE_DELTA_SLOTS && out->count < 255; i++) {
+        RouteDeltaSlot* slot = &tx->slots[i];
+        if (slot->pending == ROUTE_DELTA_OP_NONE) {
+            continue;
+        }
+        if (pos + ROUTE_DELTA_OP_MAX_SIZE > sizeof(out->ops)) {
+            break;
+        }
+
+        pos += route_delta_put_varint(&out->ops[pos], ((uint32_t)i << 2) | slot->pending);
+        if (slot->pending == ROUTE_DELTA_OP_ADD) {
+            memcpy(&out->ops[pos], slot->mac, 6);
+            pos += 6;
+        }
+        if (slot->pending != ROUTE_DELTA_OP_REMOVE) {
+            out->ops[pos++] = slot->metric;
+        } else {
+            slot->live = 0;   // Номер свободен только после объявления ухода
+        }
+        slot->pending = ROUTE_DELTA_OP_NONE;
+        out->count++;
+    }
+
+    if (out->count == 0 && !(out->flags & ROUTE_DELTA_FULL)) {
+        return 0;
+    }
+    out->seq = ++tx->seq;
+    tx->deltas++;
+    if (out->flags & ROUTE_DELTA_FULL) {
+        tx->snapshots++;
+    }
+    return (uint8_t)(ROUTE_DELTA_HEADER_SIZE + pos);
+}
+
+// Пустой кадр с текущим номером: "изменений не было"
+static inline uint8_t route_delta_tx_keepalive(const RouteDeltaTx* tx, RouteDeltaPayload* out) {
+    memset(out, 0, ROUTE_DELTA_HEADER_SIZE);
+    out->seq = tx->seq;
+    return ROUTE_DELTA_HEADER_SIZE;
+}
+
+// ============================================================================
+// ПОЛУЧАТЕЛЬ (координатор, соседние репитеры)
+// ============================================================================
+
+typedef struct {
+    uint8_t  mac[6];
+    uint8_t  valid;
+    uint8_t  synced;            // Видели снимок и с тех пор без пропусков
+    uint16_t last_seq;
+    uint32_t last_heard_ms;
+    uint32_t last_resync_ms;    // Когда последний раз просили снимок
+    uint32_t known[ROUTE_DELTA_SLOTS / 32];     // Для каких номеров знаем MAC
+    uint8_t  slot_mac[ROUTE_DELTA_SLOTS][6];
+} RouteDeltaPeer;
+
+typedef struct {
+    RouteDeltaPeer* peers;
+    uint8_t         capacity;
+
+    // Статистика
+    uint32_t applied;           // Кадров применено
+    uint32_t snapshots;         // Из них снимков
+    uint32_t gaps;              // Замечен пропуск номера
+    uint32_t resync_requests;   // Попросили снимок
+    uint32_t duplicates;        // Старый или повторный номер
+    uint32_t malformed;
+} RouteDeltaRx;
+
+typedef enum {
+    ROUTE_DELTA_APPLIED = 0,
+    ROUTE_DELTA_IGNORED,        // Повтор, ждём снимок
+    ROUTE_DELTA_NEED_RESYNC,    // Попросите у отправителя снимок
+    ROUTE_DELTA_RESYNC_ASKED,   // Это просьба о снимке к нам
+    ROUTE_DELTA_ALIVE           // keepalive сошёлся: объявленное отправителем в силе
+} RouteDeltaResult;
+
+// Операция над маршрутом через отправителя (для REMOVE metric = 0)
+typedef void (*RouteDeltaHandler)(uint8_t op, const uint8_t* mac, uint8_t metric, void* ctx);
+
+static inline void route_delta_rx_init(RouteDeltaRx* rx, RouteDeltaPeer* storage, uint8_t capacity) {
+    memset(rx, 0, sizeof(*rx));
+    memset(storage, 0, capacity * sizeof(RouteDeltaPeer));
+    rx->peers = storage;
+    rx->capacity = capacity;
+}
+
+// Найти или завести соседа (вытесняя давно не слышанного)
+static inline RouteDeltaPeer* route_delta_rx_peer(RouteDeltaRx* rx, const uint8_t* mac, uint32_t now_ms) {
+    RouteDeltaPeer* victim = &rx->peers[0];
+    for (uint8_t i = 0; i < rx->capacity; i++) {
+        RouteDeltaPeer* peer = &rx->peers[i];
+        if (peer->valid && memcmp(peer->mac, mac, 6) == 0) {
+            return peer;
+        }
+        if (victim->valid && (!peer->valid ||
+            now_ms - peer->last_heard_ms > now_ms - victim->last_heard_ms)) {
+            victim = peer;
+        }
+    }
+
+    memset(victim, 0, sizeof(*victim));
+    memcpy(victim->mac, mac, 6);
+    victim->valid = 1;
+    victim->last_heard_ms = now_ms;
+    return victim;
+}
+
+// Сосед, чьи объявления отслеживаем; NULL — такого нет
+static inline const RouteDeltaPeer* route_delta_rx_find(const RouteDeltaRx* rx, const uint8_t* mac) {
+    for (uint8_t i = 0; i < rx->capacity; i++) {
+        const RouteDeltaPeer* peer = &rx->peers[i];
+        if (peer->valid && memcmp(peer->mac, mac, 6) == 0) {
+            return peer;
+        }
+    }
+    return NULL;
+}
+
+// Номер slot объявлен соседом и ещё не снят
+static inline bool route_delta_rx_known(const RouteDeltaPeer* peer, uint8_t slot) {
+    return (peer->known[slot >> 5] >> (slot & 31)) & 1u;
+}
+
+// Рассинхронизация: снимок просим не чаще ROUTE_DELTA_RESYNC_MS
+static inline RouteDeltaResult route_delta_rx_lost(RouteDeltaRx* rx, RouteDeltaPeer* peer, uint32_t now_ms) {
+    if (peer->synced) {
+        rx->gaps++;
+    }
+    peer->synced = 0;
+    if (peer->last_resync_ms != 0 && now_ms - peer->last_resync_ms < ROUTE_DELTA_RESYNC_MS) {
+        return ROUTE_DELTA_IGNORED;
+    }
+    peer->last_resync_ms = now_ms ? now_ms : 1;
+    rx->resync_requests++;
+    return ROUTE_DELTA_NEED_RESYNC;
+}
+
+// Разобрать кадр соседа sender и применить его операции
+static inline RouteDeltaResult route_delta_rx_apply(RouteDeltaRx* rx, const uint8_t* sender,
+                                                    const uint8_t* payload, uint8_t len, uint32_t now_ms,
+                                                    RouteDeltaHandler handler, void* ctx) {
+    if (len < ROUTE_DELTA_HEADER_SIZE) {
+        rx->malformed++;
+        return ROUTE_DELTA_IGNORED;
+    }
+    RouteDeltaPayload header;
+    memcpy(&header, payload, ROUTE_DELTA_HEADER_SIZE);
+    if (header.flags & ROUTE_DELTA_RESYNC) {
+        return ROUTE_DELTA_RESYNC_ASKED;
+    }
+
+    RouteDeltaPeer* peer = route_delta_rx_peer(rx, sender, now_ms);
+    peer->last_heard_ms = now_ms;
+
+    if (header.flags & ROUTE_DELTA_FULL) {
+        // Прежние номера отправителя недействительны; маршруты через
+        // него, не попавшие в снимок, устареют сами
+        memset(peer->known, 0, sizeof(peer->known));
+        peer->synced = 1;
+        rx->snapshots++;
+    } else if (!peer->synced) {
+        return route_delta_rx_lost(rx, peer, now_ms);
+    } else if (header.count == 0) {
+        // keepalive: номер должен совпасть с последним принятым
+        return header.seq == peer->last_seq ? ROUTE_DELTA_ALIVE : route_delta_rx_lost(rx, peer, now_ms);
+    } else if ((int16_t)(header.seq - peer->last_seq) <= 0) {
+        rx->duplicates++;
+        return ROUTE_DELTA_IGNORED;
+    } else if (header.seq != (uint16_t)(peer->last_seq + 1)) {
+        return route_delta_rx_lost(rx, peer, now_ms);
+    }
+    peer->last_seq = header.seq;
+
+    const uint8_t* ops = payload + ROUTE_DELTA_HEADER_SIZE;
+    size_t ops_len = len - ROUTE_DELTA_HEADER_SIZE;
+    size_t pos = 0;
+    for (uint8_t n = 0; n < header.count; n++) {
+        uint32_t code;
+        if (!route_delta_get_varint(ops, ops_len, &pos, &code) || (code >> 2) >= ROUTE_DELTA_SLOTS) {
+            rx->malformed++;
+            return route_delta_rx_lost(rx, peer, now_ms);
+        }
+        uint8_t slot = (uint8_t)(code >> 2);
+        uint8_t op = (uint8_t)(code & 3);
+        uint32_t* word = &peer->known[slot >> 5];
+        uint32_t bit = 1u << (slot & 31);
+
+        if (op == ROUTE_DELTA_OP_ADD) {
+            if (pos + 7 > ops_len) {
+                rx->malformed++;
+                return route_delta_rx_lost(rx, peer, now_ms);
+            }
+            memcpy(peer->slot_mac[slot], &ops[pos], 6);
+            *word |= bit;
+            handler(op, peer->slot_mac[slot], ops[pos + 6], ctx);
+            pos += 7;
+        } else if (op == ROUTE_DELTA_OP_REMOVE || op == ROUTE_DELTA_OP_METRIC) {
+            uint8_t metric = 0;
+            if (op == ROUTE_DELTA_OP_METRIC) {
+                if (pos + 1 > ops_len) {
+                    rx->malformed++;
+                    return route_delta_rx_lost(rx, peer, now_ms);
+                }
+                metric = ops[pos++];
+            }
+            if (!(*word & bit)) {
+                // Номер, чей ADD мы не видели
+                return route_delta_rx_lost(rx, peer, now_ms);
+            }
+            handler(op, peer->slot_mac[slot], metric, ctx);
+            if (op == ROUTE_DELTA_OP_REMOVE) {
+                *word &= ~bit;
+            }
+        } else {
+            rx->malformed++;
+            return route_delta_rx_lost(rx, peer, now_ms);
+        }
+    }
+
+    rx->applied++;
+    return ROUTE_DELTA_APPLIED;
+}
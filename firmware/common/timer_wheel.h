@@ -0,0 +1,170 @@
+// timer_wheel.h - Периодические задачи: колесо таймеров, разброс и адаптивный период
+//
+// После отключения питания все узлы стартуют вместе и с фиксированными
+// периодами так и шумят в эфир хором. Здесь:
+//   - колесо таймеров: слоты по tick_ms, дальние сроки — кругами;
+//     постановка и срабатывание без обхода всех таймеров;
+//   - timer_jitter: срок ± процент случайно, узлы расходятся;
+//   - AdaptiveInterval (как Trickle, RFC 6206): в спокойной сети период
+//     удваивается до max, при изменениях сбрасывается к min;
+//   - discovery_slot_delay: ответ на discovery в своём слоте окна по
+//     хешу MAC — не все разом.
+// Таймеры — внешний массив, id — индекс в нём. Callback может снова
+// поставить свой таймер. Синхронизацию обеспечивает вызывающий.
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define TIMER_WHEEL_SLOTS  64       // Степень двойки
+#define TIMER_NONE         0xFF
+
+typedef void (*TimerCallback)(void* ctx, uint32_t now_ms);
+
+typedef struct {
+    TimerCallback callback;
+    void*    ctx;
+    uint32_t due_tick;          // Тик срабатывания (слот проходим раз в оборот)
+    uint8_t  slot;
+    uint8_t  next;              // Следующий таймер того же слота
+    uint8_t  active;
+} WheelTimer;
+
+typedef struct {
+    WheelTimer* timers;
+    uint8_t     capacity;
+    uint8_t     heads[TIMER_WHEEL_SLOTS];
+    uint32_t    tick_ms;
+    uint32_t    tick;           // Последний обработанный тик
+    uint32_t    fired;
+} TimerWheel;
+
+static inline void timer_wheel_init(TimerWheel* wheel, WheelTimer* storage, uint8_t capacity,
+                                    uint32_t tick_ms, uint32_t now_ms) {
+    memset(storage, 0, capacity * sizeof(WheelTimer));
+    memset(wheel->heads, TIMER_NONE, sizeof(wheel->heads));
+    wheel->timers = storage;
+    wheel->capacity = capacity;
+    wheel->tick_ms = tick_ms;
+    wheel->tick = now_ms / tick_ms;
+    wheel->fired = 0;
+}
+
+static inline void timer_wheel_cancel(TimerWheel* wheel, uint8_t id) {
+    WheelTimer* timer = &wheel->timers[id];
+    if (!timer->active) {
+        return;
+    }
+
+    uint8_t* link = &wheel->heads[timer->slot];
+    while (*link != id) {
+        link = &wheel->timers[*link].next;
+    }
+    *link = timer->next;
+    timer->active = 0;
+}
+
+// Сработать через delay_ms (не раньше следующего тика); прежний срок отменяется
+static inline void timer_wheel_schedule(TimerWheel* wheel, uint8_t id, uint32_t delay_ms,
+                                        TimerCallback callback, void* ctx) {
+    timer_wheel_cancel(wheel, id);
+
+    uint32_t ticks = (delay_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+    if (ticks == 0) {
+        ticks = 1;
+    }
+    WheelTimer* timer = &wheel->timers[id];
+    timer->callback = callback;
+    timer->ctx = ctx;
+    timer->due_tick = wheel->tick + ticks;
+    timer->slot = (uint8_t)(timer->due_tick & (TIMER_WHEEL_SLOTS - 1));
+    timer->next = wheel->heads[timer->slot];
+    timer->active = 1;
+    wheel->heads[timer->slot] = id;
+}
+
+static inline bool timer_wheel_active(const TimerWheel* wheel, uint8_t id) {
+    return wheel->timers[id].active != 0;
+}
+
+// Провернуть колесо до now_ms, вызывая наступившие таймеры.
+// Долгая пауза нагоняется тик за тиком: срабатывания не теряются.
+static inline void timer_wheel_poll(TimerWheel* wheel, uint32_t now_ms) {
+    uint32_t target = now_ms / wheel->tick_ms;
+    while ((int32_t)(target - wheel->tick) > 0) {
+        wheel->tick++;
+        uint8_t* link = &wheel->heads[wheel->tick & (TIMER_WHEEL_SLOTS - 1)];
+        while (*link != TIMER_NONE) {
+            uint8_t id = *link;
+            WheelTimer* timer = &wheel->timers[id];
+            if ((int32_t)(wheel->tick - timer->due_tick) < 0) {
+                link = &timer->next;
+                continue;
+            }
+
+            // Сначала снять: callback может поставить таймер заново
+            *link = timer->next;
+            timer->active = 0;
+            wheel->fired++;
+            timer->callback(timer->ctx, now_ms);
+        }
+    }
+}
+
+// ============================================================================
+// РАЗБРОС И АДАПТИВНЫЙ ПЕРИОД
+// ============================================================================
+
+// base_ms ± jitter_pct процентов; random — любое 32-битное случайное
+static inline uint32_t timer_jitter(uint32_t base_ms, uint8_t jitter_pct, uint32_t random) {
+    uint32_t spread = base_ms / 100 * jitter_pct;
+    if (spread == 0) {
+        return base_ms;
+    }
+    return base_ms - spread + random % (2 * spread + 1);
+}
+
+typedef struct {
+    uint32_t min_ms;
+    uint32_t max_ms;
+    uint32_t current_ms;
+    uint32_t resets;            // Сколько раз сбрасывали из-за изменений
+} AdaptiveInterval;
+
+static inline void adaptive_interval_init(AdaptiveInterval* interval, uint32_t min_ms, uint32_t max_ms) {
+    interval->min_ms = min_ms;
+    interval->max_ms = max_ms;
+    interval->current_ms = min_ms;
+    interval->resets = 0;
+}
+
+// Период прошёл; changed — в сети что-то менялось. Возвращает следующий.
+static inline uint32_t adaptive_interval_next(AdaptiveInterval* interval, bool changed) {
+    if (changed) {
+        if (interval->current_ms != interval->min_ms) {
+            interval->resets++;
+        }
+        interval->current_ms = interval->min_ms;
+    } else if (interval->current_ms < interval->max_ms / 2) {
+        interval->current_ms *= 2;
+    } else {
+        interval->current_ms = interval->max_ms;
+    }
+    return interval->current_ms;
+}
+
+// Задержка ответа на discovery: слот окна window_ms по хешу MAC (FNV-1a)
+// и случайный сдвиг внутри слота
+static inline uint32_t discovery_slot_delay(const uint8_t* mac, uint32_t window_ms,
+                                            uint32_t slot_ms, uint32_t random) {
+    uint32_t slots = slot_ms ? window_ms / slot_ms : 0;
+    if (slots == 0) {
+        return 0;
+    }
+
+    uint32_t hash = 2166136261u;
+    for (uint8_t i = 0; i < 6; i++) {
+        hash = (hash ^ mac[i]) * 16777619u;
+    }
+    return (hash % slots) * slot_ms + random % slot_ms;
+}
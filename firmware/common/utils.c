@@ -2,21 +2,109 @@
 #include "utils.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
+
+#ifdef ESP_PLATFORM
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/ringbuf.h>
+#endif
+
+// Логгирование: строка форматируется на стеке отправителя и либо
+// сразу уходит в writer, либо кладётся в кольцо для задачи вывода
+#define LOG_LINE_MAX 160
+#define LOG_TASK_STACK 2048
+
+static LogWriter log_writer = NULL;
+static volatile uint32_t log_dropped_lines = 0;
+
+#ifdef ESP_PLATFORM
+static RingbufHandle_t log_ring = NULL;
+// Строк положено в кольцо и уже выведено: log_flush ждёт, пока второй
+// догонит первый (пустое кольцо ещё не значит, что строка дописана)
+static volatile uint32_t log_queued_lines = 0;
+static volatile uint32_t log_written_lines = 0;
+
+static void log_task(void* arg) {
+    (void)arg;
+    
+    for (;;) {
+        size_t len;
+        char* line = (char*)xRingbufferReceive(log_ring, &len, portMAX_DELAY);
+        if (line) {
+            log_writer(line, len);
+            vRingbufferReturnItem(log_ring, line);
+            __atomic_fetch_add(&log_written_lines, 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+#endif
+
+void log_init(LogWriter writer, size_t async_buffer) {
+    log_writer = writer;
+    
+#ifdef ESP_PLATFORM
+    if (async_buffer > 0 && !log_ring) {
+        log_ring = xRingbufferCreate(async_buffer, RINGBUF_TYPE_NOSPLIT);
+        if (log_ring) {
+            xTaskCreate(log_task, "log_uart", LOG_TASK_STACK, NULL, tskIDLE_PRIORITY + 1, NULL);
+        }
+    }
+#else
+    (void)async_buffer;
+#endif
+}
 
-// Простая реализация логгирования
 void log_message(LogLevel level, const char* format, ...) {
-    const char* level_str;
-    switch(level) {
-        case LOG_ERROR: level_str = "ERROR"; break;
-        case LOG_WARN:  level_str = "WARN";  break;
-        case LOG_INFO:  level_str = "INFO";  break;
-        case LOG_DEBUG: level_str = "DEBUG"; break;
-        default:        level_str = "UNKNOWN"; break;
+    static const char* const LEVEL_TAGS[] = { "E", "W", "I", "D" };
+    if (!log_writer) {
+        return;
     }
     
-    // Для примера просто игнорируем вывод
-    (void)level_str;
-    (void)format;
+    char line[LOG_LINE_MAX];
+    int len = snprintf(line, sizeof(line), "[%s] ", level <= LOG_DEBUG ? LEVEL_TAGS[level] : "?");
+    
+    va_list args;
+    va_start(args, format);
+    len += vsnprintf(line + len, sizeof(line) - len, format, args);
+    va_end(args);
+    
+    // Длинная строка обрезается, перевод строки остаётся
+    if (len > (int)sizeof(line) - 2) {
+        len = sizeof(line) - 2;
+    }
+    line[len++] = '\n';
+    line[len] = '\0';
+    
+#ifdef ESP_PLATFORM
+    if (log_ring) {
+        if (xRingbufferSend(log_ring, line, len, 0) != pdTRUE) {
+            log_dropped_lines++;
+        } else {
+            __atomic_fetch_add(&log_queued_lines, 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+#endif
+    log_writer(line, len);
+}
+
+void log_flush(void) {
+#ifdef ESP_PLATFORM
+    if (!log_ring) {
+        return;
+    }
+    
+    // Ждём, пока задача вывода допишет всё, что положено до нас
+    uint32_t queued = __atomic_load_n(&log_queued_lines, __ATOMIC_RELAXED);
+    while ((int32_t)(__atomic_load_n(&log_written_lines, __ATOMIC_ACQUIRE) - queued) < 0) {
+        vTaskDelay(1);
+    }
+#endif
+}
+
+uint32_t log_dropped(void) {
+    return log_dropped_lines;
 }
 
 // Конвертация байта в бинарную строку
@@ -82,6 +170,22 @@ uint16_t calculate_checksum(const void* data, size_t len) {
     return sum;
 }
 
+// Обнуление буфера: запись через volatile не выбрасывается оптимизатором
+void memzero(void* data, size_t len) {
+    volatile uint8_t* p = (volatile uint8_t*)data;
+    while (len--) {
+        *p++ = 0;
+    }
+}
+
+// Запись 32-битного числа в big-endian
+void write_be32(uint8_t* out, uint32_t value) {
+    out[0] = (uint8_t)(value >> 24);
+    out[1] = (uint8_t)(value >> 16);
+    out[2] = (uint8_t)(value >> 8);
+    out[3] = (uint8_t)(value >> 0);
+}
+
 // Задержка (заглушка для портирования)
 void delay_ms(uint32_t ms) {
     // Реализация зависит от платформы
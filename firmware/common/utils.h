@@ -6,6 +6,10 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 // Уровни логгирования
 typedef enum {
     LOG_ERROR = 0,
@@ -14,9 +18,22 @@ typedef enum {
     LOG_DEBUG = 3
 } LogLevel;
 
-// Логгирование
+// Куда уходят готовые строки лога (обычно Serial.write)
+typedef void (*LogWriter)(const char* data, size_t len);
+
+// Логгирование (макросы LOG_* и уровень при сборке — в log.h)
 void log_message(LogLevel level, const char* format, ...);
 
+// Вывод лога: async_buffer > 0 — через кольцо такого размера
+// и фоновую задачу, 0 — синхронно
+void log_init(LogWriter writer, size_t async_buffer);
+
+// Дождаться, пока отложенный вывод уйдёт (перед сном и перезагрузкой)
+void log_flush(void);
+
+// Строк потеряно из-за полного кольца
+uint32_t log_dropped(void);
+
 // Конвертация байта в бинарную строку
 char* byte_to_binary(uint8_t value, char* buf);
 
@@ -35,6 +52,12 @@ bool compare_mac(const uint8_t* mac1, const uint8_t* mac2);
 // Генерация контрольной суммы
 uint16_t calculate_checksum(const void* data, size_t len);
 
+// Обнуление буфера (не выбрасывается оптимизатором)
+void memzero(void* data, size_t len);
+
+// Запись 32-битного числа в big-endian
+void write_be32(uint8_t* out, uint32_t value);
+
 // Задержка в миллисекундах
 void delay_ms(uint32_t ms);
 
@@ -59,4 +82,8 @@ bool is_time_elapsed(uint32_t start_time, uint32_t timeout_ms);
 #define CHECK_PTR(ptr) ((ptr) != NULL)
 #endif
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif // UTILS_H
@@ -15,6 +15,7 @@
 #include <Arduino.h>
 #include <WiFi.h>
 #include <esp_now.h>
+#include <esp_wifi.h>
 #include <ESPAsyncWebServer.h>
 #include <AsyncTCP.h>
 #include <ArduinoJson.h>
@@ -24,7 +25,27 @@
 
 // Наши модули
 #include "../../common/mesh_protocol.h"
+#include "../../common/packet_ring.h"
+#include "../../common/packet_scheduler.h"
+#include "../../common/latency_histogram.h"
+#include "../../common/packet_metrics.h"
+#include "../../common/mac_index.h"
+#include "../../common/dedup_cache.h"
+#include "../../common/reliable_delivery.h"
+#include "../../common/live_delta.h"
+#include "../../common/event_log.h"
+#include "../../common/reflex_rules.h"
+#include "../../common/group_index.h"
+#include "../../common/link_quality.h"
+#include "../../common/route_delta.h"
+#include "../../common/timer_wheel.h"
+#include "../../common/utils.h"
+#include "../../common/log.h"
+#include "web_ui_gz.h"  // Генерирует tools/build_web_ui.py при сборке
 #include "../../common/crypto/chacha20_poly1305.h"
+#include "../../common/crypto/peer_key_cache.h"
+#include "../../common/crypto/mesh_crypto_backend.h"
+#include "../../common/crypto/mesh_packet_crypto.h"
 
 // ============================================================================
 // КОНФИГУРАЦИЯ
@@ -43,11 +64,103 @@ const char* WIFI_PASSWORD = "YOUR_PASS";  // Замени на свой паро
 
 // Параметры сети
 #define MESH_CHANNEL 1           // WiFi канал для ESP-NOW (1-13 в РФ)
-#define HEARTBEAT_INTERVAL 60000 // Интервал heartbeat (60 секунд)
-#define MAX_ROUTING_ENTRIES 100  // Максимум устройств в сети
+#define HEARTBEAT_MIN_MS 15000   // Период heartbeat, пока сеть меняется
+#define HEARTBEAT_MAX_MS 240000  // До него период растёт в спокойной сети
+#define HEARTBEAT_JITTER_PCT 10  // Разброс сроков периодических задач, ± процентов
+#ifndef MAX_ROUTING_ENTRIES
+#define MAX_ROUTING_ENTRIES 100  // Максимум устройств в сети (можно задать в platformio.ini, до 253)
+#endif
 #define WEB_SERVER_PORT 80       // Порт веб-сервера
 #define OTA_ENABLED true         // Включить обновление по воздуху
 
+// Очереди приёма: callback ESP-NOW только копирует пакет в очередь
+// своего приоритета, обработка идёт в отдельной задаче.
+// Размеры — степени двойки.
+#define RX_QUEUE_EMERGENCY 8     // Аварии: редкие, но терять нельзя
+#define RX_QUEUE_IMMEDIATE 16    // Heartbeat, ACK, локальные группы
+#define RX_QUEUE_NORMAL 16       // Команды, маршруты
+#define RX_QUEUE_BULK 32         // Телеметрия и discovery (всплески)
+#define PACKET_TASK_STACK 6144   // Стек задачи обработки пакетов
+#define PACKET_TASK_PRIORITY 5   // Выше loop(), ниже задачи WiFi
+#define PACKET_TASK_CORE 1       // WiFi живёт на ядре 0
+#define GROUP_QUEUE_DEPTH 4      // Групповых команд из веба, ждущих packet_task
+
+// Качество связи с соседями (RSSI и ETX для выбора родителя)
+#define LINK_TABLE_SIZE 20       // Соседей с измерениями (по числу peer'ов ESP-NOW)
+#define LINK_STALE_MS 90000      // Соседа не слышно столько — путь через него не держим
+#define ROUTE_DELTA_PEERS 16     // Репитеров-соседей, чьи объявления отслеживаем
+
+// Очередь отправки: send_packet только ставит кадр в очередь, tx_task
+// держит в полёте не больше TX_IN_FLIGHT кадров и отдаёт следующий по
+// callback'у завершения ESP-NOW
+#define TX_QUEUE_DEPTH 32        // Кадров в очереди (всплеск групповой команды, discovery)
+#define TX_URGENT_DEPTH 8        // Аварийных кадров: своя очередь, уходят первыми
+#ifndef TX_IN_FLIGHT
+#define TX_IN_FLIGHT 4           // Отдано ESP-NOW без завершения (можно задать в platformio.ini)
+#endif
+#define TX_RETRY_MAX 3           // Повторов esp_now_send при нехватке буферов
+#define TX_RETRY_DELAY_MS 2      // Пауза перед повтором
+#define TX_COMPLETION_TIMEOUT_MS 100  // Ждём завершения дольше — считаем задержку
+#define TX_TASK_STACK 3072       // Стек задачи отправки
+#define TX_TASK_PRIORITY 6       // Выше packet_task: очередь не копится
+
+// Подавление дублей: через несколько репитеров один пакет
+// приходит несколько раз
+#define DEDUP_ENTRIES 512        // Записей в кэше дублей (степень двойки)
+#ifndef DEDUP_WINDOW_MS
+#define DEDUP_WINDOW_MS 10000    // Сколько помним (src_mac, packet_id)
+#endif
+
+// Доставка с подтверждением (команды устройствам)
+#define RELIABLE_SLOTS 8         // Пакетов в полёте одновременно
+
+// Групповые команды: состав групп для раздачи MSG_CMD_GROUP
+#define GROUP_SLOTS 32           // Групп с известным составом
+
+// Рефлексы репитеров: JSON с правилами для /api/rules
+#define REFLEX_JSON_SIZE 3072
+
+// Замер задержки до устройства (MSG_PROBE)
+#define PROBE_TIMEOUT_MS 2000    // Нет ответа — замер не удался
+
+// Кэш развёрнутых ключей устройств (шифрование без переразвёртки на пакет)
+#ifndef PEER_KEY_CACHE_SIZE
+#define PEER_KEY_CACHE_SIZE 16   // Активных устройств с готовым ключом
+#endif
+#define CRYPTO_BENCH_ITERATIONS 200  // Повторов на размер в команде bench
+
+// Сохранение таблицы маршрутизации в NVS (фоновая задача)
+#define ROUTING_PAGE_ENTRIES 16          // Записей в одном ключе NVS ("rn0", "rn1", ...)
+#define LEGACY_ROUTING_PAGE_ENTRIES 8    // Записей в странице прежнего формата ("rt0", ...)
+#define ROUTING_SAVE_INTERVAL_MS 30000   // Как часто грязные страницы уходят во flash
+#define PERSIST_TASK_STACK 4096          // Стек задачи сохранения
+#define PERSIST_TASK_PRIORITY 1          // Ниже задачи приёма пакетов
+
+// Журнал событий: кольцо в RAM + циклический файл в SPIFFS
+#define EVENT_LOG_RAM_RECORDS 256        // Записей в RAM (степень двойки, по 16 байт)
+#define EVENT_LOG_FILE_RECORDS 2048      // Записей в файле (32 КБ flash)
+#define EVENT_LOG_FLUSH_MS 10000         // Как часто новое уходит в файл
+#define EVENT_LOG_FLUSH_BATCH 32         // Записей за одну запись во flash
+#define EVENT_LOG_API_DEFAULT 200        // Сколько последних событий отдаёт /api/logs
+#define EVENT_FILE_LOCK_MS 20            // Сколько /api/logs ждёт файл журнала (задача async_tcp)
+#define EVENT_LOG_FILE_PATH "/logs/events.bin"
+
+// Текстовый лог в UART (уровень — LOG_LEVEL в platformio.ini)
+#define LOG_ASYNC_BUFFER 4096            // Кольцо отложенного вывода, байт
+
+// Живые обновления веб-интерфейса (SSE /api/events)
+#define LIVE_TICK_MS 1000        // Как часто рассылаются накопленные изменения
+
+// Периодические задачи loop() — на колесе таймеров (timer_wheel.h)
+#define TIMER_TICK_MS 50         // Шаг колеса
+#define CLEANUP_INTERVAL_MS 60000  // Удаление давно не слышанных устройств
+#define STAT_INTERVAL_MS 10000   // Обновление статистики памяти
+#define DISCOVERY_WINDOW_MIN_MS 2000   // Окно ответов на discovery...
+#define DISCOVERY_WINDOW_PER_DEVICE_MS 20  // ...плюс столько на известное устройство
+#define DISCOVERY_WINDOW_MAX_MS 30000
+#define LIVE_EVENTS_MAX 8        // Аварий за один тик
+#define LIVE_MESSAGE_SIZE 1024   // Максимум одного сообщения SSE
+
 // ============================================================================
 // ГЛОБАЛЬНЫЕ ПЕРЕМЕННЫЕ
 // ============================================================================
@@ -69,6 +182,23 @@ uint8_t self_mac[6];
  */
 AsyncWebServer web_server(WEB_SERVER_PORT);
 
+/**
+ * Живые обновления для браузеров
+ * 
+ * Изменения копятся в одном из двух буферов (пишут packet_task и
+ * loop), раз в LIVE_TICK_MS loop() меняет буферы местами под live_mux
+ * и рассылает накопленное одним сообщением всем подключённым.
+ * Работа координатора растёт с числом изменений, а не с числом
+ * открытых вкладок.
+ */
+AsyncEventSource live_events("/api/events");
+static LiveDeviceDelta live_device_storage[2][MAX_ROUTING_ENTRIES];
+static LiveEvent live_event_storage[2][LIVE_EVENTS_MAX];
+LiveDeltaBuffer live_buffers[2];
+LiveDeltaBuffer* live_pending = &live_buffers[0];
+portMUX_TYPE live_mux = portMUX_INITIALIZER_UNLOCKED;
+uint32_t live_message_id = 0;
+
 /**
  * Постоянное хранилище
  * 
@@ -77,6 +207,21 @@ AsyncWebServer web_server(WEB_SERVER_PORT);
  */
 Preferences preferences;
 
+/**
+ * Журнал событий
+ * 
+ * log_event только кладёт запись в кольцо (под event_log_mux — пишут
+ * все задачи), persist_task раз в EVENT_LOG_FLUSH_MS пачками дописывает
+ * новое в циклический файл. Файл и event_file_header — под
+ * event_file_mutex: пишет persist_task, читает /api/logs.
+ */
+static EventRecord event_log_storage[EVENT_LOG_RAM_RECORDS];
+EventLog event_log;
+portMUX_TYPE event_log_mux = portMUX_INITIALIZER_UNLOCKED;
+SemaphoreHandle_t event_file_mutex = nullptr;
+EventLogFileHeader event_file_header;
+bool event_file_ready = false;
+
 /**
  * Состояние сети
  * 
@@ -89,10 +234,170 @@ struct NetworkState {
     uint32_t packets_received = 0;    // Сколько пакетов получили
     uint32_t packets_sent = 0;        // Сколько пакетов отправили
     uint32_t last_heartbeat = 0;      // Когда последний heartbeat
+    uint32_t topology_changes = 0;    // Устройства появлялись, пропадали, меняли родителя
+    uint32_t discovery_replies = 0;   // Ответов на discovery
     uint32_t startup_time;            // Когда система запустилась
     uint32_t free_heap_min = UINT32_MAX; // Минимальная свободная память
+    
+    // Статистика очередей приёма по классам приоритета
+    uint32_t rx_queue_high_water[PRIO_CLASS_COUNT] = {}; // Максимальная заполненность
+    uint32_t rx_queue_overflows[PRIO_CLASS_COUNT] = {};  // Потеряно из-за полной очереди
+    uint32_t deadline_misses[PRIO_CLASS_COUNT] = {};     // Обработано позже дедлайна
+    LatencyHistogram dispatch_latency[PRIO_CLASS_COUNT]; // Приём → начало обработки, мкс
+    
+    // Шифрование payload (FLAG_ENCRYPTED)
+    uint32_t packets_encrypted = 0;   // Зашифровано перед отправкой
+    uint32_t packets_decrypted = 0;   // Принято и расшифровано
+    uint32_t decrypt_failures = 0;    // Тег не сошёлся — пакет отброшен
+    
+    // Сохранение таблицы маршрутизации
+    uint32_t nvs_flushes = 0;         // Проходов, записавших хоть что-то
+    uint32_t nvs_page_writes = 0;     // Записано страниц таблицы
+    
+    // Раздача групповых команд
+    uint32_t group_floods = 0;        // Общей рассылкой
+    uint32_t group_subtree_fanouts = 0; // Через поддеревья
+    uint32_t group_frames = 0;        // Кадров на это ушло (по плану)
+    
+    // Выбор маршрута
+    uint32_t parent_switches = 0;     // Родитель сменён на более дешёвый путь
+    
+    // Очередь отправки
+    uint32_t tx_queue_high_water = 0; // Максимальная заполненность
+    uint32_t tx_queue_full = 0;       // Кадр не влез в очередь — потерян
+    uint32_t tx_retries = 0;          // Повторов esp_now_send (нет буферов)
+    uint32_t tx_failed = 0;           // esp_now_send так и не принял кадр
+    uint32_t tx_completion_stalls = 0; // Ждали места в полёте дольше таймаута
+    LatencyHistogram tx_queue_latency; // Постановка в очередь → esp_now_send, мкс
 } network_state;
 
+/**
+ * Задержки горячего пути и отброшенные пакеты
+ * 
+ * Стадии queue и handler пишет packet_task, send — callback отправки
+ * (задача WiFi). Время между задачами — по micros(): счётчик тактов
+ * у каждого ядра свой. Обработка целиком идёт в packet_task на одном
+ * ядре — её меряем тактами CPU. Отправки в полёте — под send_track_mux:
+ * ставят несколько задач.
+ */
+PacketMetrics packet_metrics;
+SendTracker send_tracker;
+portMUX_TYPE send_track_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * Замер задержки до устройства
+ * 
+ * Один замер за раз: запускают веб-API и консоль, ответ разбирает
+ * packet_task, таймаут отмечает loop() — всё под probe_mux.
+ * Результат хранится до следующего замера.
+ */
+enum ProbeStatus : uint8_t {
+    PROBE_IDLE = 0,
+    PROBE_PENDING,
+    PROBE_DONE,
+    PROBE_TIMEOUT
+};
+
+struct ProbeState {
+    uint8_t  target[6];
+    uint32_t probe_id;
+    uint32_t sent_us;
+    uint32_t sent_ms;
+    uint32_t rtt_us;
+    ProbeStatus status;
+    uint8_t  hop_count;
+    ProbeHop hops[PROBE_MAX_HOPS];
+} probe_state;
+static const char* const PROBE_STATUS_NAMES[] = { "idle", "pending", "done", "timeout" };
+portMUX_TYPE probe_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * Очереди входящих пакетов
+ * 
+ * По одному кольцу на класс приоритета (см. packet_scheduler.h).
+ * Пишет callback ESP-NOW (задача WiFi), читает packet_task.
+ * Память выделена статически — в callback'е нет malloc.
+ */
+static PacketSlot rx_storage_emergency[RX_QUEUE_EMERGENCY];
+static PacketSlot rx_storage_immediate[RX_QUEUE_IMMEDIATE];
+static PacketSlot rx_storage_normal[RX_QUEUE_NORMAL];
+static PacketSlot rx_storage_bulk[RX_QUEUE_BULK];
+PacketScheduler rx_scheduler;
+TaskHandle_t packet_task_handle = nullptr;
+
+/**
+ * Очередь отправки
+ * 
+ * Кладут все, кто шлёт (packet_task, loop, веб-обработчики), забирает
+ * tx_task. Кадр копируется целиком — буфер отправителя свободен сразу.
+ * Аварийные кадры — в tx_urgent_queue: tx_task выбирает её первой,
+ * внутри каждой очереди порядок сохраняется. Уведомление tx_task —
+ * счётчик кадров в обеих очередях.
+ * tx_credits — свободные места в полёте: берёт tx_task перед
+ * esp_now_send, возвращает on_espnow_send.
+ */
+struct TxFrame {
+    uint8_t  dst_mac[6];
+    uint8_t  len;
+    uint8_t  msg_type;                // Для метрик стадии send
+    uint32_t queued_us;
+    uint8_t  data[ESP_NOW_MAX_DATA_LEN];
+};
+static uint8_t tx_queue_storage[TX_QUEUE_DEPTH * sizeof(TxFrame)];
+static StaticQueue_t tx_queue_buffer;
+QueueHandle_t tx_queue = nullptr;
+static uint8_t tx_urgent_storage[TX_URGENT_DEPTH * sizeof(TxFrame)];
+static StaticQueue_t tx_urgent_buffer;
+QueueHandle_t tx_urgent_queue = nullptr;
+static StaticSemaphore_t tx_credits_buffer;
+SemaphoreHandle_t tx_credits = nullptr;
+
+/**
+ * Очередь групповых команд от веб-интерфейса
+ * 
+ * Раздача читает таблицу маршрутизации и group_index, которые
+ * packet_task меняет на ходу, поэтому веб-обработчик только кладёт
+ * команду, а раздаёт её packet_task между пакетами.
+ */
+static uint8_t group_queue_storage[GROUP_QUEUE_DEPTH * sizeof(GroupCommand)];
+static StaticQueue_t group_queue_buffer;
+QueueHandle_t group_queue = nullptr;
+
+/**
+ * Обслуживание таблицы маршрутизации
+ * 
+ * Таблицу (позиции, хеш-индекс, group_index, номера родителей) меняет
+ * только packet_task: swap-remove, прерванный им посреди работы,
+ * рассогласовал бы всё сразу. Таймеры loop() лишь ставят бит задания
+ * и будят packet_task, тот выполняет задания между пакетами.
+ */
+enum PacketTaskJob : uint32_t {
+    JOB_CLEANUP      = 1u << 0,   // cleanup_old_entries
+    JOB_MARK_OFFLINE = 1u << 1    // mark_offline_devices
+};
+volatile uint32_t packet_task_jobs = 0;
+TaskHandle_t tx_task_handle = nullptr;
+
+/**
+ * Кэш уже принятых пакетов
+ * 
+ * Трогает только callback приёма (задача WiFi).
+ * Дубли отбрасываются до постановки в очередь.
+ */
+static DedupEntry dedup_storage[DEDUP_ENTRIES];
+DedupCache dedup_cache;
+
+/**
+ * Пакеты, ждущие подтверждения
+ * 
+ * Ставит на доставку веб-API, ACK/NACK разбирает packet_task,
+ * таймеры повторов крутит loop() — поэтому под мьютексом.
+ */
+static ReliableSlot reliable_storage[RELIABLE_SLOTS];
+ReliableTable reliable_table;
+SemaphoreHandle_t reliable_mutex = nullptr;
+uint32_t packet_id_counter = 0;
+
 /**
  * Таблица маршрутизации
  * 
@@ -101,9 +406,128 @@ struct NetworkState {
  * - Кто чей родитель
  * - Качество связи
  * - Статус (онлайн/офлайн)
+ * 
+ * Массивами по полям, а не массивом записей. Позиция в таблице —
+ * номер узла (1 байт): MAC хранится один раз, родитель — номером.
+ * Обходы по таймеру (очистка, счёт онлайн) читают подряд только
+ * last_seen и статус, не задевая MAC. Позиции плотные (swap-remove),
+ * ссылки на переехавший узел правит remove_routing_entry_at.
+ */
+static_assert(MAX_ROUTING_ENTRIES < NODE_SELF, "MAX_ROUTING_ENTRIES too large for 1-byte node index");
+uint8_t  node_mac[MAX_ROUTING_ENTRIES][6];
+uint8_t  node_parent[MAX_ROUTING_ENTRIES];     // Номер родителя, NODE_SELF — слышим напрямую
+uint8_t  node_proto[MAX_ROUTING_ENTRIES];      // Версия протокола узла (0 — неизвестна)
+uint32_t node_last_seen[MAX_ROUTING_ENTRIES];  // Секунды с момента старта
+uint8_t  node_online[MAX_ROUTING_ENTRIES];     // 1 — онлайн, 0 — офлайн
+int8_t   node_rssi[MAX_ROUTING_ENTRIES];
+uint16_t node_battery_mv[MAX_ROUTING_ENTRIES];
+uint16_t node_awake_ms[MAX_ROUTING_ENTRIES];    // Бодрствование спящего датчика за цикл (0 — не спит)
+uint16_t routing_table_size = 0;  // Сколько записей сейчас заполнено
+
+/**
+ * Хеш-индекс таблицы маршрутизации
+ * 
+ * MAC -> номер узла. Поиск за O(1) вместо
+ * линейного memcmp по всей таблице на каждом пакете.
+ * Слотов — ближайшая степень двойки не меньше 2 * MAX_ROUTING_ENTRIES.
+ */
+constexpr uint32_t next_power_of_two(uint32_t v) {
+    return v <= 1 ? 1 : 2 * next_power_of_two((v + 1) / 2);
+}
+constexpr uint32_t ROUTING_INDEX_SLOTS = next_power_of_two(2 * MAX_ROUTING_ENTRIES);
+static_assert(ROUTING_INDEX_SLOTS <= 0x8000, "MAX_ROUTING_ENTRIES too large for 16-bit index");
+
+static MacIndexSlot routing_index_storage[ROUTING_INDEX_SLOTS];
+MacIndex routing_index;
+
+/**
+ * Качество связи с соседями
+ * 
+ * RSSI пишет promiscuous-callback WiFi, доставку — on_espnow_send
+ * (оба в задаче WiFi), читает выбор родителя в packet_task.
+ */
+static LinkStats link_storage[LINK_TABLE_SIZE];
+LinkTable link_table;
+portMUX_TYPE link_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * Объявления маршрутов от соседей-репитеров (MSG_ROUTE_DELTA)
+ * 
+ * Номер последовательности и словарь "номер → MAC" на каждого
+ * соседа. Разбирает только packet_task.
+ */
+static RouteDeltaPeer route_delta_peers[ROUTE_DELTA_PEERS];
+RouteDeltaRx route_delta_rx;
+
+/**
+ * Периодические задачи loop()
+ * 
+ * Сроки с разбросом: после общего отключения питания узлы не
+ * должны шуметь в эфир хором. Период heartbeat адаптивный — растёт,
+ * пока топология не меняется (topology_changes).
  */
-RoutingEntry routing_table[MAX_ROUTING_ENTRIES];
-uint8_t routing_table_size = 0;  // Сколько записей сейчас заполнено
+enum LoopTimer {
+    TIMER_HEARTBEAT = 0,
+    TIMER_CLEANUP,
+    TIMER_STATS,
+    TIMER_LIVE_TICK,
+    LOOP_TIMER_COUNT
+};
+static WheelTimer loop_timer_storage[LOOP_TIMER_COUNT];
+TimerWheel loop_timers;
+AdaptiveInterval heartbeat_interval;
+uint32_t heartbeat_seen_changes = 0;
+
+/**
+ * Состав групп
+ * 
+ * Группу узел сообщает в заголовке своих пакетов (group_id), членство
+ * — бит по номеру узла. route_hops — сколько прыжков до
+ * узла по TTL его последнего пакета (0 — неизвестно). Не сохраняются:
+ * после перезагрузки восстанавливаются по первому пакету узла.
+ */
+constexpr uint8_t GROUP_BITMAP_WORDS = (MAX_ROUTING_ENTRIES + 31) / 32;
+static GroupSlot group_slot_storage[GROUP_SLOTS];
+static uint32_t group_bits_storage[GROUP_SLOTS * GROUP_BITMAP_WORDS];
+GroupIndex group_index;
+uint8_t route_hops[MAX_ROUTING_ENTRIES];
+
+/**
+ * План раздачи групповой команды
+ * 
+ * Сколько кадров уйдёт при общей рассылке и при раздаче через
+ * поддеревья, и кто в поддеревьях получает что.
+ */
+struct GroupFanoutPlan {
+    uint16_t members = 0;
+    uint16_t direct = 0;              // Слышат нас напрямую
+    uint16_t subtrees = 0;            // Соседей-репитеров, раздающих своим детям
+    uint16_t deep = 0;                // Глубже детей соседа — unicast каждому
+    uint16_t subtree_frames = 0;      // Кадров при раздаче через поддеревья
+    uint16_t flood_frames = 0;        // Оценка кадров при общей рассылке
+    bool flood = false;
+    uint32_t roots[GROUP_BITMAP_WORDS] = {};     // Позиции соседей-репитеров
+    uint32_t deep_members[GROUP_BITMAP_WORDS] = {};
+};
+
+/**
+ * Отложенное сохранение таблицы маршрутизации
+ * 
+ * В NVS таблица лежит страницами по ROUTING_PAGE_ENTRIES записей
+ * RoutingRecord (MAC, номер родителя, версия протокола — 8 байт).
+ * Изменение записи помечает её страницу грязной, persist_task раз в
+ * ROUTING_SAVE_INTERVAL_MS пишет только грязные — приём пакетов
+ * flash не ждёт. Грязными страницу делают новые и удалённые записи,
+ * смена родителя и версии протокола. last_seen и rssi меняются на
+ * каждом пакете, но страницу не пачкают: после перезагрузки они всё
+ * равно устаревают, а запись по ним изнашивала бы flash.
+ */
+constexpr uint16_t ROUTING_PAGES = (MAX_ROUTING_ENTRIES + ROUTING_PAGE_ENTRIES - 1) / ROUTING_PAGE_ENTRIES;
+static uint32_t routing_dirty_pages[(ROUTING_PAGES + 31) / 32];
+static bool routing_count_dirty = false;
+static bool routing_legacy_format = false; // Таблица прочитана в прежнем формате ("rt<N>" или блоб)
+portMUX_TYPE routing_persist_mux = portMUX_INITIALIZER_UNLOCKED;
+TaskHandle_t persist_task_handle = nullptr;
 
 /**
  * Сессионный ключ
@@ -114,6 +538,27 @@ uint8_t routing_table_size = 0;  // Сколько записей сейчас 
 uint8_t session_key[32];
 uint32_t current_session_id = 0;
 
+/**
+ * Номер загрузки (boot epoch)
+ * 
+ * Растёт на каждой загрузке и входит в nonce: packet_id после
+ * перезагрузки начинается с нового случайного числа и может
+ * повторить прошлые, ключ при этом тот же. Шифруем, только если
+ * новый номер успел лечь в NVS — иначе следующая загрузка повторит его.
+ */
+uint16_t boot_epoch = 0;
+bool boot_epoch_saved = false;
+
+/**
+ * Кэш ключей устройств
+ * 
+ * Расписания ChaCha20 для последних активных устройств,
+ * выводятся из session_key. Трогать только из packet_task
+ * (и из setup до её запуска).
+ */
+static PeerKeyEntry peer_key_storage[PEER_KEY_CACHE_SIZE];
+PeerKeyCache peer_key_cache;
+
 // ============================================================================
 // ПРОТОТИПЫ ФУНКЦИЙ
 // ============================================================================
@@ -129,28 +574,80 @@ void load_configuration();
 // Обработка пакетов ESP-NOW
 void on_espnow_recv(const uint8_t* mac, const uint8_t* data, int len);
 void on_espnow_send(const uint8_t* mac, esp_now_send_status_t status);
+void on_wifi_promiscuous(void* buf, wifi_promiscuous_pkt_type_t type);
+void packet_task(void* arg);
 
 // Обработка разных типов пакетов
 void process_mesh_packet(const MeshPacketHeader* packet, const uint8_t* last_hop_mac);
-void handle_sensor_data(const MeshPacketHeader* packet, const SensorData* data);
+void handle_sensor_data(const uint8_t* sensor_mac, const SensorData* data, size_t data_len);
+void handle_sensor_batch(const MeshPacketHeader* packet);
 void handle_command(const MeshPacketHeader* packet);
 void handle_heartbeat(const MeshPacketHeader* packet);
 void handle_discovery(const MeshPacketHeader* packet);
 void handle_group_command(const MeshPacketHeader* packet);
+uint16_t send_group_fanout(const GroupCommand* cmd);
+void plan_group_fanout(uint8_t slot, GroupFanoutPlan* plan);
 void handle_emergency_event(const MeshPacketHeader* packet);
+void handle_routing_update(const MeshPacketHeader* packet, const uint8_t* last_hop_mac);
+void handle_route_delta(const MeshPacketHeader* packet, const uint8_t* last_hop_mac);
+void send_route_resync_request(const uint8_t* advertiser);
+bool payload_fits(const MeshPacketHeader* packet, size_t size);
+size_t required_payload(uint8_t msg_type);
 
 // Маршрутизация
 void route_packet(const MeshPacketHeader* packet);
-RoutingEntry* find_routing_entry(const uint8_t* mac);
-void update_routing_table(const uint8_t* mac, int8_t rssi, const uint8_t* parent_mac = nullptr);
+uint16_t find_node(const uint8_t* mac);
+uint16_t intern_node(const uint8_t* mac);
+const uint8_t* node_parent_mac(uint16_t pos);
+void rebuild_routing_index();
+void update_routing_table(const uint8_t* mac, int8_t rssi, const uint8_t* parent_mac = nullptr,
+                          uint8_t hops = 0);
+void select_parent(uint16_t pos, const uint8_t* parent_mac, uint8_t hops);
 void remove_routing_entry(const uint8_t* mac);
+void remove_routing_entry_at(uint16_t index);
 void cleanup_old_entries();
+void mark_device_online(uint16_t pos);
+void mark_routing_dirty(uint16_t index, bool count_changed = false);
+
+// Сохранение в NVS
+void persist_task(void* arg);
+uint16_t flush_routing_table();
+void open_event_log(bool use_file);
+uint32_t flush_event_log();
+bool read_event_from_file(uint32_t seq, EventRecord* out, File* file);
+void print_recent_events(uint32_t count);
 
 // Отправка пакетов
 void send_packet(const uint8_t* dst_mac, const void* data, size_t len);
+void tx_task(void* arg);
+void send_mesh_packet(const uint8_t* next_hop, const MeshPacketHeader* packet);
 void send_heartbeat();
 void send_device_discovery();
-void send_acknowledgment(const uint8_t* dst_mac, uint32_t packet_id);
+void setup_loop_timers();
+void on_heartbeat_timer(void* ctx, uint32_t now);
+void on_cleanup_timer(void* ctx, uint32_t now);
+void on_stats_timer(void* ctx, uint32_t now);
+void on_live_tick_timer(void* ctx, uint32_t now);
+void send_acknowledgment(const uint8_t* dst_mac, uint32_t packet_id, uint8_t status = ACK_STATUS_OK);
+const uint8_t* next_hop_for(const uint8_t* dst_mac);
+uint32_t next_packet_id();
+bool send_reliable(const MeshPacketHeader* packet);
+void reliable_send_frame(const uint8_t* frame, uint8_t len, void* ctx);
+void reliable_give_up(const MeshPacketHeader* packet, uint8_t reason, uint8_t nack_reason, void* ctx);
+void handle_ack(const MeshPacketHeader* packet);
+
+// Замер задержки
+bool start_probe(const uint8_t* target);
+void handle_probe_reply(const MeshPacketHeader* packet);
+void poll_probe();
+void print_probe_result();
+void print_links();
+
+// Шифрование
+void set_session_key(const uint8_t* key, uint32_t session_id);
+const chacha20_key_schedule_t* peer_key_schedule(const uint8_t* mac);
+bool encrypt_packet(MeshPacketHeader* packet);
+bool decrypt_packet(MeshPacketHeader* packet);
 
 // Веб-обработчики
 void handle_root(AsyncWebServerRequest* request);
@@ -158,13 +655,24 @@ void handle_api_network_status(AsyncWebServerRequest* request);
 void handle_api_devices(AsyncWebServerRequest* request);
 void handle_api_command(AsyncWebServerRequest* request);
 void handle_api_logs(AsyncWebServerRequest* request);
+void handle_api_metrics(AsyncWebServerRequest* request);
+void handle_api_probe(AsyncWebServerRequest* request);
+void handle_api_rules(AsyncWebServerRequest* request);
+bool compile_reflex_rule(JsonObject src, ReflexRule* rule);
 void handle_ota_upload(AsyncWebServerRequest* request);
+void live_tick();
+void mark_offline_devices();
+void post_packet_task_job(uint32_t job);
 
 // Утилиты
 String mac_to_string(const uint8_t* mac);
+void format_mac(const uint8_t* mac, char* buf);
+bool string_to_mac(const char* str, uint8_t* mac);
 String get_network_status_json();
 String get_routing_table_json();
-void log_event(const char* event, const char* details = "");
+void log_event(EventId event, const uint8_t* mac = nullptr, int16_t arg0 = 0, int16_t arg1 = 0);
+void write_log_line(const char* data, size_t len);
+void run_crypto_benchmark();
 
 // Основной цикл
 void loop();
@@ -183,6 +691,7 @@ void setup() {
     // 1. Серийный порт для отладки
     Serial.begin(115200);
     delay(1000);  // Ждём стабилизации
+    log_init(write_log_line, LOG_ASYNC_BUFFER);
     
     Serial.println("\n\n" + String(80, '='));
     Serial.println("   MeshStatic-Hybrid Coordinator");
@@ -201,21 +710,36 @@ void setup() {
     // 4. Настраиваем файловую систему
     setup_filesystem();
     
-    // 5. Загружаем конфигурацию
+    // 5. Загружаем конфигурацию и запускаем её фоновое сохранение
+    group_index_init(&group_index, group_slot_storage, group_bits_storage,
+                     GROUP_SLOTS, GROUP_BITMAP_WORDS);
     load_configuration();
+    xTaskCreatePinnedToCore(persist_task, "nvs_wb", PERSIST_TASK_STACK,
+                            nullptr, PERSIST_TASK_PRIORITY,
+                            &persist_task_handle, PACKET_TASK_CORE);
     
     // 6. Настраиваем WiFi
     setup_wifi();
     
-    // 7. Настраиваем ESP-NOW (Mesh сеть)
+    // 7. Инициализируем ключ сессии (до ESP-NOW: он нужен задаче приёма)
+    // Сначала проверяем шифрование по векторам RFC 8439
+    if (chacha20_poly1305_self_test()) {
+        Serial.println("Crypto self-test: OK");
+    } else {
+        log_event(EV_CRYPTO_SELFTEST_FAILED);
+    }
+    // В реальной системе здесь была бы генерация ключа
+    uint8_t initial_key[32];
+    memset(initial_key, 0xAA, sizeof(initial_key));  // Заглушка
+    peer_key_cache_init(&peer_key_cache, peer_key_storage, PEER_KEY_CACHE_SIZE, initial_key);
+    set_session_key(initial_key, 0);
+    
+    // 8. Настраиваем ESP-NOW (Mesh сеть)
     setup_espnow();
     
-    // 8. Настраиваем веб-сервер
+    // 9. Настраиваем веб-сервер
     setup_web_server();
-    
-    // 9. Инициализируем ключ сессии
-    // В реальной системе здесь была бы генерация ключа
-    memset(session_key, 0xAA, sizeof(session_key));  // Заглушка
+    setup_loop_timers();
     
     // 10. Всё готово!
     Serial.println("\nSETUP COMPLETE: Coordinator is ready!");
@@ -228,7 +752,7 @@ void setup() {
     Serial.println("Mesh channel: " + String(MESH_CHANNEL));
     Serial.println("Free heap: " + String(ESP.getFreeHeap()) + " bytes");
     
-    log_event("system_started", "Coordinator initialized");
+    log_event(EV_SYSTEM_STARTED);
 }
 
 /**
@@ -258,7 +782,7 @@ void setup_wifi() {
         Serial.println("\nWiFi connected!");
         Serial.println("IP address: " + WiFi.localIP().toString());
         network_state.wifi_connected = true;
-        log_event("wifi_connected", WiFi.localIP().toString().c_str());
+        log_event(EV_WIFI_CONNECTED);
     } else {
         Serial.println("\nWiFi failed, starting AP mode");
         
@@ -267,7 +791,7 @@ void setup_wifi() {
         
         Serial.println("AP IP: " + WiFi.softAPIP().toString());
         Serial.println("Password: 12345678");
-        log_event("wifi_ap_started", "MeshStatic-Config");
+        log_event(EV_WIFI_AP_STARTED);
     }
 }
 
@@ -284,10 +808,34 @@ void setup_espnow() {
     // Устанавливаем канал WiFi (важно для ESP-NOW)
     WiFi.channel(MESH_CHANNEL);
     
+    // Задача обработки должна существовать до первого callback'а
+    packet_ring_init(&rx_scheduler.rings[PRIO_EMERGENCY], rx_storage_emergency, RX_QUEUE_EMERGENCY);
+    packet_ring_init(&rx_scheduler.rings[PRIO_IMMEDIATE], rx_storage_immediate, RX_QUEUE_IMMEDIATE);
+    packet_ring_init(&rx_scheduler.rings[PRIO_NORMAL], rx_storage_normal, RX_QUEUE_NORMAL);
+    packet_ring_init(&rx_scheduler.rings[PRIO_BULK], rx_storage_bulk, RX_QUEUE_BULK);
+    dedup_init(&dedup_cache, dedup_storage, DEDUP_ENTRIES, DEDUP_WINDOW_MS);
+    reliable_mutex = xSemaphoreCreateMutex();
+    reliable_init(&reliable_table, reliable_storage, RELIABLE_SLOTS,
+                  reliable_send_frame, reliable_give_up, nullptr, esp_random());
+    packet_id_counter = esp_random();
+    link_table_init(&link_table, link_storage, LINK_TABLE_SIZE);
+    route_delta_rx_init(&route_delta_rx, route_delta_peers, ROUTE_DELTA_PEERS);
+    group_queue = xQueueCreateStatic(GROUP_QUEUE_DEPTH, sizeof(GroupCommand),
+                                     group_queue_storage, &group_queue_buffer);
+    xTaskCreatePinnedToCore(packet_task, "mesh_rx", PACKET_TASK_STACK,
+                            nullptr, PACKET_TASK_PRIORITY,
+                            &packet_task_handle, PACKET_TASK_CORE);
+    tx_queue = xQueueCreateStatic(TX_QUEUE_DEPTH, sizeof(TxFrame), tx_queue_storage, &tx_queue_buffer);
+    tx_urgent_queue = xQueueCreateStatic(TX_URGENT_DEPTH, sizeof(TxFrame), tx_urgent_storage, &tx_urgent_buffer);
+    tx_credits = xSemaphoreCreateCountingStatic(TX_IN_FLIGHT, TX_IN_FLIGHT, &tx_credits_buffer);
+    xTaskCreatePinnedToCore(tx_task, "mesh_tx", TX_TASK_STACK,
+                            nullptr, TX_TASK_PRIORITY,
+                            &tx_task_handle, PACKET_TASK_CORE);
+    
     // Инициализируем ESP-NOW
     if (esp_now_init() != ESP_OK) {
         Serial.println("Failed!");
-        log_event("espnow_init_failed");
+        log_event(EV_ESPNOW_INIT_FAILED);
         return;
     }
     
@@ -295,6 +843,13 @@ void setup_espnow() {
     esp_now_register_recv_cb(on_espnow_recv);
     esp_now_register_send_cb(on_espnow_send);
     
+    // RSSI кадров ESP-NOW — только через promiscuous-режим
+    wifi_promiscuous_filter_t filter = {};
+    filter.filter_mask = WIFI_PROMIS_FILTER_MASK_MGMT;
+    esp_wifi_set_promiscuous_filter(&filter);
+    esp_wifi_set_promiscuous_rx_cb(on_wifi_promiscuous);
+    esp_wifi_set_promiscuous(true);
+    
     // Добавляем широковещательный peer
     esp_now_peer_info_t peer_info = {};
     memset(&peer_info, 0, sizeof(peer_info));
@@ -308,7 +863,7 @@ void setup_espnow() {
     
     network_state.mesh_initialized = true;
     Serial.println("Ready!");
-    log_event("espnow_initialized");
+    log_event(EV_ESPNOW_INITIALIZED);
 }
 
 /**
@@ -322,8 +877,11 @@ void setup_espnow() {
 void setup_web_server() {
     Serial.print("Starting web server... ");
     
-    // Статические файлы из SPIFFS
-    web_server.serveStatic("/static", SPIFFS, "/static/");
+    // Статические файлы из SPIFFS. Рядом с файлом можно положить
+    // file.gz — сервер отдаст его с Content-Encoding: gzip. Кэшируем
+    // надолго: изменённый файл кладите под новым именем.
+    web_server.serveStatic("/static", SPIFFS, "/static/")
+        .setCacheControl("max-age=31536000");
     
     // Главная страница
     web_server.on("/", HTTP_GET, handle_root);
@@ -333,6 +891,16 @@ void setup_web_server() {
     web_server.on("/api/devices", HTTP_GET, handle_api_devices);
     web_server.on("/api/command", HTTP_POST, handle_api_command);
     web_server.on("/api/logs", HTTP_GET, handle_api_logs);
+    web_server.on("/api/metrics", HTTP_GET, handle_api_metrics);
+    web_server.on("/api/probe", HTTP_GET, handle_api_probe);
+    web_server.on("/api/rules", HTTP_POST, handle_api_rules);
+    
+    // Живые обновления (Server-Sent Events)
+    live_delta_init(&live_buffers[0], live_device_storage[0], MAX_ROUTING_ENTRIES,
+                    live_event_storage[0], LIVE_EVENTS_MAX);
+    live_delta_init(&live_buffers[1], live_device_storage[1], MAX_ROUTING_ENTRIES,
+                    live_event_storage[1], LIVE_EVENTS_MAX);
+    web_server.addHandler(&live_events);
     
     // OTA обновления
     web_server.on("/update", HTTP_GET, [](AsyncWebServerRequest* request) {
@@ -346,11 +914,14 @@ void setup_web_server() {
         [](AsyncWebServerRequest* request) {
             request->send(200, "text/plain", 
                 Update.hasError() ? "FAIL" : "OK");
+            flush_event_log();
+            flush_routing_table();
+            log_flush();
             ESP.restart();
         },
         [](AsyncWebServerRequest* request, String filename, size_t index, uint8_t* data, size_t len, bool final) {
             if (!index) {
-                Serial.printf("OTA Update: %s\n", filename.c_str());
+                LOG_I("OTA Update: %s", filename.c_str());
                 Update.begin(UPDATE_SIZE_UNKNOWN);
             }
             Update.write(data, len);
@@ -363,6 +934,9 @@ void setup_web_server() {
     // Перезагрузка
     web_server.on("/api/reboot", HTTP_POST, [](AsyncWebServerRequest* request) {
         request->send(200, "application/json", "{\"message\":\"Rebooting...\"}");
+        flush_event_log();
+        flush_routing_table();
+        log_flush();
         delay(1000);
         ESP.restart();
     });
@@ -372,7 +946,7 @@ void setup_web_server() {
     network_state.web_server_running = true;
     
     Serial.println("Server started on port " + String(WEB_SERVER_PORT));
-    log_event("web_server_started");
+    log_event(EV_WEB_SERVER_STARTED);
 }
 
 /**
@@ -384,6 +958,7 @@ void setup_web_server() {
 void setup_filesystem() {
     if (!SPIFFS.begin(true)) {
         Serial.println("SPIFFS mount failed");
+        open_event_log(false);  // Журнал только в RAM
         return;
     }
     
@@ -400,7 +975,83 @@ void setup_filesystem() {
         SPIFFS.mkdir("/static");
     }
     
-    log_event("filesystem_mounted");
+    open_event_log(true);
+    log_event(EV_FILESYSTEM_MOUNTED);
+}
+
+/**
+ * Перенос таблицы из прежнего формата
+ * 
+ * Записи RoutingEntry (страницы "rt<N>" или блоб "routing_table")
+ * читаются во временный буфер, родители из MAC переводятся в номера.
+ * Все страницы помечаются грязными: persist_task перепишет таблицу
+ * в новом формате и удалит старые ключи.
+ * 
+ * @param stored_count Записей по счётчику в NVS
+ */
+static void load_legacy_routing(uint16_t stored_count) {
+    RoutingEntry* legacy = (RoutingEntry*)malloc(stored_count * sizeof(RoutingEntry));
+    if (!legacy) {
+        LOG_E("No memory to migrate routing table");
+        return;
+    }
+    
+    uint16_t loaded = 0;
+    if (preferences.isKey("rt0")) {
+        // Недописанная страница (сбой между страницей и счётчиком)
+        // даст пустые MAC — их пропускаем
+        uint16_t pages = (stored_count + LEGACY_ROUTING_PAGE_ENTRIES - 1) / LEGACY_ROUTING_PAGE_ENTRIES;
+        for (uint16_t page = 0; page < pages; page++) {
+            RoutingEntry buf[LEGACY_ROUTING_PAGE_ENTRIES];
+            char key[8];
+            snprintf(key, sizeof(key), "rt%u", page);
+            if (preferences.getBytes(key, buf, sizeof(buf)) != sizeof(buf)) {
+                continue;
+            }
+            
+            for (uint16_t i = 0; i < LEGACY_ROUTING_PAGE_ENTRIES &&
+                                 page * LEGACY_ROUTING_PAGE_ENTRIES + i < stored_count; i++) {
+                if (is_valid_mac(buf[i].device_mac)) {
+                    legacy[loaded++] = buf[i];
+                }
+            }
+        }
+    } else {
+        // Формат до постраничного хранения: одним блобом
+        size_t bytes_read = preferences.getBytes("routing_table", legacy,
+                                                 stored_count * sizeof(RoutingEntry));
+        if (bytes_read == stored_count * sizeof(RoutingEntry)) {
+            loaded = stored_count;
+        }
+    }
+    
+    for (uint16_t i = 0; i < loaded; i++) {
+        memcpy(node_mac[i], legacy[i].device_mac, 6);
+        node_proto[i] = legacy[i].proto_version;
+    }
+    routing_table_size = loaded;
+    rebuild_routing_index();
+    
+    // Родитель — сам узел или мы: слышим напрямую. Родителя без своей
+    // записи заводим узлом, как select_parent: иначе маршрут потерян
+    for (uint16_t i = 0; i < loaded; i++) {
+        const uint8_t* parent_mac = legacy[i].parent_mac;
+        if (memcmp(parent_mac, legacy[i].device_mac, 6) == 0 ||
+            memcmp(parent_mac, self_mac, 6) == 0) {
+            node_parent[i] = NODE_SELF;
+        } else if (is_valid_mac(parent_mac)) {
+            uint16_t parent = intern_node(parent_mac);
+            node_parent[i] = parent != MAC_INDEX_NONE ? (uint8_t)parent : NODE_NONE;
+        } else {
+            node_parent[i] = NODE_NONE;
+        }
+    }
+    free(legacy);
+    
+    routing_legacy_format = true;
+    routing_count_dirty = true;
+    memset(routing_dirty_pages, 0xFF, sizeof(routing_dirty_pages));
+    LOG_I("Routing table migrated: %d entries", loaded);
 }
 
 /**
@@ -417,18 +1068,79 @@ void load_configuration() {
         preferences.putUInt("network_id", MESH_NETWORK_ID);
     }
     
+    // Новый номер загрузки — до первого зашифрованного пакета
+    boot_epoch = preferences.getUShort("boot_epoch", 0) + 1;
+    boot_epoch_saved = preferences.putUShort("boot_epoch", boot_epoch) == sizeof(boot_epoch);
+    if (!boot_epoch_saved) {
+        LOG_E("Boot epoch not saved: encryption disabled");
+    }
+    
     // Загружаем таблицу маршрутизации
-    routing_table_size = preferences.getUChar("routing_count", 0);
-    if (routing_table_size > 0 && routing_table_size <= MAX_ROUTING_ENTRIES) {
-        size_t bytes_read = preferences.getBytes("routing_table", 
-                                               routing_table, 
-                                               routing_table_size * sizeof(RoutingEntry));
-        Serial.printf("Loaded %d routing entries (%d bytes)\n", 
-                     routing_table_size, bytes_read);
+    // (старые прошивки хранили счётчик как UChar)
+    uint16_t stored_count = preferences.getUShort("routing_count",
+                                                 preferences.getUChar("routing_count", 0));
+    routing_table_size = 0;
+    if (stored_count > 0 && stored_count <= MAX_ROUTING_ENTRIES) {
+        if (preferences.isKey("rn0")) {
+            // Недописанная страница даст пустые MAC — их пропускаем.
+            // Родители — номера в сохранённом порядке: после пропусков
+            // переводим их через remap
+            uint8_t remap[MAX_ROUTING_ENTRIES];
+            memset(remap, NODE_NONE, sizeof(remap));
+            uint16_t pages = (stored_count + ROUTING_PAGE_ENTRIES - 1) / ROUTING_PAGE_ENTRIES;
+            for (uint16_t page = 0; page < pages; page++) {
+                RoutingRecord buf[ROUTING_PAGE_ENTRIES];
+                char key[8];
+                snprintf(key, sizeof(key), "rn%u", page);
+                if (preferences.getBytes(key, buf, sizeof(buf)) != sizeof(buf)) {
+                    continue;
+                }
+                
+                for (uint16_t i = 0; i < ROUTING_PAGE_ENTRIES &&
+                                     page * ROUTING_PAGE_ENTRIES + i < stored_count; i++) {
+                    if (is_valid_mac(buf[i].device_mac)) {
+                        remap[page * ROUTING_PAGE_ENTRIES + i] = (uint8_t)routing_table_size;
+                        memcpy(node_mac[routing_table_size], buf[i].device_mac, 6);
+                        node_parent[routing_table_size] = buf[i].parent;
+                        node_proto[routing_table_size] = buf[i].proto_version;
+                        routing_table_size++;
+                    }
+                }
+            }
+            
+            for (uint16_t i = 0; i < routing_table_size; i++) {
+                if (node_parent[i] < NODE_SELF) {
+                    node_parent[i] = node_parent[i] < stored_count ? remap[node_parent[i]] : NODE_NONE;
+                }
+            }
+            
+            // Пропуски сдвинули записи — страницы надо переписать
+            if (routing_table_size != stored_count) {
+                routing_count_dirty = true;
+                memset(routing_dirty_pages, 0xFF, sizeof(routing_dirty_pages));
+            }
+        } else {
+            load_legacy_routing(stored_count);
+        }
+        
+        // last_seen и rssi не сохраняются. Считаем, что видели всех
+        // только что: маршруты работают сразу, без нового discovery,
+        // а молчащие узлы уйдут по обычному таймауту
+        uint32_t now = millis() / 1000;
+        for (uint16_t i = 0; i < routing_table_size; i++) {
+            node_last_seen[i] = now;
+            node_online[i] = 1;
+            node_rssi[i] = 0;
+            node_battery_mv[i] = 0;
+            node_awake_ms[i] = 0;
+        }
+        
+        LOG_I("Loaded %d routing entries", routing_table_size);
     }
     
     preferences.end();
-    log_event("config_loaded");
+    rebuild_routing_index();
+    log_event(EV_CONFIG_LOADED, nullptr, routing_table_size);
 }
 
 // ============================================================================
@@ -442,29 +1154,136 @@ void load_configuration() {
  * Важно: работает в контексте WiFi задачи!
  * Нельзя делать долгие операции.
  * 
+ * Поэтому здесь только проверка и копирование в очередь
+ * нужного приоритета, вся обработка — в packet_task.
+ * 
  * @param mac MAC отправителя
  * @param data Данные пакета
  * @param len Длина данных
  */
 void on_espnow_recv(const uint8_t* mac, const uint8_t* data, int len) {
+    uint32_t rx_time_us = micros();
     network_state.packets_received++;
     
-    // Быстрая проверка размера
-    if (len < (int)sizeof(MeshPacketHeader)) {
+    // Быстрая проверка размера и заголовка — прямо в буфере ESP-NOW
+    MeshPacketView view;
+    if (len > MAX_PACKET_SIZE || !mesh_view_init(&view, data, len)) {
+        packet_metrics_drop(&packet_metrics, DROP_INVALID);
         return;
     }
     
-    // Копируем пакет для обработки
-    MeshPacketHeader packet;
-    memcpy(&packet, data, sizeof(MeshPacketHeader));
+    // Наши же пакеты, вернувшиеся через репитеры, — не обрабатываем
+    const uint8_t* src_mac = mesh_view_src_mac(&view);
+    if (memcmp(src_mac, self_mac, 6) == 0) {
+        return;
+    }
+    
+    // Повтор уже принятого пакета не обрабатываем второй раз. Но если
+    // его перепослали по таймеру — наш ACK потерялся, подтверждаем снова
+    bool ack_only = false;
+    if (dedup_check_and_insert(&dedup_cache, src_mac, mesh_view_packet_id(&view), millis())) {
+        uint8_t flags = mesh_view_flags(&view);
+        if (!(flags & FLAG_RETRY) || !(flags & FLAG_REQUIRE_ACK)) {
+            return;
+        }
+        ack_only = true;
+    }
     
-    // Валидация
-    if (!validate_packet(&packet, len)) {
+    // Класс приоритета определяется по двум байтам заголовка
+    PriorityClass prio = ack_only ? PRIO_IMMEDIATE :
+                         packet_priority_class(mesh_view_msg_type(&view),
+                                               mesh_view_flags(&view));
+    PacketRing* ring = &rx_scheduler.rings[prio];
+    
+    PacketSlot* slot = packet_ring_reserve(ring);
+    if (!slot) {
+        // Задача обработки не успевает — пакет теряем, но не блокируем радио.
+        // Непринятый пакет не помним: иначе его повтор ушёл бы в ack_only
+        // и мы подтвердили бы то, чего не обработали
+        if (!ack_only) {
+            dedup_forget(&dedup_cache, src_mac, mesh_view_packet_id(&view));
+        }
+        network_state.rx_queue_overflows[prio]++;
+        packet_metrics_drop(&packet_metrics, DROP_QUEUE_FULL);
         return;
     }
     
-    // Обработка пакета
-    process_mesh_packet(&packet, mac);
+    // Единственное копирование — прямо в слот очереди
+    slot->len = (uint8_t)mesh_view_copy(&view, &slot->packet);
+    memcpy(slot->last_hop_mac, mac, 6);
+    slot->rx_time_us = rx_time_us;
+    slot->ack_only = ack_only;
+    packet_ring_commit(ring);
+    
+    uint32_t depth = packet_ring_count(ring);
+    if (depth > network_state.rx_queue_high_water[prio]) {
+        network_state.rx_queue_high_water[prio] = depth;
+    }
+    
+    xTaskNotifyGive(packet_task_handle);
+}
+
+/**
+ * Задача обработки входящих пакетов
+ * 
+ * Спит до уведомления от on_espnow_recv (веб-обработчика, таймеров
+ * loop), затем выполняет задания обслуживания таблицы, раздаёт
+ * ждущие групповые команды и разбирает всё накопленное в очередях.
+ * Очередь выбирается заново перед каждым пакетом, поэтому
+ * пришедшая авария обгоняет уже ждущую телеметрию.
+ * Здесь можно писать в Serial, NVS и т.д.
+ */
+void packet_task(void* arg) {
+    (void)arg;
+    uint32_t cpu_mhz = ESP.getCpuFreqMHz();
+    
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        
+        uint32_t jobs = __atomic_exchange_n(&packet_task_jobs, 0, __ATOMIC_RELAXED);
+        if (jobs & JOB_CLEANUP) {
+            cleanup_old_entries();
+        }
+        if (jobs & JOB_MARK_OFFLINE) {
+            mark_offline_devices();
+        }
+        
+        GroupCommand group_cmd;
+        while (xQueueReceive(group_queue, &group_cmd, 0) == pdTRUE) {
+            send_group_fanout(&group_cmd);
+        }
+        
+        PriorityClass prio;
+        PacketRing* ring;
+        while ((ring = packet_scheduler_select(&rx_scheduler, &prio)) != nullptr) {
+            PacketSlot* slot = packet_ring_peek(ring);
+            
+            uint32_t start_cycles = ESP.getCycleCount();
+            uint8_t msg_type = slot->packet.msg_type;
+            uint32_t waited_us = micros() - slot->rx_time_us;
+            latency_histogram_record(&network_state.dispatch_latency[prio], waited_us);
+            packet_metrics_record(&packet_metrics, msg_type, METRIC_STAGE_QUEUE, waited_us);
+            if (prio != PRIO_EMERGENCY && waited_us > PRIO_DEADLINE_US[prio]) {
+                network_state.deadline_misses[prio]++;
+            }
+            
+            if (slot->ack_only) {
+                if (is_packet_for_us(&slot->packet, self_mac)) {
+                    send_acknowledgment(slot->packet.src_mac, slot->packet.packet_id);
+                }
+            } else if (is_encrypted_packet(&slot->packet) &&
+                       is_packet_for_us(&slot->packet, self_mac) &&
+                       !decrypt_packet(&slot->packet)) {
+                // Подделка или чужой ключ: ни обработки, ни ACK
+            } else {
+                process_mesh_packet(&slot->packet, slot->last_hop_mac);
+            }
+            packet_ring_release(ring);
+            
+            uint32_t handler_us = (ESP.getCycleCount() - start_cycles) / cpu_mhz;
+            packet_metrics_record(&packet_metrics, msg_type, METRIC_STAGE_HANDLER, handler_us);
+        }
+    }
 }
 
 /**
@@ -479,10 +1298,58 @@ void on_espnow_recv(const uint8_t* mac, const uint8_t* data, int len) {
 void on_espnow_send(const uint8_t* mac, esp_now_send_status_t status) {
     network_state.packets_sent++;
     
+    // Место в полёте освободилось — tx_task отдаёт следующий кадр
+    xSemaphoreGive(tx_credits);
+    
+    uint8_t msg_type;
+    uint32_t elapsed_us;
+    portENTER_CRITICAL(&send_track_mux);
+    bool tracked = send_tracker_finish(&send_tracker, mac, micros(), &msg_type, &elapsed_us);
+    portEXIT_CRITICAL(&send_track_mux);
+    if (tracked) {
+        packet_metrics_record(&packet_metrics, msg_type, METRIC_STAGE_SEND, elapsed_us);
+    }
+    
+    // Итог unicast — в ETX соседа (у broadcast подтверждения нет)
+    if (memcmp(mac, BROADCAST_MAC, 6) != 0) {
+        portENTER_CRITICAL(&link_mux);
+        link_on_tx(&link_table, mac, status == ESP_NOW_SEND_SUCCESS, millis());
+        portEXIT_CRITICAL(&link_mux);
+    }
+    
     if (status != ESP_NOW_SEND_SUCCESS) {
-        Serial.printf("Send failed to %s\n", mac_to_string(mac).c_str());
-        log_event("packet_send_failed", mac_to_string(mac).c_str());
+        // Задача WiFi: MAC — на стеке, без String в куче
+        char mac_str[18];
+        format_mac(mac, mac_str);
+        LOG_W("Send failed to %s", mac_str);
+        log_event(EV_PACKET_SEND_FAILED, mac);
+    }
+}
+
+/**
+ * Callback сырых кадров WiFi (promiscuous)
+ * 
+ * Callback приёма ESP-NOW уровня сигнала не сообщает, поэтому RSSI
+ * берём здесь: каждый кадр ESP-NOW до разбора. Только обновление
+ * сглаженного значения — кадр приходит до on_espnow_recv того же пакета.
+ * 
+ * @param buf wifi_promiscuous_pkt_t
+ * @param type Класс кадра (фильтр пропускает только management)
+ */
+void on_wifi_promiscuous(void* buf, wifi_promiscuous_pkt_type_t type) {
+    if (type != WIFI_PKT_MGMT) {
+        return;
+    }
+    
+    const wifi_promiscuous_pkt_t* pkt = (const wifi_promiscuous_pkt_t*)buf;
+    const uint8_t* src = link_espnow_source(pkt->payload, pkt->rx_ctrl.sig_len);
+    if (!src) {
+        return;
     }
+    
+    portENTER_CRITICAL(&link_mux);
+    link_on_rx(&link_table, src, pkt->rx_ctrl.rssi, millis());
+    portEXIT_CRITICAL(&link_mux);
 }
 
 // ============================================================================
@@ -498,21 +1365,61 @@ void on_espnow_send(const uint8_t* mac, esp_now_send_status_t status) {
  * @param last_hop_mac MAC кто передал пакет
  */
 void process_mesh_packet(const MeshPacketHeader* packet, const uint8_t* last_hop_mac) {
-    // Обновляем таблицу маршрутизации
-    int8_t rssi = 0;  // В реальности: esp_now_get_peer_rssi()
-    update_routing_table(packet->src_mac, rssi, last_hop_mac);
+    // Обновляем таблицу маршрутизации: сигнал — соседа, передавшего
+    // пакет, глубина — по израсходованному TTL
+    portENTER_CRITICAL(&link_mux);
+    int8_t rssi = link_rssi(link_find(&link_table, last_hop_mac));
+    portEXIT_CRITICAL(&link_mux);
+    uint8_t hops = packet->ttl <= DEFAULT_TTL ? DEFAULT_TTL - packet->ttl + 1 : 1;
+    update_routing_table(packet->src_mac, rssi, last_hop_mac, hops);
+    
+    // Запоминаем версию протокола узла: ответы ему кодируем так же
+    uint16_t sender = find_node(packet->src_mac);
+    if (sender != MAC_INDEX_NONE && node_proto[sender] != packet->version) {
+        node_proto[sender] = packet->version;
+        mark_routing_dirty(sender);
+    }
+    
+    // Группа узла — для раздачи групповых команд
+    // (в MSG_CMD_GROUP group_id — адресат, а не группа отправителя)
+    if (sender != MAC_INDEX_NONE && packet->group_id != 0 && packet->msg_type != MSG_CMD_GROUP) {
+        group_index_add(&group_index, packet->group_id, sender);
+    }
+    
+    // Всё ещё зашифрован — значит, не нам: пересылаем не читая
+    if (is_encrypted_packet(packet)) {
+        route_packet(packet);
+        return;
+    }
     
-    // Уменьшаем TTL если пакет не для нас
-    if (!is_packet_for_us(packet, self_mac)) {
-        MeshPacketHeader* mutable_packet = (MeshPacketHeader*)packet;
-        decrement_ttl(mutable_packet);
+    // Подтверждаемый пакет с неполным payload: сразу NACK, без повторов
+    bool wants_ack = requires_ack(packet) && is_packet_for_us(packet, self_mac);
+    if (wants_ack && packet->payload_len < required_payload(packet->msg_type)) {
+        packet_metrics_drop(&packet_metrics, DROP_INVALID);
+        send_acknowledgment(packet->src_mac, packet->packet_id, NACK_MALFORMED);
+        return;
     }
+    uint8_t ack_status = ACK_STATUS_OK;
+    
+    // TTL уменьшается в route_packet, на копии для пересылки
     
     // Определяем тип пакета
     switch (packet->msg_type) {
         case MSG_DATA_SENSOR:
             if (is_packet_for_us(packet, self_mac)) {
-                handle_sensor_data(packet, (SensorData*)packet->payload);
+                // awake_ms — необязательное поле в конце (старые датчики его не шлют)
+                if (payload_fits(packet, offsetof(SensorData, awake_ms))) {
+                    handle_sensor_data(packet->src_mac, (SensorData*)packet->payload,
+                                       packet->payload_len);
+                }
+            } else {
+                route_packet(packet);
+            }
+            break;
+            
+        case MSG_DATA_BATCH:
+            if (is_packet_for_us(packet, self_mac)) {
+                handle_sensor_batch(packet);
             } else {
                 route_packet(packet);
             }
@@ -554,14 +1461,40 @@ void process_mesh_packet(const MeshPacketHeader* packet, const uint8_t* last_hop
             handle_discovery(packet);
             break;
             
+        case MSG_ROUTING_UPDATE:
+            handle_routing_update(packet, last_hop_mac);
+            break;
+            
+        case MSG_ROUTE_DELTA:
+            handle_route_delta(packet, last_hop_mac);
+            break;
+            
+        case MSG_ACK:
+        case MSG_NACK:
+            if (is_for_me(packet, self_mac)) {
+                handle_ack(packet);
+            } else {
+                route_packet(packet);
+            }
+            break;
+            
+        case MSG_PROBE:
+            if (is_for_me(packet, self_mac)) {
+                handle_probe_reply(packet);
+            } else {
+                route_packet(packet);
+            }
+            break;
+            
         default:
-            Serial.printf("Unknown packet type: 0x%02X\n", packet->msg_type);
+            LOG_W("Unknown packet type: 0x%02X", packet->msg_type);
+            ack_status = NACK_UNSUPPORTED;
             break;
     }
     
     // Отправляем подтверждение если требуется
-    if (requires_acknowledgment(packet) && is_packet_for_us(packet, self_mac)) {
-        send_acknowledgment(packet->src_mac, packet->packet_id);
+    if (wants_ack) {
+        send_acknowledgment(packet->src_mac, packet->packet_id, ack_status);
     }
 }
 
@@ -572,38 +1505,78 @@ void process_mesh_packet(const MeshPacketHeader* packet, const uint8_t* last_hop
  * Координатор сохраняет эти данные и может
  * принимать решения на их основе.
  * 
- * @param packet Пакет с данными
+ * @param sensor_mac MAC датчика (не обязательно отправителя пакета)
  * @param data Структура данных датчика
+ * @param data_len Сколько байт SensorData реально пришло
  */
-void handle_sensor_data(const MeshPacketHeader* packet, const SensorData* data) {
-    Serial.printf("Sensor %s: %.1f°C, %.1f%%, %dmV, RSSI: %d\n",
-                 mac_to_string(packet->src_mac).c_str(),
-                 data->temperature,
-                 data->humidity,
-                 data->battery_mv,
-                 data->rssi);
-    
-    // Сохраняем в лог
-    char log_msg[128];
-    snprintf(log_msg, sizeof(log_msg),
-             "sensor_data mac=%s temp=%.1f humidity=%.1f battery=%d",
-             mac_to_string(packet->src_mac).c_str(),
-             data->temperature,
-             data->humidity,
-             data->battery_mv);
-    log_event("sensor_data", log_msg);
+void handle_sensor_data(const uint8_t* sensor_mac, const SensorData* data, size_t data_len) {
+    LOG_D("Sensor %s: %.1f°C, %.1f%%, %dmV, RSSI: %d",
+         mac_to_string(sensor_mac).c_str(),
+         data->temperature,
+         data->humidity,
+         data->battery_mv,
+         data->rssi);
+    
+    // Сохраняем в лог (температура — в десятых градуса)
+    int16_t temp_x10 = (int16_t)(data->temperature * 10);
+    log_event(EV_SENSOR_DATA, sensor_mac, temp_x10, data->battery_mv);
+    
+    // Заряд и время бодрствования (спящие датчики сообщают его за
+    // прошлый цикл, старые не шлют) — в таблицу, для /api/devices
+    uint16_t pos = find_node(sensor_mac);
+    if (pos != MAC_INDEX_NONE) {
+        node_battery_mv[pos] = data->battery_mv;
+        if (data_len >= sizeof(SensorData)) {
+            node_awake_ms[pos] = data->awake_ms;
+        }
+    }
+    
+    portENTER_CRITICAL(&live_mux);
+    live_delta_reading(live_pending, sensor_mac, data->temperature, data->humidity,
+                       data->battery_mv, data->rssi);
+    portEXIT_CRITICAL(&live_mux);
     
     // Проверяем аномалии
     if (data->temperature > 40.0) {
         // Слишком горячо!
-        Serial.println("High temperature detected!");
-        log_event("high_temperature", mac_to_string(packet->src_mac).c_str());
+        LOG_W("High temperature detected!");
+        log_event(EV_HIGH_TEMPERATURE, sensor_mac, temp_x10);
     }
     
     if (data->battery_mv < 3000) {
         // Батарея садится
-        Serial.println("Low battery!");
-        log_event("low_battery", mac_to_string(packet->src_mac).c_str());
+        LOG_W("Low battery!");
+        log_event(EV_LOW_BATTERY, sensor_mac, data->battery_mv);
+    }
+}
+
+/**
+ * Обработка пачки показаний от репитера
+ * 
+ * Репитер собирает SensorData своих детей за окно агрегации
+ * и шлёт одним кадром. Датчики — дети репитера: он и есть родитель.
+ * 
+ * @param packet Пакет MSG_DATA_BATCH
+ */
+void handle_sensor_batch(const MeshPacketHeader* packet) {
+    if (!payload_fits(packet, 1)) {
+        return;
+    }
+    
+    const SensorBatch* batch = (const SensorBatch*)packet->payload;
+    // Читаем только записи, которые реально пришли в кадре
+    uint8_t count = (packet->payload_len - 1) / sizeof(SensorRecord);
+    if (batch->count < count) {
+        count = batch->count;
+    }
+    
+    uint16_t repeater = find_node(packet->src_mac);
+    uint8_t hops = repeater != MAC_INDEX_NONE && route_hops[repeater] ? route_hops[repeater] + 1 : 0;
+    
+    for (uint8_t i = 0; i < count; i++) {
+        const SensorRecord* record = &batch->records[i];
+        update_routing_table(record->src_mac, record->data.rssi, packet->src_mac, hops);
+        handle_sensor_data(record->src_mac, &record->data, sizeof(SensorData));
     }
 }
 
@@ -618,8 +1591,8 @@ void handle_sensor_data(const MeshPacketHeader* packet, const SensorData* data)
  * @param packet Пакет с командой
  */
 void handle_command(const MeshPacketHeader* packet) {
-    Serial.printf("Command from %s\n", mac_to_string(packet->src_mac).c_str());
-    log_event("command_received", mac_to_string(packet->src_mac).c_str());
+    LOG_I("Command from %s", mac_to_string(packet->src_mac).c_str());
+    log_event(EV_COMMAND_RECEIVED, packet->src_mac);
     
     // В реальной системе здесь была бы обработка команд
     // Например: включить свет, изменить температуру и т.д.
@@ -635,13 +1608,13 @@ void handle_command(const MeshPacketHeader* packet) {
  */
 void handle_heartbeat(const MeshPacketHeader* packet) {
     // Обновляем время последнего контакта
-    RoutingEntry* entry = find_routing_entry(packet->src_mac);
-    if (entry) {
-        entry->last_seen = millis() / 1000;
-        entry->status = 1;  // Онлайн
+    uint16_t pos = find_node(packet->src_mac);
+    if (pos != MAC_INDEX_NONE) {
+        node_last_seen[pos] = millis() / 1000;
+        mark_device_online(pos);
         
         // Можно добавить статистику RSSI
-        // entry->rssi = ...;
+        // node_rssi[pos] = ...;
     }
 }
 
@@ -654,37 +1627,186 @@ void handle_heartbeat(const MeshPacketHeader* packet) {
  * @param packet Discovery пакет
  */
 void handle_discovery(const MeshPacketHeader* packet) {
-    Serial.printf("Discovery from %s\n", mac_to_string(packet->src_mac).c_str());
-    log_event("device_discovered", mac_to_string(packet->src_mac).c_str());
+    if (is_for_me(packet, self_mac) && memcmp(packet->dst_mac, BROADCAST_MAC, 6) != 0) {
+        network_state.discovery_replies++;
+    }
+    LOG_I("Discovery from %s", mac_to_string(packet->src_mac).c_str());
+    log_event(EV_DEVICE_DISCOVERED, packet->src_mac);
     
     // Отправляем ответ с конфигурацией
     // В реальной системе здесь была бы отправка
     // network_id, channel, encryption keys и т.д.
     
-    Serial.println("Sending welcome packet...");
+    LOG_D("Sending welcome packet...");
 }
 
 /**
  * Обработка групповых команд
  * 
- * Команда для группы устройств.
- * Координатор рассылает её всем устройствам в группе.
+ * Команда для группы устройств. Адресованную нам координатор
+ * раздаёт всем устройствам группы (send_group_fanout); с
+ * FLAG_LOCAL_PROCESS её уже раздал репитер — только журналируем.
  * 
  * @param packet Пакет групповой команды
  */
 void handle_group_command(const MeshPacketHeader* packet) {
-    GroupCommand* cmd = (GroupCommand*)packet->payload;
+    if (!payload_fits(packet, offsetof(GroupCommand, parameters))) {
+        return;
+    }
     
-    Serial.printf("Group command: group=0x%04X, cmd=0x%02X\n",
-                 cmd->group_id, cmd->command_code);
+    GroupCommand cmd = {};
+    memcpy(&cmd, packet->payload, offsetof(GroupCommand, parameters));
+    // Параметров не больше, чем реально пришло
+    uint8_t available = packet->payload_len - offsetof(GroupCommand, parameters);
+    if (cmd.parameter_len > available) cmd.parameter_len = available;
+    if (cmd.parameter_len > sizeof(cmd.parameters)) cmd.parameter_len = sizeof(cmd.parameters);
+    memcpy(cmd.parameters, ((const GroupCommand*)packet->payload)->parameters, cmd.parameter_len);
     
-    // В реальной системе здесь был бы поиск
-    // устройств в указанной группе и рассылка
-    // команды каждому из них.
+    LOG_I("Group command: group=0x%04X, cmd=0x%02X",
+         cmd.group_id, cmd.command_code);
+    
+    if (!requires_local_processing(packet) && is_for_me(packet, self_mac)) {
+        send_group_fanout(&cmd);
+    }
     
-    log_event("group_command", 
-             String("group=" + String(cmd->group_id, HEX) + 
-                   " cmd=" + String(cmd->command_code, HEX)).c_str());
+    log_event(EV_GROUP_COMMAND, packet->src_mac, cmd.group_id, cmd.command_code);
+}
+
+/**
+ * План раздачи команды группе
+ * 
+ * Член, который слышит нас сам, получает команду из одного общего
+ * broadcast на прыжок. Ребёнок соседа-репитера — из broadcast на
+ * прыжок, который сделает этот репитер (до него — один unicast).
+ * Остальным — unicast по маршруту, кадр на каждый прыжок. Общая
+ * рассылка стоит кадр от нас и по кадру от каждого репитера; известны
+ * только те, через кого достижим кто-то ещё, поэтому оценка снизу.
+ * 
+ * @param slot Слот группы в group_index
+ * @param plan Куда записать план
+ */
+void plan_group_fanout(uint8_t slot, GroupFanoutPlan* plan) {
+    *plan = GroupFanoutPlan();
+    
+    for (uint16_t pos = group_index_next(&group_index, slot, 0); pos != GROUP_INDEX_END;
+         pos = group_index_next(&group_index, slot, pos + 1)) {
+        plan->members++;
+        
+        if (route_hops[pos] == 1 || node_parent[pos] == NODE_SELF) {
+            plan->direct++;
+            continue;
+        }
+        
+        uint8_t root = node_parent[pos];
+        if (route_hops[pos] == 2 && root < NODE_SELF && route_hops[root] == 1) {
+            if (!group_bitmap_test(plan->roots, root)) {
+                group_bitmap_set(plan->roots, root);
+                plan->subtrees++;
+            }
+        } else {
+            group_bitmap_set(plan->deep_members, pos);
+            plan->deep++;
+            plan->subtree_frames += route_hops[pos] > 2 ? route_hops[pos] : 2;
+        }
+    }
+    plan->subtree_frames += (plan->direct ? 1 : 0) + 2 * plan->subtrees;
+    
+    // Репитеры — все, через кого достижим кто-то ещё
+    uint32_t relays[GROUP_BITMAP_WORDS] = {};
+    plan->flood_frames = 1;
+    for (uint16_t i = 0; i < routing_table_size; i++) {
+        uint8_t parent = node_parent[i];
+        if (parent < NODE_SELF && !group_bitmap_test(relays, parent)) {
+            group_bitmap_set(relays, parent);
+            plan->flood_frames++;
+        }
+    }
+    
+    plan->flood = plan->flood_frames <= plan->subtree_frames;
+}
+
+/**
+ * Раздача команды членам группы
+ * 
+ * Общая рассылка — один broadcast на всю сеть, получатели отбирают
+ * свою группу по group_id заголовка. Через поддеревья — соседям-
+ * репитерам unicast с FLAG_LOCAL_PROCESS, каждый раздаёт команду
+ * детям одним broadcast на прыжок (см. plan_group_fanout). Выбираем,
+ * где кадров меньше: 30 ламп у трёх репитеров — 7 кадров, а не 30
+ * отправок подряд.
+ * 
+ * @param cmd Команда (group_id — кому)
+ * @return Число известных членов группы (0 — ничего не ушло)
+ */
+uint16_t send_group_fanout(const GroupCommand* cmd) {
+    uint8_t slot = group_index_find(&group_index, cmd->group_id);
+    if (slot == GROUP_INDEX_NONE) {
+        LOG_W("Group 0x%04X has no known members", cmd->group_id);
+        return 0;
+    }
+    
+    GroupFanoutPlan plan;
+    plan_group_fanout(slot, &plan);
+    
+    MeshPacketHeader packet = {};
+    packet.network_id = MESH_NETWORK_ID;
+    packet.version = PROTOCOL_VERSION;
+    memcpy(packet.src_mac, self_mac, 6);
+    memcpy(packet.last_hop_mac, self_mac, 6);
+    packet.msg_type = MSG_CMD_GROUP;
+    packet.group_id = cmd->group_id;
+    packet.payload_len = offsetof(GroupCommand, parameters) + cmd->parameter_len;
+    memcpy(packet.payload, cmd, packet.payload_len);
+    
+    if (plan.flood) {
+        packet.ttl = DEFAULT_TTL;
+        packet.packet_id = next_packet_id();
+        memcpy(packet.dst_mac, BROADCAST_MAC, 6);
+        send_packet(BROADCAST_MAC, &packet, mesh_packet_wire_size(&packet));
+        network_state.group_floods++;
+    } else {
+        // Свои соседи — одним broadcast, дальше он не пойдёт
+        packet.flags = FLAG_LOCAL_PROCESS;
+        if (plan.direct) {
+            packet.ttl = 1;
+            packet.packet_id = next_packet_id();
+            memcpy(packet.dst_mac, BROADCAST_MAC, 6);
+            send_packet(BROADCAST_MAC, &packet, mesh_packet_wire_size(&packet));
+        }
+        
+        // Соседям-репитерам: раздадут своим детям
+        packet.ttl = DEFAULT_TTL;
+        for (uint16_t pos = group_bitmap_next(plan.roots, GROUP_BITMAP_WORDS, 0); pos != GROUP_INDEX_END;
+             pos = group_bitmap_next(plan.roots, GROUP_BITMAP_WORDS, pos + 1)) {
+            packet.packet_id = next_packet_id();
+            memcpy(packet.dst_mac, node_mac[pos], 6);
+            send_mesh_packet(node_mac[pos], &packet);
+        }
+        
+        // Дальние члены — каждому по маршруту
+        packet.flags = 0;
+        for (uint16_t pos = group_bitmap_next(plan.deep_members, GROUP_BITMAP_WORDS, 0);
+             pos != GROUP_INDEX_END;
+             pos = group_bitmap_next(plan.deep_members, GROUP_BITMAP_WORDS, pos + 1)) {
+            const uint8_t* next_hop = next_hop_for(node_mac[pos]);
+            if (!next_hop) {
+                continue;
+            }
+            packet.packet_id = next_packet_id();
+            memcpy(packet.dst_mac, node_mac[pos], 6);
+            send_mesh_packet(next_hop, &packet);
+        }
+        network_state.group_subtree_fanouts++;
+    }
+    network_state.group_frames += plan.flood ? plan.flood_frames : plan.subtree_frames;
+    
+    LOG_I("Group 0x%04X: %u members, %s (%u frames, %s %u)",
+         cmd->group_id, plan.members, plan.flood ? "flood" : "subtree",
+         plan.flood ? plan.flood_frames : plan.subtree_frames,
+         plan.flood ? "subtree" : "flood",
+         plan.flood ? plan.subtree_frames : plan.flood_frames);
+    
+    return plan.members;
 }
 
 /**
@@ -696,11 +1818,19 @@ void handle_group_command(const MeshPacketHeader* packet) {
  * @param packet Пакет события
  */
 void handle_emergency_event(const MeshPacketHeader* packet) {
+    if (!payload_fits(packet, sizeof(EmergencyEvent))) {
+        return;
+    }
+    
     EmergencyEvent* event = (EmergencyEvent*)packet->payload;
     
-    Serial.printf("EMERGENCY! Type: %d, Severity: %d, From: %s\n",
-                 event->event_type, event->severity,
-                 mac_to_string(event->sensor_mac).c_str());
+    LOG_E("EMERGENCY! Type: %d, Severity: %d, From: %s",
+         event->event_type, event->severity,
+         mac_to_string(event->sensor_mac).c_str());
+    
+    portENTER_CRITICAL(&live_mux);
+    live_delta_event(live_pending, event->sensor_mac, event->event_type, event->severity);
+    portEXIT_CRITICAL(&live_mux);
     
     // Визуальная и звуковая сигнализация
     // (если есть подключённые устройства)
@@ -708,9 +1838,338 @@ void handle_emergency_event(const MeshPacketHeader* packet) {
     // Уведомления
     // (если есть подключение к интернету)
     
-    log_event("emergency", 
-             String("type=" + String(event->event_type) +
-                   " severity=" + String(event->severity)).c_str());
+    log_event(EV_EMERGENCY, event->sensor_mac, event->event_type, event->severity);
+}
+
+/**
+ * Обработка объявления маршрутов от репитера
+ * 
+ * Репитер перечисляет своих непосредственных детей —
+ * для них он и есть родитель. Полным списком шлют прежние
+ * прошивки, новые — изменениями (handle_route_delta).
+ * 
+ * @param packet Пакет с RoutingUpdate
+ * @param last_hop_mac Репитер, приславший объявление
+ */
+void handle_routing_update(const MeshPacketHeader* packet, const uint8_t* last_hop_mac) {
+    if (!payload_fits(packet, 1)) {
+        return;
+    }
+    
+    const RoutingUpdate* update = (const RoutingUpdate*)packet->payload;
+    // Читаем только записи, которые реально пришли в кадре
+    uint8_t count = (packet->payload_len - 1) / sizeof(RouteAdvert);
+    if (update->count < count) {
+        count = update->count;
+    }
+    
+    // Соседи объявившего репитера — на прыжок дальше него
+    uint16_t advertiser = find_node(packet->src_mac);
+    uint8_t hops = advertiser != MAC_INDEX_NONE && route_hops[advertiser] ? route_hops[advertiser] + 1 : 0;
+    
+    for (uint8_t i = 0; i < count; i++) {
+        const RouteAdvert* route = &update->routes[i];
+        if (route->hops != 0 || memcmp(route->mac, self_mac, 6) == 0) {
+            continue;
+        }
+        
+        uint16_t pos = find_node(route->mac);
+        if (pos != MAC_INDEX_NONE) {
+            select_parent(pos, last_hop_mac, hops);
+        } else {
+            update_routing_table(route->mac, 0, last_hop_mac, hops);
+        }
+    }
+}
+
+// Чьё объявление разбираем (контекст on_route_delta_op)
+struct RouteDeltaContext {
+    const uint8_t* advertiser;
+    uint8_t hops;                 // Прыжков до его детей (0 — неизвестно)
+};
+
+/**
+ * Операция из объявления репитера над его ребёнком
+ * 
+ * ADD и METRIC — кандидат в родители, как в handle_routing_update
+ * (ETX чужого канала в цену пути координатора не входит). REMOVE —
+ * если родителем был этот репитер, маршрута больше нет: запись ждёт
+ * следующего пакета от устройства или объявления другого репитера.
+ */
+static void on_route_delta_op(uint8_t op, const uint8_t* mac, uint8_t metric, void* ctx) {
+    (void)metric;
+    const RouteDeltaContext* context = (const RouteDeltaContext*)ctx;
+    if (memcmp(mac, self_mac, 6) == 0) {
+        return;
+    }
+    
+    uint16_t pos = find_node(mac);
+    if (op == ROUTE_DELTA_OP_REMOVE) {
+        uint16_t advertiser = find_node(context->advertiser);
+        if (pos != MAC_INDEX_NONE && advertiser != MAC_INDEX_NONE && node_parent[pos] == advertiser) {
+            node_parent[pos] = NODE_NONE;
+            route_hops[pos] = 0;
+            mark_routing_dirty(pos);
+            network_state.topology_changes++;
+        }
+    } else if (pos != MAC_INDEX_NONE) {
+        select_parent(pos, context->advertiser, context->hops);
+    } else {
+        update_routing_table(mac, 0, context->advertiser, context->hops);
+    }
+}
+
+/**
+ * Обработка изменений маршрутов от репитера (MSG_ROUTE_DELTA)
+ * 
+ * Пропуск номера последовательности — просим у репитера снимок.
+ * 
+ * @param packet Пакет с RouteDeltaPayload
+ * @param last_hop_mac Репитер, приславший объявление
+ */
+void handle_route_delta(const MeshPacketHeader* packet, const uint8_t* last_hop_mac) {
+    uint16_t advertiser = find_node(last_hop_mac);
+    RouteDeltaContext context = { last_hop_mac, 0 };
+    if (advertiser != MAC_INDEX_NONE && route_hops[advertiser]) {
+        context.hops = route_hops[advertiser] + 1;
+    }
+    
+    RouteDeltaResult result = route_delta_rx_apply(&route_delta_rx, last_hop_mac, packet->payload,
+                                                   packet->payload_len, millis(),
+                                                   on_route_delta_op, &context);
+    if (result == ROUTE_DELTA_NEED_RESYNC) {
+        send_route_resync_request(last_hop_mac);
+    }
+}
+
+/**
+ * Просьба к репитеру прислать снимок своих детей
+ * 
+ * На один прыжок, broadcast-кадром: peer'а для соседа может не быть.
+ * 
+ * @param advertiser MAC репитера
+ */
+void send_route_resync_request(const uint8_t* advertiser) {
+    MeshPacketHeader packet = {};
+    packet.network_id = MESH_NETWORK_ID;
+    packet.version = PROTOCOL_VERSION;
+    packet.ttl = 1;
+    packet.packet_id = next_packet_id();
+    memcpy(packet.src_mac, self_mac, 6);
+    memcpy(packet.dst_mac, advertiser, 6);
+    memcpy(packet.last_hop_mac, self_mac, 6);
+    packet.msg_type = MSG_ROUTE_DELTA;
+    packet.payload_len = ROUTE_DELTA_HEADER_SIZE;
+    ((RouteDeltaPayload*)packet.payload)->flags = ROUTE_DELTA_RESYNC;
+    send_packet(BROADCAST_MAC, &packet, mesh_packet_wire_size(&packet));
+}
+
+/**
+ * Обработка MSG_ACK / MSG_NACK на наши пакеты
+ * 
+ * Снимает пакет с доставки: по ACK — успешно,
+ * по NACK — с вызовом reliable_give_up.
+ * 
+ * @param packet Пакет подтверждения
+ */
+void handle_ack(const MeshPacketHeader* packet) {
+    if (!payload_fits(packet, sizeof(AckPayload))) {
+        return;
+    }
+    
+    const AckPayload* ack = (const AckPayload*)packet->payload;
+    
+    xSemaphoreTake(reliable_mutex, portMAX_DELAY);
+    if (packet->msg_type == MSG_ACK) {
+        reliable_on_ack(&reliable_table, packet->src_mac, ack->acked_id);
+    } else {
+        reliable_on_nack(&reliable_table, packet->src_mac, ack->acked_id, ack->status);
+    }
+    xSemaphoreGive(reliable_mutex);
+}
+
+/**
+ * Ответ на наш замер задержки
+ * 
+ * RTT считается здесь, поэтому включает и ожидание ответа в очереди
+ * приёма координатора.
+ * 
+ * @param packet MSG_PROBE от адресата замера
+ */
+void handle_probe_reply(const MeshPacketHeader* packet) {
+    uint32_t now_us = micros();
+    if (!payload_fits(packet, PROBE_HEADER_SIZE)) {
+        return;
+    }
+    
+    const ProbePayload* probe = (const ProbePayload*)packet->payload;
+    uint8_t hop_count = probe->hop_count;
+    if (probe->direction != PROBE_DIR_REPLY || hop_count > PROBE_MAX_HOPS ||
+        !payload_fits(packet, PROBE_HEADER_SIZE + hop_count * sizeof(ProbeHop))) {
+        return;
+    }
+    
+    portENTER_CRITICAL(&probe_mux);
+    bool matched = probe_state.status == PROBE_PENDING &&
+                   probe_state.probe_id == probe->probe_id &&
+                   memcmp(probe_state.target, packet->src_mac, 6) == 0;
+    if (matched) {
+        probe_state.rtt_us = now_us - probe_state.sent_us;
+        probe_state.hop_count = hop_count;
+        memcpy(probe_state.hops, probe->hops, hop_count * sizeof(ProbeHop));
+        probe_state.status = PROBE_DONE;
+    }
+    uint32_t rtt_us = probe_state.rtt_us;
+    portEXIT_CRITICAL(&probe_mux);
+    
+    if (matched) {
+        LOG_I("Probe to %s: RTT %lu us, %u hops",
+             mac_to_string(packet->src_mac).c_str(), rtt_us, hop_count);
+    }
+}
+
+/**
+ * Таймаут замера задержки (из loop)
+ */
+void poll_probe() {
+    uint32_t now = millis();
+    uint8_t target[6];
+    
+    portENTER_CRITICAL(&probe_mux);
+    bool expired = probe_state.status == PROBE_PENDING &&
+                   now - probe_state.sent_ms > PROBE_TIMEOUT_MS;
+    if (expired) {
+        probe_state.status = PROBE_TIMEOUT;
+        memcpy(target, probe_state.target, 6);
+    }
+    portEXIT_CRITICAL(&probe_mux);
+    
+    if (expired) {
+        LOG_W("Probe to %s timed out", mac_to_string(target).c_str());
+    }
+}
+
+/**
+ * Копия состояния замера для вывода
+ * 
+ * @return Снимок probe_state
+ */
+ProbeState probe_snapshot() {
+    portENTER_CRITICAL(&probe_mux);
+    ProbeState probe = probe_state;
+    portEXIT_CRITICAL(&probe_mux);
+    return probe;
+}
+
+/**
+ * Средняя задержка одного прыжка в эфире
+ * 
+ * Часы узлов не синхронизированы, так что делить эфир по прыжкам
+ * нечем: из RTT вычитаем время на узлах и делим поровну. Медленный
+ * ретранслятор виден по своему residence_us.
+ * 
+ * @param probe Завершённый замер
+ * @return Мкс на прыжок (записей + 1 прыжок)
+ */
+uint32_t probe_link_us(const ProbeState* probe) {
+    uint32_t residence = 0;
+    for (uint8_t i = 0; i < probe->hop_count; i++) {
+        residence += probe->hops[i].residence_us;
+    }
+    if (probe->rtt_us <= residence) {
+        return 0;
+    }
+    return (probe->rtt_us - residence) / (probe->hop_count + 1);
+}
+
+/**
+ * MAC узла из записи о прыжке
+ * 
+ * В записи только три последних байта — полный MAC ищем в таблице
+ * маршрутизации, не нашли — старшие байты выводим как "??".
+ * 
+ * @param hop Запись о прыжке
+ * @param buf Буфер на 18 байт
+ */
+void format_probe_hop(const ProbeHop* hop, char* buf) {
+    for (uint16_t i = 0; i < routing_table_size; i++) {
+        if (memcmp(node_mac[i] + 3, hop->mac_tail, 3) == 0) {
+            format_mac(node_mac[i], buf);
+            return;
+        }
+    }
+    snprintf(buf, 18, "??:??:??:%02X:%02X:%02X", hop->mac_tail[0], hop->mac_tail[1], hop->mac_tail[2]);
+}
+
+/**
+ * Вывод последнего замера в консоль
+ */
+void print_probe_result() {
+    ProbeState probe = probe_snapshot();
+    if (probe.status == PROBE_IDLE) {
+        Serial.println("No probe yet, use: probe AA:BB:CC:DD:EE:FF");
+        return;
+    }
+    
+    Serial.printf("Probe %lu to %s: %s\n", probe.probe_id,
+                 mac_to_string(probe.target).c_str(), PROBE_STATUS_NAMES[probe.status]);
+    if (probe.status != PROBE_DONE) {
+        return;
+    }
+    
+    Serial.printf("RTT %lu us, %u hops, ~%lu us per link in the air\n",
+                 probe.rtt_us, probe.hop_count, probe_link_us(&probe));
+    for (uint8_t i = 0; i < probe.hop_count; i++) {
+        char mac[18];
+        format_probe_hop(&probe.hops[i], mac);
+        bool is_target = memcmp(probe.hops[i].mac_tail, probe.target + 3, 3) == 0;
+        Serial.printf("%2u. %s %5u us%s\n", i + 1, mac, probe.hops[i].residence_us,
+                     is_target ? " (target)" : "");
+    }
+}
+
+/**
+ * Минимальный payload для типа сообщения
+ * 
+ * @param msg_type Тип сообщения
+ * @return Сколько байт payload нужно обработчику
+ */
+size_t required_payload(uint8_t msg_type) {
+    switch (msg_type) {
+        case MSG_DATA_SENSOR:     return offsetof(SensorData, awake_ms);
+        case MSG_CMD_GROUP:       return offsetof(GroupCommand, parameters);
+        case MSG_EVENT_BROADCAST: return sizeof(EmergencyEvent);
+        case MSG_ROUTING_UPDATE:
+        case MSG_DATA_BATCH:      return 1;
+        case MSG_ACK:
+        case MSG_NACK:            return sizeof(AckPayload);
+        case MSG_PROBE:           return PROBE_HEADER_SIZE;
+        case MSG_REFLEX_RULES:    return REFLEX_TABLE_HEADER_SIZE;
+        case MSG_ROUTE_DELTA:     return ROUTE_DELTA_HEADER_SIZE;
+        default:                  return 0;
+    }
+}
+
+/**
+ * Проверка, что в пакете пришло не меньше size байт payload
+ * 
+ * Кадр v2 несёт только полезные байты, поэтому читать структуру
+ * целиком можно лишь после этой проверки.
+ * 
+ * @param packet Пакет
+ * @param size Сколько байт payload нужно обработчику
+ * @return true если данных достаточно
+ */
+bool payload_fits(const MeshPacketHeader* packet, size_t size) {
+    if (packet->payload_len >= size) {
+        return true;
+    }
+    
+    LOG_W("Short payload from %s: type=0x%02X, %u < %u",
+         mac_to_string(packet->src_mac).c_str(), packet->msg_type,
+         packet->payload_len, (unsigned)size);
+    packet_metrics_drop(&packet_metrics, DROP_INVALID);
+    return false;
 }
 
 // ============================================================================
@@ -722,491 +2181,2027 @@ void handle_emergency_event(const MeshPacketHeader* packet) {
  * 
  * Определяет куда отправить пакет дальше.
  * Использует таблицу маршрутизации.
+ * Входной пакет не меняется: TTL уменьшается на копии.
  * 
  * @param packet Пакет для маршрутизации
  */
 void route_packet(const MeshPacketHeader* packet) {
-    // Ищем запись в таблице маршрутизации
-    RoutingEntry* entry = find_routing_entry(packet->dst_mac);
+    if (packet->ttl <= 1) {
+        packet_metrics_drop(&packet_metrics, DROP_TTL_EXPIRED);
+        return;  // Дальше пакет не пойдёт
+    }
+    
+    // Определяем следующий прыжок по таблице маршрутизации
+    const uint8_t* next_hop = next_hop_for(packet->dst_mac);
+    
+    if (!next_hop) {
+        // Маршрут не найден
+        LOG_W("No route to %s", mac_to_string(packet->dst_mac).c_str());
+        log_event(EV_ROUTE_NOT_FOUND, packet->dst_mac);
+        packet_metrics_drop(&packet_metrics, DROP_NO_ROUTE);
+        return;
+    }
+    
+    // Отправляем
+    LOG_D("Routing packet to %s via %s",
+         mac_to_string(packet->dst_mac).c_str(),
+         mac_to_string(next_hop).c_str());
+    
+    MeshPacketHeader forward;
+    memcpy(&forward, packet, mesh_packet_wire_size(packet));
+    decrement_ttl(&forward);
+    memcpy(forward.last_hop_mac, self_mac, 6);
+    
+    send_mesh_packet(next_hop, &forward);
+}
+
+/**
+ * Следующий прыжок к устройству
+ * 
+ * @param dst_mac MAC получателя
+ * @return MAC следующего прыжка или nullptr, если маршрута нет
+ */
+const uint8_t* next_hop_for(const uint8_t* dst_mac) {
+    uint16_t pos = find_node(dst_mac);
+    if (pos == MAC_INDEX_NONE) {
+        return nullptr;
+    }
+    return node_parent_mac(pos);
+}
+
+/**
+ * MAC родителя узла
+ * 
+ * @param pos Номер узла
+ * @return MAC самого узла, если он слышит нас напрямую; nullptr,
+ *         если маршрута нет (прежний родитель объявил, что узел ушёл)
+ */
+const uint8_t* node_parent_mac(uint16_t pos) {
+    uint8_t parent = node_parent[pos];
+    if (parent == NODE_SELF) {
+        return node_mac[pos];
+    }
+    if (parent == NODE_NONE) {
+        return nullptr;
+    }
+    // Узел дальше по цепочке — отправляем его родителю
+    return node_mac[parent];
+}
+
+/**
+ * Поиск узла в таблице маршрутизации
+ * 
+ * Через хеш-индекс: пара сравнений вместо прохода по таблице.
+ * 
+ * @param mac MAC для поиска
+ * @return Номер узла или MAC_INDEX_NONE
+ */
+uint16_t find_node(const uint8_t* mac) {
+    return mac_index_find(&routing_index, mac);
+}
+
+/**
+ * Номер узла, с заведением новой записи
+ * 
+ * Новый узел — без маршрута, видели только что и потому сразу
+ * онлайн через mark_device_online: /api/devices и живые обновления
+ * не расходятся. Данные о связи заполняет вызывающий.
+ * 
+ * @param mac MAC устройства
+ * @return Номер узла или MAC_INDEX_NONE, если таблица переполнена
+ */
+uint16_t intern_node(const uint8_t* mac) {
+    uint16_t pos = find_node(mac);
+    if (pos != MAC_INDEX_NONE) {
+        return pos;
+    }
+    
+    if (routing_table_size >= MAX_ROUTING_ENTRIES) {
+        LOG_E("Routing table full!");
+        return MAC_INDEX_NONE;
+    }
+    
+    pos = routing_table_size;
+    memcpy(node_mac[pos], mac, 6);
+    node_parent[pos] = NODE_NONE;
+    node_proto[pos] = 0;
+    node_last_seen[pos] = millis() / 1000;
+    node_online[pos] = 0;
+    node_rssi[pos] = 0;
+    node_battery_mv[pos] = 0;
+    node_awake_ms[pos] = 0;
+    route_hops[pos] = 0;
+    mac_index_insert(&routing_index, mac, pos);
+    routing_table_size++;
+    mark_routing_dirty(pos, true);
+    mark_device_online(pos);
+    
+    LOG_I("New device: %s", mac_to_string(mac).c_str());
+    return pos;
+}
+
+/**
+ * Перестроение хеш-индекса с нуля
+ * 
+ * После загрузки таблицы и когда накопилось много надгробий.
+ */
+void rebuild_routing_index() {
+    mac_index_init(&routing_index, routing_index_storage, ROUTING_INDEX_SLOTS);
+    for (uint16_t i = 0; i < routing_table_size; i++) {
+        mac_index_insert(&routing_index, node_mac[i], i);
+    }
+}
+
+/**
+ * Обновление таблицы маршрутизации
+ * 
+ * Добавляет или обновляет запись об устройстве.
+ * 
+ * @param mac MAC устройства
+ * @param rssi Сила сигнала
+ * @param parent_mac MAC родителя (nullptr если мы родитель)
+ * @param hops Прыжков до устройства через parent_mac (0 — неизвестно)
+ */
+void update_routing_table(const uint8_t* mac, int8_t rssi, const uint8_t* parent_mac, uint8_t hops) {
+    uint16_t pos = intern_node(mac);
+    if (pos == MAC_INDEX_NONE) {
+        return;
+    }
+    
+    // Обновляем данные
+    node_rssi[pos] = rssi;
+    node_last_seen[pos] = millis() / 1000;
+    mark_device_online(pos);
+    
+    if (parent_mac) {
+        select_parent(pos, parent_mac, hops);
+    }
+}
+
+/**
+ * Выбор родителя по качеству пути
+ * 
+ * Родитель — наш сосед, через которого устройство достижимо. Нового
+ * принимаем, если путь через него дешевле текущего по ожидаемым
+ * передачам (link_path_metric) хотя бы на LINK_SWITCH_HYSTERESIS или
+ * текущего соседа давно не слышно. Иначе копия пакета, первой
+ * пришедшая через слабый канал, перетягивала бы маршрут на себя.
+ * 
+ * Родитель заводится в таблице как узел: хранится его номер.
+ * 
+ * @param pos Номер устройства
+ * @param parent_mac Через кого пришёл пакет
+ * @param hops Прыжков до устройства через него (0 — неизвестно)
+ */
+void select_parent(uint16_t pos, const uint8_t* parent_mac, uint8_t hops) {
+    uint16_t parent = NODE_SELF;
+    if (memcmp(parent_mac, node_mac[pos], 6) != 0 && memcmp(parent_mac, self_mac, 6) != 0) {
+        parent = intern_node(parent_mac);
+        if (parent == MAC_INDEX_NONE) {
+            return;
+        }
+    }
+    
+    if (node_parent[pos] == parent) {
+        if (hops) {
+            route_hops[pos] = hops;
+        }
+        return;
+    }
+    
+    const uint8_t* current_mac = node_parent_mac(pos);
+    if (current_mac) {
+        uint32_t now = millis();
+        portENTER_CRITICAL(&link_mux);
+        const LinkStats* current = link_find(&link_table, current_mac);
+        bool current_alive = current && now - current->last_rx_ms < LINK_STALE_MS;
+        uint16_t current_cost = link_path_metric(link_etx(current), route_hops[pos]);
+        uint16_t candidate_cost = link_path_metric(link_etx(link_find(&link_table, parent_mac)), hops);
+        portEXIT_CRITICAL(&link_mux);
+        
+        if (current_alive && candidate_cost + LINK_SWITCH_HYSTERESIS > current_cost) {
+            return;
+        }
+        network_state.parent_switches++;
+    }
+    network_state.topology_changes++;
+    
+    // Во flash запись уйдёт из persist_task
+    node_parent[pos] = (uint8_t)parent;
+    route_hops[pos] = hops;
+    mark_routing_dirty(pos);
+}
+
+/**
+ * Вывод качества связи с соседями в консоль
+ * 
+ * Копия таблицы под link_mux — печать в Serial долгая.
+ */
+void print_links() {
+    static LinkStats links[LINK_TABLE_SIZE];
+    portENTER_CRITICAL(&link_mux);
+    memcpy(links, link_storage, sizeof(links));
+    portEXIT_CRITICAL(&link_mux);
+    
+    uint32_t now = millis();
+    Serial.println("=== Neighbours ===");
+    for (int i = 0; i < LINK_TABLE_SIZE; i++) {
+        if (!links[i].valid) {
+            continue;
+        }
+        uint16_t etx = link_etx(&links[i]);
+        Serial.printf("%s  RSSI %4d  ETX %u.%02u  tx %lu ok / %lu failed  heard %lu s ago\n",
+                     mac_to_string(links[i].mac).c_str(), link_rssi(&links[i]),
+                     etx / LINK_ETX_ONE, (etx % LINK_ETX_ONE) * 100 / LINK_ETX_ONE,
+                     links[i].tx_ok, links[i].tx_fail, (now - links[i].last_rx_ms) / 1000);
+    }
+}
+
+/**
+ * Удаление записи из таблицы
+ * 
+ * @param mac MAC для удаления
+ */
+void remove_routing_entry(const uint8_t* mac) {
+    uint16_t index = mac_index_find(&routing_index, mac);
+    if (index != MAC_INDEX_NONE) {
+        remove_routing_entry_at(index);
+    }
+}
+
+/**
+ * Удаление записи по позиции
+ * 
+ * Swap-remove: на место удалённой ставим последнюю запись, без
+ * сдвига всей таблицы. Родители хранятся номерами, поэтому один
+ * проход по node_parent: дети удалённого узла остаются без маршрута,
+ * ссылки на переехавший получают новый номер.
+ * 
+ * @param index Номер узла
+ */
+void remove_routing_entry_at(uint16_t index) {
+    uint16_t last = routing_table_size - 1;
+    
+    for (uint16_t i = 0; i < routing_table_size; i++) {
+        if (node_parent[i] == index) {
+            node_parent[i] = NODE_NONE;
+            route_hops[i] = 0;
+            mark_routing_dirty(i);
+        } else if (node_parent[i] == last) {
+            node_parent[i] = (uint8_t)index;
+            mark_routing_dirty(i);
+        }
+    }
+    
+    mac_index_remove(&routing_index, node_mac[index]);
+    group_index_clear(&group_index, index);
+    if (index != last) {
+        memcpy(node_mac[index], node_mac[last], 6);
+        node_parent[index] = node_parent[last];
+        node_proto[index] = node_proto[last];
+        node_last_seen[index] = node_last_seen[last];
+        node_online[index] = node_online[last];
+        node_rssi[index] = node_rssi[last];
+        node_battery_mv[index] = node_battery_mv[last];
+        node_awake_ms[index] = node_awake_ms[last];
+        route_hops[index] = route_hops[last];
+        mac_index_update(&routing_index, node_mac[index], index);
+        group_index_move(&group_index, last, index);
+    }
+    routing_table_size--;
+    network_state.topology_changes++;
+    
+    // Хвостовая страница не переписывается: лишнее отрежет счётчик
+    mark_routing_dirty(index, true);
+    
+    // Надгробия удлиняют цепочки поиска — время от времени чистим
+    if (routing_index.tombstones > ROUTING_INDEX_SLOTS / 4) {
+        rebuild_routing_index();
+    }
+}
+
+/**
+ * Очистка старых записей
+ * 
+ * Удаляет устройства которые не видели больше 5 минут.
+ * Идём с конца: swap-remove подставляет уже проверенную запись.
+ * Только из packet_task (JOB_CLEANUP).
+ */
+void cleanup_old_entries() {
+    uint32_t now = millis() / 1000;
+    uint32_t threshold = 300;  // 5 минут
+    
+    for (int i = routing_table_size - 1; i >= 0; i--) {
+        if (now - node_last_seen[i] > threshold) {
+            LOG_I("Removing stale device: %s",
+                 mac_to_string(node_mac[i]).c_str());
+            
+            portENTER_CRITICAL(&live_mux);
+            live_delta_removed(live_pending, node_mac[i]);
+            portEXIT_CRITICAL(&live_mux);
+            
+            remove_routing_entry_at(i);
+        }
+    }
+}
+
+/**
+ * Отметить ушедшие в офлайн устройства
+ * 
+ * Порог тот же, что у /api/devices: 5 минут. Переход уходит в живые
+ * обновления. Только из packet_task (JOB_MARK_OFFLINE).
+ */
+void mark_offline_devices() {
+    uint32_t now = millis() / 1000;
+    
+    for (int i = 0; i < routing_table_size; i++) {
+        if (node_online[i] == 1 && now - node_last_seen[i] >= 300) {
+            node_online[i] = 0;
+            portENTER_CRITICAL(&live_mux);
+            live_delta_online(live_pending, node_mac[i], false);
+            portEXIT_CRITICAL(&live_mux);
+        }
+    }
+}
+
+/**
+ * Задание обслуживания таблицы для packet_task
+ * 
+ * @param job Биты PacketTaskJob
+ */
+void post_packet_task_job(uint32_t job) {
+    __atomic_fetch_or(&packet_task_jobs, job, __ATOMIC_RELAXED);
+    xTaskNotifyGive(packet_task_handle);
+}
+
+/**
+ * Отметить устройство онлайн
+ * 
+ * Переход из офлайна (или новая запись) уходит в живые обновления.
+ * 
+ * @param pos Номер узла
+ */
+void mark_device_online(uint16_t pos) {
+    if (node_online[pos] == 1) {
+        return;
+    }
+    
+    node_online[pos] = 1;
+    network_state.topology_changes++;
+    portENTER_CRITICAL(&live_mux);
+    live_delta_online(live_pending, node_mac[pos], true);
+    portEXIT_CRITICAL(&live_mux);
+}
+
+// ============================================================================
+// СОХРАНЕНИЕ В NVS
+// ============================================================================
+
+/**
+ * Пометить запись для сохранения
+ * 
+ * Вызывать после изменения записи: если persist_task как раз
+ * копирует её страницу, пометка снова сделает страницу грязной.
+ * 
+ * @param index Номер узла
+ * @param count_changed Изменилось и число записей
+ */
+void mark_routing_dirty(uint16_t index, bool count_changed) {
+    uint16_t page = index / ROUTING_PAGE_ENTRIES;
+    
+    portENTER_CRITICAL(&routing_persist_mux);
+    if (page < ROUTING_PAGES) {
+        routing_dirty_pages[page / 32] |= 1u << (page % 32);
+    }
+    if (count_changed) {
+        routing_count_dirty = true;
+    }
+    portEXIT_CRITICAL(&routing_persist_mux);
+}
+
+/**
+ * Записать грязные страницы таблицы в NVS
+ * 
+ * Страница снимается копией без остановки приёма: пометка снимается
+ * до копирования, так что запись, изменённая посреди копии, уйдёт
+ * следующим проходом. Счётчик пишется после страниц. Свой объект
+ * Preferences — можно вызывать из любой задачи (перед перезагрузкой).
+ * 
+ * @return Сколько страниц записано
+ */
+uint16_t flush_routing_table() {
+    Preferences store;
+    bool opened = false;
+    uint16_t written = 0;
+    
+    for (uint16_t page = 0; page < ROUTING_PAGES; page++) {
+        uint32_t bit = 1u << (page % 32);
+        
+        portENTER_CRITICAL(&routing_persist_mux);
+        bool dirty = (routing_dirty_pages[page / 32] & bit) != 0;
+        routing_dirty_pages[page / 32] &= ~bit;
+        portEXIT_CRITICAL(&routing_persist_mux);
+        
+        if (!dirty) {
+            continue;
+        }
+        
+        // Хвост страницы за концом таблицы — нулями
+        RoutingRecord buf[ROUTING_PAGE_ENTRIES] = {};
+        uint16_t first = page * ROUTING_PAGE_ENTRIES;
+        uint16_t size = routing_table_size;
+        for (uint16_t i = 0; i < ROUTING_PAGE_ENTRIES && first + i < size; i++) {
+            memcpy(buf[i].device_mac, node_mac[first + i], 6);
+            buf[i].parent = node_parent[first + i];
+            buf[i].proto_version = node_proto[first + i];
+        }
+        
+        if (!opened) {
+            opened = store.begin("meshstatic", false);
+            if (!opened) {
+                // NVS недоступно — попробуем в следующий раз
+                mark_routing_dirty(first);
+                return written;
+            }
+        }
+        
+        char key[8];
+        snprintf(key, sizeof(key), "rn%u", page);
+        if (store.putBytes(key, buf, sizeof(buf)) == sizeof(buf)) {
+            written++;
+        } else {
+            mark_routing_dirty(first);
+        }
+    }
+    
+    portENTER_CRITICAL(&routing_persist_mux);
+    bool count_dirty = routing_count_dirty;
+    routing_count_dirty = false;
+    portEXIT_CRITICAL(&routing_persist_mux);
+    
+    if (count_dirty) {
+        if (!opened) {
+            opened = store.begin("meshstatic", false);
+        }
+        if (opened) {
+            store.putUShort("routing_count", routing_table_size);
+            
+            // Старый формат больше не нужен — страницы уже записаны
+            if (routing_legacy_format) {
+                store.remove("routing_table");
+                for (uint16_t page = 0; page * LEGACY_ROUTING_PAGE_ENTRIES < MAX_ROUTING_ENTRIES; page++) {
+                    char key[8];
+                    snprintf(key, sizeof(key), "rt%u", page);
+                    store.remove(key);
+                }
+                routing_legacy_format = false;
+            }
+        }
+    }
+    
+    if (opened) {
+        store.end();
+        network_state.nvs_flushes++;
+        network_state.nvs_page_writes += written;
+    }
+    return written;
+}
+
+/**
+ * Открытие журнала событий
+ * 
+ * Нумерация продолжается с сохранённой в файле. Файл другого
+ * формата или размера создаётся заново (один раз — нулями).
+ * 
+ * @param use_file SPIFFS смонтирована — журнал сохраняется во flash
+ */
+void open_event_log(bool use_file) {
+    event_file_mutex = xSemaphoreCreateMutex();
+    uint32_t first_seq = 0;
+    
+    if (use_file) {
+        const size_t records_size = EVENT_LOG_FILE_RECORDS * sizeof(EventRecord);
+        File file = SPIFFS.open(EVENT_LOG_FILE_PATH, "r");
+        bool valid = file && file.size() == sizeof(EventLogFileHeader) + records_size &&
+                     file.read((uint8_t*)&event_file_header, sizeof(event_file_header)) == sizeof(event_file_header) &&
+                     event_file_header.magic == EVENT_LOG_MAGIC &&
+                     event_file_header.record_size == sizeof(EventRecord) &&
+                     event_file_header.file_records == EVENT_LOG_FILE_RECORDS;
+        if (file) {
+            file.close();
+        }
+        
+        if (!valid) {
+            event_file_header = {EVENT_LOG_MAGIC, sizeof(EventRecord), EVENT_LOG_FILE_RECORDS, 0, 0};
+            file = SPIFFS.open(EVENT_LOG_FILE_PATH, "w");
+            valid = file && file.write((const uint8_t*)&event_file_header, sizeof(event_file_header)) ==
+                            sizeof(event_file_header);
+            
+            uint8_t zeros[256] = {};
+            for (size_t left = records_size; valid && left > 0; ) {
+                size_t n = left < sizeof(zeros) ? left : sizeof(zeros);
+                valid = file.write(zeros, n) == n;
+                left -= n;
+            }
+            if (file) {
+                file.close();
+            }
+        }
+        
+        event_file_ready = valid;
+        if (valid) {
+            first_seq = event_file_header.next_seq;
+        } else {
+            LOG_W("Event log file unavailable, keeping events in RAM only");
+        }
+    }
+    
+    event_log_init(&event_log, event_log_storage, EVENT_LOG_RAM_RECORDS, first_seq);
+    log_event(EV_BOOT);
+}
+
+/**
+ * Дописать новые события в файл журнала
+ * 
+ * Пачками по EVENT_LOG_FLUSH_BATCH, кольцо под замком только на
+ * время копирования пачки. Заголовок (next_seq) обновляется в конце.
+ * Если кольцо успело перезаписать несохранённое, в файле пропуск:
+ * всё до него считается устаревшим (first_seq).
+ * 
+ * @return Сколько записей сохранено
+ */
+uint32_t flush_event_log() {
+    if (!event_file_ready) {
+        return 0;
+    }
+    
+    EventRecord batch[EVENT_LOG_FLUSH_BATCH];
+    uint32_t saved = 0;
+    File file;
+    
+    xSemaphoreTake(event_file_mutex, portMAX_DELAY);
+    for (;;) {
+        uint32_t first;
+        portENTER_CRITICAL(&event_log_mux);
+        uint32_t count = event_log_take(&event_log, batch, EVENT_LOG_FLUSH_BATCH, &first);
+        portEXIT_CRITICAL(&event_log_mux);
+        
+        if (count == 0) {
+            break;
+        }
+        if (!file) {
+            file = SPIFFS.open(EVENT_LOG_FILE_PATH, "r+");
+            if (!file) {
+                break;
+            }
+        }
+        
+        // Пачка может переходить через конец файла — тогда два куска
+        for (uint32_t i = 0; i < count; ) {
+            uint32_t slot = (first + i) % EVENT_LOG_FILE_RECORDS;
+            uint32_t run = count - i;
+            if (run > EVENT_LOG_FILE_RECORDS - slot) {
+                run = EVENT_LOG_FILE_RECORDS - slot;
+            }
+            file.seek(sizeof(EventLogFileHeader) + slot * sizeof(EventRecord));
+            file.write((const uint8_t*)&batch[i], run * sizeof(EventRecord));
+            i += run;
+        }
+        
+        portENTER_CRITICAL(&event_log_mux);
+        event_log_mark_persisted(&event_log, first + count);
+        portEXIT_CRITICAL(&event_log_mux);
+        
+        if (first != event_file_header.next_seq) {
+            event_file_header.first_seq = first;
+        }
+        event_file_header.next_seq = first + count;
+        saved += count;
+    }
+    
+    if (file) {
+        if (saved > 0) {
+            file.seek(0);
+            file.write((const uint8_t*)&event_file_header, sizeof(event_file_header));
+        }
+        file.close();
+    }
+    xSemaphoreGive(event_file_mutex);
+    return saved;
+}
+
+/**
+ * Событие из файла журнала (вызывать под event_file_mutex)
+ * 
+ * @param seq Номер события
+ * @param out Куда положить запись
+ * @param file Файл журнала; открывается при первом обращении
+ * @return false — в файле такого события уже (или ещё) нет
+ */
+bool read_event_from_file(uint32_t seq, EventRecord* out, File* file) {
+    if (seq < event_log_file_oldest(&event_file_header) || seq >= event_file_header.next_seq) {
+        return false;
+    }
+    if (!*file) {
+        *file = SPIFFS.open(EVENT_LOG_FILE_PATH, "r");
+        if (!*file) {
+            return false;
+        }
+    }
+    
+    uint32_t slot = seq % EVENT_LOG_FILE_RECORDS;
+    return file->seek(sizeof(EventLogFileHeader) + slot * sizeof(EventRecord)) &&
+           file->read((uint8_t*)out, sizeof(*out)) == sizeof(*out);
+}
+
+/**
+ * Последние события из RAM в Serial (команда events)
+ * 
+ * @param count Сколько событий показать
+ */
+void print_recent_events(uint32_t count) {
+    portENTER_CRITICAL(&event_log_mux);
+    uint32_t end = event_log.head;
+    uint32_t oldest = event_log_oldest(&event_log);
+    portEXIT_CRITICAL(&event_log_mux);
+    
+    uint32_t seq = end - oldest > count ? end - count : oldest;
+    for (; seq < end; seq++) {
+        EventRecord rec;
+        portENTER_CRITICAL(&event_log_mux);
+        bool found = event_log_get(&event_log, seq, &rec);
+        portEXIT_CRITICAL(&event_log_mux);
+        
+        if (found) {
+            char line[112];
+            event_log_format(&rec, line, sizeof(line));
+            Serial.println(line);
+        }
+    }
+}
+
+/**
+ * Задача фонового сохранения
+ * 
+ * Раз в EVENT_LOG_FLUSH_MS дописывает журнал событий, раз в
+ * ROUTING_SAVE_INTERVAL_MS — изменившиеся страницы таблицы
+ * маршрутизации. Низкий приоритет: запись во flash не задерживает
+ * приём пакетов.
+ * 
+ * @param arg Не используется
+ */
+void persist_task(void* arg) {
+    (void)arg;
+    uint32_t last_routing_save = millis();
+    
+    for (;;) {
+        vTaskDelay(pdMS_TO_TICKS(EVENT_LOG_FLUSH_MS));
+        flush_event_log();
+        
+        if (millis() - last_routing_save >= ROUTING_SAVE_INTERVAL_MS) {
+            flush_routing_table();
+            last_routing_save = millis();
+        }
+    }
+}
+
+// ============================================================================
+// ОТПРАВКА ПАКЕТОВ
+// ============================================================================
+
+/**
+ * Отправка пакета
+ * 
+ * Кадр копируется в очередь отправки, в эфир его отдаёт tx_task —
+ * отправитель не ждёт ни радио, ни буферов ESP-NOW. Аварийные
+ * кадры — в свою очередь, она уходит раньше обычной в порядке
+ * поступления. Полная очередь — кадр теряется
+ * (tx_queue_full), но вызывающий не блокируется.
+ * 
+ * @param dst_mac MAC получателя
+ * @param data Данные пакета
+ * @param len Длина данных
+ */
+void send_packet(const uint8_t* dst_mac, const void* data, size_t len) {
+    if (len > ESP_NOW_MAX_DATA_LEN) {
+        LOG_E("Packet too large for ESP-NOW");
+        return;
+    }
+    
+    TxFrame frame;
+    memcpy(frame.dst_mac, dst_mac, 6);
+    memcpy(frame.data, data, len);
+    frame.len = (uint8_t)len;
+    frame.queued_us = micros();
+    
+    // Тип — для метрик: заголовок кадра любой версии
+    MeshPacketView view;
+    bool parsed = mesh_view_init(&view, frame.data, len);
+    frame.msg_type = parsed ? mesh_view_msg_type(&view) : 0;
+    bool urgent = parsed && ((mesh_view_flags(&view) & FLAG_EMERGENCY) ||
+                             frame.msg_type == MSG_EVENT_BROADCAST);
+    
+    if (xQueueSend(urgent ? tx_urgent_queue : tx_queue, &frame, 0) != pdTRUE) {
+        network_state.tx_queue_full++;
+        char mac_str[18];
+        format_mac(dst_mac, mac_str);
+        LOG_W("TX queue full, frame to %s dropped", mac_str);
+        return;
+    }
+    xTaskNotifyGive(tx_task_handle);
+    
+    uint32_t depth = uxQueueMessagesWaiting(tx_queue) + uxQueueMessagesWaiting(tx_urgent_queue);
+    if (depth > network_state.tx_queue_high_water) {
+        network_state.tx_queue_high_water = depth;
+    }
+}
+
+/**
+ * Задача отправки
+ * 
+ * Берёт кадр (сначала из аварийной очереди), ждёт свободного места
+ * "в полёте" (их TX_IN_FLIGHT, освобождает on_espnow_send) и отдаёт
+ * кадр ESP-NOW. Нехватку буферов ESP-NOW (ESP_ERR_ESPNOW_NO_MEM)
+ * пережидает, а не теряет кадр. Без места кадр не уходит никогда:
+ * ожидание дольше TX_COMPLETION_TIMEOUT_MS только учитывается
+ * (tx_completion_stalls), и место берётся заново.
+ */
+void tx_task(void* arg) {
+    (void)arg;
+    static TxFrame frame;
+    
+    for (;;) {
+        // Одно уведомление — один кадр в одной из очередей
+        ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+        if (xQueueReceive(tx_urgent_queue, &frame, 0) != pdTRUE &&
+            xQueueReceive(tx_queue, &frame, 0) != pdTRUE) {
+            continue;
+        }
+        
+        while (xSemaphoreTake(tx_credits, pdMS_TO_TICKS(TX_COMPLETION_TIMEOUT_MS)) != pdTRUE) {
+            network_state.tx_completion_stalls++;
+        }
+        
+        uint32_t start_us = micros();
+        latency_histogram_record(&network_state.tx_queue_latency, start_us - frame.queued_us);
+        
+        esp_err_t result;
+        uint8_t attempt = 0;
+        while ((result = esp_now_send(frame.dst_mac, frame.data, frame.len)) == ESP_ERR_ESPNOW_NO_MEM &&
+               attempt < TX_RETRY_MAX) {
+            attempt++;
+            network_state.tx_retries++;
+            vTaskDelay(pdMS_TO_TICKS(TX_RETRY_DELAY_MS));
+        }
+        
+        if (result == ESP_OK) {
+            // Успех — callback on_espnow_send вызовется позже
+            portENTER_CRITICAL(&send_track_mux);
+            send_tracker_start(&send_tracker, frame.dst_mac, frame.msg_type, start_us);
+            portEXIT_CRITICAL(&send_track_mux);
+        } else {
+            // Кадр не ушёл — его место в полёте свободно
+            xSemaphoreGive(tx_credits);
+            network_state.tx_failed++;
+            LOG_E("ESP-NOW send error: %d", result);
+            log_event(EV_ESPNOW_SEND_ERROR, frame.dst_mac, result);
+        }
+    }
+}
+
+/**
+ * Отправка mesh-пакета в нужной версии формата
+ * 
+ * По умолчанию уходит кадр v2: заголовок и payload_len байт.
+ * Если и получатель, и следующий прыжок известны как узлы v1 —
+ * кодируем полный кадр v1 (узел v1 пересылает и разбирает только
+ * его). Широковещательные пакеты всегда v2: узлы v2 принимают оба
+ * формата, а старые прошивки обновляются до версии 2.
+ * Зашифрованные пакеты — тоже только v2: в кадре v1 тег не найти.
+ * 
+ * @param next_hop MAC следующего прыжка
+ * @param packet Пакет во внутреннем формате (v2)
+ */
+void send_mesh_packet(const uint8_t* next_hop, const MeshPacketHeader* packet) {
+    uint16_t dst = find_node(packet->dst_mac);
+    uint16_t hop = find_node(next_hop);
+    bool legacy = (dst != MAC_INDEX_NONE && node_proto[dst] == 0x01) ||
+                  (hop != MAC_INDEX_NONE && node_proto[hop] == 0x01);
+    
+    if (legacy && !is_broadcast_packet(packet) && !is_encrypted_packet(packet)) {
+        uint8_t frame[MESH_WIRE_SIZE_V1];
+        size_t len = mesh_encode_v1(packet, frame);
+        send_packet(next_hop, frame, len);
+    } else {
+        send_packet(next_hop, packet, mesh_packet_wire_size(packet));
+    }
+}
+
+/**
+ * Отправка heartbeat
+ * 
+ * Координатор периодически отправляет пульс
+ * чтобы устройства знали что он жив.
+ */
+void send_heartbeat() {
+    MeshPacketHeader packet;
+    
+    packet.network_id = MESH_NETWORK_ID;
+    packet.version = PROTOCOL_VERSION;
+    packet.ttl = DEFAULT_TTL;
+    packet.packet_id = millis();
+    memcpy(packet.src_mac, self_mac, 6);
+    memcpy(packet.dst_mac, BROADCAST_MAC, 6);
+    memcpy(packet.last_hop_mac, self_mac, 6);
+    packet.msg_type = MSG_HEARTBEAT;
+    packet.flags = 0;
+    packet.group_id = 0;
+    packet.payload_len = 0;
+    
+    send_packet(BROADCAST_MAC, &packet, mesh_packet_wire_size(&packet));
+    network_state.last_heartbeat = millis();
+    
+    LOG_D("Heartbeat sent");
+}
+
+/**
+ * Отправка discovery
+ * 
+ * Просит все устройства отозваться. Каждый отвечает в своём
+ * слоте окна request.window_ms (по хешу MAC).
+ * Используется для построения карты сети.
+ */
+void send_device_discovery() {
+    MeshPacketHeader packet;
+    
+    packet.network_id = MESH_NETWORK_ID;
+    packet.version = PROTOCOL_VERSION;
+    packet.ttl = DEFAULT_TTL;
+    packet.packet_id = millis();
+    memcpy(packet.src_mac, self_mac, 6);
+    memcpy(packet.dst_mac, BROADCAST_MAC, 6);
+    memcpy(packet.last_hop_mac, self_mac, 6);
+    packet.msg_type = MSG_DISCOVERY;
+    packet.flags = 0;
+    packet.group_id = 0;
+    
+    // Окно растёт с сетью: ответы разойдутся по слотам, а не придут разом
+    uint32_t window = DISCOVERY_WINDOW_MIN_MS + routing_table_size * DISCOVERY_WINDOW_PER_DEVICE_MS;
+    DiscoveryRequest request = {};
+    request.window_ms = window < DISCOVERY_WINDOW_MAX_MS ? window : DISCOVERY_WINDOW_MAX_MS;
+    memcpy(packet.payload, &request, sizeof(request));
+    packet.payload_len = sizeof(request);
+    
+    send_packet(BROADCAST_MAC, &packet, mesh_packet_wire_size(&packet));
+    
+    LOG_I("Discovery packet sent (window %u ms)", request.window_ms);
+    log_event(EV_DISCOVERY_SENT);
+}
+
+/**
+ * Запуск замера задержки до устройства
+ * 
+ * MSG_PROBE идёт обычным маршрутом, каждый ретранслятор дописывает
+ * запись о себе, адресат отвечает тем же payload (и на обратном пути
+ * записи снова дописываются). Незавершённый замер отменяется.
+ * Отвечают репитеры; датчики в глубоком сне пакетов не слушают.
+ * 
+ * @param target MAC устройства
+ * @return false если маршрута к устройству нет
+ */
+bool start_probe(const uint8_t* target) {
+    const uint8_t* next_hop = next_hop_for(target);
+    if (!next_hop) {
+        return false;
+    }
+    
+    MeshPacketHeader packet = {};
+    packet.network_id = MESH_NETWORK_ID;
+    packet.version = PROTOCOL_VERSION;
+    packet.ttl = DEFAULT_TTL;
+    packet.packet_id = next_packet_id();
+    memcpy(packet.src_mac, self_mac, 6);
+    memcpy(packet.dst_mac, target, 6);
+    memcpy(packet.last_hop_mac, self_mac, 6);
+    packet.msg_type = MSG_PROBE;
+    
+    ProbePayload* probe = (ProbePayload*)packet.payload;
+    probe->probe_id = packet.packet_id;
+    probe->direction = PROBE_DIR_REQUEST;
+    probe->hop_count = 0;
+    packet.payload_len = PROBE_HEADER_SIZE;
+    
+    portENTER_CRITICAL(&probe_mux);
+    memcpy(probe_state.target, target, 6);
+    probe_state.probe_id = probe->probe_id;
+    probe_state.hop_count = 0;
+    probe_state.rtt_us = 0;
+    probe_state.sent_ms = millis();
+    probe_state.sent_us = micros();
+    probe_state.status = PROBE_PENDING;
+    portEXIT_CRITICAL(&probe_mux);
+    
+    send_mesh_packet(next_hop, &packet);
+    return true;
+}
+
+/**
+ * Отправка подтверждения
+ * 
+ * @param dst_mac MAC получателя
+ * @param packet_id ID пакета который подтверждаем
+ */
+void send_acknowledgment(const uint8_t* dst_mac, uint32_t packet_id, uint8_t status) {
+    MeshPacketHeader packet;
+    reliable_build_ack(&packet, self_mac, dst_mac, next_packet_id(), packet_id,
+                       status == ACK_STATUS_OK ? MSG_ACK : MSG_NACK, status);
+    
+    // ACK идёт обратным маршрутом; маршрута нет — широковещательно
+    const uint8_t* next_hop = next_hop_for(dst_mac);
+    send_mesh_packet(next_hop ? next_hop : BROADCAST_MAC, &packet);
+    
+    if (status != ACK_STATUS_OK) {
+        LOG_W("NACK %u for packet %lu to %s",
+             status, packet_id, mac_to_string(dst_mac).c_str());
+    }
+}
+
+/**
+ * Новый packet_id для наших пакетов
+ * 
+ * Счётчик со случайным началом: после перезагрузки id не совпадут
+ * с ещё живыми записями в кэшах дублей соседей.
+ */
+uint32_t next_packet_id() {
+    return __atomic_add_fetch(&packet_id_counter, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Отправка пакета с подтверждением
+ * 
+ * Пакет ставится в таблицу доставки и уходит сразу;
+ * повторы крутит loop(), итог — ACK или reliable_give_up.
+ * 
+ * @param packet Пакет (packet_id уже назначен)
+ * @return false если таблица доставки заполнена
+ */
+bool send_reliable(const MeshPacketHeader* packet) {
+    xSemaphoreTake(reliable_mutex, portMAX_DELAY);
+    bool queued = reliable_send(&reliable_table, (const uint8_t*)packet,
+                                mesh_packet_wire_size(packet), millis());
+    xSemaphoreGive(reliable_mutex);
+    return queued;
+}
+
+/**
+ * Отправка (и повтор) кадра из таблицы доставки
+ * 
+ * Маршрут ищется заново на каждой попытке: за время
+ * ожидания ACK родитель устройства мог смениться.
+ */
+void reliable_send_frame(const uint8_t* frame, uint8_t len, void* ctx) {
+    (void)len;
+    (void)ctx;
+    
+    const MeshPacketHeader* packet = (const MeshPacketHeader*)frame;
+    const uint8_t* next_hop = next_hop_for(packet->dst_mac);
+    send_mesh_packet(next_hop ? next_hop : BROADCAST_MAC, packet);
+}
+
+/**
+ * Пакет так и не доставлен
+ */
+void reliable_give_up(const MeshPacketHeader* packet, uint8_t reason, uint8_t nack_reason, void* ctx) {
+    (void)ctx;
+    
+    // Таймаут — причина 0 (все RELIABLE_MAX_ATTEMPTS попыток без ответа)
+    log_event(EV_DELIVERY_FAILED, packet->dst_mac,
+              reason == RELIABLE_GAVE_UP_NACK ? nack_reason : 0,
+              (int16_t)(packet->packet_id & 0xFFFF));
+}
+
+/**
+ * Установка сессионного ключа
+ * 
+ * Ключи устройств выводятся из него заново: кэш сбрасывается.
+ * 
+ * @param key Новый ключ (32 байта)
+ * @param session_id Номер сессии
+ */
+void set_session_key(const uint8_t* key, uint32_t session_id) {
+    memcpy(session_key, key, sizeof(session_key));
+    current_session_id = session_id;
+    peer_key_cache_set_session(&peer_key_cache, session_key);
+}
+
+/**
+ * Шифрование payload пакета на месте ключом устройства-получателя
+ * 
+ * Ключ выводится на месте, без кэша: вызывается и из веб-задачи.
+ * Повторы уходят уже зашифрованным кадром — шифруется один раз.
+ * 
+ * @param packet Пакет с назначенным packet_id
+ * @return false если payload не оставляет места под тег или номер
+ *         загрузки не сохранён (nonce мог бы повториться)
+ */
+bool encrypt_packet(MeshPacketHeader* packet) {
+    if (!boot_epoch_saved) {
+        return false;
+    }
+    
+    uint8_t device_key[32];
+    chacha20_key_schedule_t schedule;
+    derive_device_key(session_key, packet->dst_mac, device_key);
+    chacha20_key_schedule_init(&schedule, device_key);
+    
+    bool ok = mesh_packet_encrypt(packet, &schedule, boot_epoch);
+    secure_wipe(device_key, sizeof(device_key));
+    secure_wipe(&schedule, sizeof(schedule));
+    
+    if (ok) {
+        network_state.packets_encrypted++;
+    }
+    return ok;
+}
+
+/**
+ * Проверка и расшифровка принятого пакета на месте
+ * 
+ * Ключ — устройства-источника, из кэша. Только из packet_task.
+ * 
+ * @param packet Пакет в очереди приёма
+ * @return false если тег не сошёлся (пакет отбросить)
+ */
+bool decrypt_packet(MeshPacketHeader* packet) {
+    if (mesh_packet_decrypt(packet, peer_key_schedule(packet->src_mac))) {
+        network_state.packets_decrypted++;
+        return true;
+    }
+    
+    network_state.decrypt_failures++;
+    log_event(EV_DECRYPT_FAILED, packet->src_mac);
+    return false;
+}
+
+/**
+ * Готовое расписание ключа устройства
+ * 
+ * Попадание в кэш — без вывода ключа и развёртывания.
+ * Только из packet_task.
+ * 
+ * @param mac MAC устройства
+ * @return Расписание (действительно до следующего вызова)
+ */
+const chacha20_key_schedule_t* peer_key_schedule(const uint8_t* mac) {
+    return peer_key_cache_get(&peer_key_cache, mac);
+}
+
+// ============================================================================
+// ВЕБ-ИНТЕРФЕЙС
+// ============================================================================
+
+/**
+ * Главная страница веб-интерфейса
+ * 
+ * Отдаётся из flash как есть, уже сжатой (см. tools/build_web_ui.py):
+ * ни сборки строки, ни выделения памяти на запрос. ETag меняется
+ * вместе со страницей, поэтому кэш браузера сверяется с ним
+ * (no-cache) и после OTA не покажет старую версию; повторный
+ * заход стоит ответа 304 без тела.
+ */
+void handle_root(AsyncWebServerRequest* request) {
+    if (request->hasHeader("If-None-Match") &&
+        request->getHeader("If-None-Match")->value() == WEB_INDEX_HTML_ETAG) {
+        request->send(304);
+        return;
+    }
+    
+    AsyncWebServerResponse* response = request->beginResponse_P(200, "text/html",
+                                                                WEB_INDEX_HTML_GZ,
+                                                                WEB_INDEX_HTML_GZ_LEN);
+    response->addHeader("Content-Encoding", "gzip");
+    response->addHeader("ETag", WEB_INDEX_HTML_ETAG);
+    response->addHeader("Cache-Control", "no-cache");
+    request->send(response);
+}
+
+/**
+ * API: статус сети
+ */
+void handle_api_network_status(AsyncWebServerRequest* request) {
+    StaticJsonDocument<1536> doc;
+    
+    doc["uptime"] = (millis() - network_state.startup_time) / 1000;
+    doc["packets_received"] = network_state.packets_received;
+    doc["packets_sent"] = network_state.packets_sent;
+    
+    // Считаем онлайн-устройства
+    uint8_t online_count = 0;
+    uint32_t now = millis() / 1000;
+    for (int i = 0; i < routing_table_size; i++) {
+        if (now - node_last_seen[i] < 300) {  // Видели последние 5 минут
+            online_count++;
+        }
+    }
+    
+    doc["nodes_online"] = online_count;
+    doc["nodes_total"] = routing_table_size;
+    doc["mesh_initialized"] = network_state.mesh_initialized;
+    doc["wifi_connected"] = network_state.wifi_connected;
+    doc["free_heap"] = ESP.getFreeHeap();
+    doc["free_heap_min"] = network_state.free_heap_min;
+    
+    JsonObject dedup = doc.createNestedObject("dedup");
+    dedup["hits"] = dedup_cache.hits;
+    dedup["misses"] = dedup_cache.misses;
+    dedup["evictions"] = dedup_cache.evictions;
+    dedup["window_ms"] = dedup_cache.window_ms;
+    
+    // Доставка с подтверждением
+    JsonObject reliable = doc.createNestedObject("reliable");
+    reliable["in_flight"] = reliable_table.in_flight;
+    reliable["sent"] = reliable_table.sent;
+    reliable["retransmits"] = reliable_table.retransmits;
+    reliable["acked"] = reliable_table.acked;
+    reliable["nacked"] = reliable_table.nacked;
+    reliable["timeouts"] = reliable_table.timeouts;
+    reliable["table_full"] = reliable_table.table_full;
+    
+    // Кэш ключей устройств
+    JsonObject keys = doc.createNestedObject("key_cache");
+    keys["backend"] = MESH_CRYPTO_BACKEND_NAME;
+    keys["session_id"] = current_session_id;
+    keys["hits"] = peer_key_cache.hits;
+    keys["misses"] = peer_key_cache.misses;
+    keys["evictions"] = peer_key_cache.evictions;
+    keys["encrypted"] = network_state.packets_encrypted;
+    keys["decrypted"] = network_state.packets_decrypted;
+    keys["decrypt_failures"] = network_state.decrypt_failures;
+    
+    // Сохранение таблицы маршрутизации
+    JsonObject nvs = doc.createNestedObject("nvs");
+    nvs["flushes"] = network_state.nvs_flushes;
+    nvs["page_writes"] = network_state.nvs_page_writes;
+    
+    // Журнал событий
+    JsonObject events = doc.createNestedObject("event_log");
+    events["next_seq"] = event_log.head;
+    events["persisted"] = event_log.persisted;
+    events["lost"] = event_log.lost;
+    events["file"] = event_file_ready;
+    
+    // Живые обновления
+    JsonObject live = doc.createNestedObject("live");
+    live["clients"] = live_events.count();
+    live["coalesced"] = live_buffers[0].coalesced + live_buffers[1].coalesced;
+    live["dropped"] = live_buffers[0].dropped + live_buffers[1].dropped;
+    
+    // Очереди приёма по классам приоритета
+    JsonObject queues = doc.createNestedObject("rx_queues");
+    for (int c = 0; c < PRIO_CLASS_COUNT; c++) {
+        JsonObject queue = queues.createNestedObject(PRIO_CLASS_NAMES[c]);
+        queue["depth"] = packet_ring_count(&rx_scheduler.rings[c]);
+        queue["high_water"] = network_state.rx_queue_high_water[c];
+        queue["overflows"] = network_state.rx_queue_overflows[c];
+        queue["deadline_ms"] = PRIO_DEADLINE_US[c] / 1000;
+        queue["deadline_misses"] = network_state.deadline_misses[c];
+        queue["dispatched"] = network_state.dispatch_latency[c].count;
+        queue["p99_latency_us"] = latency_histogram_percentile(&network_state.dispatch_latency[c], 99);
+    }
+    
+    // Сериализуем прямо в буфер ответа, без промежуточной String
+    AsyncResponseStream* response = request->beginResponseStream("application/json");
+    serializeJson(doc, *response);
+    request->send(response);
+}
+
+/**
+ * Запись одного устройства для /api/devices
+ * 
+ * @param pos Номер узла
+ * @param now Текущее время, с
+ * @param first Первый элемент массива (без запятой)
+ * @param buf Куда писать
+ * @param size Размер buf
+ * @return Длина записи (>= size — не поместилась)
+ */
+static int format_device_json(uint16_t pos, uint32_t now, bool first, char* buf, size_t size) {
+    char mac[18];
+    format_mac(node_mac[pos], mac);
+    
+    uint32_t age = now - node_last_seen[pos];
+    int len = snprintf(buf, size, "%s{\"mac\":\"%s\",\"rssi\":%d,\"last_seen\":%lu,\"online\":%s",
+                       first ? "" : ",", mac, node_rssi[pos], (unsigned long)age,
+                       age < 300 ? "true" : "false");  // 5 минут
+    
+    if (node_battery_mv[pos] > 0 && len < (int)size) {
+        len += snprintf(buf + len, size - len, ",\"battery\":%u", node_battery_mv[pos]);
+    }
+    if (node_awake_ms[pos] > 0 && len < (int)size) {
+        len += snprintf(buf + len, size - len, ",\"awake_ms\":%u", node_awake_ms[pos]);
+    }
+    if (len < (int)size) {
+        len += snprintf(buf + len, size - len, "}");
+    }
+    return len;
+}
+
+/**
+ * Строка chunked-ответа, ещё не ушедшая целиком
+ * 
+ * 0 из filler'а AsyncWebServer считает концом ответа, поэтому
+ * строка, не поместившаяся в остаток куска, не откладывается
+ * целиком, а уходит по частям: хвост — в следующем куске.
+ */
+struct ChunkStage {
+    char     data[160];
+    uint16_t len = 0;         // Сколько в data
+    uint16_t sent = 0;        // Сколько из них уже ушло
+};
+
+/**
+ * Выложить в кусок остаток строки
+ * 
+ * @param stage Строка
+ * @param buffer Кусок ответа
+ * @param max_len Размер куска
+ * @param written Сколько в куске уже занято (растёт)
+ * @return true — строка ушла целиком, можно готовить следующую
+ */
+static bool chunk_stage_drain(ChunkStage* stage, uint8_t* buffer, size_t max_len, size_t* written) {
+    size_t count = stage->len - stage->sent;
+    if (count > max_len - *written) {
+        count = max_len - *written;
+    }
+    memcpy(buffer + *written, stage->data + stage->sent, count);
+    *written += count;
+    stage->sent += count;
+    
+    if (stage->sent < stage->len) {
+        return false;
+    }
+    stage->len = 0;
+    stage->sent = 0;
+    return true;
+}
+
+/**
+ * API: список устройств
+ * 
+ * Ответ идёт кусками (chunked): каждый кусок заполняется записями
+ * прямо из таблицы маршрутизации, пока они помещаются в буфер TCP. Ни
+ * JsonDocument, ни String — размер ответа не ограничен стеком и не
+ * дробит кучу. Запись, не влезшая в кусок, доходит в следующем
+ * (ChunkStage). Таблицу не блокируем (как и раньше): запись,
+ * изменённая между кусками, уйдёт в новом виде, удалённые в хвосте —
+ * пропадут.
+ */
+void handle_api_devices(AsyncWebServerRequest* request) {
+    uint32_t now = millis() / 1000;
+    int next = -1;      // -1 — ещё не записано начало
+    bool first = true;  // Ещё не было ни одной записи (без запятой)
+    bool done = false;  // "]}" уже в stage
+    ChunkStage stage;
+    
+    AsyncWebServerResponse* response = request->beginChunkedResponse("application/json",
+        [now, next, first, done, stage](uint8_t* buffer, size_t max_len, size_t) mutable -> size_t {
+            size_t written = 0;
+            
+            // 0 уходит, только когда хвост ответа уже отправлен
+            while (written < max_len && chunk_stage_drain(&stage, buffer, max_len, &written) && !done) {
+                if (next < 0) {
+                    stage.len = snprintf(stage.data, sizeof(stage.data), "{\"devices\":[");
+                    next = 0;
+                } else if (next < routing_table_size) {
+                    int len = format_device_json(next, now, first, stage.data, sizeof(stage.data));
+                    if (len > 0 && len < (int)sizeof(stage.data)) {
+                        stage.len = len;
+                        first = false;
+                    }
+                    next++;
+                } else {
+                    stage.len = snprintf(stage.data, sizeof(stage.data), "]}");
+                    done = true;
+                }
+            }
+            return written;
+        });
+    request->send(response);
+}
+
+/**
+ * API: отправка команды
+ */
+void handle_api_command(AsyncWebServerRequest* request) {
+    if (request->method() == HTTP_POST) {
+        String body = request->arg("plain");
+        StaticJsonDocument<256> doc;
+        DeserializationError error = deserializeJson(doc, body);
+        
+        if (error) {
+            request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+            return;
+        }
+        
+        const char* command = doc["command"];
+        
+        if (strcmp(command, "scan") == 0) {
+            send_device_discovery();
+            request->send(200, "application/json", "{\"message\":\"Scan started\"}");
+        } else if (strcmp(command, "probe") == 0) {
+            // {"command":"probe","mac":"AA:BB:.."} — результат в GET /api/probe
+            uint8_t target[6];
+            if (!string_to_mac(doc["mac"] | "", target)) {
+                request->send(400, "application/json", "{\"error\":\"Invalid mac\"}");
+                return;
+            }
+            if (start_probe(target)) {
+                request->send(202, "application/json", "{\"message\":\"Probe sent\"}");
+            } else {
+                request->send(404, "application/json", "{\"error\":\"No route to device\"}");
+            }
+        } else if (strcmp(command, "group") == 0) {
+            // {"command":"group","group":2,"code":1,"param":0} — всем членам группы.
+            // Раздаёт packet_task: план и кадры — в журнале и консоли (status)
+            GroupCommand cmd = {};
+            cmd.group_id = doc["group"] | 0;
+            cmd.command_code = doc["code"] | 0;
+            cmd.parameter_len = 1;
+            cmd.parameters[0] = doc["param"] | 0;
+            
+            if (cmd.group_id == 0) {
+                request->send(404, "application/json", "{\"error\":\"Unknown group\"}");
+                return;
+            }
+            if (xQueueSend(group_queue, &cmd, 0) != pdTRUE) {
+                request->send(503, "application/json", "{\"error\":\"Group queue full\"}");
+                return;
+            }
+            xTaskNotifyGive(packet_task_handle);
+            request->send(202, "application/json", "{\"message\":\"Group command queued\"}");
+        } else if (strcmp(command, "set") == 0) {
+            // {"command":"set","mac":"AA:BB:..","code":1,"param":0,"encrypt":true} — с подтверждением
+            uint8_t dst_mac[6];
+            if (!string_to_mac(doc["mac"] | "", dst_mac)) {
+                request->send(400, "application/json", "{\"error\":\"Invalid mac\"}");
+                return;
+            }
+            
+            MeshPacketHeader packet = {};
+            packet.network_id = MESH_NETWORK_ID;
+            packet.version = PROTOCOL_VERSION;
+            packet.ttl = DEFAULT_TTL;
+            packet.packet_id = next_packet_id();
+            memcpy(packet.src_mac, self_mac, 6);
+            memcpy(packet.dst_mac, dst_mac, 6);
+            memcpy(packet.last_hop_mac, self_mac, 6);
+            packet.msg_type = MSG_CMD_SET;
+            packet.flags = FLAG_REQUIRE_ACK;
+            
+            GroupCommand* cmd = (GroupCommand*)packet.payload;
+            cmd->command_code = doc["code"] | 0;
+            cmd->parameter_len = 1;
+            cmd->parameters[0] = doc["param"] | 0;
+            packet.payload_len = offsetof(GroupCommand, parameters) + cmd->parameter_len;
+            
+            if ((doc["encrypt"] | false) && !encrypt_packet(&packet)) {
+                request->send(400, "application/json", "{\"error\":\"Payload too large to encrypt or encryption disabled\"}");
+                return;
+            }
+            
+            if (send_reliable(&packet)) {
+                char response[48];
+                snprintf(response, sizeof(response), "{\"packet_id\":%lu}", packet.packet_id);
+                request->send(202, "application/json", response);
+            } else {
+                request->send(503, "application/json", "{\"error\":\"Too many commands in flight\"}");
+            }
+        } else {
+            request->send(400, "application/json", "{\"error\":\"Unknown command\"}");
+        }
+    } else {
+        request->send(405, "application/json", "{\"error\":\"Method not allowed\"}");
+    }
+}
+
+/**
+ * API: журнал событий
+ * 
+ * Последние ?count= событий (по умолчанию EVENT_LOG_API_DEFAULT)
+ * текстом, по строке на событие, старые — первыми. Записи
+ * форматируются только здесь, кусками прямо в буфер ответа; свежие
+ * берутся из RAM, более старые — из файла. Строка, не влезшая
+ * в кусок, доходит в следующем (ChunkStage).
+ * 
+ * Обработчик работает в задаче async_tcp: файл, занятый persist_task,
+ * ждём не дольше EVENT_FILE_LOCK_MS и отдаём то, что уже готово.
+ */
+void handle_api_logs(AsyncWebServerRequest* request) {
+    uint32_t count = EVENT_LOG_API_DEFAULT;
+    if (request->hasParam("count")) {
+        count = request->getParam("count")->value().toInt();
+    }
+    
+    portENTER_CRITICAL(&event_log_mux);
+    uint32_t end = event_log.head;
+    uint32_t oldest = event_log_oldest(&event_log);
+    portEXIT_CRITICAL(&event_log_mux);
+    
+    // Файл занят — отдаём только то, что в RAM
+    if (event_file_ready &&
+        xSemaphoreTake(event_file_mutex, pdMS_TO_TICKS(EVENT_FILE_LOCK_MS)) == pdTRUE) {
+        uint32_t file_oldest = event_log_file_oldest(&event_file_header);
+        xSemaphoreGive(event_file_mutex);
+        if (file_oldest < oldest) {
+            oldest = file_oldest;
+        }
+    }
+    uint32_t next = end - oldest > count ? end - count : oldest;
+    ChunkStage stage;
+    
+    AsyncWebServerResponse* response = request->beginChunkedResponse("text/plain",
+        [next, end, stage](uint8_t* buffer, size_t max_len, size_t) mutable -> size_t {
+            size_t written = 0;
+            bool locked = false;
+            bool busy = false;
+            File file;
+            
+            while (written < max_len && chunk_stage_drain(&stage, buffer, max_len, &written) &&
+                   next < end) {
+                EventRecord rec;
+                portENTER_CRITICAL(&event_log_mux);
+                bool found = event_log_get(&event_log, next, &rec);
+                portEXIT_CRITICAL(&event_log_mux);
+                
+                if (!found && event_file_ready) {
+                    if (!locked) {
+                        if (xSemaphoreTake(event_file_mutex, pdMS_TO_TICKS(EVENT_FILE_LOCK_MS)) != pdTRUE) {
+                            busy = true;
+                            break;
+                        }
+                        locked = true;
+                    }
+                    found = read_event_from_file(next, &rec, &file);
+                }
+                next++;
+                if (!found) {
+                    continue;  // Потеряно до сохранения или уже затёрто
+                }
+                
+                int len = event_log_format(&rec, stage.data, sizeof(stage.data) - 1);
+                if (len > 0 && len < (int)sizeof(stage.data) - 1) {
+                    stage.data[len++] = '\n';
+                    stage.len = len;
+                }
+            }
+            
+            if (file) {
+                file.close();
+            }
+            if (locked) {
+                xSemaphoreGive(event_file_mutex);
+            }
+            
+            // 0 завершил бы ответ — пусть сервер позовёт ещё раз
+            if (written == 0 && busy) {
+                return RESPONSE_TRY_AGAIN;
+            }
+            return written;
+        });
+    request->send(response);
+}
+
+/**
+ * API: метрики в текстовом формате Prometheus
+ * 
+ * Задержки стадий по типам сообщений — summary с квантилями
+ * 0.5/0.9/0.99 (оценка по гистограмме, до 25%) и отдельно максимум;
+ * типы без пакетов пропускаются. Плюс счётчики пакетов, отброшенных
+ * по причинам, очереди приёма по классам приоритета и очередь отправки.
+ */
+void handle_api_metrics(AsyncWebServerRequest* request) {
+    static const uint32_t QUANTILES[] = { 50, 90, 99 };
+    AsyncResponseStream* response = request->beginResponseStream("text/plain; version=0.0.4");
+    
+    response->print("# HELP mesh_stage_latency_us Packet latency by stage and message type\n"
+                    "# TYPE mesh_stage_latency_us summary\n");
+    for (int type = 0; type < METRICS_TYPE_SLOTS; type++) {
+        for (int stage = 0; stage < METRIC_STAGE_COUNT; stage++) {
+            const LatencyHistogram* hist = &packet_metrics.latency[type][stage];
+            if (hist->count == 0) {
+                continue;
+            }
+            for (uint32_t q : QUANTILES) {
+                response->printf("mesh_stage_latency_us{stage=\"%s\",type=\"%s\",quantile=\"0.%02lu\"} %lu\n",
+                                 METRIC_STAGE_NAMES[stage], message_type_name(type), q,
+                                 latency_histogram_percentile(hist, q));
+            }
+            response->printf("mesh_stage_latency_us_count{stage=\"%s\",type=\"%s\"} %lu\n",
+                             METRIC_STAGE_NAMES[stage], message_type_name(type), hist->count);
+        }
+    }
     
-    if (!entry) {
-        // Маршрут не найден
-        Serial.printf("No route to %s\n", mac_to_string(packet->dst_mac).c_str());
-        log_event("route_not_found", mac_to_string(packet->dst_mac).c_str());
-        return;
+    response->print("# HELP mesh_stage_latency_max_us Worst packet latency since boot\n"
+                    "# TYPE mesh_stage_latency_max_us gauge\n");
+    for (int type = 0; type < METRICS_TYPE_SLOTS; type++) {
+        for (int stage = 0; stage < METRIC_STAGE_COUNT; stage++) {
+            const LatencyHistogram* hist = &packet_metrics.latency[type][stage];
+            if (hist->count > 0) {
+                response->printf("mesh_stage_latency_max_us{stage=\"%s\",type=\"%s\"} %lu\n",
+                                 METRIC_STAGE_NAMES[stage], message_type_name(type), hist->max);
+            }
+        }
     }
     
-    // Определяем следующий прыжок
-    uint8_t* next_hop;
+    response->printf("# TYPE mesh_packets_received_total counter\n"
+                     "mesh_packets_received_total %lu\n"
+                     "# TYPE mesh_packets_sent_total counter\n"
+                     "mesh_packets_sent_total %lu\n",
+                     network_state.packets_received, network_state.packets_sent);
     
-    if (memcmp(entry->parent_mac, self_mac, 6) == 0) {
-        // Мы родитель этого устройства — отправляем напрямую
-        next_hop = entry->device_mac;
-    } else {
-        // Устройство дальше по цепочке — отправляем его родителю
-        next_hop = entry->parent_mac;
+    response->print("# TYPE mesh_packets_dropped_total counter\n");
+    for (int reason = 0; reason < DROP_REASON_COUNT; reason++) {
+        response->printf("mesh_packets_dropped_total{reason=\"%s\"} %lu\n",
+                         DROP_REASON_NAMES[reason], packet_metrics.drops[reason]);
     }
+    response->printf("mesh_packets_dropped_total{reason=\"decrypt_failed\"} %lu\n",
+                     network_state.decrypt_failures);
     
-    // Отправляем
-    Serial.printf("Routing packet to %s via %s\n",
-                 mac_to_string(packet->dst_mac).c_str(),
-                 mac_to_string(next_hop).c_str());
+    response->print("# TYPE mesh_rx_queue_depth gauge\n");
+    for (int c = 0; c < PRIO_CLASS_COUNT; c++) {
+        response->printf("mesh_rx_queue_depth{class=\"%s\"} %lu\n",
+                         PRIO_CLASS_NAMES[c], packet_ring_count(&rx_scheduler.rings[c]));
+    }
+    response->print("# TYPE mesh_deadline_misses_total counter\n");
+    for (int c = 0; c < PRIO_CLASS_COUNT; c++) {
+        response->printf("mesh_deadline_misses_total{class=\"%s\"} %lu\n",
+                         PRIO_CLASS_NAMES[c], network_state.deadline_misses[c]);
+    }
     
-    send_packet(next_hop, packet, sizeof(MeshPacketHeader));
+    response->printf("# TYPE mesh_tx_queue_depth gauge\n"
+                     "mesh_tx_queue_depth %u\n"
+                     "# TYPE mesh_tx_in_flight gauge\n"
+                     "mesh_tx_in_flight %u\n"
+                     "# TYPE mesh_tx_retries_total counter\n"
+                     "mesh_tx_retries_total %lu\n"
+                     "# TYPE mesh_tx_dropped_total counter\n"
+                     "mesh_tx_dropped_total{reason=\"queue_full\"} %lu\n"
+                     "mesh_tx_dropped_total{reason=\"send_failed\"} %lu\n",
+                     uxQueueMessagesWaiting(tx_queue) + uxQueueMessagesWaiting(tx_urgent_queue),
+                     TX_IN_FLIGHT - uxSemaphoreGetCount(tx_credits),
+                     network_state.tx_retries, network_state.tx_queue_full, network_state.tx_failed);
+    response->print("# TYPE mesh_tx_queue_wait_us summary\n");
+    for (uint32_t q : QUANTILES) {
+        response->printf("mesh_tx_queue_wait_us{quantile=\"0.%02lu\"} %lu\n",
+                         q, latency_histogram_percentile(&network_state.tx_queue_latency, q));
+    }
+    response->printf("mesh_tx_queue_wait_us_count %lu\n", network_state.tx_queue_latency.count);
+    
+    response->printf("# TYPE mesh_free_heap_bytes gauge\n"
+                     "mesh_free_heap_bytes %lu\n", ESP.getFreeHeap());
+    request->send(response);
 }
 
 /**
- * Поиск записи в таблице маршрутизации
+ * Сборка одного правила рефлекса из JSON
  * 
- * @param mac MAC для поиска
- * @return Указатель на запись или nullptr
+ * {"group":1,"field":"temperature","op":">","value":30.5,
+ *  "target":2,"code":1,"param":1,"cooldown_ms":5000}
+ * Порог переводится в целые единицы таблицы (десятые для
+ * температуры и влажности) — репитеру не нужна плавающая точка.
+ * 
+ * @param src Правило в JSON
+ * @param rule Куда записать
+ * @return false если поле или операция неизвестны
  */
-RoutingEntry* find_routing_entry(const uint8_t* mac) {
-    for (int i = 0; i < routing_table_size; i++) {
-        if (memcmp(routing_table[i].device_mac, mac, 6) == 0) {
-            return &routing_table[i];
+bool compile_reflex_rule(JsonObject src, ReflexRule* rule) {
+    memset(rule, 0, sizeof(*rule));
+    
+    const char* field = src["field"] | "";
+    const char* op = src["op"] | "";
+    rule->field = REFLEX_FIELD_COUNT;
+    rule->op = REFLEX_OP_COUNT;
+    for (uint8_t i = 0; i < REFLEX_FIELD_COUNT; i++) {
+        if (strcmp(field, REFLEX_FIELD_NAMES[i]) == 0) {
+            rule->field = i;
+        }
+    }
+    for (uint8_t i = 0; i < REFLEX_OP_COUNT; i++) {
+        if (strcmp(op, REFLEX_OP_NAMES[i]) == 0) {
+            rule->op = i;
         }
     }
-    return nullptr;
+    if (!reflex_rule_valid(rule)) {
+        return false;
+    }
+    
+    float threshold = (src["value"] | 0.0f) * reflex_field_scale(rule->field);
+    if (threshold > INT16_MAX) threshold = INT16_MAX;
+    if (threshold < INT16_MIN) threshold = INT16_MIN;
+    rule->threshold = (int16_t)lroundf(threshold);
+    rule->source_group = src["group"] | 0;
+    rule->target_group = src["target"] | 0;
+    rule->command_code = src["code"] | 0;
+    rule->parameter = src["param"] | 0;
+    int cooldown = (src["cooldown_ms"] | 0) / 100;
+    rule->cooldown_100ms = cooldown > 255 ? 255 : (cooldown < 0 ? 0 : cooldown);
+    return true;
 }
 
 /**
- * Обновление таблицы маршрутизации
- * 
- * Добавляет или обновляет запись об устройстве.
+ * API: таблица рефлексов для репитера
  * 
- * @param mac MAC устройства
- * @param rssi Сила сигнала
- * @param parent_mac MAC родителя (nullptr если мы родитель)
+ * POST {"mac":"AA:BB:..","rules":[...]} — правила (см.
+ * compile_reflex_rule) собираются в таблицу и уходят репитеру одним
+ * MSG_REFLEX_RULES с подтверждением. Новая таблица целиком заменяет
+ * прежнюю, пустой список правила снимает.
  */
-void update_routing_table(const uint8_t* mac, int8_t rssi, const uint8_t* parent_mac) {
-    RoutingEntry* entry = find_routing_entry(mac);
+void handle_api_rules(AsyncWebServerRequest* request) {
+    DynamicJsonDocument doc(REFLEX_JSON_SIZE);
+    if (deserializeJson(doc, request->arg("plain"))) {
+        request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
+        return;
+    }
     
-    if (!entry) {
-        // Новая запись
-        if (routing_table_size >= MAX_ROUTING_ENTRIES) {
-            // Таблица переполнена
-            Serial.println("Routing table full!");
-            return;
-        }
-        
-        entry = &routing_table[routing_table_size];
-        memcpy(entry->device_mac, mac, 6);
-        routing_table_size++;
-        
-        Serial.printf("New device: %s\n", mac_to_string(mac).c_str());
+    uint8_t dst_mac[6];
+    if (!string_to_mac(doc["mac"] | "", dst_mac)) {
+        request->send(400, "application/json", "{\"error\":\"Invalid mac\"}");
+        return;
     }
     
-    // Обновляем данные
-    entry->rssi = rssi;
-    entry->last_seen = millis() / 1000;
-    entry->status = 1;  // Онлайн
+    JsonArray rules = doc["rules"];
+    if (rules.size() > REFLEX_MAX_RULES) {
+        request->send(400, "application/json", "{\"error\":\"Too many rules\"}");
+        return;
+    }
     
-    if (parent_mac) {
-        memcpy(entry->parent_mac, parent_mac, 6);
+    MeshPacketHeader packet = {};
+    packet.network_id = MESH_NETWORK_ID;
+    packet.version = PROTOCOL_VERSION;
+    packet.ttl = DEFAULT_TTL;
+    packet.packet_id = next_packet_id();
+    memcpy(packet.src_mac, self_mac, 6);
+    memcpy(packet.dst_mac, dst_mac, 6);
+    memcpy(packet.last_hop_mac, self_mac, 6);
+    packet.msg_type = MSG_REFLEX_RULES;
+    packet.flags = FLAG_REQUIRE_ACK;
+    
+    ReflexRuleTable* table = (ReflexRuleTable*)packet.payload;
+    table->version = (uint16_t)packet.packet_id;
+    table->count = rules.size();
+    for (uint8_t i = 0; i < table->count; i++) {
+        if (!compile_reflex_rule(rules[i], &table->rules[i])) {
+            request->send(400, "application/json", "{\"error\":\"Unknown field or op\"}");
+            return;
+        }
     }
+    packet.payload_len = reflex_table_size(table->count);
     
-    // Периодически сохраняем в EEPROM
-    static uint32_t last_save = 0;
-    if (millis() - last_save > 30000) {  // Каждые 30 секунд
-        preferences.begin("meshstatic", false);
-        preferences.putUChar("routing_count", routing_table_size);
-        preferences.putBytes("routing_table", routing_table, 
-                           routing_table_size * sizeof(RoutingEntry));
-        preferences.end();
-        last_save = millis();
+    if (send_reliable(&packet)) {
+        char response[64];
+        snprintf(response, sizeof(response), "{\"packet_id\":%lu,\"rules\":%u}",
+                 packet.packet_id, table->count);
+        request->send(202, "application/json", response);
+    } else {
+        request->send(503, "application/json", "{\"error\":\"Too many commands in flight\"}");
     }
 }
 
 /**
- * Удаление записи из таблицы
+ * API: последний замер задержки
  * 
- * @param mac MAC для удаления
+ * Запускается командой {"command":"probe","mac":".."} в /api/command.
+ * Прыжки — в порядке прохождения: туда, адресат ("target": true),
+ * обратно.
  */
-void remove_routing_entry(const uint8_t* mac) {
-    for (int i = 0; i < routing_table_size; i++) {
-        if (memcmp(routing_table[i].device_mac, mac, 6) == 0) {
-            // Сдвигаем остальные записи
-            for (int j = i; j < routing_table_size - 1; j++) {
-                routing_table[j] = routing_table[j + 1];
-            }
-            routing_table_size--;
-            break;
+void handle_api_probe(AsyncWebServerRequest* request) {
+    ProbeState probe = probe_snapshot();
+    AsyncResponseStream* response = request->beginResponseStream("application/json");
+    
+    char mac[18];
+    format_mac(probe.target, mac);
+    response->printf("{\"target\":\"%s\",\"probe_id\":%lu,\"status\":\"%s\"",
+                     mac, probe.probe_id, PROBE_STATUS_NAMES[probe.status]);
+    
+    if (probe.status == PROBE_DONE) {
+        response->printf(",\"rtt_us\":%lu,\"link_us\":%lu,\"hops\":[",
+                         probe.rtt_us, probe_link_us(&probe));
+        for (uint8_t i = 0; i < probe.hop_count; i++) {
+            format_probe_hop(&probe.hops[i], mac);
+            bool is_target = memcmp(probe.hops[i].mac_tail, probe.target + 3, 3) == 0;
+            response->printf("%s{\"mac\":\"%s\",\"residence_us\":%u,\"target\":%s}",
+                             i ? "," : "", mac, probe.hops[i].residence_us,
+                             is_target ? "true" : "false");
         }
+        response->print("]");
     }
+    response->print("}");
+    request->send(response);
 }
 
 /**
- * Очистка старых записей
+ * Запись одного изменения устройства для события "devices"
  * 
- * Удаляет устройства которые не видели больше 5 минут.
+ * @param delta Накопленное изменение
+ * @param first Первый элемент массива (без запятой)
+ * @param buf Куда писать
+ * @param size Размер buf
+ * @return Длина записи (>= size — не поместилась)
  */
-void cleanup_old_entries() {
-    uint32_t now = millis() / 1000;
-    uint32_t threshold = 300;  // 5 минут
+static int format_live_delta_json(const LiveDeviceDelta* delta, bool first, char* buf, size_t size) {
+    char mac[18];
+    format_mac(delta->mac, mac);
     
-    for (int i = 0; i < routing_table_size; i++) {
-        if (now - routing_table[i].last_seen > threshold) {
-            Serial.printf("Removing stale device: %s\n",
-                         mac_to_string(routing_table[i].device_mac).c_str());
-            
-            remove_routing_entry(routing_table[i].device_mac);
-            i--;  // Проверяем текущий индекс снова после сдвига
-        }
+    int len = snprintf(buf, size, "%s{\"mac\":\"%s\"", first ? "" : ",", mac);
+    
+    if ((delta->changes & LIVE_CHANGE_REMOVED) && len < (int)size) {
+        len += snprintf(buf + len, size - len, ",\"removed\":true");
+    }
+    if ((delta->changes & LIVE_CHANGE_ONLINE) && len < (int)size) {
+        len += snprintf(buf + len, size - len, ",\"online\":%s", delta->online ? "true" : "false");
+    }
+    if ((delta->changes & LIVE_CHANGE_READING) && len < (int)size) {
+        len += snprintf(buf + len, size - len,
+                        ",\"temperature\":%.1f,\"humidity\":%.1f,\"battery\":%u,\"rssi\":%d",
+                        delta->temperature, delta->humidity, delta->battery_mv, delta->rssi);
+    }
+    if (len < (int)size) {
+        len += snprintf(buf + len, size - len, "}");
     }
+    return len;
 }
 
-// ============================================================================
-// ОТПРАВКА ПАКЕТОВ
-// ============================================================================
-
 /**
- * Отправка пакета
+ * Тик живых обновлений (из loop)
  * 
- * @param dst_mac MAC получателя
- * @param data Данные пакета
- * @param len Длина данных
+ * Забирает накопленный буфер и рассылает его (уход в офлайн отмечает
+ * packet_task по заданию этого же таймера): событие "devices" — массив изменений (если не
+ * влезает в LIVE_MESSAGE_SIZE — несколькими сообщениями), событие
+ * "emergency" — по одному на аварию. Без подключённых браузеров
+ * накопленное просто сбрасывается.
  */
-void send_packet(const uint8_t* dst_mac, const void* data, size_t len) {
-    // ESP-NOW может отправлять до 250 байт
-    if (len > 250) {
-        Serial.println("Packet too large for ESP-NOW");
+void live_tick() {
+    static char message[LIVE_MESSAGE_SIZE];
+    
+    // Меняем буферы: дальше пишут в другой, этот наш до очистки
+    portENTER_CRITICAL(&live_mux);
+    LiveDeltaBuffer* ready = live_pending;
+    live_pending = (ready == &live_buffers[0]) ? &live_buffers[1] : &live_buffers[0];
+    portEXIT_CRITICAL(&live_mux);
+    
+    if (live_delta_empty(ready) || live_events.count() == 0) {
+        live_delta_clear(ready);
         return;
     }
     
-    esp_err_t result = esp_now_send(dst_mac, (uint8_t*)data, len);
+    size_t len = 0;
+    for (uint16_t i = 0; i < ready->count; i++) {
+        char line[160];
+        int line_len = format_live_delta_json(&ready->devices[i], len == 0, line, sizeof(line));
+        if (line_len <= 0 || line_len >= (int)sizeof(line)) {
+            continue;
+        }
+        
+        // Не влезает — отправляем накопленное и начинаем новый массив
+        if (len > 0 && len + line_len + 2 > sizeof(message)) {
+            message[len++] = ']';
+            message[len] = '\0';
+            live_events.send(message, "devices", ++live_message_id);
+            len = 0;
+            line_len = format_live_delta_json(&ready->devices[i], true, line, sizeof(line));
+        }
+        
+        if (len == 0) {
+            message[len++] = '[';
+        }
+        memcpy(message + len, line, line_len);
+        len += line_len;
+    }
+    if (len > 0) {
+        message[len++] = ']';
+        message[len] = '\0';
+        live_events.send(message, "devices", ++live_message_id);
+    }
     
-    if (result == ESP_OK) {
-        // Успех — callback on_espnow_send вызовется позже
-    } else {
-        Serial.printf("ESP-NOW send error: %d\n", result);
-        log_event("espnow_send_error", String(result).c_str());
+    for (uint8_t i = 0; i < ready->event_count; i++) {
+        const LiveEvent* event = &ready->events[i];
+        char mac[18];
+        format_mac(event->sensor_mac, mac);
+        snprintf(message, sizeof(message), "{\"mac\":\"%s\",\"type\":%u,\"severity\":%u}",
+                 mac, event->event_type, event->severity);
+        live_events.send(message, "emergency", ++live_message_id);
     }
+    
+    live_delta_clear(ready);
 }
 
+// ============================================================================
+// УТИЛИТЫ
+// ============================================================================
+
 /**
- * Отправка heartbeat
+ * Конвертация MAC в строку
  * 
- * Координатор периодически отправляет пульс
- * чтобы устройства знали что он жив.
+ * @param mac MAC адрес
+ * @return Строка вида "AA:BB:CC:DD:EE:FF"
  */
-void send_heartbeat() {
-    MeshPacketHeader packet;
-    
-    packet.network_id = MESH_NETWORK_ID;
-    packet.version = PROTOCOL_VERSION;
-    packet.ttl = DEFAULT_TTL;
-    packet.packet_id = millis();
-    memcpy(packet.src_mac, self_mac, 6);
-    memcpy(packet.dst_mac, BROADCAST_MAC, 6);
-    memcpy(packet.last_hop_mac, self_mac, 6);
-    packet.msg_type = MSG_HEARTBEAT;
-    packet.flags = 0;
-    packet.group_id = 0;
-    
-    send_packet(BROADCAST_MAC, &packet, sizeof(packet));
-    network_state.last_heartbeat = millis();
-    
-    Serial.println("Heartbeat sent");
+String mac_to_string(const uint8_t* mac) {
+    char buf[18];
+    format_mac(mac, buf);
+    return String(buf);
 }
 
 /**
- * Отправка discovery
+ * MAC в строку без выделения памяти
  * 
- * Просит все устройства отозваться.
- * Используется для построения карты сети.
+ * @param mac MAC адрес
+ * @param buf Буфер на 18 байт
  */
-void send_device_discovery() {
-    MeshPacketHeader packet;
-    
-    packet.network_id = MESH_NETWORK_ID;
-    packet.version = PROTOCOL_VERSION;
-    packet.ttl = DEFAULT_TTL;
-    packet.packet_id = millis();
-    memcpy(packet.src_mac, self_mac, 6);
-    memcpy(packet.dst_mac, BROADCAST_MAC, 6);
-    memcpy(packet.last_hop_mac, self_mac, 6);
-    packet.msg_type = MSG_DISCOVERY;
-    packet.flags = 0;
-    packet.group_id = 0;
-    
-    send_packet(BROADCAST_MAC, &packet, sizeof(packet));
-    
-    Serial.println("Discovery packet sent");
-    log_event("discovery_sent");
+void format_mac(const uint8_t* mac, char* buf) {
+    snprintf(buf, 18, "%02X:%02X:%02X:%02X:%02X:%02X",
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
 }
 
 /**
- * Отправка подтверждения
+ * Разбор MAC из строки "AA:BB:CC:DD:EE:FF"
  * 
- * @param dst_mac MAC получателя
- * @param packet_id ID пакета который подтверждаем
+ * @param str Строка
+ * @param mac Куда записать 6 байт
+ * @return true если формат верный
  */
-void send_acknowledgment(const uint8_t* dst_mac, uint32_t packet_id) {
-    // В реальной системе здесь был бы пакет ACK
-    Serial.printf("Sending ACK for packet %lu to %s\n",
-                 packet_id, mac_to_string(dst_mac).c_str());
+bool string_to_mac(const char* str, uint8_t* mac) {
+    unsigned int bytes[6];
+    if (sscanf(str, "%2x:%2x:%2x:%2x:%2x:%2x",
+               &bytes[0], &bytes[1], &bytes[2], &bytes[3], &bytes[4], &bytes[5]) != 6) {
+        return false;
+    }
+    for (int i = 0; i < 6; i++) {
+        mac[i] = (uint8_t)bytes[i];
+    }
+    return true;
 }
 
-// ============================================================================
-// ВЕБ-ИНТЕРФЕЙС
-// ============================================================================
-
 /**
- * Главная страница веб-интерфейса
+ * Логирование события
+ * 
+ * Только 16 байт в кольцо журнала — можно звать из любой задачи и
+ * на горячем пути. Текстом событие станет при чтении /api/logs.
+ * 
+ * @param event Событие
+ * @param mac Участник (nullptr — нет)
+ * @param arg0 Первый аргумент (смысл — см. EventId)
+ * @param arg1 Второй аргумент
  */
-void handle_root(AsyncWebServerRequest* request) {
-    String html = R"rawliteral(
-    <!DOCTYPE html>
-    <html>
-    <head>
-        <title>MeshStatic Coordinator</title>
-        <meta charset="UTF-8">
-        <meta name="viewport" content="width=device-width, initial-scale=1">
-        <style>
-            body { font-family: Arial, sans-serif; margin: 20px; background: #f0f0f0; }
-            .container { max-width: 1200px; margin: 0 auto; background: white; padding: 20px; border-radius: 10px; box-shadow: 0 0 10px rgba(0,0,0,0.1); }
-            .header { background: #4CAF50; color: white; padding: 20px; border-radius: 10px 10px 0 0; margin: -20px -20px 20px -20px; }
-            .stats { display: grid; grid-template-columns: repeat(auto-fit, minmax(200px, 1fr)); gap: 15px; margin: 20px 0; }
-            .stat-card { background: #f8f9fa; padding: 15px; border-radius: 8px; border-left: 4px solid #4CAF50; }
-            .stat-value { font-size: 2em; font-weight: bold; color: #2c3e50; }
-            .stat-label { color: #7f8c8d; font-size: 0.9em; }
-            table { width: 100%; border-collapse: collapse; margin-top: 20px; }
-            th { background: #34495e; color: white; padding: 12px; text-align: left; }
-            td { padding: 10px; border-bottom: 1px solid #ddd; }
-            .online { color: #27ae60; font-weight: bold; }
-            .offline { color: #e74c3c; }
-            .btn { background: #3498db; color: white; border: none; padding: 10px 20px; border-radius: 5px; cursor: pointer; margin: 5px; }
-            .btn:hover { background: #2980b9; }
-            .btn-scan { background: #e67e22; }
-            .btn-reboot { background: #e74c3c; }
-        </style>
-    </head>
-    <body>
-        <div class="container">
-            <div class="header">
-                <h1>MeshStatic Coordinator</h1>
-                <p>Autonomous Mesh Network Management</p>
-            </div>
-            
-            <div class="stats" id="stats">
-                <!-- Заполняется JavaScript -->
-            </div>
-            
-            <div>
-                <button class="btn" onclick="refreshData()">Refresh</button>
-                <button class="btn btn-scan" onclick="sendCommand('scan')">Scan Network</button>
-                <button class="btn btn-reboot" onclick="reboot()">Reboot</button>
-            </div>
-            
-            <h2>Connected Devices</h2>
-            <table>
-                <thead>
-                    <tr>
-                        <th>MAC Address</th>
-                        <th>Signal</th>
-                        <th>Last Seen</th>
-                        <th>Status</th>
-                    </tr>
-                </thead>
-                <tbody id="devices-table">
-                    <!-- Заполняется JavaScript -->
-                </tbody>
-            </table>
-        </div>
-        
-        <script>
-            function refreshData() {
-                fetch('/api/network-status')
-                    .then(r => r.json())
-                    .then(data => {
-                        document.getElementById('stats').innerHTML = `
-                            <div class="stat-card">
-                                <div class="stat-value">${data.uptime}s</div>
-                                <div class="stat-label">Uptime</div>
-                            </div>
-                            <div class="stat-card">
-                                <div class="stat-value">${data.packets_received}</div>
-                                <div class="stat-label">Packets Received</div>
-                            </div>
-                            <div class="stat-card">
-                                <div class="stat-value">${data.packets_sent}</div>
-                                <div class="stat-label">Packets Sent</div>
-                            </div>
-                            <div class="stat-card">
-                                <div class="stat-value">${data.nodes_online}</div>
-                                <div class="stat-label">Nodes Online</div>
-                            </div>`;
-                    });
-                    
-                fetch('/api/devices')
-                    .then(r => r.json())
-                    .then(data => {
-                        let html = '';
-                        data.devices.forEach(device => {
-                            html += `
-                                <tr>
-                                    <td>${device.mac}</td>
-                                    <td>${device.rssi} dBm</td>
-                                    <td>${device.last_seen}s ago</td>
-                                    <td class="${device.online ? 'online' : 'offline'}">
-                                        ${device.online ? 'ONLINE' : 'OFFLINE'}
-                                    </td>
-                                </tr>`;
-                        });
-                        document.getElementById('devices-table').innerHTML = html;
-                    });
-            }
-            
-            function sendCommand(cmd) {
-                fetch('/api/command', {
-                    method: 'POST',
-                    headers: {'Content-Type': 'application/json'},
-                    body: JSON.stringify({command: cmd})
-                }).then(r => r.json())
-                  .then(data => alert(data.message));
-            }
-            
-            function reboot() {
-                if(confirm('Reboot coordinator?')) {
-                    fetch('/api/reboot', {method: 'POST'});
-                }
-            }
-            
-            // Автообновление каждые 10 секунд
-            setInterval(refreshData, 10000);
-            document.addEventListener('DOMContentLoaded', refreshData);
-        </script>
-    </body>
-    </html>
-    )rawliteral";
+void log_event(EventId event, const uint8_t* mac, int16_t arg0, int16_t arg1) {
+    uint32_t now = millis();
     
-    request->send(200, "text/html", html);
+    portENTER_CRITICAL(&event_log_mux);
+    event_log_append(&event_log, event, now, mac, arg0, arg1);
+    portEXIT_CRITICAL(&event_log_mux);
 }
 
 /**
- * API: статус сети
+ * Вывод готовой строки лога в UART
+ * 
+ * Зовётся из задачи отложенного вывода (см. log_init), а не из
+ * того, кто пишет в лог.
+ * 
+ * @param data Строка с переводом строки
+ * @param len Длина
  */
-void handle_api_network_status(AsyncWebServerRequest* request) {
-    StaticJsonDocument<512> doc;
-    
-    doc["uptime"] = (millis() - network_state.startup_time) / 1000;
-    doc["packets_received"] = network_state.packets_received;
-    doc["packets_sent"] = network_state.packets_sent;
-    
-    // Считаем онлайн-устройства
-    uint8_t online_count = 0;
-    uint32_t now = millis() / 1000;
-    for (int i = 0; i < routing_table_size; i++) {
-        if (now - routing_table[i].last_seen < 300) {  // Видели последние 5 минут
-            online_count++;
-        }
-    }
-    
-    doc["nodes_online"] = online_count;
-    doc["nodes_total"] = routing_table_size;
-    doc["mesh_initialized"] = network_state.mesh_initialized;
-    doc["wifi_connected"] = network_state.wifi_connected;
-    doc["free_heap"] = ESP.getFreeHeap();
-    doc["free_heap_min"] = network_state.free_heap_min;
-    
-    String response;
-    serializeJson(doc, response);
-    request->send(200, "application/json", response);
+void write_log_line(const char* data, size_t len) {
+    Serial.write((const uint8_t*)data, len);
 }
 
 /**
- * API: список устройств
+ * Замер шифрования: такты на байт
+ * 
+ * Шифрование и расшифровка пакета с AAD размера заголовка через
+ * mesh_*_packet_ks — ту же реализацию (MESH_CRYPTO_BACKEND), что и
+ * на реальном пути пакета. У mbedTLS в замер входит установка ключа
+ * на каждый пакет: так он и работает.
+ * Размеры: короткая команда, один блок, типичный payload, кадр целиком.
+ * Пока идёт замер, пакеты ждут в очередях.
  */
-void handle_api_devices(AsyncWebServerRequest* request) {
-    StaticJsonDocument<4096> doc;
-    JsonArray devices = doc.createNestedArray("devices");
+void run_crypto_benchmark() {
+    static const size_t sizes[] = {16, 64, 180, 250};
+    static uint8_t plaintext[MAX_PACKET_SIZE] __attribute__((aligned(4)));
+    static uint8_t ciphertext[MAX_PACKET_SIZE] __attribute__((aligned(4)));
+    static uint8_t decrypted[MAX_PACKET_SIZE] __attribute__((aligned(4)));
+    uint8_t aad[MESH_HEADER_SIZE];
+    uint8_t nonce[CHACHA20_NONCE_SIZE] = {0};
+    uint8_t tag[POLY1305_TAG_SIZE];
     
-    uint32_t now = millis() / 1000;
+    for (size_t i = 0; i < sizeof(plaintext); i++) {
+        plaintext[i] = (uint8_t)esp_random();
+    }
+    memset(aad, 0x5A, sizeof(aad));
     
-    for (int i = 0; i < routing_table_size; i++) {
-        JsonObject device = devices.createNestedObject();
-        
-        device["mac"] = mac_to_string(routing_table[i].device_mac);
-        device["rssi"] = routing_table[i].rssi;
-        device["last_seen"] = now - routing_table[i].last_seen;
-        device["online"] = (now - routing_table[i].last_seen) < 300;  // 5 минут
+    // Своё расписание: кэш ключей принадлежит packet_task
+    chacha20_key_schedule_t schedule;
+    chacha20_key_schedule_init(&schedule, session_key);
+    
+    Serial.printf("=== Crypto benchmark: %s (cycles/byte) ===\n", MESH_CRYPTO_BACKEND_NAME);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t len = sizes[s];
+        bool ok = true;
         
-        if (routing_table[i].battery_mv > 0) {
-            device["battery"] = routing_table[i].battery_mv;
+        uint32_t start = ESP.getCycleCount();
+        for (int i = 0; i < CRYPTO_BENCH_ITERATIONS; i++) {
+            nonce[0] = (uint8_t)i;
+            mesh_encrypt_packet_ks(&schedule, nonce, plaintext, len,
+                                   aad, sizeof(aad), ciphertext, tag);
         }
-    }
-    
-    String response;
-    serializeJson(doc, response);
-    request->send(200, "application/json", response);
-}
-
-/**
- * API: отправка команды
- */
-void handle_api_command(AsyncWebServerRequest* request) {
-    if (request->method() == HTTP_POST) {
-        String body = request->arg("plain");
-        StaticJsonDocument<256> doc;
-        DeserializationError error = deserializeJson(doc, body);
+        uint32_t encrypt_cycles = ESP.getCycleCount() - start;
         
-        if (error) {
-            request->send(400, "application/json", "{\"error\":\"Invalid JSON\"}");
-            return;
+        // Расшифровываем последний шифртекст: тег обязан сойтись
+        start = ESP.getCycleCount();
+        for (int i = 0; i < CRYPTO_BENCH_ITERATIONS; i++) {
+            ok &= mesh_decrypt_packet_ks(&schedule, nonce, ciphertext, len,
+                                         aad, sizeof(aad), tag, decrypted);
         }
+        uint32_t decrypt_cycles = ESP.getCycleCount() - start;
         
-        const char* command = doc["command"];
+        float bytes = (float)len * CRYPTO_BENCH_ITERATIONS;
+        Serial.printf("%3u B: encrypt %.1f, decrypt %.1f%s\n", (unsigned)len,
+                     encrypt_cycles / bytes, decrypt_cycles / bytes,
+                     ok ? "" : " (TAG MISMATCH)");
         
-        if (strcmp(command, "scan") == 0) {
-            send_device_discovery();
-            request->send(200, "application/json", "{\"message\":\"Scan started\"}");
-        } else {
-            request->send(400, "application/json", "{\"error\":\"Unknown command\"}");
-        }
-    } else {
-        request->send(405, "application/json", "{\"error\":\"Method not allowed\"}");
+        delay(1);  // Не душим сторожевой таймер
     }
-}
-
-/**
- * API: логи системы
- */
-void handle_api_logs(AsyncWebServerRequest* request) {
-    // В реальной системе здесь читались бы логи из файла
-    request->send(200, "text/plain", "Logs would be here...\n");
+    
+    secure_wipe(&schedule, sizeof(schedule));
 }
 
 // ============================================================================
-// УТИЛИТЫ
+// ПЕРИОДИЧЕСКИЕ ЗАДАЧИ
 // ============================================================================
 
 /**
- * Конвертация MAC в строку
+ * Запуск периодических задач loop()
  * 
- * @param mac MAC адрес
- * @return Строка вида "AA:BB:CC:DD:EE:FF"
+ * Первый heartbeat — в случайный момент первого периода.
  */
-String mac_to_string(const uint8_t* mac) {
-    char buf[18];
-    snprintf(buf, sizeof(buf), "%02X:%02X:%02X:%02X:%02X:%02X",
-             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-    return String(buf);
+void setup_loop_timers() {
+    uint32_t now = millis();
+    timer_wheel_init(&loop_timers, loop_timer_storage, LOOP_TIMER_COUNT, TIMER_TICK_MS, now);
+    adaptive_interval_init(&heartbeat_interval, HEARTBEAT_MIN_MS, HEARTBEAT_MAX_MS);
+    
+    timer_wheel_schedule(&loop_timers, TIMER_HEARTBEAT, esp_random() % HEARTBEAT_MIN_MS,
+                         on_heartbeat_timer, nullptr);
+    timer_wheel_schedule(&loop_timers, TIMER_CLEANUP,
+                         timer_jitter(CLEANUP_INTERVAL_MS, HEARTBEAT_JITTER_PCT, esp_random()),
+                         on_cleanup_timer, nullptr);
+    timer_wheel_schedule(&loop_timers, TIMER_STATS, STAT_INTERVAL_MS, on_stats_timer, nullptr);
+    timer_wheel_schedule(&loop_timers, TIMER_LIVE_TICK, LIVE_TICK_MS, on_live_tick_timer, nullptr);
 }
 
 /**
- * Логирование события
+ * Heartbeat и выбор следующего периода
  * 
- * @param event Событие
- * @param details Детали
+ * Топология менялась с прошлого раза — период сбрасывается к
+ * HEARTBEAT_MIN_MS, иначе удваивается до HEARTBEAT_MAX_MS.
  */
-void log_event(const char* event, const char* details) {
-    // В реальной системе здесь было бы сохранение в файл
-    Serial.printf("Event: %s", event);
-    if (details && strlen(details) > 0) {
-        Serial.printf(" (%s)", details);
+void on_heartbeat_timer(void* ctx, uint32_t now) {
+    (void)ctx;
+    (void)now;
+    send_heartbeat();
+    
+    uint32_t changes = network_state.topology_changes;
+    uint32_t period = adaptive_interval_next(&heartbeat_interval, changes != heartbeat_seen_changes);
+    heartbeat_seen_changes = changes;
+    timer_wheel_schedule(&loop_timers, TIMER_HEARTBEAT,
+                         timer_jitter(period, HEARTBEAT_JITTER_PCT, esp_random()),
+                         on_heartbeat_timer, nullptr);
+}
+
+void on_cleanup_timer(void* ctx, uint32_t now) {
+    (void)ctx;
+    (void)now;
+    post_packet_task_job(JOB_CLEANUP);
+    timer_wheel_schedule(&loop_timers, TIMER_CLEANUP,
+                         timer_jitter(CLEANUP_INTERVAL_MS, HEARTBEAT_JITTER_PCT, esp_random()),
+                         on_cleanup_timer, nullptr);
+}
+
+// Обновление статистики памяти
+void on_stats_timer(void* ctx, uint32_t now) {
+    (void)ctx;
+    (void)now;
+    uint32_t free_heap = ESP.getFreeHeap();
+    if (free_heap < network_state.free_heap_min) {
+        network_state.free_heap_min = free_heap;
     }
-    Serial.println();
+    timer_wheel_schedule(&loop_timers, TIMER_STATS, STAT_INTERVAL_MS, on_stats_timer, nullptr);
+}
+
+// Рассылка накопленных изменений в браузеры (эфир не занимает — без разброса)
+void on_live_tick_timer(void* ctx, uint32_t now) {
+    (void)ctx;
+    (void)now;
+    post_packet_task_job(JOB_MARK_OFFLINE);
+    live_tick();
+    timer_wheel_schedule(&loop_timers, TIMER_LIVE_TICK, LIVE_TICK_MS, on_live_tick_timer, nullptr);
 }
 
 // ============================================================================
@@ -1220,30 +4215,14 @@ void log_event(const char* event, const char* details) {
  * Здесь обрабатываются фоновые задачи.
  */
 void loop() {
-    static uint32_t last_heartbeat = 0;
-    static uint32_t last_cleanup = 0;
-    static uint32_t last_stat_update = 0;
-    
-    // Периодический heartbeat
-    if (millis() - last_heartbeat > HEARTBEAT_INTERVAL) {
-        send_heartbeat();
-        last_heartbeat = millis();
-    }
+    // Heartbeat, очистка, статистика, живые обновления
+    timer_wheel_poll(&loop_timers, millis());
     
-    // Очистка старых записей каждую минуту
-    if (millis() - last_cleanup > 60000) {
-        cleanup_old_entries();
-        last_cleanup = millis();
-    }
-    
-    // Обновление статистики памяти
-    if (millis() - last_stat_update > 10000) {
-        uint32_t free_heap = ESP.getFreeHeap();
-        if (free_heap < network_state.free_heap_min) {
-            network_state.free_heap_min = free_heap;
-        }
-        last_stat_update = millis();
-    }
+    // Таймеры повторов для пакетов без подтверждения
+    xSemaphoreTake(reliable_mutex, portMAX_DELAY);
+    reliable_poll(&reliable_table, millis());
+    xSemaphoreGive(reliable_mutex);
+    poll_probe();
     
     // Простая консоль для отладки
     if (Serial.available()) {
@@ -1256,7 +4235,75 @@ void loop() {
             Serial.printf("Packets RX/TX: %lu/%lu\n", 
                          network_state.packets_received, 
                          network_state.packets_sent);
-            Serial.printf("Routing entries: %d\n", routing_table_size);
+            Serial.printf("Routing entries: %d (NVS: %lu flushes, %lu pages written)\n",
+                         routing_table_size, network_state.nvs_flushes,
+                         network_state.nvs_page_writes);
+            uint8_t groups = 0;
+            for (uint8_t i = 0; i < GROUP_SLOTS; i++) {
+                groups += group_slot_storage[i].members ? 1 : 0;
+            }
+            Serial.printf("Groups: %u known (%lu overflow), %lu flood / %lu subtree fan-outs, %lu frames\n",
+                         groups, group_index.overflow, network_state.group_floods,
+                         network_state.group_subtree_fanouts, network_state.group_frames);
+            Serial.printf("Heartbeat: every %lu ms (%lu..%lu, %lu resets), %lu topology changes, %lu discovery replies\n",
+                         heartbeat_interval.current_ms, heartbeat_interval.min_ms,
+                         heartbeat_interval.max_ms, heartbeat_interval.resets,
+                         network_state.topology_changes, network_state.discovery_replies);
+            Serial.printf("Links: %lu evictions, %lu parent switches\n",
+                         link_table.evictions, network_state.parent_switches);
+            Serial.printf("Route deltas: %lu applied (%lu snapshots), %lu gaps, %lu resync requests, %lu duplicates\n",
+                         route_delta_rx.applied, route_delta_rx.snapshots, route_delta_rx.gaps,
+                         route_delta_rx.resync_requests, route_delta_rx.duplicates);
+            Serial.printf("Dedup: %lu hits, %lu misses, %lu evictions (window %lu ms)\n",
+                         dedup_cache.hits, dedup_cache.misses,
+                         dedup_cache.evictions, dedup_cache.window_ms);
+            Serial.printf("Reliable: %u in flight, %lu sent, %lu retx, %lu acked, %lu nacked, %lu timeouts\n",
+                         reliable_table.in_flight, reliable_table.sent,
+                         reliable_table.retransmits, reliable_table.acked,
+                         reliable_table.nacked, reliable_table.timeouts);
+            Serial.printf("Key cache: %lu hits, %lu misses, %lu evictions (session %lu, %s)\n",
+                         peer_key_cache.hits, peer_key_cache.misses,
+                         peer_key_cache.evictions, current_session_id,
+                         MESH_CRYPTO_BACKEND_NAME);
+            Serial.printf("Event log: %lu events, %lu persisted, %lu lost (%s)\n",
+                         event_log.head, event_log.persisted, event_log.lost,
+                         event_file_ready ? EVENT_LOG_FILE_PATH : "RAM only");
+            Serial.printf("Log: level %d, %lu lines dropped\n", LOG_LEVEL, log_dropped());
+            Serial.printf("Crypto: %lu encrypted, %lu decrypted, %lu failures, boot epoch %u%s\n",
+                         network_state.packets_encrypted, network_state.packets_decrypted,
+                         network_state.decrypt_failures, boot_epoch,
+                         boot_epoch_saved ? "" : " (not saved: encryption off)");
+            Serial.printf("TX queue : depth %u (peak %lu), %u in flight, %lu retries, "
+                         "%lu full, %lu failed, %lu completion stalls, p99 wait %lu us\n",
+                         uxQueueMessagesWaiting(tx_queue) + uxQueueMessagesWaiting(tx_urgent_queue),
+                         network_state.tx_queue_high_water,
+                         TX_IN_FLIGHT - uxSemaphoreGetCount(tx_credits), network_state.tx_retries,
+                         network_state.tx_queue_full, network_state.tx_failed,
+                         network_state.tx_completion_stalls,
+                         latency_histogram_percentile(&network_state.tx_queue_latency, 99));
+            for (int c = 0; c < PRIO_CLASS_COUNT; c++) {
+                Serial.printf("RX %-9s: depth %lu (peak %lu, overflows %lu), p99 %lu us\n",
+                             PRIO_CLASS_NAMES[c],
+                             packet_ring_count(&rx_scheduler.rings[c]),
+                             network_state.rx_queue_high_water[c],
+                             network_state.rx_queue_overflows[c],
+                             latency_histogram_percentile(&network_state.dispatch_latency[c], 99));
+            }
+            for (int type = 0; type < METRICS_TYPE_SLOTS; type++) {
+                const LatencyHistogram* stages = packet_metrics.latency[type];
+                if (stages[METRIC_STAGE_QUEUE].count == 0 && stages[METRIC_STAGE_SEND].count == 0) {
+                    continue;
+                }
+                Serial.printf("%-15s: p99 queue %lu, handler %lu, send %lu us (rx %lu, tx %lu)\n",
+                             message_type_name(type),
+                             latency_histogram_percentile(&stages[METRIC_STAGE_QUEUE], 99),
+                             latency_histogram_percentile(&stages[METRIC_STAGE_HANDLER], 99),
+                             latency_histogram_percentile(&stages[METRIC_STAGE_SEND], 99),
+                             stages[METRIC_STAGE_QUEUE].count, stages[METRIC_STAGE_SEND].count);
+            }
+            Serial.printf("Dropped: %lu invalid, %lu TTL expired, %lu no route, %lu queue full\n",
+                         packet_metrics.drops[DROP_INVALID], packet_metrics.drops[DROP_TTL_EXPIRED],
+                         packet_metrics.drops[DROP_NO_ROUTE], packet_metrics.drops[DROP_QUEUE_FULL]);
             Serial.printf("Free heap: %lu bytes (min: %lu)\n", 
                          ESP.getFreeHeap(), 
                          network_state.free_heap_min);
@@ -1269,10 +4316,13 @@ void loop() {
             Serial.println("=== Connected Devices ===");
             for (int i = 0; i < routing_table_size; i++) {
                 Serial.printf("%2d. %s ", i + 1, 
-                             mac_to_string(routing_table[i].device_mac).c_str());
-                Serial.printf("(RSSI: %d, ", routing_table[i].rssi);
+                             mac_to_string(node_mac[i]).c_str());
+                Serial.printf("(RSSI: %d, ", node_rssi[i]);
+                if (node_awake_ms[i] > 0) {
+                    Serial.printf("awake %u ms, ", node_awake_ms[i]);
+                }
                 
-                uint32_t last_seen = (millis() / 1000) - routing_table[i].last_seen;
+                uint32_t last_seen = (millis() / 1000) - node_last_seen[i];
                 if (last_seen < 60) {
                     Serial.printf("seen %lus ago)\n", last_seen);
                 } else if (last_seen < 3600) {
@@ -1282,12 +4332,37 @@ void loop() {
                 }
             }
         }
+        else if (cmd == "links") {
+            print_links();
+        }
         else if (cmd == "scan") {
             send_device_discovery();
             Serial.println("Discovery packet sent");
         }
+        else if (cmd == "probe") {
+            print_probe_result();
+        }
+        else if (cmd.startsWith("probe ")) {
+            uint8_t target[6];
+            if (!string_to_mac(cmd.substring(6).c_str(), target)) {
+                Serial.println("Usage: probe AA:BB:CC:DD:EE:FF");
+            } else if (start_probe(target)) {
+                Serial.println("Probe sent, type 'probe' for the result");
+            } else {
+                Serial.println("No route to device");
+            }
+        }
+        else if (cmd == "events") {
+            print_recent_events(20);
+        }
+        else if (cmd == "bench") {
+            run_crypto_benchmark();
+        }
         else if (cmd == "reboot") {
             Serial.println("Rebooting...");
+            flush_event_log();
+            flush_routing_table();
+            log_flush();
             delay(1000);
             ESP.restart();
         }
@@ -1295,7 +4370,11 @@ void loop() {
             Serial.println("Available commands:");
             Serial.println("  status    - Show system status");
             Serial.println("  devices   - List connected devices");
+            Serial.println("  links     - Neighbour RSSI and ETX");
             Serial.println("  scan      - Send discovery packet");
+            Serial.println("  events    - Last 20 logged events");
+            Serial.println("  probe MAC - Per-hop latency to a device ('probe' shows the last result)");
+            Serial.println("  bench     - Crypto cycles/byte (16/64/180/250 B)");
             Serial.println("  reboot    - Reboot coordinator");
             Serial.println("  help      - This help");
         }
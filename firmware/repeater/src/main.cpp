@@ -1,50 +1,1022 @@
 #include <Arduino.h>
 #include <WiFi.h>
 #include <esp_now.h>
+#include <esp_wifi.h>
+#include <Preferences.h>
 
 #include "../../common/mesh_protocol.h"
+#include "../../common/dedup_cache.h"
+#include "../../common/mac_index.h"
+#include "../../common/reliable_delivery.h"
+#include "../../common/reflex_rules.h"
+#include "../../common/link_quality.h"
+#include "../../common/route_delta.h"
+#include "../../common/timer_wheel.h"
+#include "../../common/log.h"
 
 // Конфигурация
 #define MESH_CHANNEL 1
-#define HEARTBEAT_INTERVAL 30000  // 30 сек для репитера
+#define ROUTE_KEEPALIVE_MIN_MS 15000   // Пустое объявление, пока дети меняются...
+#define ROUTE_KEEPALIVE_MAX_MS 75000   // ...и до этого растёт в спокойной сети: с разбросом
+                                       // ниже LINK_STALE_MS координатора (90 с)
+#define JITTER_PCT 10              // Разброс сроков периодических задач, ± процентов
+#define DISCOVERY_SLOT_MS 20       // Слот ответа на discovery (окно задаёт координатор)
+#define TIMER_TICK_MS DISCOVERY_SLOT_MS  // Шаг колеса и сна loop(): слоты discovery различимы
+#define DEDUP_ENTRIES 256         // Записей в кэше дублей (степень двойки)
+#ifndef DEDUP_WINDOW_MS
+#define DEDUP_WINDOW_MS 10000     // Сколько помним пересланный пакет
+#endif
+#define ROUTE_CACHE_SIZE 64        // Маршрутов в локальной таблице
+#define ROUTE_INDEX_SLOTS 128      // Слотов хеш-индекса (степень двойки, >= 2x)
+#define ROUTE_TIMEOUT_MS 120000    // Маршрут без подтверждения устаревает
+#define MAX_UNICAST_PEERS 16       // ESP-NOW держит до 20 незашифрованных peer'ов
+#define CUSTODY_SLOTS 8            // Пакетов с FLAG_REQUIRE_ACK под нашей опекой
+#define CUSTODY_QUEUE_DEPTH 8      // Запросов к таблице опеки от callback'а приёма
+#define LINK_TABLE_SIZE 16         // Соседей с измерениями RSSI и ETX
+#define ROUTE_DELTA_INTERVAL_MS 2000  // Как часто проверяем, изменились ли дети
+#define ROUTE_DELTA_BURST 4        // Кадров изменений за одну проверку, не больше
+#define ROUTE_DELTA_PEERS 8        // Соседей-репитеров, чьи объявления отслеживаем
+
+// Агрегация телеметрии: показания детей копятся и уходят одним
+// MSG_DATA_BATCH — меньше кадров в эфире у координатора
+#ifndef AGGREGATION_FLUSH_MS
+#define AGGREGATION_FLUSH_MS 500   // Максимальная задержка показания в пачке
+#endif
+#ifndef AGGREGATION_MAX_RECORDS
+#define AGGREGATION_MAX_RECORDS BATCH_MAX_RECORDS  // Пачка уходит сразу при заполнении
+#endif
+static_assert(ROUTE_KEEPALIVE_MAX_MS * (100 + JITTER_PCT) / 100 + ROUTE_DELTA_INTERVAL_MS < ROUTE_TIMEOUT_MS,
+              "route keepalive must arrive before routes through us expire");
+static_assert(AGGREGATION_MAX_RECORDS <= BATCH_MAX_RECORDS, "AGGREGATION_MAX_RECORDS exceeds SensorBatch");
+
+#define LOG_ASYNC_BUFFER 2048      // Кольцо отложенного вывода лога, байт
+#define REFLEX_FIRE_MAX 4          // Команд на одно показание, не больше
+
+#ifndef ENABLE_LOCAL_LOGIC
+#define ENABLE_LOCAL_LOGIC 0
+#endif
 
 uint8_t self_mac[6];
 bool mesh_initialized = false;
 
+// Кэш уже пересланных пакетов: без него несколько репитеров
+// в зоне слышимости пересылают один пакет друг другу до исчерпания TTL
+static DedupEntry dedup_storage[DEDUP_ENTRIES];
+DedupCache dedup_cache;
+
+// Локальная таблица маршрутов: куда слать пакет для данного узла.
+// Учится по тому, от кого пришёл пакет (обратный путь),
+// и по объявлениям MSG_ROUTE_DELTA от соседей. Из нескольких
+// соседей выбирается путь с меньшим ожидаемым числом передач.
+typedef struct {
+    uint8_t  dst_mac[6];
+    uint8_t  next_hop[6];
+    uint8_t  hops;
+    uint16_t tail_cost;       // ETX x16 от next_hop до dst
+    uint32_t last_seen_ms;
+} RouteCacheEntry;
+
+RouteCacheEntry route_cache[ROUTE_CACHE_SIZE];
+uint16_t route_cache_size = 0;
+static MacIndexSlot route_index_storage[ROUTE_INDEX_SLOTS];
+MacIndex route_index;
+portMUX_TYPE route_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Качество связи с соседями (RSSI кадров и доставка unicast) —
+// тоже под route_mux: читается при выборе маршрута
+static LinkStats link_storage[LINK_TABLE_SIZE];
+LinkTable link_table;
+uint32_t route_switches = 0;
+
+// Объявления детей изменениями (route_delta.h). Своё состояние —
+// под route_mux (обход таблицы маршрутов); чужие объявления разбирает
+// только callback приёма.
+RouteDeltaTx route_delta_tx;
+static RouteDeltaPeer route_delta_peers[ROUTE_DELTA_PEERS];
+RouteDeltaRx route_delta_rx;
+uint32_t next_route_keepalive_ms = 0;
+AdaptiveInterval route_keepalive;
+
+// loop() спит тик колеса или до уведомления callback'а приёма
+// (опека, полная пачка, discovery) — работа не ждёт конца сна
+TaskHandle_t loop_task_handle = nullptr;
+
+// Периодические задачи loop() — с разбросом сроков: после общего
+// отключения питания репитеры не должны объявляться хором
+enum LoopTimer {
+    TIMER_ROUTE_DELTA = 0,
+    TIMER_DISCOVERY_REPLY,
+    LOOP_TIMER_COUNT
+};
+static WheelTimer loop_timer_storage[LOOP_TIMER_COUNT];
+TimerWheel loop_timers;
+
+// Запрос discovery принял callback приёма, ответ в своём слоте шлёт loop()
+uint8_t discovery_requester[6];
+uint16_t discovery_window_ms = 0;
+volatile bool discovery_requested = false;
+portMUX_TYPE discovery_mux = portMUX_INITIALIZER_UNLOCKED;
+uint32_t discovery_replies = 0;
+
+// Unicast peer'ы ESP-NOW, добавленные нами (FIFO для вытеснения).
+// Заводят и callback приёма, и loop() (опека, пачки, discovery) —
+// под unicast_peer_mutex: esp_now_add_peer может ждать, portMUX нельзя.
+// Держим только на время учёта, не на время esp_now_send
+uint8_t unicast_peers[MAX_UNICAST_PEERS][6];
+uint8_t unicast_peer_count = 0;
+uint8_t unicast_peer_next = 0;
+static StaticSemaphore_t unicast_peer_mutex_buffer;
+SemaphoreHandle_t unicast_peer_mutex = nullptr;
+
+// Опека над подтверждаемыми пакетами: пересланный unicast с
+// FLAG_REQUIRE_ACK повторяем сами, пока через нас не пройдёт ACK.
+// Потеря на одном прыжке чинится здесь, а не повтором через всю сеть.
+// Таблицу трогает только loop(). Callback приёма (задача WiFi) ставит
+// ACK/NACK и взятие под опеку в custody_queue: ждать loop() ему
+// нельзя — тот сам ждёт радио в esp_now_send.
+static ReliableSlot custody_storage[CUSTODY_SLOTS];
+ReliableTable custody_table;
+
+enum CustodyRequestKind {
+    CUSTODY_TAKE = 0,         // Кадр уже отправлен — повторять до ACK
+    CUSTODY_ACK,
+    CUSTODY_NACK
+};
+
+struct CustodyRequest {
+    uint8_t  kind;
+    uint8_t  len;
+    uint8_t  status;          // AckStatus из NACK
+    uint8_t  mac[6];          // Кто подтвердил
+    uint32_t packet_id;       // Что подтвердили
+    uint32_t sent_ms;         // Когда ушёл кадр (TAKE)
+    uint8_t  frame[MAX_PACKET_SIZE];
+};
+static uint8_t custody_queue_storage[CUSTODY_QUEUE_DEPTH * sizeof(CustodyRequest)];
+static StaticQueue_t custody_queue_buffer;
+QueueHandle_t custody_queue = nullptr;
+uint32_t custody_queue_full = 0;
+
+// Пачка показаний, ожидающая отправки: копит callback приёма,
+// отправляет loop() (по окну или когда пачка заполнилась)
+SensorBatch pending_batch;
+uint32_t pending_batch_since = 0;
+volatile bool pending_batch_full = false;
+portMUX_TYPE batch_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Координатор узнаём по его heartbeat: пачки адресуем ему
+uint8_t coordinator_mac[6];
+bool coordinator_known = false;
+
+// Рефлексы: правила от координатора (хранятся в NVS). Проверяет и
+// заменяет таблицу callback приёма, сохраняет во flash loop()
+ReflexEngine reflex_engine;
+portMUX_TYPE reflex_mux = portMUX_INITIALIZER_UNLOCKED;
+volatile bool reflex_save_pending = false;
+
+uint32_t packet_id_counter = 0;
+
+uint32_t relayed_unicast = 0;
+uint32_t relayed_broadcast = 0;
+uint32_t batched_records = 0;
+uint32_t batches_sent = 0;
+
+String mac_to_string(const uint8_t* mac);
+void write_log_line(const char* data, size_t len);
+void on_espnow_send(const uint8_t* mac, esp_now_send_status_t status);
+void on_wifi_promiscuous(void* buf, wifi_promiscuous_pkt_type_t type);
+void learn_route(const uint8_t* dst, const uint8_t* next_hop, uint8_t hops, uint32_t now);
+void learn_route_cost(const uint8_t* dst, const uint8_t* next_hop, uint8_t hops,
+                      uint16_t tail_cost, uint32_t now);
+bool lookup_next_hop(const uint8_t* dst, uint8_t* next_hop, uint32_t now);
+bool ensure_unicast_peer(const uint8_t* mac);
+void forget_route(const uint8_t* dst);
+void forget_route_via(const uint8_t* dst, const uint8_t* next_hop);
+void refresh_routes_via(const uint8_t* next_hop, uint32_t now);
+void handle_routing_update(const uint8_t* payload, uint8_t payload_len, const uint8_t* sender);
+void handle_route_delta(const MeshPacketView* view, const uint8_t* sender, uint32_t now);
+void on_route_delta_op(uint8_t op, const uint8_t* mac, uint8_t metric, void* ctx);
+void send_route_resync_request(const uint8_t* advertiser);
+void reply_to_probe(const MeshPacketView* view, uint32_t rx_us, uint32_t now);
+void send_route_delta(uint32_t now);
+void on_route_delta_timer(void* ctx, uint32_t now);
+void on_discovery_reply_timer(void* ctx, uint32_t now);
+void custody_send_frame(const uint8_t* frame, uint8_t len, void* ctx);
+void custody_give_up(const MeshPacketHeader* packet, uint8_t reason, uint8_t nack_reason, void* ctx);
+void wake_loop();
+void post_custody_ack(uint8_t msg_type, const uint8_t* from_mac, const AckPayload* ack);
+bool post_custody_take(const uint8_t* frame, uint8_t len, uint32_t sent_ms);
+void drain_custody_queue();
+uint32_t next_packet_id();
+bool aggregate_sensor_data(const MeshPacketView* view);
+void flush_sensor_batch();
+void send_ack_to_child(const uint8_t* child_mac, uint32_t packet_id);
+void send_ack(const uint8_t* dst_mac, uint32_t packet_id, uint8_t status, uint32_t now);
+void send_group_command(const GroupCommand* cmd, uint8_t parameter_len);
+void run_reflexes(const MeshPacketView* view, uint32_t now);
+void handle_reflex_rules(const MeshPacketView* view, uint32_t now);
+void save_reflex_rules();
+void load_reflex_rules();
+
+// Маршрут по пакету: дальше next_hop каналы не измерены, по 1.0 на прыжок
+void learn_route(const uint8_t* dst, const uint8_t* next_hop, uint8_t hops, uint32_t now) {
+    learn_route_cost(dst, next_hop, hops, link_path_metric(0, hops), now);
+}
+
+// Запоминаем маршрут, если он дешевле известного по ожидаемым передачам
+// (с запасом LINK_SWITCH_HYSTERESIS, чтобы не скакать) или известный устарел.
+// tail_cost — ETX x16 от next_hop до dst (из объявления соседа).
+void learn_route_cost(const uint8_t* dst, const uint8_t* next_hop, uint8_t hops,
+                      uint16_t tail_cost, uint32_t now) {
+    if (memcmp(dst, self_mac, 6) == 0 || !memcmp(dst, BROADCAST_MAC, 6)) return;
+    
+    portENTER_CRITICAL(&route_mux);
+    uint16_t index = mac_index_find(&route_index, dst);
+    
+    if (index == MAC_INDEX_NONE) {
+        if (route_cache_size < ROUTE_CACHE_SIZE) {
+            index = route_cache_size++;
+        } else {
+            // Таблица полна — вытесняем самую старую запись
+            index = 0;
+            for (uint16_t i = 1; i < route_cache_size; i++) {
+                if ((int32_t)(route_cache[i].last_seen_ms - route_cache[index].last_seen_ms) < 0) {
+                    index = i;
+                }
+            }
+            mac_index_remove(&route_index, route_cache[index].dst_mac);
+            if (route_index.tombstones > ROUTE_INDEX_SLOTS / 4) {
+                mac_index_clear(&route_index);
+                for (uint16_t i = 0; i < route_cache_size; i++) {
+                    if (i != index) mac_index_insert(&route_index, route_cache[i].dst_mac, i);
+                }
+            }
+        }
+        memcpy(route_cache[index].dst_mac, dst, 6);
+        mac_index_insert(&route_index, dst, index);
+    } else {
+        RouteCacheEntry* known = &route_cache[index];
+        bool stale = (now - known->last_seen_ms) > ROUTE_TIMEOUT_MS;
+        bool same_hop = memcmp(known->next_hop, next_hop, 6) == 0;
+        if (!stale && !same_hop) {
+            uint16_t known_cost = link_etx(link_find(&link_table, known->next_hop)) + known->tail_cost;
+            uint16_t cost = link_etx(link_find(&link_table, next_hop)) + tail_cost;
+            if (cost + LINK_SWITCH_HYSTERESIS > known_cost) {
+                portEXIT_CRITICAL(&route_mux);
+                return;
+            }
+            route_switches++;
+        }
+    }
+    
+    memcpy(route_cache[index].next_hop, next_hop, 6);
+    route_cache[index].hops = hops;
+    route_cache[index].tail_cost = tail_cost;
+    route_cache[index].last_seen_ms = now;
+    portEXIT_CRITICAL(&route_mux);
+}
+
+bool lookup_next_hop(const uint8_t* dst, uint8_t* next_hop, uint32_t now) {
+    bool found = false;
+    
+    portENTER_CRITICAL(&route_mux);
+    uint16_t index = mac_index_find(&route_index, dst);
+    if (index != MAC_INDEX_NONE &&
+        (now - route_cache[index].last_seen_ms) <= ROUTE_TIMEOUT_MS) {
+        memcpy(next_hop, route_cache[index].next_hop, 6);
+        found = true;
+    }
+    portEXIT_CRITICAL(&route_mux);
+    
+    return found;
+}
+
+// Маршрут не сработал — пусть следующий пакет ищет путь широковещательно
+void forget_route(const uint8_t* dst) {
+    portENTER_CRITICAL(&route_mux);
+    uint16_t index = mac_index_find(&route_index, dst);
+    if (index != MAC_INDEX_NONE) {
+        route_cache[index].last_seen_ms = millis() - ROUTE_TIMEOUT_MS - 1;
+    }
+    portEXIT_CRITICAL(&route_mux);
+}
+
+// Сосед объявил, что dst через него больше не достижим
+void forget_route_via(const uint8_t* dst, const uint8_t* next_hop) {
+    portENTER_CRITICAL(&route_mux);
+    uint16_t index = mac_index_find(&route_index, dst);
+    if (index != MAC_INDEX_NONE && memcmp(route_cache[index].next_hop, next_hop, 6) == 0) {
+        route_cache[index].last_seen_ms = millis() - ROUTE_TIMEOUT_MS - 1;
+    }
+    portEXIT_CRITICAL(&route_mux);
+}
+
+// keepalive соседа: его объявленные дети всё ещё за ним. Продлеваем
+// только маршруты через него — перехваченные другим соседом не трогаем
+void refresh_routes_via(const uint8_t* next_hop, uint32_t now) {
+    const RouteDeltaPeer* peer = route_delta_rx_find(&route_delta_rx, next_hop);
+    if (!peer) return;
+    
+    portENTER_CRITICAL(&route_mux);
+    for (uint8_t slot = 0; slot < ROUTE_DELTA_SLOTS; slot++) {
+        if (!route_delta_rx_known(peer, slot)) continue;
+        uint16_t index = mac_index_find(&route_index, peer->slot_mac[slot]);
+        if (index == MAC_INDEX_NONE) continue;
+        RouteCacheEntry* entry = &route_cache[index];
+        if (memcmp(entry->next_hop, next_hop, 6) == 0 &&
+            (now - entry->last_seen_ms) <= ROUTE_TIMEOUT_MS) {
+            entry->last_seen_ms = now;
+        }
+    }
+    portEXIT_CRITICAL(&route_mux);
+}
+
+// Итог unicast-отправки — в ETX соседа (у broadcast подтверждения нет)
+void on_espnow_send(const uint8_t* mac, esp_now_send_status_t status) {
+    if (memcmp(mac, BROADCAST_MAC, 6) == 0) return;
+    
+    portENTER_CRITICAL(&route_mux);
+    link_on_tx(&link_table, mac, status == ESP_NOW_SEND_SUCCESS, millis());
+    portEXIT_CRITICAL(&route_mux);
+}
+
+// RSSI кадров ESP-NOW: callback приёма его не сообщает, берём из
+// promiscuous-режима (кадр приходит сюда до on_espnow_recv)
+void on_wifi_promiscuous(void* buf, wifi_promiscuous_pkt_type_t type) {
+    if (type != WIFI_PKT_MGMT) return;
+    
+    const wifi_promiscuous_pkt_t* pkt = (const wifi_promiscuous_pkt_t*)buf;
+    const uint8_t* src = link_espnow_source(pkt->payload, pkt->rx_ctrl.sig_len);
+    if (!src) return;
+    
+    portENTER_CRITICAL(&route_mux);
+    link_on_rx(&link_table, src, pkt->rx_ctrl.rssi, millis());
+    portEXIT_CRITICAL(&route_mux);
+}
+
+// ESP-NOW шлёт unicast только зарегистрированным peer'ам
+bool ensure_unicast_peer(const uint8_t* mac) {
+    xSemaphoreTake(unicast_peer_mutex, portMAX_DELAY);
+    if (esp_now_is_peer_exist(mac)) {
+        xSemaphoreGive(unicast_peer_mutex);
+        return true;
+    }
+    
+    if (unicast_peer_count == MAX_UNICAST_PEERS) {
+        esp_now_del_peer(unicast_peers[unicast_peer_next]);
+    } else {
+        unicast_peer_count++;
+    }
+    
+    esp_now_peer_info_t peer_info = {};
+    memcpy(peer_info.peer_addr, mac, 6);
+    peer_info.channel = MESH_CHANNEL;
+    peer_info.encrypt = false;
+    bool added = esp_now_add_peer(&peer_info) == ESP_OK;
+    if (added) {
+        memcpy(unicast_peers[unicast_peer_next], mac, 6);
+        unicast_peer_next = (unicast_peer_next + 1) % MAX_UNICAST_PEERS;
+    } else {
+        unicast_peer_count--;
+    }
+    xSemaphoreGive(unicast_peer_mutex);
+    return added;
+}
+
+// Сосед на прежней прошивке сообщает, какие узлы достижимы через него
+void handle_routing_update(const uint8_t* payload, uint8_t payload_len, const uint8_t* sender) {
+    if (payload_len < 1) return;
+    
+    const RoutingUpdate* update = (const RoutingUpdate*)payload;
+    // Читаем только записи, которые реально пришли в кадре
+    uint8_t count = (payload_len - 1) / sizeof(RouteAdvert);
+    if (update->count < count) count = update->count;
+    uint32_t now = millis();
+    
+    for (uint8_t i = 0; i < count; i++) {
+        const RouteAdvert* route = &update->routes[i];
+        if (route->hops < DEFAULT_TTL) {
+            learn_route(route->mac, sender, route->hops + 1, now);
+        }
+    }
+}
+
+// Изменения маршрутов соседа (или его просьба прислать наш снимок)
+void handle_route_delta(const MeshPacketView* view, const uint8_t* sender, uint32_t now) {
+    RouteDeltaResult result = route_delta_rx_apply(&route_delta_rx, sender, mesh_view_payload(view),
+                                                   view->payload_len, now, on_route_delta_op,
+                                                   (void*)sender);
+    if (result == ROUTE_DELTA_RESYNC_ASKED) {
+        if (memcmp(mesh_view_dst_mac(view), self_mac, 6) == 0) {
+            portENTER_CRITICAL(&route_mux);
+            route_delta_tx_request_full(&route_delta_tx);
+            portEXIT_CRITICAL(&route_mux);
+        }
+    } else if (result == ROUTE_DELTA_NEED_RESYNC) {
+        send_route_resync_request(sender);
+    } else if (result == ROUTE_DELTA_ALIVE) {
+        refresh_routes_via(sender, now);
+    }
+}
+
+// Ребёнок соседа: через соседа, ещё прыжок по объявленному ETX
+void on_route_delta_op(uint8_t op, const uint8_t* mac, uint8_t metric, void* ctx) {
+    const uint8_t* sender = (const uint8_t*)ctx;
+    if (op == ROUTE_DELTA_OP_REMOVE) {
+        forget_route_via(mac, sender);
+    } else {
+        learn_route_cost(mac, sender, 2, metric, millis());
+    }
+}
+
+// Пропустили изменения соседа — просим снимок (один прыжок)
+void send_route_resync_request(const uint8_t* advertiser) {
+    MeshPacketHeader packet = {};
+    packet.network_id = MESH_NETWORK_ID;
+    packet.version = PROTOCOL_VERSION;
+    packet.ttl = 1;
+    packet.packet_id = next_packet_id();
+    memcpy(packet.src_mac, self_mac, 6);
+    memcpy(packet.dst_mac, advertiser, 6);
+    memcpy(packet.last_hop_mac, self_mac, 6);
+    packet.msg_type = MSG_ROUTE_DELTA;
+    packet.payload_len = ROUTE_DELTA_HEADER_SIZE;
+    ((RouteDeltaPayload*)packet.payload)->flags = ROUTE_DELTA_RESYNC;
+    esp_now_send(BROADCAST_MAC, (uint8_t*)&packet, mesh_packet_wire_size(&packet));
+}
+
+// Отправка (и повтор) опекаемого кадра по текущему маршруту
+void custody_send_frame(const uint8_t* frame, uint8_t len, void* ctx) {
+    (void)ctx;
+    
+    const MeshPacketHeader* packet = (const MeshPacketHeader*)frame;
+    uint8_t next_hop[6];
+    if (lookup_next_hop(packet->dst_mac, next_hop, millis()) &&
+        ensure_unicast_peer(next_hop) &&
+        esp_now_send(next_hop, frame, len) == ESP_OK) {
+        return;
+    }
+    esp_now_send(BROADCAST_MAC, frame, len);
+}
+
+// ACK так и не прошёл: маршрут через этого соседа считаем мёртвым
+void custody_give_up(const MeshPacketHeader* packet, uint8_t reason, uint8_t nack_reason, void* ctx) {
+    (void)nack_reason;
+    (void)ctx;
+    
+    if (reason == RELIABLE_GAVE_UP_TIMEOUT) {
+        forget_route(packet->dst_mac);
+    }
+    LOG_W("Custody dropped packet %lu to %s (%s)", packet->packet_id,
+         mac_to_string(packet->dst_mac).c_str(),
+         reason == RELIABLE_GAVE_UP_NACK ? "nack" : "timeout");
+}
+
+// Разбудить loop() из callback'а приёма
+void wake_loop() {
+    if (loop_task_handle) xTaskNotifyGive(loop_task_handle);
+}
+
+// ACK/NACK, прошедший через нас, — в очередь loop()
+void post_custody_ack(uint8_t msg_type, const uint8_t* from_mac, const AckPayload* ack) {
+    CustodyRequest request;
+    request.kind = msg_type == MSG_ACK ? CUSTODY_ACK : CUSTODY_NACK;
+    request.len = 0;
+    request.status = ack->status;
+    memcpy(request.mac, from_mac, 6);
+    request.packet_id = ack->acked_id;
+    request.sent_ms = 0;
+    if (xQueueSend(custody_queue, &request, 0) != pdTRUE) {
+        custody_queue_full++;
+        return;
+    }
+    wake_loop();
+}
+
+// Отправленный кадр — под опеку (повторы пойдут из loop()).
+// false — очередь полна: кадр ушёл один раз, без повторов.
+bool post_custody_take(const uint8_t* frame, uint8_t len, uint32_t sent_ms) {
+    CustodyRequest request;
+    request.kind = CUSTODY_TAKE;
+    request.len = len;
+    request.status = 0;
+    request.packet_id = 0;
+    request.sent_ms = sent_ms;
+    memcpy(request.frame, frame, len);
+    if (xQueueSend(custody_queue, &request, 0) != pdTRUE) {
+        custody_queue_full++;
+        return false;
+    }
+    wake_loop();
+    return true;
+}
+
+// Запросы callback'а приёма — в таблицу опеки
+void drain_custody_queue() {
+    CustodyRequest request;
+    while (xQueueReceive(custody_queue, &request, 0) == pdTRUE) {
+        if (request.kind == CUSTODY_ACK) {
+            reliable_on_ack(&custody_table, request.mac, request.packet_id);
+        } else if (request.kind == CUSTODY_NACK) {
+            reliable_on_nack(&custody_table, request.mac, request.packet_id, request.status);
+        } else {
+            // Уже под опекой — повтор от источника, наши таймеры идут
+            reliable_track(&custody_table, request.frame, request.len, request.sent_ms);
+        }
+    }
+}
+
+uint32_t next_packet_id() {
+    return __atomic_add_fetch(&packet_id_counter, 1, __ATOMIC_RELAXED);
+}
+
+// Подтверждение датчику от нашего имени: дальше за доставку отвечаем мы
+void send_ack_to_child(const uint8_t* child_mac, uint32_t packet_id) {
+    MeshPacketHeader ack;
+    reliable_build_ack(&ack, self_mac, child_mac, next_packet_id(), packet_id,
+                       MSG_ACK, ACK_STATUS_OK);
+    ack.ttl = 1;
+    if (ensure_unicast_peer(child_mac)) {
+        esp_now_send(child_mac, (uint8_t*)&ack, mesh_packet_wire_size(&ack));
+    }
+}
+
+// Показание непосредственного ребёнка — в пачку. false — пересылать как обычно
+// (в том числе пока loop() не отправил заполненную пачку).
+bool aggregate_sensor_data(const MeshPacketView* view) {
+    if (!coordinator_known) return false;  // Некому подтверждать пачку
+    if (view->payload_len < offsetof(SensorData, awake_ms)) return false;
+    
+    portENTER_CRITICAL(&batch_mux);
+    if (pending_batch.count >= AGGREGATION_MAX_RECORDS) {
+        portEXIT_CRITICAL(&batch_mux);
+        return false;
+    }
+    if (pending_batch.count == 0) {
+        pending_batch_since = millis();
+    }
+    SensorRecord* record = &pending_batch.records[pending_batch.count++];
+    memset(record, 0, sizeof(*record));
+    memcpy(record->src_mac, mesh_view_src_mac(view), 6);
+    memcpy(&record->data, mesh_view_payload(view),
+           view->payload_len < sizeof(SensorData) ? view->payload_len : sizeof(SensorData));
+    bool full = pending_batch.count >= AGGREGATION_MAX_RECORDS;
+    if (full) {
+        pending_batch_full = true;
+    }
+    portEXIT_CRITICAL(&batch_mux);
+    if (full) {
+        wake_loop();
+    }
+    
+    batched_records++;
+    if (mesh_view_flags(view) & FLAG_REQUIRE_ACK) {
+        send_ack_to_child(mesh_view_src_mac(view), mesh_view_packet_id(view));
+    }
+    return true;
+}
+
+// Отправка накопленной пачки координатору (с подтверждением), из loop()
+void flush_sensor_batch() {
+    MeshPacketHeader packet = {};
+    
+    portENTER_CRITICAL(&batch_mux);
+    uint8_t count = pending_batch.count;
+    if (count > 0) {
+        memcpy(packet.payload, &pending_batch, 1 + count * sizeof(SensorRecord));
+        pending_batch.count = 0;
+    }
+    pending_batch_full = false;
+    portEXIT_CRITICAL(&batch_mux);
+    
+    if (count == 0) return;
+    
+    packet.network_id = MESH_NETWORK_ID;
+    packet.version = PROTOCOL_VERSION;
+    packet.ttl = DEFAULT_TTL;
+    packet.packet_id = next_packet_id();
+    memcpy(packet.src_mac, self_mac, 6);
+    memcpy(packet.dst_mac, coordinator_mac, 6);
+    memcpy(packet.last_hop_mac, self_mac, 6);
+    packet.msg_type = MSG_DATA_BATCH;
+    packet.flags = FLAG_REQUIRE_ACK;
+    packet.payload_len = 1 + count * sizeof(SensorRecord);
+    
+    bool queued = reliable_send(&custody_table, (uint8_t*)&packet,
+                                mesh_packet_wire_size(&packet), millis());
+    
+    if (!queued) {
+        // Таблица опеки занята — отправляем без повторов, но не теряем сразу
+        custody_send_frame((uint8_t*)&packet, mesh_packet_wire_size(&packet), nullptr);
+    }
+    batches_sent++;
+}
+
+// Объявляем соседям изменения в своих непосредственных детях (один
+// прыжок, не пересылается). Без изменений — пустой кадр с номером
+// последовательности; его период растёт, пока дети не меняются.
+void send_route_delta(uint32_t now) {
+    MeshPacketHeader packet = {};
+    packet.network_id = MESH_NETWORK_ID;
+    packet.version = PROTOCOL_VERSION;
+    packet.ttl = 1;
+    memcpy(packet.src_mac, self_mac, 6);
+    memcpy(packet.dst_mac, BROADCAST_MAC, 6);
+    memcpy(packet.last_hop_mac, self_mac, 6);
+    packet.msg_type = MSG_ROUTE_DELTA;
+    RouteDeltaPayload* delta = (RouteDeltaPayload*)packet.payload;
+    
+    portENTER_CRITICAL(&route_mux);
+    route_delta_tx_begin(&route_delta_tx);
+    for (uint16_t i = 0; i < route_cache_size; i++) {
+        const RouteCacheEntry* entry = &route_cache[i];
+        if (entry->hops == 1 && (now - entry->last_seen_ms) <= ROUTE_TIMEOUT_MS) {
+            uint16_t etx = link_etx(link_find(&link_table, entry->dst_mac));
+            route_delta_tx_observe(&route_delta_tx, entry->dst_mac, etx < 255 ? etx : 255);
+        }
+    }
+    route_delta_tx_end(&route_delta_tx);
+    portEXIT_CRITICAL(&route_mux);
+    
+    for (uint8_t burst = 0; burst < ROUTE_DELTA_BURST; burst++) {
+        portENTER_CRITICAL(&route_mux);
+        packet.payload_len = route_delta_tx_build(&route_delta_tx, delta);
+        if (packet.payload_len == 0 && burst == 0 && (int32_t)(now - next_route_keepalive_ms) >= 0) {
+            packet.payload_len = route_delta_tx_keepalive(&route_delta_tx, delta);
+        }
+        portEXIT_CRITICAL(&route_mux);
+        
+        if (packet.payload_len == 0) break;
+        
+        packet.packet_id = next_packet_id();
+        esp_now_send(BROADCAST_MAC, (uint8_t*)&packet, mesh_packet_wire_size(&packet));
+        
+        bool changed = delta->count > 0 || (delta->flags & ROUTE_DELTA_FULL);
+        uint32_t period = adaptive_interval_next(&route_keepalive, changed);
+        next_route_keepalive_ms = now + timer_jitter(period, JITTER_PCT, esp_random());
+        if (!changed) break;
+    }
+}
+
+// Проверка изменений в детях — с разбросом, чтобы соседи не совпадали
+void on_route_delta_timer(void* ctx, uint32_t now) {
+    (void)ctx;
+    send_route_delta(now);
+    timer_wheel_schedule(&loop_timers, TIMER_ROUTE_DELTA,
+                         timer_jitter(ROUTE_DELTA_INTERVAL_MS, JITTER_PCT, esp_random()),
+                         on_route_delta_timer, nullptr);
+}
+
+// Ответ на discovery: наш слот окна наступил
+void on_discovery_reply_timer(void* ctx, uint32_t now) {
+    (void)ctx;
+    (void)now;
+    
+    MeshPacketHeader packet = {};
+    packet.network_id = MESH_NETWORK_ID;
+    packet.version = PROTOCOL_VERSION;
+    packet.ttl = DEFAULT_TTL;
+    packet.packet_id = next_packet_id();
+    memcpy(packet.src_mac, self_mac, 6);
+    portENTER_CRITICAL(&discovery_mux);
+    memcpy(packet.dst_mac, discovery_requester, 6);
+    portEXIT_CRITICAL(&discovery_mux);
+    memcpy(packet.last_hop_mac, self_mac, 6);
+    packet.msg_type = MSG_DISCOVERY;
+    
+    custody_send_frame((uint8_t*)&packet, mesh_packet_wire_size(&packet), nullptr);
+    discovery_replies++;
+}
+
 // Callback при получении пакета
 void on_espnow_recv(const uint8_t* mac, const uint8_t* data, int len) {
-    if (len < (int)sizeof(MeshPacketHeader)) return;
+    uint32_t rx_us = micros();
+    
+    // Проверяем заголовок прямо в приёмном буфере, без копирования
+    MeshPacketView view;
+    if (!mesh_view_init(&view, data, len)) return;
+    
+    const uint8_t* src_mac = mesh_view_src_mac(&view);
+    const uint8_t* dst_mac = mesh_view_dst_mac(&view);
+    uint8_t ttl = mesh_view_ttl(&view);
+    
+    // Свои пакеты и уже виденные не пересылаем
+    if (memcmp(src_mac, self_mac, 6) == 0) return;
+    
+    uint32_t now = millis();
+    
+    // Обратный путь: источник достижим через того, кто передал пакет
+    uint8_t hops = ttl <= DEFAULT_TTL ? DEFAULT_TTL - ttl + 1 : 1;
+    learn_route(src_mac, mac, hops, now);
+    
+    // Зашифрованный payload (FLAG_ENCRYPTED) репитер не читает и не
+    // расшифровывает: ключа у него нет, заголовок открыт — пересылаем как есть
+    uint8_t flags = mesh_view_flags(&view);
+    bool encrypted = (flags & FLAG_ENCRYPTED) != 0;
+    
+    if (mesh_view_msg_type(&view) == MSG_ROUTING_UPDATE && !encrypted) {
+        handle_routing_update(mesh_view_payload(&view), view.payload_len, mac);
+        return;  // Объявления действуют на один прыжок
+    }
+    if (mesh_view_msg_type(&view) == MSG_ROUTE_DELTA && !encrypted) {
+        handle_route_delta(&view, mac, now);
+        return;
+    }
+    
+    // Повтор по таймеру (FLAG_RETRY) пропускаем дальше, но только по
+    // известному маршруту — широковещательно повтор не разойдётся
+    bool duplicate = dedup_check_and_insert(&dedup_cache, src_mac, mesh_view_packet_id(&view), now);
+    if (duplicate && !(flags & FLAG_RETRY)) return;
+    
+    // Heartbeat координатора: запоминаем, кому слать пачки
+    if (mesh_view_msg_type(&view) == MSG_HEARTBEAT &&
+        memcmp(dst_mac, BROADCAST_MAC, 6) == 0 && !duplicate) {
+        memcpy(coordinator_mac, src_mac, 6);
+        coordinator_known = true;
+    }
+    
+    // Запрос discovery: ответим в своём слоте окна (из loop())
+    if (mesh_view_msg_type(&view) == MSG_DISCOVERY && !encrypted &&
+        memcmp(dst_mac, BROADCAST_MAC, 6) == 0 && !duplicate) {
+        DiscoveryRequest request = { DISCOVERY_WINDOW_DEFAULT_MS };
+        if (view.payload_len >= sizeof(request)) {
+            memcpy(&request, mesh_view_payload(&view), sizeof(request));
+        }
+        portENTER_CRITICAL(&discovery_mux);
+        memcpy(discovery_requester, src_mac, 6);
+        discovery_window_ms = request.window_ms;
+        discovery_requested = true;
+        portEXIT_CRITICAL(&discovery_mux);
+        wake_loop();
+    }
+    
+    // Через нас прошёл ACK — опекаемый пакет доставлен
+    uint8_t msg_type = mesh_view_msg_type(&view);
+    if ((msg_type == MSG_ACK || msg_type == MSG_NACK) && !encrypted &&
+        view.payload_len >= sizeof(AckPayload)) {
+        AckPayload ack;
+        memcpy(&ack, mesh_view_payload(&view), sizeof(ack));
+        post_custody_ack(msg_type, src_mac, &ack);
+    }
+    
+    // Замер задержки, адресованный нам: отвечаем источнику
+    if (msg_type == MSG_PROBE && !encrypted && !duplicate &&
+        memcmp(dst_mac, self_mac, 6) == 0) {
+        reply_to_probe(&view, rx_us, now);
+        return;
+    }
+    
+    // Групповая команда с local_process, адресованная нам: раздаём детям
+    // (так координатор делит раздачу группе по поддеревьям)
+    if (msg_type == MSG_CMD_GROUP && !encrypted && !duplicate &&
+        (flags & FLAG_LOCAL_PROCESS) && memcmp(dst_mac, self_mac, 6) == 0 &&
+        view.payload_len >= offsetof(GroupCommand, parameters)) {
+        send_group_command((const GroupCommand*)mesh_view_payload(&view),
+                           view.payload_len - offsetof(GroupCommand, parameters));
+        return;
+    }
+    
+#if ENABLE_LOCAL_LOGIC
+    // Таблица рефлексов от координатора
+    if (msg_type == MSG_REFLEX_RULES && !encrypted && !duplicate &&
+        memcmp(dst_mac, self_mac, 6) == 0) {
+        handle_reflex_rules(&view, now);
+        return;
+    }
     
-    MeshPacketHeader packet;
-    memcpy(&packet, data, sizeof(MeshPacketHeader));
+    // Показания и аварии детей проверяем по правилам до пересылки:
+    // команда уходит сразу, исходный пакет идёт координатору как обычно
+    if ((msg_type == MSG_DATA_SENSOR || msg_type == MSG_EVENT_BROADCAST) &&
+        !encrypted && !duplicate) {
+        run_reflexes(&view, now);
+    }
+#endif
     
-    if (!validate_packet(&packet, len)) return;
+    // Телеметрия от непосредственного ребёнка копится в пачку
+    // (аварийные и зашифрованные показания не задерживаем)
+    if (msg_type == MSG_DATA_SENSOR && !duplicate && !encrypted &&
+        !(flags & FLAG_EMERGENCY) && memcmp(src_mac, mac, 6) == 0 &&
+        memcmp(dst_mac, self_mac, 6) != 0 &&
+        aggregate_sensor_data(&view)) {
+        return;
+    }
     
     // Если пакет не для нас и TTL > 0 - пересылаем
-    if (!is_for_me(&packet, self_mac) && packet.ttl > 1) {
-        // Уменьшаем TTL
-        MeshPacketHeader* mutable_packet = (MeshPacketHeader*)data;
-        decrement_ttl(mutable_packet);
+    if (memcmp(dst_mac, self_mac, 6) != 0 && ttl > 1) {
+        // Определяем куда пересылать: known route — unicast,
+        // иначе (или для broadcast) — широковещательно
+        uint8_t next_hop[6];
+        bool unicast = memcmp(dst_mac, BROADCAST_MAC, 6) != 0 &&
+                       lookup_next_hop(dst_mac, next_hop, now) &&
+                       memcmp(next_hop, mac, 6) != 0 &&  // Не возвращаем пакет отправителю
+                       ensure_unicast_peer(next_hop);
+        if (duplicate && !unicast) return;
+        
+        // Копируем только сейчас, когда пакет точно уходит дальше:
+        // уменьшаем TTL и отмечаемся как последний прыжок.
+        // Кадр уходит в той же версии и длине, в какой пришёл
+        uint8_t frame[MAX_PACKET_SIZE];
+        size_t frame_len = mesh_view_copy_raw(&view, frame);
+        MeshPacketHeader* packet = (MeshPacketHeader*)frame;
+        decrement_ttl(packet);
+        memcpy(packet->last_hop_mac, self_mac, 6);
         
-        // Определяем куда пересылать
-        // Пока просто широковещательно
-        esp_now_send(BROADCAST_MAC, data, len);
+        // Замер задержки: отмечаем, сколько пакет провёл у нас
+        if (msg_type == MSG_PROBE && !encrypted && view.version >= 0x02 &&
+            probe_append_hop(packet, self_mac, micros() - rx_us)) {
+            frame_len += sizeof(ProbeHop);
+        }
         
-        Serial.printf("Relayed packet from %s\n", 
-                     mac_to_string(packet.src_mac).c_str());
+        // Подтверждаемый — сначала отправляем, потом под опеку
+        // (повторы по нашим таймерам, если ACK не пройдёт)
+        bool custody = unicast && (flags & FLAG_REQUIRE_ACK);
+        if (unicast && esp_now_send(next_hop, frame, frame_len) == ESP_OK) {
+            relayed_unicast++;
+        } else {
+            esp_now_send(BROADCAST_MAC, frame, frame_len);
+            relayed_broadcast++;
+        }
+        if (custody) {
+            post_custody_take(frame, frame_len, now);
+        }
+        
+        LOG_D("Relayed packet from %s", 
+             mac_to_string(packet->src_mac).c_str());
+    }
+}
+
+// Ответ на MSG_PROBE: записи о прыжках туда плюс наша уходят обратно,
+// по пути назад репитеры допишут свои
+void reply_to_probe(const MeshPacketView* view, uint32_t rx_us, uint32_t now) {
+    if (view->version < 0x02 || view->payload_len < PROBE_HEADER_SIZE) return;
+    
+    MeshPacketHeader reply;
+    mesh_view_copy(view, &reply);
+    ((ProbePayload*)reply.payload)->direction = PROBE_DIR_REPLY;
+    
+    reply.version = PROTOCOL_VERSION;
+    reply.ttl = DEFAULT_TTL;
+    reply.packet_id = next_packet_id();
+    memcpy(reply.dst_mac, reply.src_mac, 6);
+    memcpy(reply.src_mac, self_mac, 6);
+    memcpy(reply.last_hop_mac, self_mac, 6);
+    reply.flags = 0;
+    probe_append_hop(&reply, self_mac, micros() - rx_us);
+    
+    uint8_t next_hop[6];
+    if (lookup_next_hop(reply.dst_mac, next_hop, now) && ensure_unicast_peer(next_hop)) {
+        esp_now_send(next_hop, (uint8_t*)&reply, mesh_packet_wire_size(&reply));
+    } else {
+        esp_now_send(BROADCAST_MAC, (uint8_t*)&reply, mesh_packet_wire_size(&reply));
     }
+    
+    LOG_D("Probe %lu answered", ((ProbePayload*)reply.payload)->probe_id);
+}
+
+// ==================== ГРУППОВЫЕ КОМАНДЫ И РЕФЛЕКСЫ ====================
+
+// Групповая команда детям: один прыжок, широковещательно.
+// Параметров — не больше, чем пришло (parameter_len)
+void send_group_command(const GroupCommand* cmd, uint8_t parameter_len) {
+    MeshPacketHeader packet = {};
+    packet.network_id = MESH_NETWORK_ID;
+    packet.version = PROTOCOL_VERSION;
+    packet.ttl = 1;
+    packet.packet_id = next_packet_id();
+    memcpy(packet.src_mac, self_mac, 6);
+    memcpy(packet.dst_mac, BROADCAST_MAC, 6);
+    memcpy(packet.last_hop_mac, self_mac, 6);
+    packet.msg_type = MSG_CMD_GROUP;
+    packet.flags = FLAG_LOCAL_PROCESS;
+    packet.group_id = cmd->group_id;
+    
+    GroupCommand* out = (GroupCommand*)packet.payload;
+    out->group_id = cmd->group_id;
+    out->command_code = cmd->command_code;
+    out->parameter_len = cmd->parameter_len < parameter_len ? cmd->parameter_len : parameter_len;
+    if (out->parameter_len > sizeof(out->parameters)) {
+        out->parameter_len = sizeof(out->parameters);
+    }
+    memcpy(out->parameters, cmd->parameters, out->parameter_len);
+    packet.payload_len = offsetof(GroupCommand, parameters) + out->parameter_len;
+    
+    esp_now_send(BROADCAST_MAC, (uint8_t*)&packet, mesh_packet_wire_size(&packet));
+}
+
+// Показание или авария ребёнка: сработавшие правила сразу рассылают команды
+void run_reflexes(const MeshPacketView* view, uint32_t now) {
+    const ReflexRule* fired[REFLEX_FIRE_MAX];
+    uint8_t count = reflex_evaluate(&reflex_engine, mesh_view_group_id(view), mesh_view_msg_type(view),
+                                    mesh_view_payload(view), view->payload_len, now,
+                                    fired, REFLEX_FIRE_MAX);
+    for (uint8_t i = 0; i < count; i++) {
+        GroupCommand cmd = {};
+        cmd.group_id = fired[i]->target_group;
+        cmd.command_code = fired[i]->command_code;
+        cmd.parameter_len = 1;
+        cmd.parameters[0] = fired[i]->parameter;
+        send_group_command(&cmd, cmd.parameter_len);
+        LOG_D("Reflex: group 0x%04X -> group 0x%04X cmd 0x%02X",
+             fired[i]->source_group, fired[i]->target_group, fired[i]->command_code);
+    }
+}
+
+// Подтверждение по маршруту (не только непосредственному ребёнку)
+void send_ack(const uint8_t* dst_mac, uint32_t packet_id, uint8_t status, uint32_t now) {
+    MeshPacketHeader ack;
+    reliable_build_ack(&ack, self_mac, dst_mac, next_packet_id(), packet_id,
+                       status == ACK_STATUS_OK ? MSG_ACK : MSG_NACK, status);
+    
+    uint8_t next_hop[6];
+    if (lookup_next_hop(dst_mac, next_hop, now) && ensure_unicast_peer(next_hop)) {
+        esp_now_send(next_hop, (uint8_t*)&ack, mesh_packet_wire_size(&ack));
+    } else {
+        esp_now_send(BROADCAST_MAC, (uint8_t*)&ack, mesh_packet_wire_size(&ack));
+    }
+}
+
+// Новая таблица от координатора. Во flash её пишет loop(): callback
+// приёма не ждёт NVS
+void handle_reflex_rules(const MeshPacketView* view, uint32_t now) {
+    portENTER_CRITICAL(&reflex_mux);
+    bool installed = reflex_install(&reflex_engine, (const ReflexRuleTable*)mesh_view_payload(view),
+                                    view->payload_len);
+    portEXIT_CRITICAL(&reflex_mux);
+    
+    if (installed) {
+        reflex_save_pending = true;
+        LOG_I("Reflex rules v%u: %u rules", reflex_engine.table.version, reflex_engine.table.count);
+    } else {
+        LOG_W("Reflex rules rejected");
+    }
+    if (mesh_view_flags(view) & FLAG_REQUIRE_ACK) {
+        send_ack(mesh_view_src_mac(view), mesh_view_packet_id(view),
+                 installed ? ACK_STATUS_OK : NACK_MALFORMED, now);
+    }
+}
+
+void save_reflex_rules() {
+    ReflexRuleTable table;
+    portENTER_CRITICAL(&reflex_mux);
+    memcpy(&table, &reflex_engine.table, reflex_table_size(reflex_engine.table.count));
+    reflex_save_pending = false;
+    portEXIT_CRITICAL(&reflex_mux);
+    
+    Preferences store;
+    store.begin("reflex", false);
+    store.putBytes("rules", &table, reflex_table_size(table.count));
+    store.end();
+}
+
+void load_reflex_rules() {
+    reflex_init(&reflex_engine);
+    
+    ReflexRuleTable table;
+    Preferences store;
+    store.begin("reflex", true);
+    size_t len = store.getBytesLength("rules");
+    if (len >= REFLEX_TABLE_HEADER_SIZE && len <= sizeof(table)) {
+        store.getBytes("rules", &table, len);
+        if (reflex_install(&reflex_engine, &table, len)) {
+            LOG_I("Loaded %u reflex rules (v%u)", table.count, table.version);
+        }
+    }
+    store.end();
 }
 
 // Настройка ESP-NOW
 void setup_espnow() {
     WiFi.channel(MESH_CHANNEL);
     
+    dedup_init(&dedup_cache, dedup_storage, DEDUP_ENTRIES, DEDUP_WINDOW_MS);
+    mac_index_init(&route_index, route_index_storage, ROUTE_INDEX_SLOTS);
+    link_table_init(&link_table, link_storage, LINK_TABLE_SIZE);
+    // Номер со случайного места: если первый снимок после перезагрузки
+    // потеряется, keepalive почти наверняка не совпадёт с номером,
+    // который соседи помнят с прошлой жизни, и они попросят снимок
+    route_delta_tx_init(&route_delta_tx, (uint16_t)esp_random());
+    route_delta_rx_init(&route_delta_rx, route_delta_peers, ROUTE_DELTA_PEERS);
+    adaptive_interval_init(&route_keepalive, ROUTE_KEEPALIVE_MIN_MS, ROUTE_KEEPALIVE_MAX_MS);
+    unicast_peer_mutex = xSemaphoreCreateMutexStatic(&unicast_peer_mutex_buffer);
+    custody_queue = xQueueCreateStatic(CUSTODY_QUEUE_DEPTH, sizeof(CustodyRequest),
+                                       custody_queue_storage, &custody_queue_buffer);
+    packet_id_counter = esp_random();
+    reliable_init(&custody_table, custody_storage, CUSTODY_SLOTS,
+                  custody_send_frame, custody_give_up, nullptr, esp_random());
+    
     if (esp_now_init() != ESP_OK) {
-        Serial.println("ESP-NOW init failed");
+        LOG_E("ESP-NOW init failed");
         return;
     }
     
     esp_now_register_recv_cb(on_espnow_recv);
+    esp_now_register_send_cb(on_espnow_send);
+    
+    wifi_promiscuous_filter_t filter = {};
+    filter.filter_mask = WIFI_PROMIS_FILTER_MASK_MGMT;
+    esp_wifi_set_promiscuous_filter(&filter);
+    esp_wifi_set_promiscuous_rx_cb(on_wifi_promiscuous);
+    esp_wifi_set_promiscuous(true);
     
     // Добавляем широковещательный peer
     esp_now_peer_info_t peer_info = {};
@@ -54,12 +1026,13 @@ void setup_espnow() {
     esp_now_add_peer(&peer_info);
     
     mesh_initialized = true;
-    Serial.println("Repeater: ESP-NOW ready");
+    LOG_I("Repeater: ESP-NOW ready");
 }
 
 void setup() {
     Serial.begin(115200);
     delay(1000);
+    log_init(write_log_line, LOG_ASYNC_BUFFER);
     
     Serial.println("\n=== MeshStatic Repeater Pro ===");
     
@@ -70,14 +1043,83 @@ void setup() {
     WiFi.mode(WIFI_STA);
     WiFi.disconnect();
     
+    load_reflex_rules();
+    loop_task_handle = xTaskGetCurrentTaskHandle();  // setup() и loop() — одна задача
     setup_espnow();
     
+    // Первая проверка детей — в случайный момент первого периода
+    timer_wheel_init(&loop_timers, loop_timer_storage, LOOP_TIMER_COUNT, TIMER_TICK_MS, millis());
+    timer_wheel_schedule(&loop_timers, TIMER_ROUTE_DELTA, esp_random() % ROUTE_DELTA_INTERVAL_MS,
+                         on_route_delta_timer, nullptr);
+    
     Serial.println("Repeater initialized. Waiting for packets...");
 }
 
 void loop() {
-    // Простой loop - всё в callback'ах
-    delay(100);
+    // Запрошен discovery — ставим ответ в свой слот окна
+    if (discovery_requested) {
+        portENTER_CRITICAL(&discovery_mux);
+        uint16_t window = discovery_window_ms;
+        discovery_requested = false;
+        portEXIT_CRITICAL(&discovery_mux);
+        timer_wheel_schedule(&loop_timers, TIMER_DISCOVERY_REPLY,
+                             discovery_slot_delay(self_mac, window, DISCOVERY_SLOT_MS, esp_random()),
+                             on_discovery_reply_timer, nullptr);
+    }
+    
+    // Объявления маршрутов, ответ на discovery
+    timer_wheel_poll(&loop_timers, millis());
+    
+    // Пачка телеметрии не ждёт дольше окна агрегации
+    if (pending_batch_full ||
+        (pending_batch.count > 0 && millis() - pending_batch_since >= AGGREGATION_FLUSH_MS)) {
+        flush_sensor_batch();
+    }
+    
+    // Таймеры повторов опекаемых пакетов
+    drain_custody_queue();
+    reliable_poll(&custody_table, millis());
+    
+    // Новая таблица рефлексов — во flash
+    if (reflex_save_pending) {
+        save_reflex_rules();
+    }
+    
+    // Слушаем команды по Serial
+    if (Serial.available()) {
+        String cmd = Serial.readStringUntil('\n');
+        cmd.trim();
+        
+        if (cmd == "status") {
+            Serial.printf("Uptime: %lu sec\n", millis() / 1000);
+            Serial.printf("Routes: %d, relayed unicast/broadcast: %lu/%lu, %lu switched to cheaper path\n",
+                         route_cache_size, relayed_unicast, relayed_broadcast, route_switches);
+            Serial.printf("Route deltas: %lu sent (%lu snapshots, seq %u), %lu applied, %lu gaps, %lu resync requests\n",
+                         route_delta_tx.deltas, route_delta_tx.snapshots, route_delta_tx.seq,
+                         route_delta_rx.applied, route_delta_rx.gaps, route_delta_rx.resync_requests);
+            Serial.printf("Keepalive: every %lu ms (%lu resets), %lu discovery replies\n",
+                         route_keepalive.current_ms, route_keepalive.resets, discovery_replies);
+            Serial.printf("Dedup: %lu hits, %lu misses, %lu evictions (window %lu ms)\n",
+                         dedup_cache.hits, dedup_cache.misses,
+                         dedup_cache.evictions, dedup_cache.window_ms);
+            Serial.printf("Custody: %u in flight, %lu taken, %lu retx, %lu acked, %lu timeouts, %lu queue full\n",
+                         custody_table.in_flight, custody_table.sent,
+                         custody_table.retransmits, custody_table.acked,
+                         custody_table.timeouts, custody_queue_full);
+            Serial.printf("Aggregation: %lu records in %lu batches, pending %u\n",
+                         batched_records, batches_sent, pending_batch.count);
+            Serial.printf("Reflexes: %u rules (v%u), %lu fired, %lu suppressed\n",
+                         reflex_engine.table.count, reflex_engine.table.version,
+                         reflex_engine.fired, reflex_engine.suppressed);
+            Serial.printf("Log: level %d, %lu lines dropped\n", LOG_LEVEL, log_dropped());
+            Serial.printf("Free heap: %lu bytes\n", ESP.getFreeHeap());
+        } else if (cmd == "help") {
+            Serial.println("Commands: status, help");
+        }
+    }
+    
+    // Тик колеса, раньше — если callback приёма оставил работу
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(TIMER_TICK_MS));
 }
 
 // Вспомогательная функция
@@ -87,3 +1129,8 @@ String mac_to_string(const uint8_t* mac) {
              mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
     return String(buf);
 }
+
+// Вывод строки лога — из задачи отложенного вывода, не из колбэка приёма
+void write_log_line(const char* data, size_t len) {
+    Serial.write((const uint8_t*)data, len);
+}
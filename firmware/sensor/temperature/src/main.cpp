@@ -1,24 +1,81 @@
 #include <Arduino.h>
 #include <WiFi.h>
 #include <esp_now.h>
-#include "../../common/mesh_protocol.h"
+#include <esp_wifi.h>
+#include <esp_sleep.h>
+#include <esp_timer.h>
+#include "../../../common/mesh_protocol.h"
+#include "../../../common/log.h"
+#include "../../../common/timer_wheel.h"
 
 // Конфигурация
 #define MESH_CHANNEL 1
+#ifdef SENSOR_UPDATE_INTERVAL
+#define SEND_INTERVAL SENSOR_UPDATE_INTERVAL
+#else
 #define SEND_INTERVAL 60000  // 1 минута
+#endif
 #define SIMULATED_TEMP 25.0f
+#define SEND_JITTER_PCT 10         // Разброс периода отправки, ± процентов
+#define BOOT_SPREAD_MS 2000        // После включения питания ждём до стольких, не все разом
+
+#ifndef DEEP_SLEEP_ENABLED
+#define DEEP_SLEEP_ENABLED 0
+#endif
+
+#ifndef ACK_WAIT_MS
+#define ACK_WAIT_MS 30             // Сколько ждём ACK перед сном
+#endif
+#ifndef PARENT_MAX_MISSES
+#define PARENT_MAX_MISSES 3        // Столько ACK подряд не пришло — забываем родителя
+#endif
+#define LOG_ASYNC_BUFFER 1024      // Кольцо отложенного вывода лога, байт
+// WAKE_GPIO — пин кнопки/геркона для внеочередного пробуждения (по желанию)
+
+// Состояние, переживающее глубокий сон (RTC память)
+#define RTC_STATE_MAGIC 0x4D534832  // "MSH2"
+
+typedef struct {
+    uint32_t magic;
+    uint8_t  channel;
+    uint8_t  has_parent;
+    uint8_t  parent_mac[6];       // Кто доставил последний ACK — шлём ему unicast
+    uint8_t  parent_misses;
+    uint32_t next_packet_id;
+    uint32_t boot_count;
+    uint16_t last_awake_ms;       // Длительность прошлого бодрствования
+} SensorRtcState;
+
+RTC_DATA_ATTR SensorRtcState rtc_state;
 
 uint8_t self_mac[6];
-uint32_t last_send = 0;
+uint32_t next_send_ms = 0;
+
+volatile bool ack_received = false;
+volatile uint32_t awaited_packet_id = 0;
+
+// Первый запуск (или RTC потеряна при сбросе питания)
+void init_rtc_state() {
+    if (rtc_state.magic == RTC_STATE_MAGIC) {
+        return;
+    }
+    
+    memset(&rtc_state, 0, sizeof(rtc_state));
+    rtc_state.magic = RTC_STATE_MAGIC;
+    rtc_state.channel = MESH_CHANNEL;
+    rtc_state.next_packet_id = esp_random();
+}
 
 // Отправка данных с датчика
 void send_sensor_data() {
-    MeshPacketHeader packet;
+    MeshPacketHeader packet = {};
+    
+    const uint8_t* next_hop = rtc_state.has_parent ? rtc_state.parent_mac : BROADCAST_MAC;
     
     packet.network_id = MESH_NETWORK_ID;
     packet.version = PROTOCOL_VERSION;
     packet.ttl = DEFAULT_TTL;
-    packet.packet_id = millis();
+    packet.packet_id = rtc_state.next_packet_id++;
     memcpy(packet.src_mac, self_mac, 6);
     memcpy(packet.dst_mac, BROADCAST_MAC, 6);
     memcpy(packet.last_hop_mac, self_mac, 6);
@@ -43,35 +100,171 @@ void send_sensor_data() {
     sensor_data.battery_mv = 3300;  // 3.3V
     sensor_data.rssi = -60;
     sensor_data.accuracy = 95;
+    sensor_data.awake_ms = rtc_state.last_awake_ms;
     
     memcpy(packet.payload, &sensor_data, sizeof(sensor_data));
+    packet.payload_len = sizeof(sensor_data);
+    
+    ack_received = false;
+    awaited_packet_id = packet.packet_id;
     
-    // Отправка
-    esp_err_t result = esp_now_send(BROADCAST_MAC, (uint8_t*)&packet, sizeof(packet));
+    // Отправка: только заголовок и реальные данные.
+    // Родителю — unicast (подтверждение на MAC-уровне), иначе всем
+    esp_err_t result = esp_now_send(next_hop, (uint8_t*)&packet,
+                                    mesh_packet_wire_size(&packet));
     
     if (result == ESP_OK) {
-        Serial.printf("Sent: %.1f°C, %.1f%%\n", 
-                     sensor_data.temperature, sensor_data.humidity);
+        LOG_D("Sent: %.1f°C, %.1f%%",
+             sensor_data.temperature, sensor_data.humidity);
     } else {
-        Serial.printf("Send error: %d\n", result);
+        LOG_E("Send error: %d", result);
     }
 }
 
+// Вывод строки лога — из задачи отложенного вывода
+void write_log_line(const char* data, size_t len) {
+    Serial.write((const uint8_t*)data, len);
+}
+
 // Callback при отправке
 void on_espnow_send(const uint8_t* mac, esp_now_send_status_t status) {
     if (status == ESP_NOW_SEND_SUCCESS) {
-        Serial.println("Delivery success");
+        LOG_D("Delivery success");
     } else {
-        Serial.println("Delivery failed");
+        LOG_W("Delivery failed");
+    }
+}
+
+// Callback при получении: ждём только ACK на свой пакет
+void on_espnow_recv(const uint8_t* mac, const uint8_t* data, int len) {
+    MeshPacketView view;
+    if (!mesh_view_init(&view, data, len)) return;
+    if (mesh_view_msg_type(&view) != MSG_ACK) return;
+    if (memcmp(mesh_view_dst_mac(&view), self_mac, 6) != 0) return;
+    
+    // Тело ACK начинается с id подтверждаемого пакета
+    if (view.payload_len >= sizeof(uint32_t)) {
+        uint32_t acked_id;
+        memcpy(&acked_id, mesh_view_payload(&view), sizeof(acked_id));
+        if (acked_id != awaited_packet_id) return;
+    }
+    
+    // Сосед, доставивший ACK, — ближайший узел к координатору
+    memcpy(rtc_state.parent_mac, mac, 6);
+    ack_received = true;
+}
+
+// Инициализация ESP-NOW
+void setup_espnow() {
+    WiFi.mode(WIFI_STA);
+    esp_wifi_set_channel(rtc_state.channel, WIFI_SECOND_CHAN_NONE);
+    
+    if (esp_now_init() != ESP_OK) {
+        LOG_E("ESP-NOW init failed");
+        ESP.restart();
+    }
+    
+    esp_now_register_send_cb(on_espnow_send);
+    esp_now_register_recv_cb(on_espnow_recv);
+    
+    // Добавляем широковещательный peer
+    esp_now_peer_info_t peer_info = {};
+    memcpy(peer_info.peer_addr, BROADCAST_MAC, 6);
+    peer_info.channel = rtc_state.channel;
+    peer_info.encrypt = false;
+    esp_now_add_peer(&peer_info);
+    
+    // И родителя из RTC — без поиска сети после пробуждения
+    if (rtc_state.has_parent) {
+        memcpy(peer_info.peer_addr, rtc_state.parent_mac, 6);
+        esp_now_add_peer(&peer_info);
+    }
+}
+
+#if DEEP_SLEEP_ENABLED
+
+// Ждём ACK коротким окном, затем обновляем знание о родителе
+void wait_for_ack() {
+    uint32_t start = millis();
+    while (!ack_received && millis() - start < ACK_WAIT_MS) {
+        delay(1);
+    }
+    
+    if (ack_received) {
+        rtc_state.has_parent = 1;
+        rtc_state.parent_misses = 0;
+    } else if (rtc_state.has_parent && ++rtc_state.parent_misses >= PARENT_MAX_MISSES) {
+        // Родитель пропал — следующий цикл снова широковещательный
+        rtc_state.has_parent = 0;
+        rtc_state.parent_misses = 0;
+        LOG_W("Parent lost, falling back to broadcast");
     }
 }
 
+void enter_deep_sleep() {
+    esp_now_deinit();
+    esp_wifi_stop();
+    
+    // С разбросом: датчики, включённые вместе, не просыпаются хором
+    uint32_t sleep_ms = timer_jitter(SEND_INTERVAL, SEND_JITTER_PCT, esp_random());
+    esp_sleep_enable_timer_wakeup((uint64_t)sleep_ms * 1000ULL);
+    
+    #ifdef WAKE_GPIO
+        #if CONFIG_IDF_TARGET_ESP32C3
+            esp_deep_sleep_enable_gpio_wakeup(1ULL << WAKE_GPIO, ESP_GPIO_WAKEUP_GPIO_HIGH);
+        #else
+            esp_sleep_enable_ext0_wakeup((gpio_num_t)WAKE_GPIO, 1);
+        #endif
+    #endif
+    
+    // Время от пробуждения до сна: главный показатель расхода батареи
+    uint32_t awake_us = (uint32_t)esp_timer_get_time();
+    rtc_state.last_awake_ms = awake_us / 1000;
+    LOG_I("Awake %lu us (boot %lu, ack %s), sleeping %lu ms",
+         awake_us, rtc_state.boot_count,
+         ack_received ? "yes" : "no", sleep_ms);
+    log_flush();
+    Serial.flush();
+    
+    esp_deep_sleep_start();
+}
+
+// Один цикл: проснулись, отправили, дождались ACK, уснули
+void setup() {
+    Serial.begin(115200);
+    log_init(write_log_line, LOG_ASYNC_BUFFER);
+    
+    init_rtc_state();
+    rtc_state.boot_count++;
+    
+    WiFi.macAddress(self_mac);
+    setup_espnow();
+    
+    if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_UNDEFINED) {
+        Serial.println("\n=== MeshStatic Temperature Sensor (deep sleep) ===");
+        delay(esp_random() % BOOT_SPREAD_MS);  // Включение питания — у всех сразу
+    }
+    
+    send_sensor_data();
+    wait_for_ack();
+    enter_deep_sleep();
+}
+
+void loop() {
+    // Не достигается: setup() заканчивается глубоким сном
+}
+
+#else
+
 void setup() {
     Serial.begin(115200);
     delay(2000);  // Даем время для подключения к Serial
+    log_init(write_log_line, LOG_ASYNC_BUFFER);
     
     Serial.println("\n=== MeshStatic Temperature Sensor ===");
     
+    init_rtc_state();
+    
     WiFi.macAddress(self_mac);
     Serial.print("MAC: ");
     
@@ -85,37 +278,24 @@ void setup() {
     WiFi.disconnect();
     
     // Инициализация ESP-NOW
-    WiFi.channel(MESH_CHANNEL);
-    
-    if (esp_now_init() != ESP_OK) {
-        Serial.println("ESP-NOW init failed");
-        ESP.restart();
-    }
-    
-    esp_now_register_send_cb(on_espnow_send);
-    
-    // Добавляем широковещательный peer
-    esp_now_peer_info_t peer_info = {};
-    memcpy(peer_info.peer_addr, BROADCAST_MAC, 6);
-    peer_info.channel = MESH_CHANNEL;
-    peer_info.encrypt = false;
-    esp_now_add_peer(&peer_info);
+    setup_espnow();
     
     Serial.println("Sensor ready. Starting transmissions...");
-    last_send = millis();
+    // Первая отправка — в случайный момент периода
+    next_send_ms = millis() + esp_random() % SEND_INTERVAL;
 }
 
 void loop() {
-    if (millis() - last_send > SEND_INTERVAL) {
+    if ((int32_t)(millis() - next_send_ms) >= 0) {
         send_sensor_data();
-        last_send = millis();
+        next_send_ms = millis() + timer_jitter(SEND_INTERVAL, SEND_JITTER_PCT, esp_random());
     }
     
     // Слушаем команды по Serial
     if (Serial.available()) {
         String cmd = Serial.readStringUntil('\n');
         cmd.trim();
-        
+    
         if (cmd == "send") {
             send_sensor_data();
         } else if (cmd == "status") {
@@ -128,3 +308,5 @@ void loop() {
     
     delay(100);
 }
+
+#endif
@@ -0,0 +1,76 @@
+# build_web_ui.py - Сборка веб-интерфейса координатора в прошивку
+#
+# Подключается в platformio.ini как pre-скрипт (extra_scripts) и
+# запускается перед каждой сборкой. Сжимает gzip'ом страницы из
+# firmware/coordinator/web и кладёт их массивами во flash
+# (firmware/coordinator/src/web_ui_gz.h). ETag — хеш исходника:
+# сменилась страница — сменился ETag, браузер скачает заново.
+#
+# Можно запустить и вручную: python tools/build_web_ui.py
+
+import gzip
+import hashlib
+import os
+
+try:
+    Import("env")  # noqa: F821 — есть только внутри PlatformIO
+    PROJECT_DIR = env["PROJECT_DIR"]  # noqa: F821
+except NameError:
+    PROJECT_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+WEB_DIR = os.path.join(PROJECT_DIR, "firmware", "coordinator", "web")
+OUTPUT = os.path.join(PROJECT_DIR, "firmware", "coordinator", "src", "web_ui_gz.h")
+
+# Файл исходника -> имя массива в прошивке
+ASSETS = [
+    ("index.html", "WEB_INDEX_HTML"),
+]
+
+
+def c_array(data):
+    lines = []
+    for i in range(0, len(data), 16):
+        chunk = data[i:i + 16]
+        lines.append("    " + ", ".join("0x%02x" % b for b in chunk) + ",")
+    return "\n".join(lines)
+
+
+def build():
+    parts = [
+        "// web_ui_gz.h - Сжатый веб-интерфейс (tools/build_web_ui.py)",
+        "// Файл генерируется при сборке, руками не править.",
+        "#pragma once",
+        "#include <Arduino.h>",
+        "",
+    ]
+
+    for filename, name in ASSETS:
+        with open(os.path.join(WEB_DIR, filename), "rb") as f:
+            source = f.read()
+
+        # mtime=0 — одинаковый исходник даёт одинаковые байты
+        packed = gzip.compress(source, compresslevel=9, mtime=0)
+        etag = hashlib.sha1(source).hexdigest()[:16]
+
+        parts.append("// %s: %d -> %d байт" % (filename, len(source), len(packed)))
+        parts.append('#define %s_ETAG "\\"%s\\""' % (name, etag))
+        parts.append("#define %s_GZ_LEN %d" % (name, len(packed)))
+        parts.append("static const uint8_t %s_GZ[] PROGMEM = {" % name)
+        parts.append(c_array(packed))
+        parts.append("};")
+        parts.append("")
+
+    text = "\n".join(parts)
+
+    # Не трогаем файл без нужды — иначе пересборка каждый раз
+    if os.path.exists(OUTPUT):
+        with open(OUTPUT, "r", encoding="utf-8") as f:
+            if f.read() == text:
+                return
+
+    with open(OUTPUT, "w", encoding="utf-8") as f:
+        f.write(text)
+    print("Web UI -> %s" % os.path.relpath(OUTPUT, PROJECT_DIR))
+
+
+build()